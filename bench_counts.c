@@ -0,0 +1,191 @@
+/*
+ * Cost of updating the counts of a tick: the counter store, where the reads
+ * store raw counts and one pass scales them and takes their deltas, against
+ * the per-event loop it replaced, where every read scaled its count into
+ * values of the perf_event_desc_t and kept the old one in prev_values, and
+ * the writer then took the deltas event by event. Reports the whole tick,
+ * readings included, and the scaling alone, for a few numbers of contexts
+ * and events, with multiplexed and non-multiplexed counts. The results of
+ * both are compared at every tick.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "perf_util.h"
+#include "pfm_counts.h"
+
+#define NUM_TICKS 200
+
+/* the counts are summed, so that no loop is optimized away */
+static volatile uint64_t sink;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Save the newly read values of an event, and keep the previous ones for
+ * computing the delta; the per-event update the store replaced
+ */
+static inline void update_values(perf_event_desc_t *fd, uint64_t val,
+				 uint64_t ena, uint64_t run)
+{
+	uint64_t values[3];
+
+	values[0] = val;
+	values[1] = ena;
+	values[2] = run;
+
+	fd->prev_values[0] = fd->values[0];
+	fd->prev_values[1] = fd->values[1];
+	fd->prev_values[2] = fd->values[2];
+	fd->values[0] = perf_scale(values);
+	fd->values[1] = ena;
+	fd->values[2] = run;
+}
+
+/*
+ * Time the ticks of num_ctxs contexts of num_evts events each
+ * Parameters:
+ *	mux	--> nonzero if the events run 3/4 of the time enabled
+ * Return value:
+ *      0       --> success
+ *      1       --> the results differ
+ */
+static int bench(int num_ctxs, int num_evts, int mux)
+{
+	perf_event_desc_t **fds;
+	pfm_counts_t store;
+	pfm_counts_row_t *rows;
+	uint64_t raw[PFM_COUNTS_BLOCK], ena, run, sum = 0;
+	double start, t_old = 0, t_new = 0, s_old = 0, s_new = 0;
+	int c, e, tick, ret = 0;
+
+	fds = malloc(sizeof(perf_event_desc_t *) * num_ctxs);
+	rows = malloc(sizeof(pfm_counts_row_t) * num_ctxs);
+	if(fds == NULL || rows == NULL)
+		err(1, "out of memory");
+	pfm_counts_init(&store);
+	for(c = 0; c < num_ctxs; c++){
+		fds[c] = calloc(num_evts, sizeof(perf_event_desc_t));
+		if(fds[c] == NULL ||
+		   pfm_counts_alloc(&store, num_evts, &rows[c]))
+			err(1, "out of memory");
+	}
+
+	for(tick = 1; tick <= NUM_TICKS; tick++){
+		ena = 1000000ULL * tick;
+		run = mux ? ena / 4 * 3 : ena;
+		for(e = 0; e < num_evts; e++)
+			raw[e] = 123457ULL * tick * (e + 1);
+
+		/* the per-event loop: scale at each read, then the deltas */
+		start = now();
+		for(c = 0; c < num_ctxs; c++)
+			for(e = 0; e < num_evts; e++)
+				update_values(&fds[c][e], raw[e] + c, ena,
+					      run);
+		for(c = 0; c < num_ctxs; c++)
+			for(e = 0; e < num_evts; e++){
+				perf_event_desc_t *fd = &fds[c][e];
+
+				sum += fd->values[0] - fd->prev_values[0];
+				sum += fd->values[1] - fd->prev_values[1];
+			}
+		t_old += now() - start;
+
+		/* the store: raw counts at each read, then one pass */
+		start = now();
+		for(c = 0; c < num_ctxs; c++)
+			for(e = 0; e < num_evts; e++)
+				pfm_counts_set(&rows[c], e, raw[e] + c, ena,
+					       run);
+		pfm_counts_update(&store);
+		for(c = 0; c < num_ctxs; c++)
+			for(e = 0; e < num_evts; e++){
+				sum += rows[c].delta[e];
+				sum += rows[c].elapsed[e];
+			}
+		t_new += now() - start;
+
+		for(c = 0; c < num_ctxs; c++)
+			for(e = 0; e < num_evts; e++){
+				perf_event_desc_t *fd = &fds[c][e];
+
+				if(fd->values[0] == rows[c].val[e] &&
+				   fd->values[0] - fd->prev_values[0] ==
+				   rows[c].delta[e])
+					continue;
+				warnx("context %d event %d: %"PRIu64", the "
+				      "store has %"PRIu64, c, e, fd->values[0],
+				      rows[c].val[e]);
+				ret = 1;
+			}
+	}
+
+	/* the scaling alone, of the last readings */
+	for(tick = 0; tick < NUM_TICKS; tick++){
+		start = now();
+		for(c = 0; c < num_ctxs; c++)
+			for(e = 0; e < num_evts; e++)
+				update_values(&fds[c][e], rows[c].raw[e],
+					      rows[c].ena[e], rows[c].run[e]);
+		s_old += now() - start;
+
+		for(c = 0; c < num_ctxs; c++)
+			for(e = 0; e < num_evts; e++)
+				pfm_counts_set(&rows[c], e, rows[c].raw[e],
+					       rows[c].ena[e], rows[c].run[e]);
+		start = now();
+		pfm_counts_update(&store);
+		s_new += now() - start;
+	}
+	sink = sum;
+
+	printf("%6d %6d %-4s %12.1f %12.1f %12.1f %12.1f\n", num_ctxs,
+	       num_evts, mux ? "yes" : "no", t_old / NUM_TICKS * 1e6,
+	       t_new / NUM_TICKS * 1e6, s_old / NUM_TICKS * 1e6,
+	       s_new / NUM_TICKS * 1e6);
+
+	for(c = 0; c < num_ctxs; c++){
+		pfm_counts_free(&store, &rows[c]);
+		free(fds[c]);
+	}
+	pfm_counts_destroy(&store);
+	free(rows);
+	free(fds);
+
+	return ret;
+}
+
+int main()
+{
+	static const int sizes[][2] = {{64, 4}, {64, 16}, {1024, 4},
+				       {1024, 16}, {10000, 8}};
+	int i, mux, failed = 0;
+
+	printf("all times in us per tick\n");
+	printf("%6s %6s %-4s %12s %12s %12s %12s\n", "ctxs", "events", "mux",
+	       "per-event", "store", "scale: old", "scale: new");
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		for(mux = 0; mux < 2; mux++)
+			failed |= bench(sizes[i][0], sizes[i][1], mux);
+
+	if(failed)
+		errx(1, "the store and the per-event loop disagree");
+
+	return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Cost of reading the counters of a tick: one read() per event, against
+ * one read() per group with PERF_FORMAT_GROUP | PERF_FORMAT_ID, whose
+ * counts are put back in place by their ids, as read_group_counts does.
+ * Reports the time of a tick and the read() calls it takes, for a few
+ * numbers of contexts and events per context; the counts of both go to a
+ * row of the counter store, as in pfm_operations.
+ *
+ * The events are software events of the benchmark itself, which need no
+ * PMU and no privileges; pfm_multi reads the events of other threads, or
+ * of cores, whose read() may also cost an IPI to the cpu running them, so
+ * grouping saves more there.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "pfm_counts.h"
+
+#define NUM_TICKS 200
+#define MAX_EVENTS 8
+
+static const uint64_t configs[MAX_EVENTS] = {
+	PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_CPU_CLOCK,
+	PERF_COUNT_SW_PAGE_FAULTS, PERF_COUNT_SW_CONTEXT_SWITCHES,
+	PERF_COUNT_SW_CPU_MIGRATIONS, PERF_COUNT_SW_PAGE_FAULTS_MIN,
+	PERF_COUNT_SW_PAGE_FAULTS_MAJ, PERF_COUNT_SW_DUMMY};
+
+typedef struct __bench_ctx{
+	int fds[MAX_EVENTS]; /* read one by one */
+	int group[MAX_EVENTS]; /* the same events in a group */
+	uint64_t ids[MAX_EVENTS]; /* of the group */
+	pfm_counts_row_t row;
+	uint64_t buf[PFM_COUNTS_ARRAYS * MAX_EVENTS];
+}bench_ctx_t;
+
+/* the counts are summed, so that no read is optimized away */
+static volatile uint64_t sink;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_event(uint64_t config, int group_fd, uint64_t format)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		PERF_FORMAT_TOTAL_TIME_RUNNING | format;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+/*
+ * The index of the event with an id in a group, as perf_id2event
+ */
+static int id2event(uint64_t *ids, int num, uint64_t id)
+{
+	int i;
+
+	for(i = 0; i < num; i++)
+		if(ids[i] == id)
+			return i;
+
+	return -1;
+}
+
+static void open_ctx(bench_ctx_t *c, int num_evts)
+{
+	int e;
+
+	for(e = 0; e < num_evts; e++){
+		c->fds[e] = open_event(configs[e], -1, 0);
+		c->group[e] = open_event(configs[e], e ? c->group[0] : -1,
+					 PERF_FORMAT_GROUP | PERF_FORMAT_ID);
+		if(c->fds[e] == -1 || c->group[e] == -1)
+			err(1, "cannot open the events");
+		if(ioctl(c->group[e], PERF_EVENT_IOC_ID, &c->ids[e]))
+			err(1, "cannot get the id of an event");
+	}
+	memset(c->buf, 0, sizeof(c->buf));
+	pfm_counts_local(&c->row, c->buf, num_evts);
+}
+
+static void close_ctx(bench_ctx_t *c, int num_evts)
+{
+	int e;
+
+	for(e = 0; e < num_evts; e++){
+		close(c->fds[e]);
+		close(c->group[e]);
+	}
+}
+
+/*
+ * The reads of a tick, event by event
+ */
+static void read_events(bench_ctx_t *c, int num_evts)
+{
+	uint64_t values[3];
+	int e;
+
+	for(e = 0; e < num_evts; e++){
+		if(read(c->fds[e], values, sizeof(values)) != sizeof(values))
+			err(1, "cannot read an event");
+		pfm_counts_set(&c->row, e, values[0], values[1], values[2]);
+	}
+}
+
+/*
+ * The read of a tick for the whole group, as read_group_counts
+ */
+static void read_group(bench_ctx_t *c, int num_evts)
+{
+	uint64_t values[3 + 2 * num_evts];
+	int i, e;
+
+	if(read(c->group[0], values, sizeof(values)) != sizeof(values))
+		err(1, "cannot read a group");
+	for(i = 0; i < values[0]; i++){
+		e = id2event(c->ids, num_evts, values[4 + 2 * i]);
+		if(e == -1)
+			errx(1, "unknown event id %"PRIu64, values[4 + 2 * i]);
+		pfm_counts_set(&c->row, e, values[3 + 2 * i], values[1],
+			       values[2]);
+	}
+}
+
+static void bench(int num_ctxs, int num_evts)
+{
+	bench_ctx_t *ctxs;
+	double start, t_evt = 0, t_grp = 0;
+	uint64_t sum = 0;
+	int c, e, tick;
+
+	ctxs = malloc(sizeof(bench_ctx_t) * num_ctxs);
+	if(ctxs == NULL)
+		err(1, "out of memory");
+	for(c = 0; c < num_ctxs; c++)
+		open_ctx(&ctxs[c], num_evts);
+
+	for(tick = 0; tick < NUM_TICKS; tick++){
+		start = now();
+		for(c = 0; c < num_ctxs; c++)
+			read_events(&ctxs[c], num_evts);
+		t_evt += now() - start;
+
+		start = now();
+		for(c = 0; c < num_ctxs; c++)
+			read_group(&ctxs[c], num_evts);
+		t_grp += now() - start;
+
+		for(c = 0; c < num_ctxs; c++)
+			for(e = 0; e < num_evts; e++)
+				sum += ctxs[c].row.raw[e];
+	}
+	sink = sum;
+
+	printf("%6d %6d %12.1f %12.1f %10d %10d\n", num_ctxs, num_evts,
+	       t_evt / NUM_TICKS * 1e6, t_grp / NUM_TICKS * 1e6,
+	       num_ctxs * num_evts, num_ctxs);
+
+	for(c = 0; c < num_ctxs; c++)
+		close_ctx(&ctxs[c], num_evts);
+	free(ctxs);
+}
+
+int main()
+{
+	static const int ctxs[] = {1, 16, 64, 256};
+	static const int evts[] = {2, 4, 8};
+	struct rlimit rl;
+	int i, j;
+
+	/* two fds per event */
+	if(!getrlimit(RLIMIT_NOFILE, &rl)){
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	printf("all times in us per tick\n");
+	printf("%6s %6s %12s %12s %10s %10s\n", "ctxs", "events",
+	       "per-event", "group", "calls: evt", "calls: grp");
+	for(i = 0; i < sizeof(ctxs) / sizeof(ctxs[0]); i++)
+		for(j = 0; j < sizeof(evts) / sizeof(evts[0]); j++)
+			bench(ctxs[i], evts[j]);
+
+	return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * Cost of a reading pass of -R against plain read(): with -R, every pass
+ * wakes a reader thread pinned to each monitored core, which reads the
+ * counters of its core with rdpmc, and waits for all of them; without it,
+ * the thread running the pass reads every counter with read(). Reports the
+ * time of a pass for a few numbers of cores, with the pool of pfm_multi.
+ *
+ * The per-cpu events of pfm_multi need privileges; without them, each
+ * reader opens the same events on itself, which rdpmc reads just as well.
+ * Software events have no rdpmc index and are read with read() by the
+ * readers too; the share of counters read with rdpmc is reported. With
+ * more cores than online cpus, the readers share the cpus, as the cores
+ * are mapped onto the online cpus round robin.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <err.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "pfm_rdpmc.h"
+#include "pfm_workpool.h"
+
+#define NUM_TICKS 200
+#define NUM_EVENTS 4
+
+typedef struct __bench_core{
+	int cpu; /* the online cpu the reader is pinned to */
+	int fds[NUM_EVENTS];
+	void *pages[NUM_EVENTS];
+	uint64_t rdpmc_reads, reads;
+}bench_core_t;
+
+static bench_core_t *cores;
+static int num_online, per_cpu;
+/* the hardware events, or software ones without a PMU */
+static uint32_t evt_type;
+static uint64_t evt_configs[NUM_EVENTS];
+/* the counts are summed, so that no read is optimized away */
+static volatile uint64_t sink;
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_event(uint64_t config, pid_t pid, int cpu)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = evt_type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return syscall(__NR_perf_event_open, &attr, pid, cpu, -1, 0);
+}
+
+static void read_event(int fd, uint64_t *values)
+{
+	if(read(fd, values, sizeof(uint64_t) * 3) != sizeof(uint64_t) * 3)
+		err(1, "cannot read an event");
+}
+
+/*
+ * The first pass: each reader pins itself to its cpu, as read_core_work
+ * does, and opens the events of its core
+ */
+static void setup_work(int idx, void *arg)
+{
+	bench_core_t *c;
+	cpu_set_t set;
+	int e;
+
+	if(idx == 0)
+		return;
+	c = &cores[idx - 1];
+	CPU_ZERO(&set);
+	CPU_SET(c->cpu, &set);
+	if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+		errx(1, "cannot pin a reader to CPU %d", c->cpu);
+	for(e = 0; e < NUM_EVENTS; e++){
+		c->fds[e] = per_cpu ? open_event(evt_configs[e], -1, c->cpu) :
+			open_event(evt_configs[e], 0, -1);
+		if(c->fds[e] == -1)
+			err(1, "cannot open the events of a core");
+		c->pages[e] = pfm_rdpmc_map(c->fds[e]);
+	}
+}
+
+/*
+ * A pass of -R: each reader reads its core, with rdpmc when it can
+ */
+static void rdpmc_work(int idx, void *arg)
+{
+	uint64_t values[3], sum = 0;
+	bench_core_t *c;
+	int e;
+
+	if(idx == 0)
+		return;
+	c = &cores[idx - 1];
+	for(e = 0; e < NUM_EVENTS; e++){
+		if(c->pages[e] && !pfm_rdpmc_read(c->pages[e], values))
+			c->rdpmc_reads++;
+		else
+			read_event(c->fds[e], values);
+		c->reads++;
+		sum += values[0];
+	}
+	__atomic_add_fetch(&sink, sum, __ATOMIC_RELAXED);
+}
+
+static void bench(int num_cores)
+{
+	uint64_t values[3], sum = 0, rdpmc_reads = 0, reads = 0;
+	double start, t_read = 0, t_rdpmc = 0;
+	void *pool;
+	int i, e, tick;
+
+	cores = calloc(num_cores, sizeof(bench_core_t));
+	if(cores == NULL)
+		err(1, "out of memory");
+	for(i = 0; i < num_cores; i++)
+		cores[i].cpu = i % num_online;
+	/* the thread running the passes and a reader per core */
+	if(pfm_workpool_init(&pool, num_cores + 1))
+		errx(1, "cannot create %d readers", num_cores);
+	pfm_workpool_run_each(pool, setup_work, NULL);
+
+	for(tick = 0; tick < NUM_TICKS; tick++){
+		start = now();
+		for(i = 0; i < num_cores; i++)
+			for(e = 0; e < NUM_EVENTS; e++){
+				read_event(cores[i].fds[e], values);
+				sum += values[0];
+			}
+		t_read += now() - start;
+
+		start = now();
+		pfm_workpool_run_each(pool, rdpmc_work, NULL);
+		t_rdpmc += now() - start;
+	}
+	sink += sum;
+
+	pfm_workpool_close(pool);
+	for(i = 0; i < num_cores; i++){
+		rdpmc_reads += cores[i].rdpmc_reads;
+		reads += cores[i].reads;
+		for(e = 0; e < NUM_EVENTS; e++){
+			pfm_rdpmc_unmap(cores[i].pages[e]);
+			close(cores[i].fds[e]);
+		}
+	}
+	free(cores);
+
+	printf("%6d %6d %12.1f %12.1f %8.0f%%\n", num_cores, NUM_EVENTS,
+	       t_read / NUM_TICKS * 1e6, t_rdpmc / NUM_TICKS * 1e6,
+	       reads ? 100.0 * rdpmc_reads / reads : 0.0);
+}
+
+int main()
+{
+	static const int sizes[] = {1, 4, 16, 64, 256};
+	int i, fd;
+
+	num_online = sysconf(_SC_NPROCESSORS_ONLN);
+	evt_type = PERF_TYPE_HARDWARE;
+	evt_configs[0] = PERF_COUNT_HW_CPU_CYCLES;
+	evt_configs[1] = PERF_COUNT_HW_INSTRUCTIONS;
+	evt_configs[2] = PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+	evt_configs[3] = PERF_COUNT_HW_BRANCH_MISSES;
+	fd = open_event(evt_configs[0], 0, -1);
+	if(fd == -1){
+		evt_type = PERF_TYPE_SOFTWARE;
+		evt_configs[0] = PERF_COUNT_SW_TASK_CLOCK;
+		evt_configs[1] = PERF_COUNT_SW_CPU_CLOCK;
+		evt_configs[2] = PERF_COUNT_SW_PAGE_FAULTS;
+		evt_configs[3] = PERF_COUNT_SW_CONTEXT_SWITCHES;
+	}
+	else
+		close(fd);
+	fd = open_event(evt_configs[0], -1, 0);
+	per_cpu = fd != -1;
+	if(per_cpu)
+		close(fd);
+
+	printf("%s events, %s, %d online cpus\n",
+	       evt_type == PERF_TYPE_HARDWARE ? "hardware" : "software",
+	       per_cpu ? "per cpu" : "of the readers, no per-cpu privileges",
+	       num_online);
+	printf("all times in us per pass\n");
+	printf("%6s %6s %12s %12s %9s\n", "cores", "events", "read()", "-R",
+	       "rdpmc");
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench(sizes[i]);
+
+	return 0;
+}
@@ -0,0 +1,255 @@
+/*
+ * Latency of the trigger channel: the shared-memory ring of pfm_trigger and
+ * the pfm_trigger lib, against the POSIX message queue they replaced, with
+ * the message size and depth msgqx_create was given. Reports the cost of a
+ * send, as seen by a monitored thread around its hot loops, and the time
+ * from a send until the trigger thread handles the message.
+ *
+ * pfm_trigger runs on its own thread as in pfm_multi, with the enabling
+ * calls stubbed out. The objects are built with the debug messages of the
+ * Makefile, which go to /dev/null here; the message queue side prints the
+ * same messages. The ring has the shm name of pfm_multi, so the benchmark
+ * must not run along with it.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <mqueue.h>
+#include <err.h>
+#include <sys/syscall.h>
+
+#include "pfm_common.h"
+#include "pfm_trigger.h"
+#include "pfm_trigger_common.h"
+#include "pfm_trigger_lib.h"
+#include "pfm_operations.h"
+
+#define NUM_SENDS 200000
+#define NUM_PINGS 20000
+#define BENCH_MQ_NAME "/PFMTRIGGERBENCH"
+
+/* messages handled by the trigger thread, the pings wait for them */
+static uint64_t handled;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void handle_msg()
+{
+	__atomic_add_fetch(&handled, 1, __ATOMIC_RELEASE);
+}
+
+/* the enabling calls of pfm_trigger, stubbed out */
+int pfm_enable_mon_thread(void *pfm_op_options, pid_t tid, int enabled)
+{
+	handle_msg();
+	return 0;
+}
+
+int pfm_enable_mon_all_threads(void *pfm_op_options, int enabled)
+{
+	handle_msg();
+	return 0;
+}
+
+int pfm_enable_mon_core(void *pfm_op_options, int cpu, int enabled)
+{
+	handle_msg();
+	return 0;
+}
+
+int pfm_enable_mon_all_cores(void *pfm_op_options, int enabled)
+{
+	handle_msg();
+	return 0;
+}
+
+int pfm_event_attrs(char *evns, struct perf_event_attr *attrs,
+		    const char **names, int max)
+{
+	return 0;
+}
+
+static void wait_handled(uint64_t num)
+{
+	while(__atomic_load_n(&handled, __ATOMIC_ACQUIRE) < num)
+		sched_yield();
+}
+
+/*
+ * Time the sends of a channel
+ * Parameters:
+ *	send	--> sends one enable/disable message of the calling thread
+ * Output parameters:
+ *	send_ns	--> average cost of a send
+ *	ping_ns	--> average time from a send until the message is handled
+ */
+static void time_channel(void (*send)(int), double *send_ns, double *ping_ns)
+{
+	uint64_t start, total = 0;
+	uint64_t base;
+	int i;
+
+	base = __atomic_load_n(&handled, __ATOMIC_ACQUIRE);
+	start = now_ns();
+	for(i = 0; i < NUM_SENDS; i++)
+		send(i & 1);
+	*send_ns = (double)(now_ns() - start) / NUM_SENDS;
+	wait_handled(base + NUM_SENDS);
+
+	for(i = 0; i < NUM_PINGS; i++){
+		base = __atomic_load_n(&handled, __ATOMIC_ACQUIRE);
+		start = now_ns();
+		send(i & 1);
+		wait_handled(base + 1);
+		total += now_ns() - start;
+	}
+	*ping_ns = (double)total / NUM_PINGS;
+}
+
+/* the shared-memory ring */
+
+static void *trigger_thread(void *arg)
+{
+	pfm_trigger_begin_process(arg);
+
+	return NULL;
+}
+
+static void ring_send(int enable)
+{
+	pfm_trigger_user_enable_thread(enable);
+}
+
+static int bench_ring(double *send_ns, double *ping_ns)
+{
+	void *handle;
+	pthread_t thr;
+	int enable_new, options;
+	FILE *out = err_out;
+
+	if(pfm_trigger_init(&handle, 0, &enable_new, &options))
+		return -1;
+	if(pthread_create(&thr, NULL, trigger_thread, handle))
+		errx(1, "cannot create the trigger thread");
+	if(pfm_trigger_user_init())
+		errx(1, "cannot map the trigger ring");
+	/* the lib resets the streams */
+	err_out = out;
+
+	time_channel(ring_send, send_ns, ping_ns);
+
+	pfm_trigger_stop(handle);
+	pthread_join(thr, NULL);
+	pfm_trigger_user_cleanup();
+	pfm_trigger_close(handle);
+
+	return 0;
+}
+
+/* the message queue, as pfm_trigger and the lib used it */
+
+static mqd_t mq;
+
+static void *mq_thread(void *arg)
+{
+	trigger_msg msg;
+
+	while(mq_receive(mq, (char*)&msg, sizeof(msg), NULL) == sizeof(msg)){
+		if(msg.msg == quit_trigger)
+			break;
+		DPRINTF("pfm_trigger enabling thread %d\n", msg.id);
+		handle_msg();
+	}
+
+	return NULL;
+}
+
+static void mq_send_msg(int enable)
+{
+	trigger_msg msg;
+
+	msg.id = gettid();
+	msg.msg = enable ? thr_enable : thr_disable;
+	if(mq_send(mq, (char*)&msg, sizeof(msg), 0))
+		warn("cannot send a message");
+	DPRINTF("Message sent for thread %d changing monitoring state to %d\n",
+		msg.id, enable);
+}
+
+static int bench_mq(double *send_ns, double *ping_ns)
+{
+	struct mq_attr attr;
+	trigger_msg msg;
+	pthread_t thr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.mq_maxmsg = MAX_NUM_TRIGGER_MSGS;
+	attr.mq_msgsize = sizeof(trigger_msg);
+	mq_unlink(BENCH_MQ_NAME);
+	mq = mq_open(BENCH_MQ_NAME, O_CREAT | O_RDWR, 0600, &attr);
+	/* without privileges, a queue is at most msg_max deep */
+	if(mq == (mqd_t)-1 && errno == EINVAL){
+		FILE *f = fopen("/proc/sys/fs/mqueue/msg_max", "r");
+
+		if(f && fscanf(f, "%ld", &attr.mq_maxmsg) == 1)
+			mq = mq_open(BENCH_MQ_NAME, O_CREAT | O_RDWR, 0600, 
+				     &attr);
+		if(f)
+			fclose(f);
+	}
+	if(mq == (mqd_t)-1)
+		return -1;
+	if(attr.mq_maxmsg != MAX_NUM_TRIGGER_MSGS)
+		printf("the message queue holds %ld messages, not %d\n",
+		       attr.mq_maxmsg, MAX_NUM_TRIGGER_MSGS);
+	if(pthread_create(&thr, NULL, mq_thread, NULL))
+		errx(1, "cannot create the message queue thread");
+
+	time_channel(mq_send_msg, send_ns, ping_ns);
+
+	msg.id = 0;
+	msg.msg = quit_trigger;
+	mq_send(mq, (char*)&msg, sizeof(msg), 0);
+	pthread_join(thr, NULL);
+	mq_close(mq);
+	mq_unlink(BENCH_MQ_NAME);
+
+	return 0;
+}
+
+int main()
+{
+	double send_ns, ping_ns;
+
+	err_out = fopen("/dev/null", "w");
+	if(err_out == NULL)
+		err(1, "cannot open /dev/null");
+
+	printf("%-14s %12s %12s\n", "channel", "send (ns)", "handled (ns)");
+	if(bench_mq(&send_ns, &ping_ns))
+		warn("message queue skipped");
+	else
+		printf("%-14s %12.1f %12.1f\n", "message queue", send_ns,
+		       ping_ns);
+	if(bench_ring(&send_ns, &ping_ns))
+		errx(1, "cannot create the trigger ring");
+	printf("%-14s %12.1f %12.1f\n", "ring", send_ns, ping_ns);
+
+	return 0;
+}
@@ -6,8 +6,7 @@
 #ifndef __PFM_MULTI_COMMON_H__
 #define __PFM_MULTI_COMMON_H__
 
-#define MAX_NUM_THREADS 512 /* maximum number of threads that we can handle */
-#define MAX_NUM_CORES 512 /*maximum number of cores that we can handle */
+#define MAX_NUM_TRIGGER_MSGS 512 /* maximum number of pending trigger messages */
 
 /* utput streams; should be FILE * type actually */
 extern void * reading_out;
@@ -0,0 +1,273 @@
+/*
+ * Counter store in structure-of-arrays blocks.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pfm_counts.h"
+
+/* the arrays of a block, in the order of pfm_counts_row_t */
+enum{RAW, ENA, RUN, VAL, DELTA, ELAPSED, LAST_ENA, FRESH};
+
+struct __pfm_counts_block{
+	/* aligned for the vector loads of the update */
+	uint64_t entries[PFM_COUNTS_ARRAYS][PFM_COUNTS_BLOCK]
+	__attribute__((aligned(64)));
+	int used; /* entries given to rows so far */
+	struct __pfm_counts_block *next;
+};
+
+/* a freed row */
+struct __pfm_counts_hole{
+	struct __pfm_counts_block *block;
+	int first;
+	int num;
+	struct __pfm_counts_hole *next;
+};
+
+/*
+ * four counts per vector; without AVX, the compiler splits each operation
+ * into two SSE operations, so the update is also built for AVX2 and picked
+ * when the processor has it
+ */
+typedef uint64_t v4u64 __attribute__((vector_size(32)));
+typedef int64_t v4i64 __attribute__((vector_size(32)));
+typedef double v4f64 __attribute__((vector_size(32)));
+#define VEC_LEN (sizeof(v4u64) / sizeof(uint64_t))
+
+void pfm_counts_init(pfm_counts_t *store)
+{
+	memset(store, 0, sizeof(pfm_counts_t));
+	pthread_mutex_init(&store->lock, NULL);
+}
+
+void pfm_counts_destroy(pfm_counts_t *store)
+{
+	struct __pfm_counts_block *b;
+	struct __pfm_counts_hole *h;
+
+	while(store->blocks){
+		b = store->blocks;
+		store->blocks = b->next;
+		free(b);
+	}
+	while(store->holes){
+		h = store->holes;
+		store->holes = h->next;
+		free(h);
+	}
+	store->last = NULL;
+	pthread_mutex_destroy(&store->lock);
+}
+
+/*
+ * Point the arrays of a row at its entries in a block
+ */
+static void set_row(pfm_counts_row_t *row, struct __pfm_counts_block *b,
+		    int first, int num)
+{
+	uint64_t **arrays[PFM_COUNTS_ARRAYS] = {&row->raw, &row->ena,
+						&row->run, &row->val,
+						&row->delta, &row->elapsed,
+						&row->last_ena, &row->fresh};
+	int i;
+
+	for(i = 0; i < PFM_COUNTS_ARRAYS; i++)
+		*arrays[i] = &b->entries[i][first];
+	row->num = num;
+	row->block = b;
+	row->first = first;
+}
+
+int pfm_counts_alloc(pfm_counts_t *store, int num, pfm_counts_row_t *row)
+{
+	struct __pfm_counts_hole **h, *hole;
+	struct __pfm_counts_block *b;
+	int first;
+
+	memset(row, 0, sizeof(pfm_counts_row_t));
+	if(num <= 0 || num > PFM_COUNTS_BLOCK)
+		return -1;
+
+	pthread_mutex_lock(&store->lock);
+	/* the contexts of a kind mostly have the same number of events */
+	for(h = &store->holes; *h; h = &(*h)->next){
+		if((*h)->num != num)
+			continue;
+		hole = *h;
+		*h = hole->next;
+		set_row(row, hole->block, hole->first, num);
+		pthread_mutex_unlock(&store->lock);
+		free(hole);
+		return 0;
+	}
+
+	b = store->last;
+	if(b == NULL || b->used + num > PFM_COUNTS_BLOCK){
+		if(posix_memalign((void **)&b, 64,
+				  sizeof(struct __pfm_counts_block))){
+			pthread_mutex_unlock(&store->lock);
+			return -1;
+		}
+		memset(b, 0, sizeof(struct __pfm_counts_block));
+		/* a pass may be walking the blocks */
+		if(store->last)
+			__atomic_store_n(&store->last->next, b,
+					 __ATOMIC_RELEASE);
+		else
+			__atomic_store_n(&store->blocks, b, __ATOMIC_RELEASE);
+		store->last = b;
+	}
+	first = b->used;
+	__atomic_store_n(&b->used, first + num, __ATOMIC_RELEASE);
+	set_row(row, b, first, num);
+	pthread_mutex_unlock(&store->lock);
+
+	return 0;
+}
+
+void pfm_counts_free(pfm_counts_t *store, pfm_counts_row_t *row)
+{
+	struct __pfm_counts_hole *hole;
+	int i;
+
+	if(row->block == NULL)
+		return;
+
+	/* zeroed entries are left alone by the updates */
+	for(i = 0; i < PFM_COUNTS_ARRAYS; i++)
+		memset(&row->block->entries[i][row->first], 0,
+		       sizeof(uint64_t) * row->num);
+
+	/* without a hole, the entries are only lost */
+	hole = malloc(sizeof(struct __pfm_counts_hole));
+	if(hole){
+		hole->block = row->block;
+		hole->first = row->first;
+		hole->num = row->num;
+		pthread_mutex_lock(&store->lock);
+		hole->next = store->holes;
+		store->holes = hole;
+		pthread_mutex_unlock(&store->lock);
+	}
+	row->block = NULL;
+	row->num = 0;
+}
+
+void pfm_counts_local(pfm_counts_row_t *row, uint64_t *buf, int num)
+{
+	uint64_t **arrays[PFM_COUNTS_ARRAYS] = {&row->raw, &row->ena,
+						&row->run, &row->val,
+						&row->delta, &row->elapsed,
+						&row->last_ena, &row->fresh};
+	int i;
+
+	for(i = 0; i < PFM_COUNTS_ARRAYS; i++)
+		*arrays[i] = buf + i * num;
+	row->num = num;
+	row->block = NULL;
+	row->first = 0;
+}
+
+/*
+ * Update count i of the arrays; the scalar form of update_block
+ */
+static inline void update_one(uint64_t **a, int i)
+{
+	uint64_t val;
+
+	if(!a[FRESH][i]){
+		a[DELTA][i] = a[ELAPSED][i] = 0;
+		return;
+	}
+
+	if(a[RUN][i] == 0)
+		val = 0;
+	/* not multiplexed, exact whatever the count */
+	else if(a[RUN][i] == a[ENA][i])
+		val = a[RAW][i];
+	else
+		val = (uint64_t)((double)a[RAW][i] * a[ENA][i] / a[RUN][i]);
+
+	a[DELTA][i] = val - a[VAL][i];
+	a[VAL][i] = val;
+	a[ELAPSED][i] = a[ENA][i] - a[LAST_ENA][i];
+	a[LAST_ENA][i] = a[ENA][i];
+	a[FRESH][i] = 0;
+}
+
+/*
+ * Update the first end entries of a block, VEC_LEN entries at a time; the
+ * entries past the rows are zero, so end may be rounded up. Lanes are
+ * selected with the all-ones/all-zeros masks of the vector comparisons.
+ */
+#ifndef __SANITIZE_THREAD__
+/* not under ThreadSanitizer, the resolver runs before it is set up */
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void update_block(struct __pfm_counts_block *b, int end)
+{
+	uint64_t (*e)[PFM_COUNTS_BLOCK] = b->entries;
+	v4u64 raw, ena, run, ran, exact, fresh, scale, val, old;
+	v4f64 scaled;
+	int i;
+
+	for(i = 0; i < end; i += VEC_LEN){
+		fresh = (v4u64)(*(v4u64 *)&e[FRESH][i] != 0);
+		raw = *(v4u64 *)&e[RAW][i];
+		ena = *(v4u64 *)&e[ENA][i];
+		run = *(v4u64 *)&e[RUN][i];
+
+		ran = (v4u64)(run != 0);
+		exact = (v4u64)(run == ena);
+		val = raw & ran;
+		scale = fresh & ran & ~exact;
+		/* 
+		 * only multiplexed counts are scaled; the counts and times fit 
+		 * in 63 bits, and signed conversions are single instructions
+		 */
+		if(scale[0] | scale[1] | scale[2] | scale[3]){
+			/* never divides by zero, those lanes are cleared */
+			scaled = __builtin_convertvector((v4i64)raw, v4f64) *
+				__builtin_convertvector((v4i64)ena, v4f64) /
+				__builtin_convertvector((v4i64)(run | (~ran & 1)),
+							v4f64);
+			val = (v4u64)__builtin_convertvector(scaled, v4i64);
+			val = ((raw & exact) | (val & ~exact)) & ran;
+		}
+
+		old = *(v4u64 *)&e[VAL][i];
+		*(v4u64 *)&e[DELTA][i] = (val - old) & fresh;
+		*(v4u64 *)&e[VAL][i] = (val & fresh) | (old & ~fresh);
+		old = *(v4u64 *)&e[LAST_ENA][i];
+		*(v4u64 *)&e[ELAPSED][i] = (ena - old) & fresh;
+		*(v4u64 *)&e[LAST_ENA][i] = (ena & fresh) | (old & ~fresh);
+		*(v4u64 *)&e[FRESH][i] = (v4u64){0, 0, 0, 0};
+	}
+}
+
+void pfm_counts_update(pfm_counts_t *store)
+{
+	struct __pfm_counts_block *b;
+	int used;
+
+	for(b = __atomic_load_n(&store->blocks, __ATOMIC_ACQUIRE); b;
+	    b = __atomic_load_n(&b->next, __ATOMIC_ACQUIRE)){
+		used = __atomic_load_n(&b->used, __ATOMIC_ACQUIRE);
+		update_block(b, (used + VEC_LEN - 1) & ~(VEC_LEN - 1));
+	}
+}
+
+void pfm_counts_update_row(pfm_counts_row_t *row)
+{
+	uint64_t *a[PFM_COUNTS_ARRAYS] = {row->raw, row->ena, row->run,
+					  row->val, row->delta, row->elapsed,
+					  row->last_ena, row->fresh};
+	int i;
+
+	for(i = 0; i < row->num; i++)
+		update_one(a, i);
+}
@@ -0,0 +1,117 @@
+/*
+ * Counter store: the counts of all contexts of a kind (threads or cores) in
+ * structure-of-arrays blocks. Each context gets a row, the entries of its
+ * events in one block. Reading a context only stores the raw count, time
+ * enabled and time running of its events; one pass per tick then scales all
+ * counts read since the last pass and computes their deltas, over whole
+ * blocks with vector operations, instead of one event at a time. Blocks
+ * never move, so a row stays valid until it is freed. Rows may be allocated
+ * and freed by any thread; the updates and the rows being freed belong to
+ * the thread running the passes.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_COUNTS_H__
+#define __PFM_COUNTS_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define PFM_COUNTS_BLOCK 1024 /* entries per block, a multiple of 8 */
+#define PFM_COUNTS_ARRAYS 8 /* arrays of a row */
+
+struct __pfm_counts_block;
+struct __pfm_counts_hole;
+
+/* the entries of one context, num consecutive entries of each array */
+typedef struct __pfm_counts_row{
+	uint64_t *raw; /* raw count, as read */
+	uint64_t *ena; /* time enabled, as read */
+	uint64_t *run; /* time running, as read */
+	uint64_t *val; /* scaled count at the last update */
+	uint64_t *delta; /* val minus val of the update before */
+	uint64_t *elapsed; /* ena minus ena of the update before */
+	uint64_t *last_ena; /* ena at the last update */
+	uint64_t *fresh; /* nonzero if read since the last update */
+	int num;
+	struct __pfm_counts_block *block; /* NULL if not in a store */
+	int first; /* first entry in the block */
+}pfm_counts_row_t;
+
+/* the blocks of one kind of contexts */
+typedef struct __pfm_counts{
+	struct __pfm_counts_block *blocks;
+	struct __pfm_counts_block *last;
+	struct __pfm_counts_hole *holes; /* rows freed, to be reused */
+	pthread_mutex_t lock; /* for allocating and freeing rows */
+}pfm_counts_t;
+
+/*
+ * Initialize an empty store
+ */
+void pfm_counts_init(pfm_counts_t *store);
+
+/*
+ * Free a store and all its blocks
+ */
+void pfm_counts_destroy(pfm_counts_t *store);
+
+/*
+ * Get a row of zeroed entries
+ * Parameters:
+ *	num	--> number of events, at most PFM_COUNTS_BLOCK
+ * Output parameters:
+ *	row	--> the row
+ * Return value:
+ *      0       --> success
+ *      other   --> out of memory, or too many events
+ */
+int pfm_counts_alloc(pfm_counts_t *store, int num, pfm_counts_row_t *row);
+
+/*
+ * Give a row back to its store; does nothing if the row has no entries
+ */
+void pfm_counts_free(pfm_counts_t *store, pfm_counts_row_t *row);
+
+/*
+ * Make a row of a buffer outside any store, e.g. for a reading that is
+ * reported once
+ * Parameters:
+ *	buf	--> PFM_COUNTS_ARRAYS * num zeroed words
+ *	num	--> number of events
+ */
+void pfm_counts_local(pfm_counts_row_t *row, uint64_t *buf, int num);
+
+/*
+ * Store a reading of an event, to be scaled by the next update
+ * Parameters:
+ *	evt	--> the event in the row
+ *	raw	--> raw count
+ *	ena	--> time enabled
+ *	run	--> time running
+ */
+static inline void pfm_counts_set(pfm_counts_row_t *row, int evt,
+				  uint64_t raw, uint64_t ena, uint64_t run)
+{
+	row->raw[evt] = raw;
+	row->ena[evt] = ena;
+	row->run[evt] = run;
+	row->fresh[evt] = 1;
+}
+
+/*
+ * Update every entry of a store read since the last update: the count is
+ * scaled as raw * ena / run (0 if never running), and its delta and the
+ * elapsed time enabled are taken; the other entries keep their values and
+ * get zero deltas
+ */
+void pfm_counts_update(pfm_counts_t *store);
+
+/*
+ * Update the entries of one row, as pfm_counts_update, for a context read
+ * outside a pass
+ */
+void pfm_counts_update_row(pfm_counts_row_t *row);
+
+#endif
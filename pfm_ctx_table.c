@@ -0,0 +1,254 @@
+/*
+ * A growable table of monitoring contexts, indexed by tid or cpu id.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pfm_ctx_table.h"
+#include "pfm_epoch.h"
+
+#define INIT_SLOTS 64
+#define BUCKET_EMPTY -1
+#define BUCKET_DELETED -2
+
+/*
+ * A bucket holds the key and the slot index in one word, so that a reader
+ * never sees the key of one context with the slot of another
+ */
+#define BUCKET(key, slot) (((uint64_t)(uint32_t)(key) << 32) | \
+			   (uint32_t)(slot))
+#define BUCKET_KEY(b) ((int)(uint32_t)((b) >> 32))
+#define BUCKET_SLOT(b) ((int)(uint32_t)(b))
+
+static inline unsigned int hash_key(int key, int num_buckets)
+{
+	/* Knuth's multiplicative hashing; tids are mostly consecutive */
+	return ((uint32_t)key * 2654435761U) & (num_buckets - 1);
+}
+
+/*
+ * Find the bucket of a key
+ * Output parameters:
+ *	word	--> the bucket, as found
+ * Return value:
+ *      the bucket index, -1 if not found
+ */
+static int find_bucket(pfm_ctx_index_t *index, int key, uint64_t *word)
+{
+	unsigned int b = hash_key(key, index->num_buckets);
+	uint64_t w;
+
+	while(1){
+		w = __atomic_load_n(&index->buckets[b], __ATOMIC_ACQUIRE);
+		if(BUCKET_SLOT(w) == BUCKET_EMPTY)
+			return -1;
+		if(BUCKET_SLOT(w) >= 0 && BUCKET_KEY(w) == key)
+			break;
+		b = (b + 1) & (index->num_buckets - 1);
+	}
+	*word = w;
+
+	return b;
+}
+
+/*
+ * Publish a new index of num_buckets buckets with the current keys; this
+ * also drops the deleted marks. The old index is freed once the readers
+ * leave.
+ */
+static int rehash(pfm_ctx_table_t *t, int num_buckets)
+{
+	pfm_ctx_index_t *index, *old = t->index;
+	uint64_t w;
+	int i;
+	unsigned int b;
+
+	index = malloc(sizeof(pfm_ctx_index_t) +
+		       sizeof(uint64_t) * num_buckets);
+	if(index == NULL)
+		return -1;
+	index->num_buckets = num_buckets;
+	for(i = 0; i < num_buckets; i++)
+		index->buckets[i] = BUCKET(0, BUCKET_EMPTY);
+
+	for(i = 0; old && i < old->num_buckets; i++){
+		w = old->buckets[i];
+		if(BUCKET_SLOT(w) < 0)
+			continue;
+		b = hash_key(BUCKET_KEY(w), num_buckets);
+		while(BUCKET_SLOT(index->buckets[b]) != BUCKET_EMPTY)
+			b = (b + 1) & (num_buckets - 1);
+		index->buckets[b] = w;
+	}
+
+	__atomic_store_n(&t->index, index, __ATOMIC_RELEASE);
+	if(old)
+		pfm_epoch_retire(old, free);
+	t->used_buckets = t->count;
+
+	return 0;
+}
+
+/*
+ * Double the slots; the old slots are freed once the readers leave
+ */
+static int grow_slots(pfm_ctx_table_t *t)
+{
+	pfm_ctx_slots_t *slots, *old = t->slots;
+	int max_slots = old->max_slots * 2;
+	int *free_slots;
+	uint64_t *free_stamps;
+	int i, j;
+
+	slots = calloc(1, sizeof(pfm_ctx_slots_t) + sizeof(void*) * max_slots);
+	free_slots = malloc(sizeof(int) * max_slots);
+	free_stamps = malloc(sizeof(uint64_t) * max_slots);
+	if(slots == NULL || free_slots == NULL || free_stamps == NULL){
+		free(slots);
+		free(free_slots);
+		free(free_stamps);
+		return -1;
+	}
+	slots->max_slots = max_slots;
+	memcpy(slots->ctxs, old->ctxs, sizeof(void*) * old->max_slots);
+
+	/* the queue of free slots starts over at 0 */
+	for(i = 0; i < t->num_free; i++){
+		j = (t->first_free + i) % old->max_slots;
+		free_slots[i] = t->free_slots[j];
+		free_stamps[i] = t->free_stamps[j];
+	}
+	free(t->free_slots);
+	free(t->free_stamps);
+	t->free_slots = free_slots;
+	t->free_stamps = free_stamps;
+	t->first_free = 0;
+
+	__atomic_store_n(&t->slots, slots, __ATOMIC_RELEASE);
+	pfm_epoch_retire(old, free);
+
+	return 0;
+}
+
+int pfm_ctx_table_init(pfm_ctx_table_t *t)
+{
+	memset(t, 0, sizeof(pfm_ctx_table_t));
+
+	t->slots = calloc(1, sizeof(pfm_ctx_slots_t) +
+			  sizeof(void*) * INIT_SLOTS);
+	t->free_slots = malloc(sizeof(int) * INIT_SLOTS);
+	t->free_stamps = malloc(sizeof(uint64_t) * INIT_SLOTS);
+	if(t->slots == NULL || t->free_slots == NULL || t->free_stamps == NULL)
+		goto error;
+	t->slots->max_slots = INIT_SLOTS;
+
+	if(rehash(t, INIT_SLOTS * 2))
+		goto error;
+
+	return 0;
+
+ error:
+	pfm_ctx_table_destroy(t);
+	return -1;
+}
+
+int pfm_ctx_table_insert(pfm_ctx_table_t *t, int key, void *ctx)
+{
+	int slot;
+	uint64_t w;
+	unsigned int b;
+
+	if(find_bucket(t->index, key, &w) != -1)
+		return -1;
+
+	/* keep the hash table at most 3/4 full, including deleted marks */
+	if((t->used_buckets + 1) * 4 > t->index->num_buckets * 3){
+		int num_buckets = t->index->num_buckets;
+
+		/* grow only if live keys fill it; otherwise just clean up */
+		if((t->count + 1) * 2 > num_buckets)
+			num_buckets *= 2;
+		if(rehash(t, num_buckets))
+			return -2;
+	}
+
+	/*
+	 * get a slot, reuse a freed one first, once no reader can find it
+	 * with its old key
+	 */
+	if(t->num_free && pfm_epoch_passed(t->free_stamps[t->first_free])){
+		slot = t->free_slots[t->first_free];
+		t->first_free = (t->first_free + 1) % t->slots->max_slots;
+		t->num_free--;
+	}
+	else{
+		if(t->num_slots == t->slots->max_slots && grow_slots(t))
+			return -2;
+		slot = t->num_slots;
+	}
+
+	/* the context is published before its key and its slot count */
+	__atomic_store_n(&t->slots->ctxs[slot], ctx, __ATOMIC_RELEASE);
+	if(slot == t->num_slots)
+		__atomic_store_n(&t->num_slots, slot + 1, __ATOMIC_RELEASE);
+
+	b = hash_key(key, t->index->num_buckets);
+	while(BUCKET_SLOT(t->index->buckets[b]) >= 0)
+		b = (b + 1) & (t->index->num_buckets - 1);
+	if(BUCKET_SLOT(t->index->buckets[b]) == BUCKET_EMPTY)
+		t->used_buckets++;
+	__atomic_store_n(&t->index->buckets[b], BUCKET(key, slot),
+			 __ATOMIC_RELEASE);
+	t->count++;
+
+	return slot;
+}
+
+void *pfm_ctx_table_lookup(pfm_ctx_table_t *t, int key)
+{
+	pfm_ctx_index_t *index = __atomic_load_n(&t->index, __ATOMIC_ACQUIRE);
+	uint64_t w;
+
+	if(find_bucket(index, key, &w) == -1)
+		return NULL;
+
+	return pfm_ctx_table_get(t, BUCKET_SLOT(w));
+}
+
+void *pfm_ctx_table_remove(pfm_ctx_table_t *t, int key)
+{
+	int b, slot, last;
+	uint64_t w;
+	void *ctx;
+
+	b = find_bucket(t->index, key, &w);
+	if(b == -1)
+		return NULL;
+
+	slot = BUCKET_SLOT(w);
+	ctx = t->slots->ctxs[slot];
+	__atomic_store_n(&t->index->buckets[b], BUCKET(key, BUCKET_DELETED),
+			 __ATOMIC_RELEASE);
+	__atomic_store_n(&t->slots->ctxs[slot], NULL, __ATOMIC_RELEASE);
+
+	last = (t->first_free + t->num_free) % t->slots->max_slots;
+	t->free_slots[last] = slot;
+	t->free_stamps[last] = pfm_epoch_stamp();
+	t->num_free++;
+	t->count--;
+
+	return ctx;
+}
+
+void pfm_ctx_table_destroy(pfm_ctx_table_t *t)
+{
+	free(t->slots);
+	free(t->free_slots);
+	free(t->free_stamps);
+	free(t->index);
+	memset(t, 0, sizeof(pfm_ctx_table_t));
+}
@@ -0,0 +1,115 @@
+/*
+ * A growable table of monitoring contexts (per-thread or per-core), indexed
+ * by tid or cpu id. Lookup by key is O(1) through an open-addressing hash
+ * table. Contexts are stored in slots; a slot is reused after its context is
+ * removed, so the slots in use track the live contexts.
+ *
+ * Readers take no lock: a thread may look up and iterate the table while
+ * one writer inserts and removes, as long as the readers are inside a
+ * pfm_epoch section. A context is published with its insertion, so it must
+ * be complete before; a removed context is only unpublished, and must not be
+ * freed before the readers leave, see pfm_epoch_retire. Writers must be
+ * serialized by the caller.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_CTX_TABLE_H__
+#define __PFM_CTX_TABLE_H__
+
+#include <stdint.h>
+
+/* the slots, replaced as a whole when the table grows */
+typedef struct __pfm_ctx_slots{
+	int max_slots; /* allocated size of ctxs */
+	void *ctxs[]; /* slot index -> context, NULL for a free slot */
+}pfm_ctx_slots_t;
+
+/* the hash buckets, replaced as a whole when rehashed */
+typedef struct __pfm_ctx_index{
+	int num_buckets; /* always a power of 2 */
+	uint64_t buckets[]; /* the key (tid or cpu) and its slot index */
+}pfm_ctx_index_t;
+
+typedef struct __pfm_ctx_table{
+	pfm_ctx_slots_t *slots;
+	int num_slots; /* number of slots ever used, i.e., the high-water mark */
+	/*
+	 * queue of freed slot indices, to be reused once no reader can
+	 * still find them by their old keys; stamps are from pfm_epoch_stamp
+	 */
+	int *free_slots;
+	uint64_t *free_stamps;
+	int first_free;
+	int num_free;
+	pfm_ctx_index_t *index;
+	int used_buckets; /* buckets holding a key or a deleted mark */
+	int count; /* number of contexts in the table */
+}pfm_ctx_table_t;
+
+/*
+ * Initialize an empty table
+ * Parameters:
+ *	t	--> the table
+ * Return value:
+ *      0       --> success
+ *      other   --> out of memory
+ */
+int pfm_ctx_table_init(pfm_ctx_table_t *t);
+
+/*
+ * Add a context to the table
+ * Parameters:
+ *	t	--> the table
+ *	key	--> tid or cpu id of the context
+ *	ctx	--> the context
+ * Return value:
+ *      >= 0    --> the slot index of the context
+ *      -1      --> key already in the table
+ *      -2      --> out of memory
+ */
+int pfm_ctx_table_insert(pfm_ctx_table_t *t, int key, void *ctx);
+
+/*
+ * Find the context of a key
+ * Parameters:
+ *	t	--> the table
+ *	key	--> tid or cpu id of the context
+ * Return value:
+ *      the context, NULL if not found
+ */
+void *pfm_ctx_table_lookup(pfm_ctx_table_t *t, int key);
+
+/*
+ * Remove the context of a key from the table; its slot will be reused
+ * Parameters:
+ *	t	--> the table
+ *	key	--> tid or cpu id of the context
+ * Return value:
+ *      the removed context, NULL if not found
+ */
+void *pfm_ctx_table_remove(pfm_ctx_table_t *t, int key);
+
+/*
+ * Free the memory of the table (not the contexts); no reader may be left
+ */
+void pfm_ctx_table_destroy(pfm_ctx_table_t *t);
+
+/*
+ * Iterating over the table: slots from 0 to pfm_ctx_table_slots() - 1,
+ * skipping the free slots, whose contexts are NULL. The contexts inserted
+ * or removed meanwhile may or may not be seen.
+ */
+static inline int pfm_ctx_table_slots(pfm_ctx_table_t *t)
+{
+	return __atomic_load_n(&t->num_slots, __ATOMIC_ACQUIRE);
+}
+
+static inline void *pfm_ctx_table_get(pfm_ctx_table_t *t, int slot)
+{
+	pfm_ctx_slots_t *slots = __atomic_load_n(&t->slots, __ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&slots->ctxs[slot], __ATOMIC_ACQUIRE);
+}
+
+#endif
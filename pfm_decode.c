@@ -0,0 +1,492 @@
+/* 
+ * This program converts the binary output of pfm_multi (-o bin) into the 
+ * text output of pfm_multi, or into CSV.
+ * Usage: pfm_decode [-h] [-c] [-M metrics] [-q] [file]; reads stdin if no file
+ * is given.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */ 
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <locale.h>
+#include <err.h>
+#include <math.h>
+
+#include "pfm_output_bin.h"
+#include "pfm_ctx_table.h"
+#include "pfm_metrics.h"
+
+/* the stream being decoded */
+typedef struct __decode_stream{
+	FILE *in;
+	FILE *out;
+	int csv;
+	uint32_t num_events;
+	pfm_bin_event_t *events;
+	pfm_ctx_table_t threads; /* tid -> pfm_bin_context_t */
+	pfm_bin_tick_t tick; /* the current tick */
+	/* derived metrics, see pfm_metrics.h */
+	char *metrics_list;
+	int metrics_only; /* print only the metrics of each reading */
+	void *metrics;
+	double *deltas; /* scaled delta of each event */
+	/* time enabled at the last reading of each thread and cpu */
+	pfm_ctx_table_t last_ena[2];
+}decode_stream_t;
+
+void usage(void)
+{
+	printf("usage: pfm_decode [-h] [-c] [-M metrics] [-q] [file]\n"
+	       "-h\t\tshow this help\n"
+	       "-c\t\toutput CSV instead of pfm_multi text output\n"
+	       "-M m=expr,..\tderived metrics of each reading, as pfm_multi "
+	       "-M\n"
+	       "-q\t\twith -M, output only the metrics of each reading\n"
+	       "file\t\tbinary output of pfm_multi -o bin, default stdin\n");
+}
+
+static void read_exact(decode_stream_t *s, void *buf, size_t size)
+{
+	if(fread(buf, size, 1, s->in) != 1)
+		errx(1, "truncated input\n");
+}
+
+static void add_context(decode_stream_t *s, pfm_bin_context_t *ctx)
+{
+	pfm_bin_context_t *c;
+
+	if(ctx->kind != PFM_OUTPUT_THREAD)
+		return;
+
+	/* a tid may be reused by a later thread */
+	c = pfm_ctx_table_remove(&s->threads, ctx->id);
+	if(c == NULL){
+		c = malloc(sizeof(pfm_bin_context_t));
+		if(c == NULL)
+			errx(1, "out of memory\n");
+	}
+	*c = *ctx;
+	if(pfm_ctx_table_insert(&s->threads, ctx->id, c) < 0)
+		errx(1, "out of memory\n");
+}
+
+static int get_tgid(decode_stream_t *s, uint32_t kind, int32_t id)
+{
+	pfm_bin_context_t *c;
+
+	if(kind != PFM_OUTPUT_THREAD)
+		return -1;
+	c = pfm_ctx_table_lookup(&s->threads, id);
+
+	return c ? c->tgid : -1;
+}
+
+static void read_header(decode_stream_t *s)
+{
+	pfm_bin_header_t hdr;
+	pfm_bin_context_t ctx;
+	size_t used;
+	uint32_t i;
+	char c;
+
+	read_exact(s, &hdr, sizeof(hdr));
+	if(memcmp(hdr.magic, PFM_BIN_MAGIC, sizeof(hdr.magic)))
+		errx(1, "not a pfm_multi binary stream\n");
+	if(hdr.version != PFM_BIN_VERSION)
+		errx(1, "unsupported stream version %u\n", hdr.version);
+
+	s->num_events = hdr.num_events;
+	s->events = calloc(hdr.num_events, sizeof(pfm_bin_event_t));
+	if(hdr.num_events && s->events == NULL)
+		errx(1, "out of memory\n");
+	for(i = 0; i < hdr.num_events; i++){
+		read_exact(s, &s->events[i], sizeof(pfm_bin_event_t));
+		s->events[i].name[PFM_BIN_NAME_LEN - 1] = '\0';
+	}
+
+	for(i = 0; i < hdr.num_contexts; i++){
+		read_exact(s, &ctx, sizeof(ctx));
+		add_context(s, &ctx);
+	}
+
+	/* skip header fields added by later versions */
+	used = sizeof(hdr) + sizeof(pfm_bin_event_t) * hdr.num_events + 
+		sizeof(pfm_bin_context_t) * hdr.num_contexts;
+	for(; used < hdr.header_size; used++)
+		read_exact(s, &c, 1);
+
+	if(s->metrics_list){
+		const char *names[hdr.num_events ? hdr.num_events : 1];
+		char errbuf[256];
+
+		for(i = 0; i < hdr.num_events; i++)
+			names[i] = s->events[i].name;
+		if(pfm_metrics_compile(&s->metrics, s->metrics_list, names, 
+				       hdr.num_events, errbuf, sizeof(errbuf)))
+			errx(1, "cannot compile metrics: %s\n", errbuf);
+		s->deltas = calloc(hdr.num_events + 1, sizeof(double));
+		if(s->deltas == NULL)
+			errx(1, "out of memory\n");
+	}
+
+	if(s->csv)
+		fprintf(s->out, "tick,intended_ns,actual_ns,kind,id,tgid,event,"
+			"delta,ena,run,scaling\n");
+}
+
+static void decode_tick(decode_stream_t *s, pfm_bin_tick_t *t)
+{
+	s->tick = *t;
+	if(s->csv)
+		return;
+
+	fprintf(s->out, "\ntick %"PRIu64": intended %'"PRIu64" ns, actual "
+		"%'"PRIu64" ns (late %'"PRIu64" ns, missed %"PRIu64")\n", 
+		t->seq, t->intended, t->actual, t->actual - t->intended, 
+		t->missed);
+}
+
+/*
+ * Get the time a context was enabled since its last reading, which the 
+ * stream only has as totals
+ */
+static double reading_ns(decode_stream_t *s, pfm_bin_counts_t *c)
+{
+	pfm_ctx_table_t *t = &s->last_ena[c->kind == PFM_OUTPUT_THREAD];
+	uint64_t *last;
+	uint64_t ena;
+
+	if(s->num_events == 0)
+		return 0;
+	ena = c->values[0].ena;
+
+	last = pfm_ctx_table_lookup(t, c->id);
+	if(last == NULL){
+		last = calloc(1, sizeof(uint64_t));
+		if(last == NULL || pfm_ctx_table_insert(t, c->id, last) < 0)
+			errx(1, "out of memory\n");
+	}
+	/* a reused tid or cpu starts over */
+	if(ena < *last)
+		*last = 0;
+	ena -= *last;
+	*last = c->values[0].ena;
+
+	return ena;
+}
+
+static void decode_metrics(decode_stream_t *s, pfm_bin_counts_t *c)
+{
+	const char *kind = c->kind == PFM_OUTPUT_THREAD ? "thread" : "cpu";
+	double ns = reading_ns(s, c);
+	int i;
+
+	for(i = 0; i < s->num_events; i++){
+		pfm_bin_value_t *v = &c->values[i];
+
+		if(v->delta < 0){
+			s->deltas[i] = NAN;
+			continue;
+		}
+		s->deltas[i] = v->delta;
+		// scale as the counts themselves are scaled
+		if(v->run && v->run < v->ena)
+			s->deltas[i] = s->deltas[i] * v->ena / v->run;
+	}
+
+	if(s->csv){
+		for(i = 0; i < pfm_metrics_num(s->metrics); i++)
+			fprintf(s->out, "%"PRIu64",%"PRIu64",%"PRIu64",%s,%d,"
+				"%d,%s,%.4f,,,\n", s->tick.seq, 
+				s->tick.intended, s->tick.actual, kind, c->id,
+				get_tgid(s, c->kind, c->id), 
+				pfm_metrics_name(s->metrics, i),
+				pfm_metrics_eval(s->metrics, i, s->deltas, ns));
+		return;
+	}
+
+	if(c->kind == PFM_OUTPUT_THREAD)
+		fprintf(s->out, "thread [%d]:", c->id);
+	else
+		fprintf(s->out, "CPU <%d>:", c->id);
+	for(i = 0; i < pfm_metrics_num(s->metrics); i++)
+		fprintf(s->out, " %s=%.4f", pfm_metrics_name(s->metrics, i),
+			pfm_metrics_eval(s->metrics, i, s->deltas, ns));
+	fprintf(s->out, "\n");
+}
+
+static void decode_counts(decode_stream_t *s, pfm_bin_counts_t *c)
+{
+	const char *kind = c->kind == PFM_OUTPUT_THREAD ? "thread" : "cpu";
+	uint32_t i;
+
+	for(i = 0; !s->metrics_only && i < s->num_events; i++){
+		pfm_bin_value_t *v = &c->values[i];
+		/* the running share of the time enabled, as perf_scale_ratio */
+		double ratio = v->ena ? (double)v->run / v->ena : 0.0;
+
+		if(s->csv){
+			fprintf(s->out, "%"PRIu64",%"PRIu64",%"PRIu64",%s,%d,"
+				"%d,%s,%"PRId64",%"PRIu64",%"PRIu64",%.4f\n",
+				s->tick.seq, s->tick.intended, 
+				s->tick.actual, kind, c->id, 
+				get_tgid(s, c->kind, c->id), 
+				s->events[i].name, v->delta, v->ena, v->run,
+				1.0 - ratio);
+			continue;
+		}
+
+		/* separate groups */
+		if(s->events[i].flags & PFM_BIN_EVT_LEADER)
+			fprintf(s->out, "\n");
+
+		if(v->delta < 0){
+			fprintf(s->out, "inconsistent scaling %s (delta=%'"
+				PRId64")\n", s->events[i].name, v->delta);
+			continue;
+		}
+		if(c->kind == PFM_OUTPUT_THREAD)
+			fprintf(s->out, "thread [%d]:", c->id);
+		else
+			fprintf(s->out, "CPU <%d>:", c->id);
+		fprintf(s->out, "%'20"PRIu64" %s (%.2f%% scaling, ena=%'"PRIu64
+			", run=%'"PRIu64")\n", (uint64_t)v->delta, 
+			s->events[i].name, (1.0 - ratio) * 100.0, v->ena, 
+			v->run);
+	}
+
+	if(s->metrics)
+		decode_metrics(s, c);
+}
+
+static void decode_totals(decode_stream_t *s, pfm_bin_totals_t *t)
+{
+	uint32_t i;
+
+	if(!s->csv)
+		fprintf(s->out, "\n");
+	for(i = 0; i < s->num_events; i++){
+		if(s->csv)
+			fprintf(s->out, "%"PRIu64",%"PRIu64",%"PRIu64
+				",process,%d,%d,%s,%"PRIu64",,,\n",
+				s->tick.seq, s->tick.intended, 
+				s->tick.actual, t->tgid, t->tgid, 
+				s->events[i].name, t->values[i]);
+		else
+			fprintf(s->out, "process [%d]:%'20"PRIu64" %s (%u "
+				"threads, %u exited, %u live)\n", t->tgid, 
+				t->values[i], s->events[i].name, 
+				t->num_threads, t->num_exited, t->num_live);
+	}
+}
+
+static void decode_bandwidth(decode_stream_t *s, pfm_bin_bandwidth_t *b)
+{
+	double sec = b->ns / 1000000000.0;
+
+	if(s->csv){
+		fprintf(s->out, "%"PRIu64",%"PRIu64",%"PRIu64",socket,%d,-1,"
+			"bytes_read,%"PRIu64",%"PRIu64",%"PRIu64",0.0000\n",
+			s->tick.seq, s->tick.intended, s->tick.actual, 
+			b->socket, b->read, b->ns, b->ns);
+		fprintf(s->out, "%"PRIu64",%"PRIu64",%"PRIu64",socket,%d,-1,"
+			"bytes_written,%"PRIu64",%"PRIu64",%"PRIu64",0.0000\n",
+			s->tick.seq, s->tick.intended, s->tick.actual, 
+			b->socket, b->written, b->ns, b->ns);
+		return;
+	}
+
+	fprintf(s->out, "socket <%d>:%'20"PRIu64" bytes read (%.3f GB/s)\n",
+		b->socket, b->read, sec > 0 ? b->read / sec / 1e9 : 0.0);
+	fprintf(s->out, "socket <%d>:%'20"PRIu64" bytes written (%.3f GB/s)\n",
+		b->socket, b->written, sec > 0 ? b->written / sec / 1e9 : 0.0);
+}
+
+static const char *mem_sources[PFM_MEM_SOURCES] = {"L1", "LFB", "L2", "L3",
+						   "DRAM", "remote DRAM",
+						   "remote cache", "other"};
+static const char *mem_csv_sources[PFM_MEM_SOURCES] = {"l1", "lfb", "l2", 
+						       "l3", "dram", 
+						       "remote_dram", 
+						       "remote_cache", 
+						       "other"};
+
+/*
+ * Output one value of the sampled loads of a thread as a CSV row
+ */
+static void csv_memory_value(decode_stream_t *s, pfm_bin_memory_t *m,
+			     const char *name, int idx, uint64_t val)
+{
+	char label[64];
+
+	if(idx >= 0)
+		snprintf(label, sizeof(label), name, idx);
+	else
+		snprintf(label, sizeof(label), "%s", name);
+	fprintf(s->out, "%"PRIu64",%"PRIu64",%"PRIu64",thread,%d,%d,%s,"
+		"%"PRIu64",0,0,0.0000\n", s->tick.seq, s->tick.intended, 
+		s->tick.actual, m->tid, m->pid, label, val);
+}
+
+static void decode_memory(decode_stream_t *s, pfm_bin_memory_t *m)
+{
+	double n = m->samples ? (double)m->samples : 1.0;
+	char name[64];
+	uint32_t i;
+
+	if(s->csv){
+		csv_memory_value(s, m, "mem_samples", -1, m->samples);
+		csv_memory_value(s, m, "mem_latency", -1, m->latency);
+		for(i = 0; i < PFM_MEM_LAT_BUCKETS - 1; i++)
+			csv_memory_value(s, m, "mem_lat_lt%d", 32 << i, 
+					 m->lat[i]);
+		csv_memory_value(s, m, "mem_lat_ge%d", 
+				 32 << (PFM_MEM_LAT_BUCKETS - 2), m->lat[i]);
+		for(i = 0; i < PFM_MEM_SOURCES; i++){
+			snprintf(name, sizeof(name), "mem_src_%s", 
+				 mem_csv_sources[i]);
+			csv_memory_value(s, m, name, -1, m->src[i]);
+		}
+		for(i = 0; i < m->num_nodes; i++)
+			csv_memory_value(s, m, "mem_node%d", i, m->nodes[i]);
+		csv_memory_value(s, m, "mem_node_unknown", -1, 
+				 m->nodes[m->num_nodes]);
+		return;
+	}
+
+	fprintf(s->out, "thread [%d]:%'20"PRIu64" loads sampled (%.1f cycles "
+		"on average)\n", m->tid, m->samples, m->latency / n);
+	fprintf(s->out, "thread [%d]: latency", m->tid);
+	for(i = 0; i < PFM_MEM_LAT_BUCKETS - 1; i++)
+		fprintf(s->out, " <%d: %.1f%%,", 32 << i, m->lat[i] * 100.0 / n);
+	fprintf(s->out, " >=%d: %.1f%%\n", 32 << (PFM_MEM_LAT_BUCKETS - 2),
+		m->lat[i] * 100.0 / n);
+	fprintf(s->out, "thread [%d]: source", m->tid);
+	for(i = 0; i < PFM_MEM_SOURCES; i++)
+		fprintf(s->out, " %s: %.1f%%%s", mem_sources[i], 
+			m->src[i] * 100.0 / n, 
+			i < PFM_MEM_SOURCES - 1 ? "," : "\n");
+	fprintf(s->out, "thread [%d]: node", m->tid);
+	for(i = 0; i < m->num_nodes; i++)
+		fprintf(s->out, " <%d>: %.1f%%,", i, m->nodes[i] * 100.0 / n);
+	fprintf(s->out, " unknown: %.1f%%\n", 
+		m->nodes[m->num_nodes] * 100.0 / n);
+}
+
+int decode(decode_stream_t *s)
+{
+	pfm_bin_rec_t rec;
+	char *buf = NULL;
+	size_t buf_size = 0;
+
+	read_header(s);
+
+	while(fread(&rec, sizeof(rec), 1, s->in) == 1){
+		if(rec.size < sizeof(rec))
+			errx(1, "corrupted record of type %u\n", rec.type);
+		if(rec.size > buf_size){
+			buf_size = rec.size;
+			buf = realloc(buf, buf_size);
+			if(buf == NULL)
+				errx(1, "out of memory\n");
+		}
+		memcpy(buf, &rec, sizeof(rec));
+		read_exact(s, buf + sizeof(rec), rec.size - sizeof(rec));
+
+		switch(rec.type){
+		case PFM_BIN_REC_TICK:
+			if(rec.size >= sizeof(pfm_bin_tick_t))
+				decode_tick(s, (pfm_bin_tick_t*)buf);
+			break;
+		case PFM_BIN_REC_CONTEXT:
+			if(rec.size >= sizeof(pfm_bin_context_rec_t))
+				add_context(s, 
+					    &((pfm_bin_context_rec_t*)buf)->ctx);
+			break;
+		case PFM_BIN_REC_COUNTS:
+			if(rec.size >= sizeof(pfm_bin_counts_t) + 
+			   sizeof(pfm_bin_value_t) * s->num_events)
+				decode_counts(s, (pfm_bin_counts_t*)buf);
+			break;
+		case PFM_BIN_REC_TOTALS:
+			if(rec.size >= sizeof(pfm_bin_totals_t) + 
+			   sizeof(uint64_t) * s->num_events)
+				decode_totals(s, (pfm_bin_totals_t*)buf);
+			break;
+		case PFM_BIN_REC_BANDWIDTH:
+			if(rec.size >= sizeof(pfm_bin_bandwidth_t))
+				decode_bandwidth(s, (pfm_bin_bandwidth_t*)buf);
+			break;
+		case PFM_BIN_REC_MEMORY:
+			if(rec.size >= sizeof(pfm_bin_memory_t) && 
+			   rec.size >= sizeof(pfm_bin_memory_t) + 
+			   sizeof(uint64_t) * 
+			   ((uint64_t)((pfm_bin_memory_t*)buf)->num_nodes + 1))
+				decode_memory(s, (pfm_bin_memory_t*)buf);
+			break;
+		default:
+			/* unknown record from a later version, skip it */
+			break;
+		}
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	decode_stream_t s;
+	int c;
+
+	setlocale(LC_ALL, "");
+
+	memset(&s, 0, sizeof(s));
+	s.in = stdin;
+	s.out = stdout;
+
+	while ((c=getopt(argc, argv,"hcM:q")) != -1) {
+		switch(c) {
+		case 'h':
+			usage();
+			exit(0);
+			break;
+		case 'c':
+			s.csv = 1;
+			break;
+		case 'M':
+			s.metrics_list = optarg;
+			break;
+		case 'q':
+			s.metrics_only = 1;
+			break;
+		default:
+			errx(1, "unknown parameter, use option \"-h\" to get "
+			     "usage\n");
+		}
+	}
+
+	if(argv[optind]){
+		s.in = fopen(argv[optind], "r");
+		if(s.in == NULL)
+			err(1, "cannot open %s", argv[optind]);
+	}
+
+	if(pfm_ctx_table_init(&s.threads) || 
+	   pfm_ctx_table_init(&s.last_ena[0]) || 
+	   pfm_ctx_table_init(&s.last_ena[1]))
+		errx(1, "out of memory\n");
+
+	decode(&s);
+
+	if(s.in != stdin)
+		fclose(s.in);
+
+	return 0;
+}
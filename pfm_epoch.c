@@ -0,0 +1,192 @@
+/*
+ * Epoch-based reclamation.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <sched.h>
+#include <err.h>
+
+#include "pfm_epoch.h"
+
+/*
+ * the epoch a reader saw when entering, shifted left, with bit 0 set while
+ * it is inside a section; 0 outside. A record is never given back, as few
+ * threads ever read.
+ */
+typedef struct __epoch_rec{
+	uint64_t epoch;
+	char pad[64 - sizeof(uint64_t)]; /* one cache line per reader */
+}epoch_rec;
+
+/* memory waiting for the readers to leave */
+typedef struct __epoch_item{
+	void *ptr;
+	void (*fn)(void *);
+	uint64_t epoch; /* the global epoch when retired */
+	struct __epoch_item *next;
+}epoch_item;
+
+static epoch_rec recs[PFM_EPOCH_MAX_THREADS] __attribute__((aligned(64)));
+static int num_recs; /* records given to threads */
+static uint64_t global_epoch = 1;
+static epoch_item *limbo; /* retired memory, pushed and taken atomically */
+
+static __thread epoch_rec *my_rec;
+static __thread int my_depth; /* nesting of the sections of the thread */
+
+void pfm_epoch_enter()
+{
+	uint64_t e;
+	int i;
+
+	if(my_depth++)
+		return;
+	if(my_rec == NULL){
+		i = __atomic_fetch_add(&num_recs, 1, __ATOMIC_ACQ_REL);
+		if(i >= PFM_EPOCH_MAX_THREADS)
+			errx(1, "more than %d threads read the contexts\n",
+			     PFM_EPOCH_MAX_THREADS);
+		my_rec = &recs[i];
+	}
+
+	/*
+	 * the announcement must be seen before any load of the section: the
+	 * scans read the record with read-modify-writes too, so either a scan
+	 * sees the announcement, or the announcement reads from the scan and
+	 * the section sees all the scanner did before; a stale epoch only
+	 * holds the reclaimers back
+	 */
+	e = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+	__atomic_exchange_n(&my_rec->epoch, (e << 1) | 1, __ATOMIC_SEQ_CST);
+}
+
+void pfm_epoch_exit()
+{
+	if(--my_depth)
+		return;
+	__atomic_store_n(&my_rec->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Advance the global epoch if every reader inside a section has seen it
+ * Return value:
+ *      the global epoch
+ */
+static uint64_t try_advance()
+{
+	uint64_t g, e;
+	int i, num;
+
+	/*
+	 * the unpublishing stores of the writer come before the scan; the
+	 * epoch words are read with read-modify-writes, which always read the
+	 * latest value, and order the stores before them with no fence
+	 */
+	g = __atomic_fetch_add(&global_epoch, 0, __ATOMIC_SEQ_CST);
+	num = __atomic_load_n(&num_recs, __ATOMIC_ACQUIRE);
+	if(num > PFM_EPOCH_MAX_THREADS)
+		num = PFM_EPOCH_MAX_THREADS;
+	for(i = 0; i < num; i++){
+		e = __atomic_fetch_add(&recs[i].epoch, 0, __ATOMIC_SEQ_CST);
+		if((e & 1) && (e >> 1) != g)
+			return g;
+	}
+
+	/* another thread may have advanced it already */
+	__atomic_compare_exchange_n(&global_epoch, &g, g + 1, 0,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+}
+
+static void push_items(epoch_item *first, epoch_item *last)
+{
+	last->next = __atomic_load_n(&limbo, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&limbo, &last->next, first, 1,
+					   __ATOMIC_RELEASE,
+					   __ATOMIC_RELAXED))
+		;
+}
+
+void pfm_epoch_retire(void *ptr, void (*fn)(void *))
+{
+	epoch_item *item;
+
+	/* without memory to remember it, it is never freed */
+	item = malloc(sizeof(epoch_item));
+	if(item == NULL)
+		return;
+	item->ptr = ptr;
+	item->fn = fn;
+	item->epoch = pfm_epoch_stamp();
+	push_items(item, item);
+
+	pfm_epoch_reclaim();
+}
+
+/*
+ * Free the retired memory of epochs at least two behind g
+ */
+static void reclaim_before(uint64_t g)
+{
+	epoch_item *item, *next;
+	epoch_item *first = NULL, *last = NULL;
+
+	/* each reclaimer takes the whole list, no item is seen twice */
+	item = __atomic_exchange_n(&limbo, NULL, __ATOMIC_ACQUIRE);
+	for(; item; item = next){
+		next = item->next;
+		/*
+		 * a reader of the epoch of retiring may still be inside; one
+		 * epoch later, all readers entered after the unpublishing
+		 */
+		if(item->epoch + 2 <= g){
+			item->fn(item->ptr);
+			free(item);
+			continue;
+		}
+		item->next = first;
+		first = item;
+		if(last == NULL)
+			last = item;
+	}
+	if(first)
+		push_items(first, last);
+}
+
+void pfm_epoch_reclaim()
+{
+	if(__atomic_load_n(&limbo, __ATOMIC_RELAXED) == NULL)
+		return;
+	reclaim_before(try_advance());
+}
+
+void pfm_epoch_synchronize()
+{
+	uint64_t target = pfm_epoch_stamp() + 2;
+	uint64_t g;
+
+	while((g = try_advance()) < target)
+		sched_yield();
+	reclaim_before(g);
+}
+
+uint64_t pfm_epoch_stamp()
+{
+	/*
+	 * the unpublishing stores of the writer come before the read, and
+	 * every later advance of the epoch carries them
+	 */
+	return __atomic_fetch_add(&global_epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+int pfm_epoch_passed(uint64_t stamp)
+{
+	if(__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) >= stamp + 2)
+		return 1;
+
+	return try_advance() >= stamp + 2;
+}
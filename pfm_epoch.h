@@ -0,0 +1,71 @@
+/*
+ * Epoch-based reclamation, for the memory that readers walk without locks,
+ * e.g., the monitoring contexts and the arrays of a context table. A reader
+ * announces itself with pfm_epoch_enter and leaves with pfm_epoch_exit; the
+ * memory unpublished in between is retired, and only freed once every
+ * reader that could still see it has left. Entering and leaving are one
+ * store each; retiring and reclaiming are for the writers.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_EPOCH_H__
+#define __PFM_EPOCH_H__
+
+#include <stdint.h>
+
+#define PFM_EPOCH_MAX_THREADS 256 /* the most threads ever entering */
+
+/*
+ * Enter a read-side section; the memory seen in it stays valid until the
+ * matching pfm_epoch_exit. Sections of a thread may nest.
+ */
+void pfm_epoch_enter();
+
+/*
+ * Leave a read-side section
+ */
+void pfm_epoch_exit();
+
+/*
+ * Free some memory once every reader that may see it has left, e.g., after
+ * it is removed from a table; the callback runs on a thread calling
+ * pfm_epoch_reclaim, pfm_epoch_retire or pfm_epoch_synchronize; without
+ * memory to remember it, the memory is never freed
+ * Parameters:
+ *	ptr	--> the memory, already unreachable for new readers
+ *	fn	--> the function freeing it, called with ptr
+ */
+void pfm_epoch_retire(void *ptr, void (*fn)(void *));
+
+/*
+ * Free the retired memory no reader can see anymore; never waits
+ */
+void pfm_epoch_reclaim();
+
+/*
+ * Wait until every reader inside a section when called has left, then free
+ * all the memory retired before; not to be called inside a section
+ */
+void pfm_epoch_synchronize();
+
+/*
+ * Get a stamp of the current epoch, for unpublished things that are not
+ * freed but reused, e.g., the slots of a table
+ * Return value:
+ *      the stamp
+ */
+uint64_t pfm_epoch_stamp();
+
+/*
+ * Check whether every reader that was inside a section when a stamp was
+ * taken has left; never waits
+ * Parameters:
+ *	stamp	--> a stamp from pfm_epoch_stamp
+ * Return value:
+ *      1       --> yes, what was unpublished before the stamp can be reused
+ *      0       --> not yet
+ */
+int pfm_epoch_passed(uint64_t stamp);
+
+#endif
@@ -0,0 +1,272 @@
+/*
+ * Idle keepers for system-wide monitoring.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#define _GNU_SOURCE             // for cpu affinity
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "pfm_common.h"
+#include "pfm_keeper.h"
+#include "pfm_sched.h"
+
+#define KEEPER_PAUSES 64 /* pauses between checks of the stop flag */
+#define KEEPER_TPAUSE_CYCLES 100000 /* TSC cycles of one tpause */
+#define PM_QOS_DEV "/dev/cpu_dma_latency"
+
+static const char *mode_names[] = {"spin", "pause", "umwait", "qos"};
+
+struct _keeper_info;
+
+/* a keeper thread */
+typedef struct _keeper_thread{
+	pthread_t thr;
+	int cpu;
+	int created;
+	uint64_t cpu_ns; /* cpu time used, set when the thread quits */
+	struct _keeper_info *info;
+}keeper_thread;
+
+/* data used by the keepers */
+typedef struct _keeper_info{
+	int mode;
+	int stop;
+	int qos_fd; /* the PM QoS request is held while this is open */
+	int num_threads;
+	keeper_thread *threads;
+	uint64_t start; /* when the keepers started, in ns */
+}keeper_info;
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static inline void cpu_relax(void)
+{
+	__asm__ volatile("pause" ::: "memory");
+}
+
+/* whether tpause/umwait are supported: CPUID.(EAX=7,ECX=0):ECX.WAITPKG */
+static int has_waitpkg(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if(!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	return (ecx >> 5) & 1;
+}
+
+/* wait in C0.1 until the TSC reaches now + cycles, or an interrupt */
+static inline void tpause(uint64_t cycles)
+{
+	uint32_t low, high;
+	uint64_t deadline;
+
+	__asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
+	deadline = (low | ((uint64_t)high) << 32) + cycles;
+
+	/* tpause %ecx; ecx = 1 selects C0.1, assemblers may not know it */
+	__asm__ volatile(".byte 0x66, 0x0f, 0xae, 0xf1"
+			 :: "c" (1), "a" ((uint32_t)deadline),
+			  "d" ((uint32_t)(deadline >> 32))
+			 : "cc", "memory");
+}
+
+#else
+
+static inline void cpu_relax(void)
+{
+	__asm__ volatile("" ::: "memory");
+}
+
+static int has_waitpkg(void)
+{
+	return 0;
+}
+
+static inline void tpause(uint64_t cycles)
+{
+}
+
+#endif
+
+static void *keeper(void *param)
+{
+	keeper_thread *k = (keeper_thread*)param;
+	int *stop = &k->info->stop;
+	struct sched_param sp;
+	struct timespec ts;
+	unsigned long sum = 0;
+	int i;
+
+	sp.sched_priority = 0;
+	pthread_setschedparam(pthread_self(), SCHED_BATCH, &sp);
+
+	switch(k->info->mode){
+	case PFM_KEEPER_SPIN:
+		while(!__atomic_load_n(stop, __ATOMIC_RELAXED)){
+			for(i = 0; i < KEEPER_PAUSES; i++)
+				sum += i;
+			// keep the loop from being optimized out
+			__asm__ volatile("" : "+r" (sum));
+		}
+		break;
+	case PFM_KEEPER_UMWAIT:
+		while(!__atomic_load_n(stop, __ATOMIC_RELAXED))
+			tpause(KEEPER_TPAUSE_CYCLES);
+		break;
+	default:
+		while(!__atomic_load_n(stop, __ATOMIC_RELAXED))
+			for(i = 0; i < KEEPER_PAUSES; i++)
+				cpu_relax();
+	}
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	k->cpu_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	return NULL;
+}
+
+int pfm_keeper_mode(const char *name)
+{
+	int i;
+
+	for(i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++)
+		if(!strcmp(name, mode_names[i]))
+			return i;
+
+	return -1;
+}
+
+/*
+ * Ask for no exit latency from idle states, i.e., no deep C-states; the
+ * request holds as long as the file is open
+ * Return value:
+ *      the open file, -1 if failed
+ */
+static int open_qos_request(void)
+{
+	int32_t latency = 0;
+	int fd;
+
+	fd = open(PM_QOS_DEV, O_WRONLY);
+	if(fd == -1)
+		return -1;
+	if(write(fd, &latency, sizeof(latency)) != sizeof(latency)){
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int pfm_keeper_start(void **handle, int mode, int *cpus, int num)
+{
+	keeper_info *info;
+	pthread_attr_t attr;
+	cpu_set_t cpuset;
+	int i;
+
+	if(handle == NULL || mode < PFM_KEEPER_SPIN || mode > PFM_KEEPER_QOS)
+		return 1;
+
+	*handle = NULL;
+
+	info = calloc(1, sizeof(keeper_info));
+	if(info == NULL)
+		return 2;
+	info->qos_fd = -1;
+	info->start = pfm_sched_now();
+
+	if(mode == PFM_KEEPER_UMWAIT && !has_waitpkg()){
+		DPRINTF("No umwait/tpause on this cpu, keeping with pause\n");
+		mode = PFM_KEEPER_PAUSE;
+	}
+	info->mode = mode;
+
+	if(mode == PFM_KEEPER_QOS){
+		info->qos_fd = open_qos_request();
+		if(info->qos_fd == -1){
+			free(info);
+			return 2;
+		}
+		*handle = info;
+		return 0;
+	}
+
+	info->threads = calloc(num, sizeof(keeper_thread));
+	if(info->threads == NULL){
+		free(info);
+		return 2;
+	}
+	info->num_threads = num;
+
+	pthread_attr_init(&attr);
+	for(i = 0; i < num; i++){
+		keeper_thread *k = &info->threads[i];
+
+		k->cpu = cpus[i];
+		k->info = info;
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpus[i], &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+		if(pthread_create(&k->thr, &attr, keeper, k) == 0)
+			k->created = 1;
+		else
+			DPRINTF("Cannot create the keeper of cpu %d\n",
+				cpus[i]);
+	}
+	pthread_attr_destroy(&attr);
+
+	*handle = info;
+
+	return 0;
+}
+
+int pfm_keeper_stop(void *handle)
+{
+	keeper_info *info = (keeper_info*)handle;
+	uint64_t wall, cpu_ns = 0;
+	int i, num = 0;
+
+	if(info == NULL)
+		return 1;
+
+	__atomic_store_n(&info->stop, 1, __ATOMIC_RELAXED);
+	for(i = 0; i < info->num_threads; i++){
+		if(!info->threads[i].created)
+			continue;
+		pthread_join(info->threads[i].thr, NULL);
+		cpu_ns += info->threads[i].cpu_ns;
+		num++;
+	}
+	if(info->qos_fd != -1)
+		close(info->qos_fd);
+	wall = pfm_sched_now() - info->start;
+
+	if(info->mode == PFM_KEEPER_QOS)
+		fprintf((FILE*)err_out, "pfm_multi: held a PM QoS request for "
+			"%.3f ms\n", wall / 1000000.0);
+	else
+		fprintf((FILE*)err_out, "pfm_multi: %d %s keepers used %.3f ms"
+			" cpu time in %.3f ms, %.1f%% of the kept cores\n",
+			num, mode_names[info->mode], cpu_ns / 1000000.0,
+			wall / 1000000.0,
+			num && wall ? 100.0 * cpu_ns / wall / num : 0.0);
+
+	free(info->threads);
+	free(info);
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * Idle keepers for system-wide monitoring (-D): keep the monitored cores out
+ * of deep C-states, e.g., so that uncore counters keep counting while the
+ * cores are idle. A keeper thread runs on each monitored core at SCHED_BATCH,
+ * or a PM QoS request forbids deep C-states on all cores.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_KEEPER_H__
+#define __PFM_KEEPER_H__
+
+/* keeper modes */
+#define PFM_KEEPER_SPIN 0 /* busy loop of additions, the old dummy threads */
+#define PFM_KEEPER_PAUSE 1 /* loop of pause, lighter on SMT siblings */
+#define PFM_KEEPER_UMWAIT 2 /* tpause in C0.1, pause if not supported */
+#define PFM_KEEPER_QOS 3 /* /dev/cpu_dma_latency request, no threads */
+
+#define PFM_KEEPER_DEFAULT PFM_KEEPER_PAUSE
+
+/*
+ * Get the keeper mode of a name: spin, pause, umwait or qos
+ * Return value:
+ *      the mode, -1 if the name is unknown
+ */
+int pfm_keeper_mode(const char *name);
+
+/*
+ * Start keeping cores busy
+ * Parameters:
+ *	mode	--> keeper mode
+ *	cpus	--> cpus to keep, unused in PFM_KEEPER_QOS mode
+ *	num	--> number of cpus
+ * Output parameter:
+ *	handle	--> the handle of the keepers
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid parameter
+ *      2       --> failed to create the keepers
+ */
+int pfm_keeper_start(void **handle, int mode, int *cpus, int num);
+
+/*
+ * Stop the keepers and print the cpu time they used to err_out
+ * Parameters:
+ *	handle	--> the handle of the keepers
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid handle
+ */
+int pfm_keeper_stop(void *handle);
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ * Derived metrics: a small recursive-descent compiler from metric
+ * expressions to stack code, and the evaluator of that code.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "pfm_metrics.h"
+
+#define MAX_METRIC_STACK 32 /* deepest evaluation stack */
+#define MAX_METRIC_NESTING 64 /* deepest ( and unary - of the parser */
+
+/* instructions of the stack code */
+typedef enum _metric_op{
+	op_const, /* push arg */
+	op_event, /* push the delta of event arg */
+	op_ns, /* push the time enabled */
+	op_add,
+	op_sub,
+	op_mul,
+	op_div,
+	op_neg
+}metric_op;
+
+typedef struct _metric_insn{
+	metric_op op;
+	int evt;
+	double val;
+}metric_insn;
+
+typedef struct _metric{
+	char *name;
+	metric_insn *code;
+	int len;
+	int max_len;
+}metric;
+
+typedef struct _metric_list{
+	metric *metrics;
+	int num;
+}metric_list;
+
+/* compiler state of one expression */
+typedef struct _metric_parser{
+	const char *p; /* next character */
+	const char * const *names;
+	int num_names;
+	metric *m;
+	int depth; /* stack depth after the code so far */
+	int max_depth;
+	int nesting; /* open ( and unary - around the next character */
+	char *errbuf;
+	size_t errlen;
+	int error;
+}metric_parser;
+
+static void parse_expr(metric_parser *ps);
+
+static void parse_error(metric_parser *ps, const char *msg)
+{
+	if(ps->error)
+		return;
+	snprintf(ps->errbuf, ps->errlen, "%s at \"%s\" in metric %s", msg,
+		 ps->p, ps->m->name);
+	ps->error = 1;
+}
+
+static void emit(metric_parser *ps, metric_op op, int evt, double val)
+{
+	metric *m = ps->m;
+	metric_insn *code;
+
+	if(ps->error)
+		return;
+	if(m->len == m->max_len){
+		code = realloc(m->code, sizeof(metric_insn) *
+			       (m->max_len * 2 + 8));
+		if(code == NULL){
+			parse_error(ps, "out of memory");
+			return;
+		}
+		m->code = code;
+		m->max_len = m->max_len * 2 + 8;
+	}
+	m->code[m->len].op = op;
+	m->code[m->len].evt = evt;
+	m->code[m->len].val = val;
+	m->len++;
+
+	/* operands push one value, binary operators pop one */
+	if(op <= op_ns)
+		ps->depth++;
+	else if(op != op_neg)
+		ps->depth--;
+	if(ps->depth > ps->max_depth)
+		ps->max_depth = ps->depth;
+}
+
+static void skip_spaces(metric_parser *ps)
+{
+	while(isspace((unsigned char)*ps->p))
+		ps->p++;
+}
+
+/*
+ * An event name is a word of letters, digits, '_', ':' and '.', or any
+ * text in braces, e.g. {INST_RETIRED:ANY_P:u=1}
+ */
+static void parse_name(metric_parser *ps)
+{
+	const char *start, *end;
+	size_t len;
+	int i;
+
+	if(*ps->p == '{'){
+		start = ++ps->p;
+		end = strchr(start, '}');
+		if(end == NULL){
+			parse_error(ps, "missing }");
+			return;
+		}
+		ps->p = end + 1;
+	}
+	else{
+		start = ps->p;
+		while(isalnum((unsigned char)*ps->p) || *ps->p == '_' ||
+		      *ps->p == ':' || *ps->p == '.')
+			ps->p++;
+		end = ps->p;
+	}
+	len = end - start;
+
+	for(i = 0; i < ps->num_names; i++)
+		if(strlen(ps->names[i]) == len &&
+		   !strncmp(ps->names[i], start, len)){
+			emit(ps, op_event, i, 0);
+			return;
+		}
+	if(len == 2 && !strncmp(start, "ns", 2)){
+		emit(ps, op_ns, 0, 0);
+		return;
+	}
+
+	ps->p = start;
+	parse_error(ps, "unknown event");
+}
+
+static void parse_primary(metric_parser *ps)
+{
+	char *end;
+	double val;
+
+	skip_spaces(ps);
+	/* both recurse, so the text cannot run the parser out of stack */
+	if((*ps->p == '(' || *ps->p == '-') &&
+	   ++ps->nesting > MAX_METRIC_NESTING){
+		parse_error(ps, "expression nested too deep");
+		return;
+	}
+
+	if(*ps->p == '('){
+		ps->p++;
+		parse_expr(ps);
+		ps->nesting--;
+		skip_spaces(ps);
+		if(*ps->p != ')'){
+			parse_error(ps, "missing )");
+			return;
+		}
+		ps->p++;
+	}
+	else if(*ps->p == '-'){
+		ps->p++;
+		parse_primary(ps);
+		ps->nesting--;
+		emit(ps, op_neg, 0, 0);
+	}
+	else if(isdigit((unsigned char)*ps->p) || *ps->p == '.'){
+		val = strtod(ps->p, &end);
+		ps->p = end;
+		emit(ps, op_const, 0, val);
+	}
+	else if(isalpha((unsigned char)*ps->p) || *ps->p == '_' ||
+		*ps->p == '{')
+		parse_name(ps);
+	else
+		parse_error(ps, "expected a number, an event or (");
+}
+
+static void parse_term(metric_parser *ps)
+{
+	char c;
+
+	parse_primary(ps);
+	while(!ps->error){
+		skip_spaces(ps);
+		c = *ps->p;
+		if(c != '*' && c != '/')
+			break;
+		ps->p++;
+		parse_primary(ps);
+		emit(ps, c == '*' ? op_mul : op_div, 0, 0);
+	}
+}
+
+static void parse_expr(metric_parser *ps)
+{
+	char c;
+
+	parse_term(ps);
+	while(!ps->error){
+		skip_spaces(ps);
+		c = *ps->p;
+		if(c != '+' && c != '-')
+			break;
+		ps->p++;
+		parse_term(ps);
+		emit(ps, c == '+' ? op_add : op_sub, 0, 0);
+	}
+}
+
+/*
+ * Compile one "name=expr"
+ * Return value:
+ *      0       --> success
+ *      1       --> failed, described in errbuf
+ */
+static int compile_metric(metric *m, char *def, const char * const *names,
+			  int num, char *errbuf, size_t errlen)
+{
+	metric_parser ps;
+	char *eq;
+
+	eq = strchr(def, '=');
+	if(eq == NULL || eq == def){
+		snprintf(errbuf, errlen, "metric \"%s\" is not name=expr",
+			 def);
+		return 1;
+	}
+	*eq = '\0';
+	m->name = strdup(def);
+	if(m->name == NULL){
+		snprintf(errbuf, errlen, "out of memory");
+		return 1;
+	}
+
+	memset(&ps, 0, sizeof(ps));
+	ps.p = eq + 1;
+	ps.names = names;
+	ps.num_names = num;
+	ps.m = m;
+	ps.errbuf = errbuf;
+	ps.errlen = errlen;
+
+	parse_expr(&ps);
+	skip_spaces(&ps);
+	if(*ps.p != '\0')
+		parse_error(&ps, "unexpected text");
+	if(!ps.error && ps.max_depth > MAX_METRIC_STACK)
+		parse_error(&ps, "expression too deep");
+
+	return ps.error;
+}
+
+int pfm_metrics_compile(void **handle, const char *list,
+			const char * const *names, int num,
+			char *errbuf, size_t errlen)
+{
+	metric_list *ml;
+	char *copy, *def, *saveptr;
+	int max = 1;
+	const char *c;
+
+	if(handle == NULL || list == NULL)
+		return 1;
+	*handle = NULL;
+
+	for(c = list; *c; c++)
+		if(*c == ',')
+			max++;
+
+	ml = calloc(1, sizeof(metric_list));
+	copy = strdup(list);
+	if(ml == NULL || copy == NULL){
+		free(ml);
+		free(copy);
+		return 2;
+	}
+	ml->metrics = calloc(max, sizeof(metric));
+	if(ml->metrics == NULL){
+		free(ml);
+		free(copy);
+		return 2;
+	}
+
+	for(def = strtok_r(copy, ",", &saveptr); def;
+	    def = strtok_r(NULL, ",", &saveptr)){
+		if(compile_metric(&ml->metrics[ml->num++], def, names, num,
+				  errbuf, errlen)){
+			free(copy);
+			pfm_metrics_free(ml);
+			return 1;
+		}
+	}
+	free(copy);
+
+	*handle = ml;
+
+	return 0;
+}
+
+int pfm_metrics_num(void *handle)
+{
+	metric_list *ml = (metric_list*)handle;
+
+	return ml ? ml->num : 0;
+}
+
+const char *pfm_metrics_name(void *handle, int idx)
+{
+	metric_list *ml = (metric_list*)handle;
+
+	return ml->metrics[idx].name;
+}
+
+double pfm_metrics_eval(void *handle, int idx, const double *deltas,
+			double ns)
+{
+	metric *m = &((metric_list*)handle)->metrics[idx];
+	double stack[MAX_METRIC_STACK];
+	int sp = 0;
+	int i;
+
+	for(i = 0; i < m->len; i++){
+		metric_insn *in = &m->code[i];
+
+		switch(in->op){
+		case op_const:
+			stack[sp++] = in->val;
+			break;
+		case op_event:
+			stack[sp++] = deltas[in->evt];
+			break;
+		case op_ns:
+			stack[sp++] = ns;
+			break;
+		case op_add:
+			sp--;
+			stack[sp-1] += stack[sp];
+			break;
+		case op_sub:
+			sp--;
+			stack[sp-1] -= stack[sp];
+			break;
+		case op_mul:
+			sp--;
+			stack[sp-1] *= stack[sp];
+			break;
+		case op_div:
+			sp--;
+			if(stack[sp] == 0)
+				stack[sp-1] = NAN;
+			else
+				stack[sp-1] /= stack[sp];
+			break;
+		case op_neg:
+			stack[sp-1] = -stack[sp-1];
+			break;
+		}
+	}
+
+	return sp ? stack[0] : NAN;
+}
+
+void pfm_metrics_free(void *handle)
+{
+	metric_list *ml = (metric_list*)handle;
+	int i;
+
+	if(ml == NULL)
+		return;
+
+	for(i = 0; i < ml->num; i++){
+		free(ml->metrics[i].name);
+		free(ml->metrics[i].code);
+	}
+	free(ml->metrics);
+	free(ml);
+}
@@ -0,0 +1,64 @@
+/*
+ * Derived metrics, e.g., IPC or MPKI, computed from the deltas of a reading.
+ * A metric list like "ipc=INSTRUCTIONS/CYCLES,mpki=MISSES*1000/INSTRUCTIONS"
+ * is compiled once into stack code over event indices, so evaluating a
+ * metric on every reading does no parsing or name lookup. Expressions have
+ * numbers, event names, + - * / and parentheses; the name "ns" stands for
+ * the time enabled during the reading, in nanoseconds.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_METRICS_H__
+#define __PFM_METRICS_H__
+
+#include <stddef.h>
+
+/*
+ * Compile a metric list
+ * Parameters:
+ *	list	--> metrics, "name=expr,name=expr,..."
+ *	names	--> names of the events, in reading order
+ *	num	--> number of events
+ *	errbuf	--> buffer for the error message
+ *	errlen	--> size of errbuf
+ * Output parameter:
+ *	handle	--> the compiled metrics
+ * Return value:
+ *      0       --> success
+ *      1       --> syntax error or unknown event, described in errbuf
+ *      2       --> out of memory
+ */
+int pfm_metrics_compile(void **handle, const char *list,
+			const char * const *names, int num,
+			char *errbuf, size_t errlen);
+
+/*
+ * Number of metrics in a compiled list
+ */
+int pfm_metrics_num(void *handle);
+
+/*
+ * Name of a metric
+ */
+const char *pfm_metrics_name(void *handle, int idx);
+
+/*
+ * Evaluate a metric
+ * Parameters:
+ *	handle	--> the compiled metrics
+ *	idx	--> index of the metric
+ *	deltas	--> the scaled delta of each event
+ *	ns	--> time enabled during the reading, in ns
+ * Return value:
+ *      the value of the metric, NaN if it divides by 0
+ */
+double pfm_metrics_eval(void *handle, int idx, const double *deltas,
+			double ns);
+
+/*
+ * Free a compiled list
+ */
+void pfm_metrics_free(void *handle);
+
+#endif
@@ -11,24 +11,44 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <locale.h>
+#include <errno.h>
 #include <err.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/ptrace.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
 #include <string.h>
 #include <time.h>
 #include <sched.h>
 #include <pthread.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <dirent.h>
 
 #include <common_toolx.h>
 
 #include "pfm_operations.h"
 #include "pfm_trigger.h"
 #include "pfm_common.h"
+#include "pfm_sched.h"
+#include "pfm_output.h"
+#include "pfm_keeper.h"
+#include "pfm_metrics.h"
+#include "pfm_place.h"
+#include "pfm_uncore.h"
+#include "pfm_sample.h"
 
 #define DEFAULT_PMU_EVENTS "PERF_COUNT_HW_CPU_CYCLES,PERF_COUNT_HW_INSTRUCTIONS"
+#define INHERIT_COLLECT_INTERVAL 10000 // us between collecting exited threads with -I
+#define DEFAULT_MEM_LDLAT 30 // cycles, the least latency of sampled loads
+#define ATTACH_POLL_INTERVAL 100000 // us between checks on a -T process
+/* trace new threads and processes, and exits to harvest their counters */
+#define THREADMON_PTRACE_OPTIONS (PTRACE_O_TRACEEXEC | PTRACE_O_TRACEFORK | \
+				  PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | \
+				  PTRACE_O_TRACEEXIT)
 
 typedef struct __options{
 	long print_interval;
@@ -36,19 +56,58 @@ typedef struct __options{
 	char * events;
 	int is_sys_wide_mon;
 	char * cores;
+	int * cpus; // the cpus monitored system-wide, from cores
+	int cpu_num;
 	int use_trigger;
 	void *trigger_info;
 	int use_dummy_thread;
-	int dummy_result; // store the results from dummy threads
+	int keeper_mode; // how dummy threads keep the cores busy
 	int * run_cores; // cores to run application threads
 	int run_core_cnt; // the number of run cores
+	int place_policy; // how threads are placed on the run cores, -1 if unset
+	char ** place_rules; // placement rules of -r
+	int num_place_rules;
+	void * placement; // the thread placement
 	char * output_file;
 	int append_output;
+	int output_format; // PFM_OUTPUT_TEXT or PFM_OUTPUT_BIN
+	char * metrics; // derived metrics, "name=expr,..."
+	int metrics_only; // print only the metrics of each reading
+	void * metrics_info; // the compiled metrics
+	int rollups; // PFM_ROLLUP_* levels printed for each pass
+	long mux_interval; // ns between rotations of planned groups, 0 if none
+	int bandwidth; // report the memory bandwidth of each socket
+	void * uncore; // the uncore memory controller counters
+	pid_t attach_pid; // running process to attach to with -T, 0 if none
+	long sample_period; // events between two samples of -S, 0 if none
+	int sample_top; // instruction pointers or pages printed per thread
+	long mem_period; // loads between two samples of -W, 0 if none
+	int mem_ldlat; // the least latency in cycles of the sampled loads
 }options_t;
 
 options_t options;
 
 int enable_logging;
+pthread_t logger;
+int trigger_running;
+pthread_t trigger_thr;
+void * logging_sched; /* the scheduler driving the logging thread */
+uint64_t logging_start; /* the time of tick 0 */
+/* 
+ * with -m, the logging thread ticks every rotation, and takes a reading 
+ * every read_every ticks; 0 means no readings
+ */
+uint64_t read_every;
+uint64_t num_readings;
+/* the process attached with -T, and how it is waited for */
+typedef struct __attached_wait{
+	pid_t pid;
+	int trace; /* nonzero if its threads are traced */
+	int flags; /* performance monitoring flags of its new threads */
+}attached_wait_t;
+
+void stop_logging(void);
+void stop_trigger(void);
 
 void * reading_out;
 void * err_out;
@@ -91,25 +150,81 @@ int child(char ** args)
 	/* not reached */
 }
 
-int monitor_new_thread(pid_t tid, int flags, options_t *options)
+/*
+ * Fork the command to monitor and wait until it stops at exec
+ * Return value:
+ *   the pid of the child
+ */
+pid_t start_child(char ** args)
+{
+	pid_t pid;
+	int status;
+
+	if ((pid=fork()) == -1)
+		err(1, "Cannot fork process");
+	
+	/*
+	 * Child process
+	 */
+	if(pid == 0){
+		/*
+		 * allow paren to trace
+		 */
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+			errx(1, "cannot ptrace self\n");
+		
+		exit(child(args));
+		/* not reached */
+	}
+
+	/* wait for the child to exec */
+	waitpid(pid, &status, WUNTRACED);
+
+	return pid;
+}
+
+/*
+ * With -T, SIGINT and SIGTERM stop the monitoring and detach from the 
+ * process instead of killing pfm_multi, and SIGCHLD tells that a traced 
+ * thread stopped or exited. They are blocked before any other thread is 
+ * created, so they stay pending until the thread waiting for the process 
+ * reads them from a signalfd; none is lost between a check and a wait.
+ */
+void stop_signals(sigset_t *set)
+{
+	sigemptyset(set);
+	sigaddset(set, SIGINT);
+	sigaddset(set, SIGTERM);
+	sigaddset(set, SIGCHLD);
+}
+
+int monitor_new_thread(pid_t tid, pid_t tgid, int flags, options_t *options)
 {
 	if(tid == -1)
 		return 1;
-	return pfm_attach_thread(tid, options->events,flags, 
+	return pfm_attach_thread(tid, tgid, options->events,flags, 
 				 &(options->pfm_options));
 }
 
-int pin_thread(pid_t tid, int core_id)
+/*
+ * Pin a new thread, or a thread that has exec'd, as -P, -L and -r say
+ */
+int place_thread(pid_t tid, int exec)
 {
 	cpu_set_t cpuset;
 	int ret_val;
 	
-	CPU_ZERO(&cpuset);
-	CPU_SET(core_id, &cpuset);
+	if(exec)
+		ret_val = pfm_place_exec(options.placement, tid, &cpuset);
+	else
+		ret_val = pfm_place_new_thread(options.placement, tid, 
+					       &cpuset);
+	if(ret_val)
+		return 0;
 
 	ret_val = sched_setaffinity(tid, sizeof(cpuset), &cpuset);
-	DPRINTF("Pin thread %d to core %d with result %d\n", tid, core_id,
-		ret_val);
+	DPRINTF("Pin thread %d to %d cores with result %d\n", tid, 
+		CPU_COUNT(&cpuset), ret_val);
 	
 	return ret_val;
 }
@@ -121,13 +236,13 @@ int pin_thread(pid_t tid, int core_id)
  *   tid: the tid that generates the sigtrap
  *   status: the status of the thread
  *   flags: performance monitoring flags
- *   run_core_idx: the run core index to which the new thread is pinned
  * Return value:
  *   the signal to send to child
  */
-int handle_sigtrap(int tid, int status, int flags, int *run_core_idx)
+int handle_sigtrap(int tid, int status, int flags)
 {
 	int new_tid = -1;
+	int new_tgid = -1;
 	int ret = 0;
 	int event;
 	
@@ -139,22 +254,48 @@ int handle_sigtrap(int tid, int status, int flags, int *run_core_idx)
 	switch(event) {
 	case PTRACE_EVENT_FORK:
 		new_tid = get_new_thread_id(tid);
+		new_tgid = new_tid;
 		DPRINTF("FORK called by thread [%d], new process created with "
 			"pid [%d]\n", tid, new_tid);
 	
 		break;
 	case PTRACE_EVENT_CLONE:
 		new_tid = get_new_thread_id(tid);
+		new_tgid = pfm_thread_tgid(tid);
 		DPRINTF("CLONE called by thread [%d], new thread created with "
 			"tid [%d]\n", tid, new_tid);
+		/* with -T, walk_process_tree may have seized it already */
+		if(new_tid != -1 && pfm_thread_attached(new_tid)){
+			DPRINTF("Thread [%d] already attached\n", new_tid);
+			new_tid = -1;
+		}
 		break;
 	case PTRACE_EVENT_VFORK:
 		new_tid = get_new_thread_id(tid);
+		new_tgid = new_tid;
 		DPRINTF("VFORK called by thread [%d], new process created with "
 			"pid [%d]\n", tid, new_tid);
 		break;
 	case PTRACE_EVENT_EXEC:
 		DPRINTF("EXEC called by thread [%d]\n", tid);
+		/* the new program has a new name for the name rules */
+		place_thread(tid, 1);
+		/* and new mappings for the sampled instruction pointers */
+		if(options.pfm_options.sample)
+			pfm_sample_exec(tid);
+		break;
+	case PTRACE_EVENT_STOP:
+		/* threads created by seized threads start with this stop */
+		DPRINTF("Thread [%d] stopped by ptrace\n", tid);
+		break;
+	case PTRACE_EVENT_EXIT:
+		/* 
+		 * the thread is stopped before it exits, take the final 
+		 * reading and release its counters 
+		 */
+		DPRINTF("EXIT called by thread [%d]\n", tid);
+		if(!options.is_sys_wide_mon)
+			pfm_detach_thread(tid);
 		break;
 	case  0:
 		DPRINTF("Event 0 by thread [%d]\n", tid);
@@ -166,20 +307,457 @@ int handle_sigtrap(int tid, int status, int flags, int *run_core_idx)
 
 	if(new_tid != -1){
 		// pin thread
-		if(options.run_core_cnt != 0){
-			pin_thread(new_tid, options.run_cores[*run_core_idx]);
-			(*run_core_idx)++;
-			*run_core_idx = *run_core_idx % options.run_core_cnt;
-		}
+		place_thread(new_tid, 0);
 		// attach monitoring session to thread
 		if(!options.is_sys_wide_mon)
-			ret = monitor_new_thread(new_tid, flags, &options);
+			ret = monitor_new_thread(new_tid, new_tgid, flags, 
+						 &options);
 	}
 	
 	return ret;
 }
 
 
+/*
+ * Call fn on every thread of a process and of its descendant processes. 
+ * Threads may be created while the threads are listed, so the threads are 
+ * listed again until fn accepts none of them; fn must refuse the threads it
+ * already accepted.
+ * Parameters:
+ *	pid	--> the process
+ *	fn	--> the function, returns 0 if it accepts a thread
+ * Return value:
+ *   the number of threads accepted
+ */
+int walk_process_tree(pid_t pid, int (*fn)(pid_t tid, pid_t tgid))
+{
+	char path[64];
+	DIR *dir;
+	struct dirent *ent;
+	FILE *f;
+	pid_t tid, child_pid;
+	int found, accepted = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	do{
+		found = 0;
+		dir = opendir(path);
+		if(dir == NULL)
+			return accepted;
+		while((ent = readdir(dir)) != NULL){
+			tid = atoi(ent->d_name);
+			if(tid > 0 && !fn(tid, pid))
+				found++;
+		}
+		closedir(dir);
+		accepted += found;
+	}while(found);
+
+	/* 
+	 * processes forked before fn saw their parent thread; later ones are
+	 * fn's business, e.g. traced with PTRACE_O_TRACEFORK
+	 */
+	dir = opendir(path);
+	if(dir == NULL)
+		return accepted;
+	while((ent = readdir(dir)) != NULL){
+		char children[128];
+
+		tid = atoi(ent->d_name);
+		if(tid <= 0)
+			continue;
+		snprintf(children, sizeof(children), 
+			 "/proc/%d/task/%d/children", pid, tid);
+		f = fopen(children, "r");
+		if(f == NULL)
+			continue;
+		while(fscanf(f, "%d", &child_pid) == 1)
+			accepted += walk_process_tree(child_pid, fn);
+		fclose(f);
+	}
+	closedir(dir);
+
+	return accepted;
+}
+
+/*
+ * Trace a running thread without stopping it, then pin it and count it as 
+ * a new thread; for walk_process_tree
+ * Return value:
+ *   0 if the thread is now traced, -1 if it is already traced or gone
+ */
+int seize_thread(pid_t tid, pid_t tgid)
+{
+	if(ptrace(PTRACE_SEIZE, tid, NULL, 
+		  (void *)(unsigned long)THREADMON_PTRACE_OPTIONS) == -1)
+		return -1;
+	DPRINTF("Seized thread [%d] of process [%d]\n", tid, tgid);
+
+	place_thread(tid, 0);
+	monitor_new_thread(tid, tgid, 0, &options);
+
+	return 0;
+}
+
+/*
+ * Stop a traced thread and detach from it, letting it go with the signal it
+ * was about to get, if any; for walk_process_tree
+ * Return value:
+ *   0 if the thread has been detached, -1 if it is not traced
+ */
+int release_thread(pid_t tid, pid_t tgid)
+{
+	unsigned long sig = 0;
+	int status;
+
+	if(ptrace(PTRACE_INTERRUPT, tid, NULL, NULL) == -1)
+		return -1;
+	if(waitpid(tid, &status, __WALL) != tid || !WIFSTOPPED(status))
+		return 0;
+	/* a signal-delivery-stop has no event */
+	if((status >> 16) == 0 && WSTOPSIG(status) != SIGTRAP)
+		sig = WSTOPSIG(status);
+	if(ptrace(PTRACE_DETACH, tid, NULL, (void *)sig) == -1)
+		DPRINTF("Cannot detach from thread [%d]\n", tid);
+
+	return 0;
+}
+
+/*
+ * Handle a change of a traced thread, then let it continue
+ * Parameters:
+ *	tid	--> the thread, as returned by wait4
+ *	status	--> its status
+ *	pid	--> the main process
+ *	flags	--> performance monitoring flags
+ * Return value:
+ *   1 if the main process quit, 0 otherwise
+ */
+int handle_traced(pid_t tid, int status, pid_t pid, int flags)
+{
+	unsigned long sig = 0;
+
+	if (WIFEXITED(status) || WIFSIGNALED(status)){
+		DPRINTF("Thread [%d] terminated\n", tid);
+		  
+		if(tid == pid) /* main process quit */
+			return 1;
+			
+		/* 
+		 * in case we missed its exit stop, close its counters and free 
+		 * its context slot 
+		 */
+		pfm_detach_thread(tid);
+		return 0; /* nothing else todo */
+	}
+		
+	if(WIFSTOPPED(status)){
+		sig = WSTOPSIG(status);
+		if((status >> 16) == PTRACE_EVENT_STOP && sig != SIGTRAP){
+			/* 
+			 * group-stop of a seized thread, it stays stopped 
+			 * until SIGCONT
+			 */
+			ptrace(PTRACE_LISTEN, tid, NULL, NULL);
+			return 0;
+		}
+		if (sig == SIGTRAP){
+			/*
+			 * do not propagate the signal, it was for us
+			 */
+			sig = 0;
+			sig = handle_sigtrap(tid, status, flags);
+		}
+		else{
+			DPRINTF("Awake for thread [%d] with sig %lu, "
+				"event not handled\n", tid, sig);
+			/* 
+			 * Interestingly, I don't know what caused these stops, 
+			 * so I just let the program proceed 
+			 */
+			//sig = 0;
+		}
+	}
+
+	/*
+	 * let the child continue
+	 */
+	child_continue(tid, sig);
+
+	return 0;
+}
+
+/*
+ * Handle every traced thread that changed, without blocking
+ * Return value:
+ *   1 if the main process quit or no thread is traced any more, 0 otherwise
+ */
+int reap_traced(attached_wait_t *w)
+{
+	struct rusage rusage;
+	pid_t tid;
+	int status;
+
+	while((tid = wait4(-1, &status, __WALL | WNOHANG, &rusage)) > 0)
+		if(handle_traced(tid, status, w->pid, w->flags))
+			return 1;
+
+	return tid == -1 && errno == ECHILD;
+}
+
+/*
+ * SIGINT, SIGTERM or SIGCHLD, read from the signalfd; for pfm_sched_add_fd
+ */
+int attached_signal(int fd, uint32_t events, void *arg)
+{
+	attached_wait_t *w = (attached_wait_t*)arg;
+	struct signalfd_siginfo si;
+	int child = 0;
+
+	while(read(fd, &si, sizeof(si)) == sizeof(si)){
+		if(si.ssi_signo != SIGCHLD){
+			DPRINTF("Got signal %d, detaching from process [%d]\n",
+				si.ssi_signo, w->pid);
+			return 1;
+		}
+		child = 1;
+	}
+	/* SIGCHLDs pending together are merged into one */
+	if(child && w->trace)
+		return reap_traced(w);
+
+	return 0;
+}
+
+/*
+ * Check that an untraced process is alive, or reap the traced threads in 
+ * case a SIGCHLD went elsewhere; for pfm_sched_run
+ */
+int attached_tick(pfm_sched_tick_t *tick, void *arg)
+{
+	attached_wait_t *w = (attached_wait_t*)arg;
+
+	if(w->trace)
+		return reap_traced(w);
+
+	return kill(w->pid, 0) == -1;
+}
+
+/*
+ * Wait for a process attached with -T to quit, or for SIGINT or SIGTERM, in 
+ * the epoll loop of a scheduler. The threads of a traced process are 
+ * waited for when SIGCHLD comes; system-wide monitoring does not trace the 
+ * process, it is checked every ATTACH_POLL_INTERVAL.
+ * Parameters:
+ *	pid	--> the process
+ *	trace	--> nonzero if its threads are traced
+ *	flags	--> performance monitoring flags of its new threads
+ */
+void wait_attached(pid_t pid, int trace, int flags)
+{
+	attached_wait_t w;
+	void *sched;
+	sigset_t set;
+	int fd;
+
+	w.pid = pid;
+	w.trace = trace;
+	w.flags = flags;
+
+	/* the signals since they were blocked are pending, none is missed */
+	stop_signals(&set);
+	fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(fd == -1)
+		err(1, "cannot create the signalfd for process [%d]", pid);
+	if(pfm_sched_init(&sched, ATTACH_POLL_INTERVAL * 1000L, 0))
+		errx(1, "cannot create the scheduler for process [%d]\n", pid);
+	if(pfm_sched_add_fd(sched, fd, EPOLLIN, attached_signal, &w))
+		errx(1, "cannot wait for the signals of process [%d]\n", pid);
+
+	pfm_sched_run(sched, attached_tick, &w);
+
+	pfm_sched_close(sched);
+	close(fd);
+}
+
+/*
+ * Wait for the child with inherited counters to quit. The child is not 
+ * traced, so its new threads run without stopping; the counts of the 
+ * threads that exit are collected here, unless the logging thread does it.
+ */
+void wait_inherited(pid_t pid)
+{
+	int status;
+	pid_t ret;
+
+	/* the child is stopped at exec, let it go */
+	if(ptrace(PTRACE_DETACH, pid, NULL, NULL) == -1)
+		errx(1, "cannot detach from child process [%d]\n", pid);
+
+	while(1){
+		ret = waitpid(pid, &status, enable_logging ? 0 : WNOHANG);
+		if(ret == -1 || (ret == pid && 
+				 (WIFEXITED(status) || WIFSIGNALED(status))))
+			break;
+		if(!enable_logging){
+			pfm_collect_inherited(&(options.pfm_options));
+			usleep(INHERIT_COLLECT_INTERVAL);
+		}
+	}
+}
+
+/*
+ * Compile the derived metrics of -M over the event list, before the child
+ * starts, so that a bad expression stops pfm_multi early
+ */
+void setup_metrics(void)
+{
+	const char **names;
+	char errbuf[256];
+	int num;
+
+	if(options.metrics == NULL)
+		return;
+	if(options.output_format == PFM_OUTPUT_BIN){
+		warnx("-M ignored with -o bin, decode with pfm_decode -M");
+		return;
+	}
+
+	num = pfm_event_names(options.events, NULL, 0);
+	names = malloc(sizeof(char *) * num);
+	if(names == NULL)
+		errx(1, "cannot allocate memory for metrics\n");
+	pfm_event_names(options.events, names, num);
+	if(pfm_metrics_compile(&options.metrics_info, options.metrics, names, 
+			       num, errbuf, sizeof(errbuf)))
+		errx(1, "cannot compile metrics: %s\n", errbuf);
+	free(names);
+
+	pfm_output_set_metrics(options.metrics_info, options.metrics_only);
+}
+
+/*
+ * Start sampling loads for -W, falling back to counting only if the PMU 
+ * cannot sample them
+ */
+void setup_mem_sampling(void)
+{
+	int ret;
+
+	ret = pfm_sample_mem_init(options.mem_period, options.mem_ldlat, 
+				  options.sample_top);
+	if(ret == 1)
+		warnx("-W ignored, the PMU has no load latency event "
+		      "(cpu/events/mem-loads); sampling loads needs PEBS on an "
+		      "Intel processor");
+	else if(ret == 2)
+		warn("-W ignored, the load latency event cannot sample loads, "
+		     "e.g. in a virtual machine or with "
+		     "/proc/sys/kernel/perf_event_paranoid too high");
+	else if(ret)
+		errx(1, "cannot start the sample drain thread\n");
+	if(ret)
+		return;
+
+	options.pfm_options.mem = 1;
+	pfm_sample_mem_print();
+}
+
+/*
+ * Make every event sample for -S, and every thread or core sample its loads
+ * for -W, before the child starts; the samples are reported after every 
+ * event is closed
+ */
+void setup_sampling(void)
+{
+	const char **names;
+	int num;
+
+	if(options.mem_period)
+		setup_mem_sampling();
+	if(!options.sample_period)
+		return;
+
+	num = pfm_event_names(options.events, NULL, 0);
+	names = malloc(sizeof(char *) * num);
+	if(names == NULL)
+		errx(1, "cannot allocate memory for sampling\n");
+	pfm_event_names(options.events, names, num);
+	if(pfm_sample_init(options.sample_period, options.sample_top, names,
+			   num))
+		errx(1, "cannot start the sample drain thread\n");
+	free(names);
+
+	options.pfm_options.sample = 1;
+}
+
+/*
+ * Split the events into groups that fit the PMU for -m, before the child 
+ * starts; the groups are rotated by the logging thread
+ * Parameters:
+ *	cpu	--> the cpu to probe for system-wide monitoring, -1 otherwise
+ */
+void plan_events(int cpu)
+{
+	int groups, max_size;
+
+	if(!options.mux_interval)
+		return;
+
+	groups = pfm_plan_events(options.events, cpu, &max_size);
+	if(groups < 0)
+		errx(1, "cannot probe the PMU with events %s\n", 
+		     options.events);
+	fprintf((FILE*)err_out, "pfm_multi: the PMU counts %d of %d events "
+		"at once, planned %d groups\n", max_size, 
+		pfm_event_names(options.events, NULL, 0), groups);
+
+	/* the planned groups are opened as groups, with or without -g */
+	options.pfm_options.grouped = 1;
+	if(groups > 1)
+		options.pfm_options.mux = 1;
+}
+
+/*
+ * Get the cpus to monitor system-wide, all online cpus without -c
+ */
+void setup_cores(void)
+{
+	int i, ret;
+
+	if(options.cores == NULL){
+		/* no cpu specified, monitor all cpus */
+		options.cpu_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+		options.cpus = malloc(sizeof(int) * options.cpu_num);
+		if(options.cpus == NULL)
+			errx(1, "cannot allocate the CPU list\n");
+		for(i = 0; i < options.cpu_num; i++)
+			options.cpus[i] = i;
+	}
+	else{
+		/* monitor only specified cpus */
+		ret = parse_value_list(options.cores, (void**)&options.cpus, 
+				       &options.cpu_num, 0);
+		if(ret != 0)
+			errx(1, "Parsing CPU list failed with error %d\n", ret);
+	}
+}
+
+/*
+ * Encode the events, and set up the metrics, the sampling and the planned 
+ * groups; the options they set are read by the logging and trigger 
+ * threads, so this runs before the threads start
+ */
+void setup_events(void)
+{
+	/* encode the events once, before any thread waits for them */
+	if(pfm_prepare_events(options.events))
+		errx(1, "cannot set up events %s\n", options.events);
+	setup_metrics();
+	setup_sampling();
+	plan_events(options.is_sys_wide_mon ? options.cpus[0] : -1);
+}
+
 /*
  * Parent process for per-thread monitoring
  */
@@ -193,72 +771,60 @@ int parent_threadmon(char ** args)
 	unsigned long ptrace_flags;
 	struct rusage rusage;
 	int wait_type;
-	unsigned long sig;
-	int flags;
-	int run_core_idx = 0;
-	
-	/* initialize PMU monitoring */
-	ret = pfm_operations_init();
-	if(ret != 0 )
-		errx(1, "PMU initialization failed\n");
-	
-	/*
-	 * create the child task
-	 */
-	if ((pid=fork()) == -1)
-		err(1, "Cannot fork process");
+		int flags;
+	int attached;
+	uint64_t attach_start;
 	
-	/*
-	 * Child process
-	 */
-	if(pid == 0){
-		/*
-		 * allow paren to trace
+	flags = 0;
+	if(options.attach_pid){
+		/* 
+		 * attach to the running threads without stopping them; their 
+		 * new threads and processes are traced from now on
 		 */
-		ret = ptrace(PTRACE_TRACEME, 0, NULL, NULL);
-		if (ret == -1) {
-			errx(1, "cannot ptrace self\n");
-		}
-		
-		exit(child(args));
-		/* not reached */
+		pid = options.attach_pid;
+		attach_start = pfm_sched_now();
+		attached = walk_process_tree(pid, seize_thread);
+		if(attached == 0)
+			errx(1, "cannot attach to process [%d], check "
+			     "/proc/sys/kernel/yama/ptrace_scope\n", pid);
+		fprintf((FILE*)err_out, "pfm_multi: attached to %d threads of "
+			"process [%d] in %.3f ms\n", attached, pid, 
+			(pfm_sched_now() - attach_start) / 1000000.0);
 	}
+	else{
+		/*
+		 * create the child task
+		 */
+		pid = start_child(args);
 	
-	
-	/*
-	 * parent process
-	 */
-	
-	
-	/* wait for the child to exec */
-	waitpid(pid, &status, WUNTRACED);
-	
-	/* attach to the first child thread */
-	//pfm_attach(pid, options.events, PFM_OP_ENABLE_ON_EXEC, 
-	// &(options.pfm_options));
-	flags = 0;
-	if(options.run_core_cnt != 0){
-		pin_thread(pid, options.run_cores[run_core_idx]);
-		run_core_idx++;
-		run_core_idx %= options.run_core_cnt;
-	}
-	pfm_attach_thread(pid, options.events, flags, &(options.pfm_options));
+		/* attach to the first child thread */
+		//pfm_attach(pid, options.events, PFM_OP_ENABLE_ON_EXEC, 
+		// &(options.pfm_options));
+		place_thread(pid, 0);
+		pfm_attach_thread(pid, pid, options.events, flags, 
+				  &(options.pfm_options));
 
-	/*
-	 * child is stopped here
-	 */
-	ptrace_flags = 0UL | PTRACE_O_TRACEEXEC | PTRACE_O_TRACEFORK | 
-		PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE;
-	ret = ptrace(PTRACE_SETOPTIONS, pid, NULL, (void *)ptrace_flags);
-	if (ret == -1) 
-		errx(1, "cannot set ptrace options on child porcess [%d]\n", 
-		     pid);
+		if(options.pfm_options.inherit){
+			wait_inherited(pid);
+			goto child_exited;
+		}
+
+		/*
+		 * child is stopped here; 
+		 * trace exits to harvest the counters of exiting threads
+		 */
+		ptrace_flags = THREADMON_PTRACE_OPTIONS;
+		ret = ptrace(PTRACE_SETOPTIONS, pid, NULL, 
+			     (void *)ptrace_flags);
+		if (ret == -1) 
+			errx(1, "cannot set ptrace options on child porcess "
+			     "[%d]\n", pid);
 		
-  
-	/*
-	 * let the child continue
-	 */
-	child_continue(pid, 0);
+		/*
+		 * let the child continue
+		 */
+		child_continue(pid, 0);
+	}
   
 	/*
 	 * WUNTRACED: PTtrace events
@@ -269,51 +835,32 @@ int parent_threadmon(char ** args)
 	wait_type = __WALL;
 
 	/*
-	 * main loop that handle the child's traces
+	 * main loop that handle the child's traces; a -T process is waited 
+	 * for along with SIGINT and SIGTERM
 	 */
-	while((tid = wait4(-1, &status, wait_type, &rusage)) > 0){
-
-		if (WIFEXITED(status) || WIFSIGNALED(status)){
-			DPRINTF("Thread [%d] terminated\n", tid);
-		  
-			if(tid == pid) /* main process quit */
+	if(options.attach_pid)
+		wait_attached(pid, 1, flags);
+	else
+		while((tid = wait4(-1, &status, wait_type, &rusage)) > 0)
+			if(handle_traced(tid, status, pid, flags))
 				break;
-			
-			continue; /* nothing else todo */
-		}
-		
-		if(WIFSTOPPED(status)){
-			sig = WSTOPSIG(status);
-			if (sig == SIGTRAP){
-				/*
-				 * do not propagate the signal, it was for us
-				 */
-				sig = 0;
-				sig = handle_sigtrap(tid, status, flags, 
-						     &run_core_idx);
-			}
-			else{
-				DPRINTF("Awake for thread [%d] with sig %lu, "
-					"event not handled\n", tid, sig);
-				/* 
-				 * Interestingly, I don't know what caused these
-				 * stops, so I just let the program proceed 
-				 */
-				//sig = 0;
-			}
-		}
 
-		
-		/*
-		 * let the child continue
-		 */
-		child_continue(tid, sig);
+	/* leave a -T process running, untraced */
+	if(options.attach_pid){
+		DPRINTF("Detaching from process [%d]\n", pid);
+		walk_process_tree(pid, release_thread);
 	}
 
-	DPRINTF("Child process [%d] terminated\n", tid);
+ child_exited:
+	DPRINTF("Child process [%d] terminated\n", pid);
 	
+	stop_trigger();
+	stop_logging();
+
 	/* print results */
 	pfm_read_all_threads(&(options.pfm_options));  
+	pfm_uncore_read(options.uncore);
+	pfm_read_all_processes(&(options.pfm_options));
 	
 	/* cleanup PMU monitoring */
 	pfm_operations_cleanup();
@@ -321,24 +868,6 @@ int parent_threadmon(char ** args)
 	return 0;
 }
 
-void * dummy_thread(void * param){
-	int *p = (int*) param;
-	int sum;
-	struct sched_param sp;
-	int tid = gettid();
-
-	sp.sched_priority = 0;
-	//sched_setscheduler(tid, SCHED_IDLE, &sp);
-	sched_setscheduler(tid, SCHED_BATCH, &sp);
-
-	while(p != NULL)
-		sum += sum;
-
-	*p += sum;
-
-	return p;
-}
-
 /*
  * Parent process for system-wide (per-core) monitoring
  */
@@ -347,7 +876,7 @@ int parent_coremon(char ** args)
 	pid_t pid, tid;
 	int ret;
 	int * cpus;
-	int i, cpu_num;
+	int cpu_num;
 	int flags;
 	
 	int status;
@@ -356,85 +885,47 @@ int parent_coremon(char ** args)
 	int wait_type;
 	unsigned long sig;
 
-	pthread_t pt;
-	pthread_attr_t attr;
-	cpu_set_t cpuset;
+	void *keeper = NULL;
 
-	int run_core_idx = 0;
+	int attached, workers;
+	uint64_t attach_start;
 	
-	/* process cpu list */
-	if(options.cores == NULL){
-		/* no cpu specified, monitor all cpus */
-		cpu_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
-		cpus = malloc(sizeof(int) * cpu_num);
-		for(i = 0; i < cpu_num; i++)
-			cpus[i] = i;
+	cpus = options.cpus;
+	cpu_num = options.cpu_num;
+
+	if(options.attach_pid){
+		/* the cores are counted, the process is only waited for */
+		pid = options.attach_pid;
+		if(kill(pid, 0) == -1)
+			err(1, "cannot attach to process [%d]", pid);
 	}
 	else{
-		/* monitor only specified cpus */
-		ret = parse_value_list(options.cores, (void**)&cpus, &cpu_num, 
-				       0);
-		if(ret != 0)
-			errx(1, "Parsing CPU list failed with error %d\n", ret);
-	}
-
-	/* initialize PMU monitoring */
-	ret = pfm_operations_init();
-	if(ret != 0 )
-		errx(1, "PMU initialization failed\n");
-
-	/*
-	 * create the child task
-	 */
-	if ((pid=fork()) == -1)
-		err(1, "Cannot fork process");
-	
-	/*
-	 * Child process
-	 */
-	if(pid == 0){
 		/*
-		 * allow paren to trace
+		 * create the child task
 		 */
-		ret = ptrace(PTRACE_TRACEME, 0, NULL, NULL);
-		if (ret == -1) 
-			errx(1, "cannot ptrace self\n");
-
-		exit(child(args));
-		/* not reached */
+		pid = start_child(args);
+		place_thread(pid, 0);
 	}
   
-	/*
-	 * paren process
+	/* 
+	 * attach CPU monitoring contexts; the child waits for this, so the
+	 * cores are attached in parallel
 	 */
-	
-	/* wait for the child to exec */
-	waitpid(pid, &status, WUNTRACED);
-	if(options.run_core_cnt != 0){
-		pin_thread(pid, options.run_cores[run_core_idx]);
-		run_core_idx++;
-		run_core_idx %= options.run_core_cnt;		
-	}
-  
-	/* attach CPU monitoring contexts */
 	flags = 0;
-	if(options.use_dummy_thread)
-		// set the scheduling properties for the dummy threads
-		pthread_attr_init(&attr);
-	for(i = 0; i < cpu_num; i++){
-		pfm_attach_core(cpus[i], options.events, flags, 
-				&(options.pfm_options));
-		if(options.use_dummy_thread){
-			CPU_ZERO(&cpuset);
-			CPU_SET(cpus[i], &cpuset);
-			pthread_attr_setaffinity_np(&attr, sizeof(cpuset),
-						    &cpuset);
-			pthread_create(&pt, &attr, dummy_thread, 
-				       &options.dummy_result);
-		}
+	attach_start = pfm_sched_now();
+	attached = pfm_attach_cores(cpus, cpu_num, options.events, flags, 
+				    &(options.pfm_options), &workers);
+	fprintf((FILE*)err_out, "pfm_multi: attached %d of %d CPUs in %.3f ms"
+		" with %d threads\n", attached, cpu_num, 
+		(pfm_sched_now() - attach_start) / 1000000.0, workers);
+	if(options.use_dummy_thread &&
+	   pfm_keeper_start(&keeper, options.keeper_mode, cpus, cpu_num))
+		warnx("cannot keep the monitored cores busy");
+
+	if(options.attach_pid){
+		wait_attached(pid, 0, flags);
+		goto child_exited;
 	}
-	if(options.use_dummy_thread)
-		pthread_attr_destroy(&attr);
   
 	/* child is stopped here */
 	/* Detach ptrace, we don't need it anymore */
@@ -487,8 +978,7 @@ int parent_coremon(char ** args)
 				 * do not propagate the signal, it was for us
 				 */
 				sig = 0;
-				sig = handle_sigtrap(tid, status, flags, 
-						     &run_core_idx);
+				sig = handle_sigtrap(tid, status, flags);
 			}
 			else{
 				DPRINTF("Awake for thread [%d] with sig %lu, "
@@ -508,10 +998,18 @@ int parent_coremon(char ** args)
 		child_continue(tid, sig);
 	}
   	
+ child_exited:
 	DPRINTF("Child process [%d] terminated\n", pid);
+
+	if(keeper)
+		pfm_keeper_stop(keeper);
 	
+	stop_trigger();
+	stop_logging();
+
 	/* print results */
 	pfm_read_all_cores(&(options.pfm_options));  
+	pfm_uncore_read(options.uncore);
   
 	/* cleanup PMU monitoring */
 	pfm_operations_cleanup();
@@ -522,7 +1020,7 @@ int parent_coremon(char ** args)
 void usage(void)
 {
 	printf("usage: pfm_multi [-h] [-C] [-c cpu]  [-i interval] [-g] [-p] "
-	       "[-e event1,event2,...] cmd\n"
+	       "[-e event1,event2,...] cmd | -T pid\n"
 	       "-h\t\tshow this help\n"
 	       "-i\t\tprint counts every interval nanosecond\n"
 	       "-g\t\tgroup events\n"
@@ -536,12 +1034,88 @@ void usage(void)
 	       "allowed)\n"
 	       "-D\t\tCreate low-priority threads doing dummy work on cores "
 	       "being system-wide monitored\n"
+	       "-k mode\t\thow -D keeps cores busy: pause (default), umwait, "
+	       "spin, or qos for a /dev/cpu_dma_latency request\n"
 	       "-P\t\tcores to run application threads (comma separated list)\n"
+	       "-L policy\thow threads are placed on the -P cores, or on all "
+	       "cores without -P: rr (round-robin in -P order, the default), "
+	       "compact, scatter (across sockets) or core (one per physical "
+	       "core)\n"
+	       "-r key=cpus\tpin the key-th thread created (0 is the first), "
+	       "or the threads whose name matches the pattern key, to cpus, "
+	       "e.g. -r 'worker*=4-7'; rules come before -L, multiple -r "
+	       "switches are allowed\n"
 	       "-f\t\tfile to output readings and logs\n"
 	       "-a\t\tappend to output file\n"
+	       "-o fmt\t\toutput format: text (default) or bin; decode bin "
+	       "output with pfm_decode\n"
+	       "-R\t\tread per-core counters with rdpmc in userspace when "
+	       "possible, must be used with -C; runs a reader thread on each "
+	       "monitored core, woken at every reading\n"
+	       "-M m=expr,..\tprint derived metrics of each reading, e.g. "
+	       "ipc=INSTRUCTIONS/CYCLES; ns is the time of the reading\n"
+	       "-q\t\twith -M, print only the metrics of each reading\n"
+	       "-m interval\tsplit the events into groups that fit the PMU "
+	       "and count one group at a time, rotating them every interval "
+	       "nanosecond; counts are extrapolated with 95%% bounds\n"
+	       "-A lv,lv\tlevels printed for each reading pass: self (each "
+	       "thread or core, the default), process, socket, node, all\n"
+	       "-T pid\t\tattach to the running process pid and its "
+	       "descendants instead of running cmd, until it quits or on "
+	       "SIGINT or SIGTERM, which detach and leave it running\n"
+	       "-B\t\treport the memory read and write bandwidth of each "
+	       "socket with each reading, from the uncore memory controllers\n"
+	       "-S period\tsample the instruction pointer every period "
+	       "events of each event, and print the hottest functions of "
+	       "each thread at the end\n"
+	       "-N top\t\tnumber of hot spots printed per thread and event "
+	       "with -S, and of pages per thread with -W (10 by default)\n"
+	       "-W period\tsample one of every period loads with the load "
+	       "latency event (PEBS), and print the latency, data source and "
+	       "NUMA node of the sampled loads of each thread with each "
+	       "reading, and the hottest pages at the end\n"
+	       "-w cycles\twith -W, sample only loads taking at least cycles "
+	       "(30 by default)\n"
+	       "-j num\t\tsplit the reads of each reading into num shards, "
+	       "read in parallel by num sampler threads\n"
+	       "-H cpus\t\tpin the sampler threads to these housekeeping cores "
+	       "(comma separated list); num defaults to their number\n"
+	       "-I\t\tcount new threads with inherited counters instead of "
+	       "tracing them; per-thread counts are printed when threads "
+	       "exit\n"
 	       );
 }
 
+/*
+ * Parse a rollup level list, e.g. "self,socket,all"
+ * Return value:
+ *      the PFM_ROLLUP_* levels, -1 if a level is unknown
+ */
+int parse_rollups(char *list)
+{
+	char *lv, *saveptr;
+	int levels = 0;
+
+	for(lv = strtok_r(list, ",", &saveptr); lv; 
+	    lv = strtok_r(NULL, ",", &saveptr)){
+		if(!strcmp(lv, "self") || !strcmp(lv, "thread") || 
+		   !strcmp(lv, "core"))
+			levels |= PFM_ROLLUP_SELF;
+		else if(!strcmp(lv, "process"))
+			levels |= PFM_ROLLUP_PROCESS;
+		else if(!strcmp(lv, "socket"))
+			levels |= PFM_ROLLUP_SOCKET;
+		else if(!strcmp(lv, "node"))
+			levels |= PFM_ROLLUP_NODE;
+		else if(!strcmp(lv, "all"))
+			levels |= PFM_ROLLUP_ALL;
+		else
+			return -1;
+	}
+
+	return levels;
+}
+
 void parse_cmdln_params(int argc, char **argv)
 {
 	int c;
@@ -552,6 +1126,8 @@ void parse_cmdln_params(int argc, char **argv)
 	options.pfm_options.grouped = 0;
 	options.pfm_options.pinned = 0;
 	options.pfm_options.enable_new = 1;
+	options.pfm_options.rdpmc = 0;
+	options.pfm_options.inherit = 0;
 	options.print_interval = 0;
 	options.events = NULL;
 	options.is_sys_wide_mon = 0;
@@ -559,10 +1135,33 @@ void parse_cmdln_params(int argc, char **argv)
 	options.use_trigger = 0;
 	options.trigger_info = NULL;
 	options.use_dummy_thread = 0;
+	options.keeper_mode = PFM_KEEPER_DEFAULT;
 	options.run_core_cnt = 0;
+	options.place_policy = -1;
+	options.place_rules = NULL;
+	options.num_place_rules = 0;
+	options.placement = NULL;
 	options.output_file = NULL;
 	options.append_output = 0;
-	while ((c=getopt(argc, argv,"+hgpCc:i:e:tDP:f:a")) != -1) {
+	options.output_format = PFM_OUTPUT_TEXT;
+	options.metrics = NULL;
+	options.metrics_only = 0;
+	options.metrics_info = NULL;
+	options.rollups = PFM_ROLLUP_SELF;
+	options.mux_interval = 0;
+	options.bandwidth = 0;
+	options.uncore = NULL;
+	options.attach_pid = 0;
+	options.sample_period = 0;
+	options.sample_top = 10;
+	options.pfm_options.sample = 0;
+	options.mem_period = 0;
+	options.mem_ldlat = DEFAULT_MEM_LDLAT;
+	options.pfm_options.mem = 0;
+	options.pfm_options.samplers = 0;
+	options.pfm_options.sampler_cpus = NULL;
+	options.pfm_options.num_sampler_cpus = 0;
+	while ((c=getopt(argc, argv,"+hgpCc:i:e:tDk:P:L:r:f:aRo:IM:qA:m:BT:S:N:W:w:j:H:")) != -1) {
 		switch(c) {
 		case 'e':
 			options.events = strdup(optarg);
@@ -603,6 +1202,12 @@ void parse_cmdln_params(int argc, char **argv)
 			options.use_dummy_thread = 1;
 			DPRINTF("Enable dummy threads\n");
 			break;
+		case 'k':
+			options.keeper_mode = pfm_keeper_mode(optarg);
+			if(options.keeper_mode == -1)
+				errx(1, "unknown keeper mode %s\n", optarg);
+			DPRINTF("Keeper mode %s\n", optarg);
+			break;
 		case 'f':
 			options.output_file = strdup(optarg);
 			DPRINTF("Output readings to %s\n", options.output_file);
@@ -611,6 +1216,106 @@ void parse_cmdln_params(int argc, char **argv)
 			options.append_output = 1;
 			DPRINTF("Append output %s\n", options.output_file);
 			break;
+		case 'o':
+			if(!strcmp(optarg, "text"))
+				options.output_format = PFM_OUTPUT_TEXT;
+			else if(!strcmp(optarg, "bin"))
+				options.output_format = PFM_OUTPUT_BIN;
+			else
+				errx(1, "unknown output format %s\n", optarg);
+			DPRINTF("Output format %s\n", optarg);
+			break;
+		case 'R':
+			options.pfm_options.rdpmc = 1;
+			DPRINTF("Read counters with rdpmc\n");
+			break;
+		case 'I':
+			options.pfm_options.inherit = 1;
+			DPRINTF("Count new threads with inherited counters\n");
+			break;
+		case 'M':
+			options.metrics = strdup(optarg);
+			DPRINTF("Derived metrics %s\n", options.metrics);
+			break;
+		case 'q':
+			options.metrics_only = 1;
+			DPRINTF("Print only derived metrics\n");
+			break;
+		case 'm':
+			options.mux_interval = atol(optarg);
+			if(options.mux_interval <= 0)
+				errx(1, "invalid rotation interval %s\n", 
+				     optarg);
+			DPRINTF("Rotation interval is %ld\n", 
+				options.mux_interval);
+			break;
+		case 'T':
+			options.attach_pid = atoi(optarg);
+			if(options.attach_pid <= 0)
+				errx(1, "invalid process id %s for -T\n", 
+				     optarg);
+			DPRINTF("Attaching to process %d\n", 
+				options.attach_pid);
+			break;
+		case 'S':
+			options.sample_period = atol(optarg);
+			if(options.sample_period <= 0)
+				errx(1, "invalid sampling period %s\n", optarg);
+			DPRINTF("Sampling period is %ld\n", 
+				options.sample_period);
+			break;
+		case 'W':
+			options.mem_period = atol(optarg);
+			if(options.mem_period <= 0)
+				errx(1, "invalid load sampling period %s\n", 
+				     optarg);
+			DPRINTF("Load sampling period is %ld\n", 
+				options.mem_period);
+			break;
+		case 'w':
+			options.mem_ldlat = atoi(optarg);
+			if(options.mem_ldlat <= 0)
+				errx(1, "invalid load latency threshold %s\n", 
+				     optarg);
+			DPRINTF("Load latency threshold is %d\n", 
+				options.mem_ldlat);
+			break;
+		case 'N':
+			options.sample_top = atoi(optarg);
+			if(options.sample_top <= 0)
+				errx(1, "invalid number of hot spots %s\n", 
+				     optarg);
+			DPRINTF("Printing %d hot spots\n", options.sample_top);
+			break;
+		case 'j':
+			options.pfm_options.samplers = atoi(optarg);
+			if(options.pfm_options.samplers <= 0 || 
+			   options.pfm_options.samplers > PFM_MAX_SAMPLERS)
+				errx(1, "invalid number of samplers %s, at most "
+				     "%d\n", optarg, PFM_MAX_SAMPLERS);
+			DPRINTF("%d samplers\n", options.pfm_options.samplers);
+			break;
+		case 'H':
+			ret = parse_value_list(strdup(optarg), 
+					       (void**)&options.pfm_options.
+					       sampler_cpus, 
+					       &options.pfm_options.
+					       num_sampler_cpus, 0);
+			if(ret != 0)
+				errx(1, "Parsing sampler-core-list failed with "
+				     "error %d\n", ret);
+			DPRINTF("Pin samplers to %s\n", optarg);
+			break;
+		case 'B':
+			options.bandwidth = 1;
+			DPRINTF("Memory bandwidth enabled\n");
+			break;
+		case 'A':
+			options.rollups = parse_rollups(strdup(optarg));
+			if(options.rollups <= 0)
+				errx(1, "unknown rollup level in %s\n", optarg);
+			DPRINTF("Rollup levels %s\n", optarg);
+			break;
 		case 'P':
 			ret = parse_value_list(strdup(optarg), 
 					       (void**)&options.run_cores, 
@@ -621,6 +1326,24 @@ void parse_cmdln_params(int argc, char **argv)
 
 			DPRINTF("Pin threads %s\n", optarg);
 			break;
+		case 'L':
+			options.place_policy = pfm_place_policy(optarg);
+			if(options.place_policy == -1)
+				errx(1, "unknown placement policy %s\n", 
+				     optarg);
+			DPRINTF("Placement policy %s\n", optarg);
+			break;
+		case 'r':
+			options.place_rules = realloc(options.place_rules, 
+						      sizeof(char *) * 
+						      (options.num_place_rules
+						       + 1));
+			if(options.place_rules == NULL)
+				errx(1, "cannot allocate placement rules\n");
+			options.place_rules[options.num_place_rules++] = 
+				optarg;
+			DPRINTF("Placement rule %s\n", optarg);
+			break;
 		default:
 			errx(1, "unknown parameter, use option \"-h\" to get "
 			     "usage\n");
@@ -629,24 +1352,133 @@ void parse_cmdln_params(int argc, char **argv)
 
 }
 
-void * logging_thread(void * param)
+/*
+ * Set up the placement of the monitored threads from -P, -L and -r
+ */
+void setup_placement(void)
 {
-	struct timespec wait_length;
-	
-	wait_length.tv_sec = options.print_interval / 1000000000UL;
-	wait_length.tv_nsec = options.print_interval % 1000000000UL;
-	
-	while(enable_logging){
-		nanosleep(&wait_length, NULL);
+	int i, ret;
+
+	/* -P alone places threads round-robin, as it always has */
+	if(options.place_policy == -1)
+		options.place_policy = options.run_core_cnt ? PFM_PLACE_RR : 
+			PFM_PLACE_NONE;
+	if(options.place_policy == PFM_PLACE_NONE && 
+	   !options.num_place_rules)
+		return;
+
+	ret = pfm_place_init(&options.placement, options.place_policy, 
+			     options.run_core_cnt ? options.run_cores : NULL,
+			     options.run_core_cnt);
+	if(ret)
+		errx(1, "cannot set up the thread placement, error %d\n", ret);
+	for(i = 0; i < options.num_place_rules; i++)
+		if(pfm_place_add_rule(options.placement, 
+				      options.place_rules[i]))
+			errx(1, "invalid placement rule %s\n", 
+			     options.place_rules[i]);
+	pfm_place_print(options.placement);
+}
+
+/*
+ * Start counting the memory traffic of each socket for -B; the uncore 
+ * counters count the whole socket, in both monitoring modes
+ */
+void setup_uncore(void)
+{
+	int ret;
+
+	if(!options.bandwidth)
+		return;
+
+	ret = pfm_uncore_open(&options.uncore);
+	if(ret == 1)
+		warnx("-B ignored, no uncore memory controller PMU found");
+	else if(ret == 2)
+		warnx("-B ignored, cannot open the uncore memory controller "
+		      "PMUs, check /proc/sys/kernel/perf_event_paranoid");
+	else if(ret)
+		errx(1, "cannot allocate the uncore counters\n");
+	pfm_uncore_print(options.uncore);
+}
+
+/*
+ * One logging tick: print the intended and actual time of the sample, then 
+ * read and print the counters
+ */
+int logging_tick(pfm_sched_tick_t *tick, void *param)
+{
+	pfm_sched_tick_t reading;
+
+	if(tick->missed)
+		DPRINTF("Logging missed %"PRIu64" ticks before tick %"PRIu64
+			"\n", tick->missed, tick->seq);
+
+	if(options.pfm_options.mux){
 		if(options.is_sys_wide_mon)
-			pfm_read_all_cores(&(options.pfm_options));
+			pfm_rotate_all_cores(&(options.pfm_options));
 		else
-			pfm_read_all_threads(&(options.pfm_options));
+			pfm_rotate_all_threads(&(options.pfm_options));
 	}
-	
+
+	/* a missed tick may have been the one for a reading */
+	if(!read_every || tick->seq / read_every == num_readings)
+		return 0;
+	num_readings = tick->seq / read_every;
+	reading = *tick;
+	reading.seq = num_readings;
+	pfm_output_tick(&reading, logging_start);
+
+	if(options.is_sys_wide_mon)
+		pfm_read_all_cores(&(options.pfm_options));
+	else
+		pfm_read_all_threads(&(options.pfm_options));
+	pfm_uncore_read(options.uncore);
+	pfm_sample_mem_flush();
+
+	return 0;
+}
+
+void * logging_thread(void * param)
+{
+	pfm_sched_run(logging_sched, logging_tick, NULL);
+
 	return NULL;
 }
 
+/*
+ * Stop the logging thread, so that the final readings and the cleanup do not
+ * race with it
+ */
+void stop_logging(void)
+{
+	if(!enable_logging)
+		return;
+
+	enable_logging = 0;
+	pfm_sched_stop(logging_sched);
+	pthread_join(logger, NULL);
+	pfm_operations_logging(0);
+	DPRINTF("Logging stopped, %"PRIu64" ticks missed\n", 
+		pfm_sched_missed(logging_sched));
+	pfm_sched_close(logging_sched);
+	logging_sched = NULL;
+}
+
+/*
+ * Stop the trigger thread, so that it does not enable or disable contexts
+ * during the final readings and the cleanup
+ */
+void stop_trigger(void)
+{
+	if(!trigger_running)
+		return;
+
+	trigger_running = 0;
+	pfm_trigger_stop(options.trigger_info);
+	pthread_join(trigger_thr, NULL);
+}
+
 void * trigger_thread(void * param)
 {
 	options_t * options = (options_t*)param;
@@ -661,9 +1493,6 @@ void * trigger_thread(void * param)
 
 int main(int argc, char **argv)
 {
-	pthread_t logger;
-	pthread_t trigger_thr;
-	
 	setlocale(LC_ALL, "");
   
 	enable_logging = 0;
@@ -673,12 +1502,95 @@ int main(int argc, char **argv)
 
 	parse_cmdln_params(argc, argv);
 	
-	if (!argv[optind])
-		errx(1, "you must specify a command to execute\n");
+	if (!argv[optind] && !options.attach_pid)
+		errx(1, "you must specify a command to execute, or a process "
+		     "to attach to with -T\n");
+	if (argv[optind] && options.attach_pid)
+		errx(1, "-T attaches to a running process, no command can be "
+		     "given\n");
 	
 	if(options.events == NULL)
 		options.events = DEFAULT_PMU_EVENTS;
 
+	/* 
+	 * rdpmc can only read counters of the calling thread or of the cpu the
+	 * caller is on, so it is useless for monitoring other threads 
+	 */
+	if(options.pfm_options.rdpmc && !options.is_sys_wide_mon){
+		warnx("-R ignored for per-thread monitoring, use -C");
+		options.pfm_options.rdpmc = 0;
+	}
+	if(options.pfm_options.inherit && options.is_sys_wide_mon){
+		warnx("-I ignored for system-wide monitoring");
+		options.pfm_options.inherit = 0;
+	}
+	/* running threads cannot inherit counters opened after they started */
+	if(options.pfm_options.inherit && options.attach_pid){
+		warnx("-I ignored with -T");
+		options.pfm_options.inherit = 0;
+	}
+	/* system-wide monitoring does not trace a -T process */
+	if(options.is_sys_wide_mon && options.attach_pid &&
+	   (options.run_core_cnt || options.place_policy != -1 ||
+	    options.num_place_rules)){
+		warnx("-P, -L and -r ignored with -C -T");
+		options.run_core_cnt = 0;
+		options.place_policy = -1;
+		options.num_place_rules = 0;
+	}
+	/* 
+	 * inherited counters already use their ring for the counts of exited
+	 * threads, and rdpmc the mapped page of the counters
+	 */
+	if(options.sample_period && options.pfm_options.inherit){
+		warnx("-S ignored with -I");
+		options.sample_period = 0;
+	}
+	if(options.sample_period && options.pfm_options.rdpmc){
+		warnx("-S ignored with -R");
+		options.sample_period = 0;
+	}
+	/* the loads of new threads would go to the first thread's rings */
+	if(options.mem_period && options.pfm_options.inherit){
+		warnx("-W ignored with -I");
+		options.mem_period = 0;
+	}
+	/* one sampler per housekeeping core unless -j says otherwise */
+	if(options.pfm_options.samplers == 0)
+		options.pfm_options.samplers = 
+			options.pfm_options.num_sampler_cpus ? 
+			options.pfm_options.num_sampler_cpus : 1;
+	/* inherited counters are not grouped */
+	if(options.mux_interval && options.pfm_options.inherit){
+		warnx("-m ignored with -I");
+		options.mux_interval = 0;
+	}
+	/* new threads are not seen one by one, so they cannot be pinned */
+	if(options.pfm_options.inherit && 
+	   (options.run_core_cnt > 1 || options.place_policy != -1 ||
+	    options.num_place_rules))
+		warnx("with -I, only the first thread is placed, the others "
+		      "inherit its affinity");
+
+	/* 
+	 * threads have no socket or node, cores have no process; binary 
+	 * output leaves the sums to pfm_decode
+	 */
+	if(options.is_sys_wide_mon && (options.rollups & PFM_ROLLUP_PROCESS)){
+		warnx("-A process ignored for system-wide monitoring");
+		options.rollups &= ~PFM_ROLLUP_PROCESS;
+	}
+	if(!options.is_sys_wide_mon && 
+	   (options.rollups & (PFM_ROLLUP_SOCKET | PFM_ROLLUP_NODE))){
+		warnx("-A socket and node need system-wide monitoring, use -C");
+		options.rollups &= ~(PFM_ROLLUP_SOCKET | PFM_ROLLUP_NODE);
+	}
+	if(options.output_format == PFM_OUTPUT_BIN && 
+	   options.rollups != PFM_ROLLUP_SELF){
+		warnx("-A ignored for binary output");
+		options.rollups = PFM_ROLLUP_SELF;
+	}
+
 	/* open file for output, redirect stdout and stderr */
 	if(options.output_file != NULL){
 		if(options.append_output)
@@ -688,21 +1600,87 @@ int main(int argc, char **argv)
 
 		if(reading_out == NULL)
 			err(1, "Unable to open output file.\n");
-		err_out = reading_out;
+		/* logs would corrupt a binary stream */
+		if(options.output_format != PFM_OUTPUT_BIN)
+			err_out = reading_out;
 	}
 
-	DPRINTF("Executing command %s\n", argv[optind]);
+	setup_placement();
 
-	/* create a thread for periodical PMU result output */
-	if(enable_logging)
-		pthread_create(&logger, NULL, logging_thread, NULL); 
+	/* 
+	 * initialize PMU monitoring before the logging and trigger threads 
+	 * start, they walk the context tables
+	 */
+	if(pfm_operations_init() != 0)
+		errx(1, "PMU initialization failed\n");
+	if(options.is_sys_wide_mon)
+		setup_cores();
+	setup_events();
+
+	/* before any thread starts, see stop_signals */
+	if(options.attach_pid){
+		sigset_t set;
+
+		stop_signals(&set);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+	}
+
+	/* start the writer thread that formats the readings */
+	if(pfm_output_init(options.output_format))
+		errx(1, "cannot start the output writer\n");
+	if(pfm_output_set_rollups(options.rollups))
+		errx(1, "cannot allocate the rollups\n");
+	setup_uncore();
+
+	if(options.attach_pid){
+		DPRINTF("Attaching to process %d\n", options.attach_pid);
+	}
+	else{
+		DPRINTF("Executing command %s\n", argv[optind]);
+	}
 
+	/* 
+	 * create a thread for periodical PMU result output, which also rotates
+	 * the planned groups of -m
+	 */
+	/* 
+	 * the trigger sets enable_new, and region markers in the monitored
+	 * program open the same events, before either thread starts
+	 */
 	if(options.use_trigger){
 		pfm_trigger_init(&options.trigger_info, options.is_sys_wide_mon,
 				 &options.pfm_options.enable_new, 
 				 &options.pfm_options);
+		pfm_trigger_set_events(options.trigger_info, options.events);
+	}
+
+	read_every = enable_logging;
+	if(options.mux_interval){
+		if(options.print_interval && 
+		   options.print_interval < options.mux_interval)
+			warnx("-i is shorter than -m, reading every rotation");
+		if(options.print_interval)
+			read_every = options.print_interval / 
+				options.mux_interval;
+		if(options.print_interval && read_every == 0)
+			read_every = 1;
+		enable_logging = 1;
+	}
+	if(enable_logging){
+		logging_start = pfm_sched_now();
+		if(pfm_sched_init(&logging_sched, options.mux_interval ? 
+				  options.mux_interval : 
+				  options.print_interval, 
+				  logging_start))
+			errx(1, "cannot create the logging scheduler\n");
+		pfm_operations_logging(1);
+		pthread_create(&logger, NULL, logging_thread, NULL); 
+	}
+
+	if(options.use_trigger){
 		pthread_create(&trigger_thr, NULL, trigger_thread, 
 			       (void*)&options);
+		trigger_running = 1;
 	}
 
 	if(options.is_sys_wide_mon)
@@ -712,8 +1690,21 @@ int main(int argc, char **argv)
 		/* per-thread monitoring */
 		parent_threadmon(argv+optind); 
 	
-	if(options.use_trigger)
-		pfm_trigger_close(&options.trigger_info);
+	if(options.use_trigger){
+		stop_trigger();
+		pfm_trigger_close(options.trigger_info);
+	}
+
+	/* the loads sampled since the last reading, and by exited threads */
+	pfm_sample_mem_flush();
+	pfm_output_close();
+	/* keep the hot spots out of a binary stream */
+	if(options.sample_period || options.pfm_options.mem)
+		pfm_sample_report(options.output_format == PFM_OUTPUT_BIN ? 
+				  err_out : reading_out);
+	pfm_metrics_free(options.metrics_info);
+	pfm_place_close(options.placement);
+	pfm_uncore_close(options.uncore);
 
 	if(options.output_file != NULL)
 		fclose((FILE*)reading_out);
@@ -0,0 +1,256 @@
+/*
+ * Multiplexing planner: probing the PMU for groups of events that fit, and
+ * extrapolating the counts of rotated groups.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <sys/ioctl.h>
+
+#include "perf_util.h"
+
+#include "pfm_common.h"
+#include "pfm_mux.h"
+#include "pfm_sched.h"
+
+#define PROBE_NS 200000 /* time a probe group counts, in ns */
+#define BOUND_Z 1.96 /* z of the 95% confidence bound */
+
+/*
+ * Open the events first..last as one group and count them briefly
+ * Return value:
+ *      1       --> the whole group was scheduled
+ *      0       --> the group could not be scheduled, it does not fit
+ *      -1      --> an event cannot be opened
+ */
+static int group_fits(perf_event_desc_t *fds, int first, int last, pid_t pid,
+		      int cpu)
+{
+	int num = last - first + 1;
+	int probe_fds[num];
+	uint64_t values[3 + num];
+	struct perf_event_attr attr;
+	uint64_t start;
+	int i, ret = -1;
+
+	for(i = 0; i < num; i++)
+		probe_fds[i] = -1;
+
+	for(i = 0; i < num; i++){
+		attr = fds[first + i].hw;
+		attr.disabled = i == 0;
+		attr.enable_on_exec = 0;
+		attr.inherit = 0;
+		attr.pinned = 0;
+		attr.read_format = PERF_FORMAT_GROUP |
+			PERF_FORMAT_TOTAL_TIME_ENABLED |
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+		probe_fds[i] = perf_event_open(&attr, pid, cpu,
+					       i ? probe_fds[0] : -1, 0);
+		if(probe_fds[i] == -1){
+			DPRINTF("Cannot open event %s to probe the PMU\n",
+				fds[first + i].name);
+			goto out;
+		}
+	}
+
+	ioctl(probe_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	start = pfm_sched_now();
+	while(pfm_sched_now() - start < PROBE_NS)
+		;
+	ioctl(probe_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+	if(read(probe_fds[0], values, sizeof(values)) != sizeof(values))
+		goto out;
+	/* a group that does not fit is never scheduled */
+	ret = values[2] > 0 && values[1] - values[2] < values[1] / 100;
+
+ out:
+	for(i = 0; i < num; i++)
+		if(probe_fds[i] != -1)
+			close(probe_fds[i]);
+
+	return ret;
+}
+
+int pfm_mux_plan(perf_event_desc_t *fds, int num, pid_t pid, int cpu,
+		 int *max_size)
+{
+	int first = 0;
+	int groups = 1;
+	int i, fits;
+
+	*max_size = 0;
+	if(num <= 0)
+		return -1;
+
+	fds[0].group_leader = 0;
+	for(i = 1; i < num; i++){
+		fits = group_fits(fds, first, i, pid, cpu);
+		if(fits == -1)
+			return -1;
+		if(!fits){
+			if(i - first > *max_size)
+				*max_size = i - first;
+			first = i;
+			groups++;
+		}
+		fds[i].group_leader = first;
+	}
+	if(num - first > *max_size)
+		*max_size = num - first;
+
+	return groups;
+}
+
+pfm_mux_t *pfm_mux_new(perf_event_desc_t *fds, int num)
+{
+	pfm_mux_t *mux;
+	int i, g;
+
+	mux = calloc(1, sizeof(pfm_mux_t));
+	if(mux == NULL)
+		return NULL;
+
+	for(i = 0; i < num; i++)
+		if(perf_is_group_leader(fds, i))
+			mux->num_groups++;
+
+	mux->leaders = calloc(mux->num_groups, sizeof(int));
+	mux->sizes = calloc(mux->num_groups, sizeof(int));
+	mux->slice_counts = calloc(num, sizeof(uint64_t));
+	mux->slice_ena = calloc(mux->num_groups, sizeof(uint64_t));
+	mux->num_slices = calloc(mux->num_groups, sizeof(uint64_t));
+	mux->rate_mean = calloc(num, sizeof(double));
+	mux->rate_m2 = calloc(num, sizeof(double));
+	mux->new_slices = calloc(mux->num_groups, sizeof(int));
+	mux->read_ena = calloc(mux->num_groups, sizeof(uint64_t));
+	mux->bounds = calloc(num, sizeof(uint64_t));
+	if(!mux->leaders || !mux->sizes || !mux->slice_counts ||
+	   !mux->slice_ena || !mux->num_slices || !mux->rate_mean ||
+	   !mux->rate_m2 || !mux->new_slices || !mux->read_ena ||
+	   !mux->bounds){
+		pfm_mux_free(mux);
+		return NULL;
+	}
+
+	for(i = 0, g = -1; i < num; i++){
+		if(perf_is_group_leader(fds, i))
+			mux->leaders[++g] = i;
+		mux->sizes[g]++;
+	}
+
+	return mux;
+}
+
+void pfm_mux_free(pfm_mux_t *mux)
+{
+	if(mux == NULL)
+		return;
+
+	free(mux->leaders);
+	free(mux->sizes);
+	free(mux->slice_counts);
+	free(mux->slice_ena);
+	free(mux->num_slices);
+	free(mux->rate_mean);
+	free(mux->rate_m2);
+	free(mux->new_slices);
+	free(mux->read_ena);
+	free(mux->bounds);
+	free(mux);
+}
+
+void pfm_mux_end_slice(pfm_mux_t *mux, uint64_t *counts, uint64_t ena)
+{
+	int g = mux->active;
+	int leader = mux->leaders[g];
+	uint64_t ns = ena - mux->slice_ena[g];
+	double rate, delta;
+	uint64_t n;
+	int i;
+
+	if(ns){
+		/* Welford's update of the mean and variance of the rates */
+		n = ++mux->num_slices[g];
+		for(i = 0; i < mux->sizes[g]; i++){
+			rate = (double)(counts[i] -
+					mux->slice_counts[leader + i]) / ns;
+			delta = rate - mux->rate_mean[leader + i];
+			mux->rate_mean[leader + i] += delta / n;
+			mux->rate_m2[leader + i] += delta *
+				(rate - mux->rate_mean[leader + i]);
+		}
+		mux->new_slices[g]++;
+	}
+
+	memcpy(mux->slice_counts + leader, counts,
+	       sizeof(uint64_t) * mux->sizes[g]);
+	mux->slice_ena[g] = ena;
+	/* read by the triggers, which toggle the active group */
+	__atomic_store_n(&mux->active, (g + 1) % mux->num_groups, 
+			 __ATOMIC_RELEASE);
+}
+
+/*
+ * The 95% bound of an extrapolated delta: the mean rate of the slices in
+ * the reading varies as the rates of all slices so far, scaled to the
+ * reading's time; the part of the time the group counted is known exactly
+ */
+static uint64_t delta_bound(pfm_mux_t *mux, int g, int evt, uint64_t total,
+			    uint64_t ena)
+{
+	uint64_t n = mux->num_slices[g];
+	int slices = mux->new_slices[g];
+	double sd, unseen;
+
+	if(ena >= total)
+		return 0;
+	/* the slice in progress */
+	if(slices == 0 && ena)
+		slices = 1;
+	if(n < 2 || slices == 0)
+		return PFM_MUX_NO_BOUND;
+
+	sd = sqrt(mux->rate_m2[evt] / (n - 1));
+	unseen = 1.0 - (double)ena / total;
+
+	return (uint64_t)(BOUND_Z * sd * total * sqrt(unseen / slices));
+}
+
+void pfm_mux_extrapolate(pfm_mux_t *mux, pfm_counts_row_t *row)
+{
+	uint64_t total = 0;
+	uint64_t ena, prev;
+	int g, i, evt;
+
+	for(g = 0; g < mux->num_groups; g++)
+		total += row->ena[mux->leaders[g]];
+
+	for(g = 0; g < mux->num_groups; g++){
+		ena = row->ena[mux->leaders[g]];
+		for(i = 0; i < mux->sizes[g]; i++){
+			evt = mux->leaders[g] + i;
+			if(evt >= row->num)
+				break;
+			/* the extrapolated count of the last reading */
+			prev = row->val[evt] - row->delta[evt];
+			row->val[evt] = ena ? (uint64_t)
+				((double)row->val[evt] * total / ena) : 0;
+			row->delta[evt] = row->val[evt] - prev;
+			row->ena[evt] = total;
+			row->run[evt] = ena;
+			mux->bounds[evt] = delta_bound(mux, g, evt,
+						       total - mux->read_total,
+						       ena - mux->read_ena[g]);
+		}
+		mux->read_ena[g] = ena;
+		mux->new_slices[g] = 0;
+	}
+	mux->read_total = total;
+}
@@ -0,0 +1,96 @@
+/*
+ * Multiplexing planner: when there are more events than hardware counters,
+ * the event list is split into groups that each fit the PMU, found by
+ * probing the PMU with the events themselves at startup. pfm_multi then
+ * counts one group at a time and rotates the groups every sub-interval
+ * (-m), instead of leaving the time sharing to the kernel. Each group's
+ * counts are extrapolated to the whole monitored time, with a 95%
+ * confidence bound from the rates seen in the slices of the group.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_MUX_H__
+#define __PFM_MUX_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "perf_util.h"
+#include "pfm_counts.h"
+
+/* the bound of an extrapolated delta that cannot be estimated yet */
+#define PFM_MUX_NO_BOUND UINT64_MAX
+
+/* the rotation state of the planned groups of one context */
+typedef struct __pfm_mux{
+	int num_groups;
+	int active; /* the group counting now, stored atomically */
+	int *leaders; /* first event of each group */
+	int *sizes; /* number of events of each group */
+	/* the end of the last slice of each group */
+	uint64_t *slice_counts; /* raw count of each event */
+	uint64_t *slice_ena; /* time enabled of each group */
+	/* rates of each event over the slices of its group, in counts/ns */
+	uint64_t *num_slices; /* slices of each group */
+	double *rate_mean;
+	double *rate_m2; /* sum of squared differences from the mean */
+	/* the last reading */
+	int *new_slices; /* slices of each group since the last reading */
+	uint64_t *read_ena; /* time enabled of each group */
+	uint64_t read_total; /* time enabled of all groups */
+	uint64_t *bounds; /* 95% bound of each delta of the last reading */
+}pfm_mux_t;
+
+/*
+ * Split an event list into groups that can be counted at the same time.
+ * The events are added one by one to the current group, which is opened
+ * and counted briefly after each addition; an event that keeps the group
+ * from being scheduled starts a new group. The order of the events is kept.
+ * Parameters:
+ *	fds	--> the event list, its group leaders are set to the plan
+ *	num	--> number of events
+ *	pid	--> the thread the probes count, 0 for the caller
+ *	cpu	--> the cpu the probes count, -1 for any
+ * Output parameter:
+ *	max_size	--> the size of the largest group, i.e. the number of
+ *                          these events the PMU can count at once
+ * Return value:
+ *      the number of groups, -1 if an event cannot be opened
+ */
+int pfm_mux_plan(perf_event_desc_t *fds, int num, pid_t pid, int cpu,
+		 int *max_size);
+
+/*
+ * Create the rotation state of a context from its planned event list; the
+ * first group is active
+ * Return value:
+ *      the state, NULL if out of memory
+ */
+pfm_mux_t *pfm_mux_new(perf_event_desc_t *fds, int num);
+
+/*
+ * Free a rotation state, NULL is ignored
+ */
+void pfm_mux_free(pfm_mux_t *mux);
+
+/*
+ * End the slice of the active group and make the next group active
+ * Parameters:
+ *	counts	--> raw count of each event of the active group
+ *	ena	--> time enabled of the active group
+ */
+void pfm_mux_end_slice(pfm_mux_t *mux, uint64_t *counts, uint64_t ena);
+
+/*
+ * Extrapolate a reading of all groups to the time of all groups, after the
+ * row is updated: val becomes the extrapolated count, with its delta from 
+ * the last extrapolated count, ena the time enabled of all groups and run
+ * the time of the event's group; also sets the bound of each delta since 
+ * the last reading
+ * Parameters:
+ *	row	--> the counts of the event list, just read and updated
+ */
+void pfm_mux_extrapolate(pfm_mux_t *mux, pfm_counts_row_t *row);
+
+#endif
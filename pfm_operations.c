@@ -3,12 +3,16 @@
  *
  * Author: Wei Wang <wwang@virginia.edu>
  */
+#define _GNU_SOURCE             // for pthread_setaffinity_np
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <string.h>
 #include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <pthread.h>
 
 /* 
  * We use libpfm and helper functions from Stephane Eranian 
@@ -17,32 +21,210 @@
 
 #include "pfm_operations.h"
 #include "pfm_common.h"
+#include "pfm_rdpmc.h"
+#include "pfm_ctx_table.h"
+#include "pfm_output.h"
+#include "pfm_workpool.h"
+#include "pfm_sched.h"
+#include "pfm_mux.h"
+#include "pfm_sample.h"
+#include "pfm_counts.h"
+#include "pfm_epoch.h"
 
 typedef struct __thread_pfm_context{
 	perf_event_desc_t *fds;
 	int num_fds;
+	pfm_counts_row_t counts; /* the counts of the events */
 	pid_t tid;
+	pid_t tgid;
 	int grouped;
-	int enabled;
+	int enabled; /* flipped by the triggers, accessed atomically */
+	int flush; /* disabled by a trigger, its reading is due */
+	/* 
+	 * Inherited counters, which also count the new threads. The kernel
+	 * only lets per-cpu inherited counters have a ring buffer, where it
+	 * writes a PERF_RECORD_READ with the counts of every exiting child. 
+	 * So the events are opened on every cpu, and fds only keeps the sums.
+	 */
+	int inherit;
+	int num_cpus;
+	perf_event_desc_t **cpu_fds; /* events on each cpu, NULL if offline */
+	int num_rings; /* number of cpus whose records are collected */
+	struct __inherit_id *ids; /* kernel ids of the events, sorted */
+	int num_ids;
+	/* the counts of the exited children, included in the readings */
+	uint64_t *inherited;
+	pfm_ctx_table_t exiting; /* children with some records yet to read */
+	pfm_mux_t *mux; /* rotation of the planned groups, NULL if none */
+	/* the load latency event of -W, NULL if none */
+	perf_event_desc_t *mem_fds;
+	int num_mem_fds;
+	struct __thread_pfm_context *next_detached; /* see detached */
 }thread_pfm_context_t;
 
-thread_pfm_context_t thread_ctxs[MAX_NUM_THREADS];
-int thr_ctx_idx;
+/* maps the kernel id in a PERF_RECORD_READ to the event */
+typedef struct __inherit_id{
+	uint64_t id;
+	int evt;
+}inherit_id_t;
+
+/* the readings of an exited child of inherited counters, by tid */
+typedef struct __inherited_thread{
+	pid_t pid;
+	pid_t tid;
+	int num_read; /* number of records read, one per event per cpu */
+	uint64_t values[]; /* value, time enabled, time running per event */
+}inherited_thread_t;
+
+/* data pages of the ring buffer collecting PERF_RECORD_READ records */
+#define INHERIT_RING_PAGES 16
+
+/* thread contexts, indexed by tid */
+static pfm_ctx_table_t thread_ctxs;
+/* the counts of the thread contexts */
+static pfm_counts_t thread_counts;
 
 typedef struct __core_pfm_context{
 	perf_event_desc_t *fds;
 	int num_fds;
+	pfm_counts_row_t counts; /* the counts of the events */
 	int cpu;
 	int grouped;
-	int enabled;
+	int enabled; /* flipped by the triggers, accessed atomically */
+	int flush; /* disabled by a trigger, its reading is due */
+	pfm_mux_t *mux; /* rotation of the planned groups, NULL if none */
+	/* the load latency event of -W, NULL if none */
+	perf_event_desc_t *mem_fds;
+	int num_mem_fds;
+	int reader; /* the rdpmc reader of the core, 0 if none, see readers */
 }core_pfm_context_t;
 
-core_pfm_context_t core_ctxs[MAX_NUM_CORES];
-int core_ctx_idx;
+/* core contexts, indexed by cpu id */
+static pfm_ctx_table_t core_ctxs;
+/* the counts of the core contexts */
+static pfm_counts_t core_counts;
+
+/* 
+ * Contexts are read by the logging thread and the triggers while the 
+ * tracer attaches and detaches threads. The tables are read without locks,
+ * inside pfm_epoch sections, and a detached context is freed once no 
+ * reader is left. While logging, the logging thread owns the counts and 
+ * the rotation of every context: the other threads only flip the enabled 
+ * flags and toggle the counters, and leave the readings to its next pass.
+ */
+static int logging;
+/* threads detached while logging, for the next pass to finish */
+static thread_pfm_context_t *detached;
+
+/* 
+ * per-process totals; the counts of the exited threads of a process are 
+ * accumulated here when the threads are detached
+ */
+typedef struct __process_pfm_totals{
+	pid_t tgid;
+	int num_threads; /* number of threads ever attached, added atomically */
+	int num_exited; /* number of threads folded into values, likewise */
+	int num_fds;
+	uint64_t *values; /* summed scaled counts of the exited threads, 
+			     added atomically */
+}process_pfm_totals_t;
+
+/* process totals, indexed by tgid */
+static pfm_ctx_table_t process_totals;
+/* new totals come from the tracer and the collectors of inherited counters */
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 
+ * read() statistics, used to show how many syscalls grouped reading saves; 
+ * read_passes is the number of read_all passes, read_calls is the number of 
+ * read() issued, and read_evts is the number of counters fetched by them; 
+ * updated atomically, as the samplers read in parallel
+ */
+static uint64_t read_passes;
+static uint64_t read_calls;
+static uint64_t read_evts;
+static uint64_t rdpmc_evts; /* counters read in userspace with rdpmc */
+static uint64_t inherit_lost; /* PERF_RECORD_READ records lost */
+
+/* 
+ * a parsed event list; parsing an event string with libpfm is slow, so a 
+ * string is parsed once and every new context gets a copy of the template.
+ * The copies share the names of the template, so templates are only freed 
+ * at cleanup.
+ */
+typedef struct __event_template{
+	char *evns;
+	perf_event_desc_t *fds;
+	int num_fds;
+	struct __event_template *next;
+}event_template_t;
+
+static event_template_t *templates;
+
+/* thread attach statistics, to show the time a new thread is held */
+static uint64_t attach_threads;
+static uint64_t attach_ns;
+
+/* the most threads used to attach cores in parallel */
+#define MAX_ATTACH_WORKERS 32
+
+/* 
+ * enabling/disabling all contexts is done in parallel by a pool of up to 
+ * MAX_TOGGLE_WORKERS threads, when there are at least MIN_PARALLEL_TOGGLES 
+ * contexts; toggle_calls is the number of ioctls issued and toggle_evts the
+ * number of counters they toggled
+ */
+#define MAX_TOGGLE_WORKERS 16
+#define MIN_PARALLEL_TOGGLES 64
+static void *toggle_pool;
+static uint64_t toggle_calls;
+static uint64_t toggle_evts;
+
+/* 
+ * with options->samplers, the contexts read by a reading pass are split 
+ * into one shard per sampler thread, shard i always read by sampler i, so 
+ * a pinned sampler keeps reading the same slice from its cpu; each shard 
+ * keeps the time its reads take, to show whether the pass fits the interval
+ */
+typedef struct __sampler_shard{
+	uint64_t passes;
+	uint64_t ctxs; /* contexts read by all passes */
+	uint64_t ns; /* time of all passes */
+	uint64_t max_ns; /* time of the longest pass */
+}sampler_shard_t;
+
+static void *sampler_pool;
+static int sampler_failed; /* the pool cannot be created, read serially */
+static sampler_shard_t *shards;
+static int num_shards;
+/* the contexts read by the current pass, in table order */
+static void **pass_ctxs;
+static int pass_size;
+
+/* 
+ * with options->rdpmc, rdpmc only reads the counters of the cpu it runs on,
+ * so each core is read by its own reader thread, pinned to the core; 
+ * reader i of the pool reads the core context whose reader is i, while 
+ * the thread running the pass reads the cores without a reader. The 
+ * readers are created on the first pass, for the cores attached by then.
+ */
+static void *reader_pool;
+static int readers_tried; /* the pool was created, or cannot be */
+static core_pfm_context_t **reader_ctxs; /* by reader, NULL if not read */
+static int num_readers; /* including the thread running the passes */
+/* the cpu the calling thread is pinned to as a reader, -1 if none */
+static __thread int reader_cpu = -1;
 
-void read_counts(perf_event_desc_t *fds, int num);
-void print_thread_counts(pid_t tid, perf_event_desc_t *fds, int num);
-void print_core_counts(int cpu, perf_event_desc_t *fds, int num);
+void read_counts(perf_event_desc_t *fds, pfm_counts_row_t *row, int num, 
+		 int grouped, int cpu);
+void print_thread_counts(thread_pfm_context_t *ctx);
+static void read_thread_counts(thread_pfm_context_t *ctx);
+static void update_thread_counts(thread_pfm_context_t *ctx);
+void print_core_counts(core_pfm_context_t *ctx);
+static void read_core_counts(core_pfm_context_t *ctx);
+static void collect_inherited(thread_pfm_context_t *ctx);
+static int toggle_thread_events(thread_pfm_context_t *ctx, long request);
+static int toggle_core_events(core_pfm_context_t *ctx, long request);
 
 /*
  * Initilization
@@ -61,15 +243,408 @@ int pfm_operations_init()
       return -1;
     }
   
-  thr_ctx_idx = 0;
+  if (pfm_ctx_table_init(&thread_ctxs) || pfm_ctx_table_init(&core_ctxs) ||
+      pfm_ctx_table_init(&process_totals))
+    {
+      warnx("cannot allocate PMU context tables");
+      return -1;
+    }
+  pfm_counts_init(&thread_counts);
+  pfm_counts_init(&core_counts);
   
   return 0;
 }
 
+/*
+ * Get the kernel id of an opened event, which is used to match the values 
+ * returned by a group read to the events of the group
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+static int get_event_id(perf_event_desc_t *fd)
+{
+	if(ioctl(fd->fd, PERF_EVENT_IOC_ID, &fd->id) == -1){
+		warn("cannot get the id of event %s", fd->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Close the opened events of an event list and free the list; unopened 
+ * events have fd -1
+ */
+static void close_fds(perf_event_desc_t *fds, int num)
+{
+	int i;
+
+	for(i = 0; i < num; i++){
+		/* the last samples are taken before the ring is gone */
+		pfm_sample_unmap(&fds[i]);
+		if(fds[i].pgmsk)
+			munmap(fds[i].buf, fds[i].pgmsk + 1 + 
+			       sysconf(_SC_PAGESIZE));
+		else
+			pfm_rdpmc_unmap(fds[i].buf);
+		fds[i].buf = NULL;
+		if(fds[i].fd != -1)
+			close(fds[i].fd);
+	}
+
+	/* the names belong to the template */
+	free(fds);
+}
+
+/*
+ * Free a thread context and everything it holds
+ */
+static void free_thread_context(thread_pfm_context_t *ctx)
+{
+	int i;
+
+	close_fds(ctx->fds, ctx->num_fds);
+	if(ctx->mem_fds)
+		close_fds(ctx->mem_fds, ctx->num_mem_fds);
+	if(ctx->inherit){
+		for(i = 0; ctx->cpu_fds && i < ctx->num_cpus; i++)
+			if(ctx->cpu_fds[i])
+				close_fds(ctx->cpu_fds[i], ctx->num_fds);
+		free(ctx->cpu_fds);
+		free(ctx->ids);
+		for(i = 0; i < pfm_ctx_table_slots(&ctx->exiting); i++)
+			free(pfm_ctx_table_get(&ctx->exiting, i));
+		pfm_ctx_table_destroy(&ctx->exiting);
+		free(ctx->inherited);
+	}
+	pfm_mux_free(ctx->mux);
+	pfm_counts_free(&thread_counts, &ctx->counts);
+	free(ctx);
+}
+
+/*
+ * Free a core context and everything it holds
+ */
+static void free_core_context(core_pfm_context_t *ctx)
+{
+	close_fds(ctx->fds, ctx->num_fds);
+	if(ctx->mem_fds)
+		close_fds(ctx->mem_fds, ctx->num_mem_fds);
+	pfm_mux_free(ctx->mux);
+	pfm_counts_free(&core_counts, &ctx->counts);
+	free(ctx);
+}
+
+/*
+ * Map the ring buffer of an inherited counter, where the kernel writes a 
+ * PERF_RECORD_READ with the final counts of every child that exits; the 
+ * other events on the same cpu are redirected to this buffer
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+static int map_inherit_ring(perf_event_desc_t *fd)
+{
+	size_t pgsz = sysconf(_SC_PAGESIZE);
+	void *buf;
+
+	buf = mmap(NULL, (INHERIT_RING_PAGES + 1) * pgsz, 
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fd->fd, 0);
+	if(buf == MAP_FAILED)
+		return -1;
+
+	fd->buf = buf;
+	fd->pgmsk = INHERIT_RING_PAGES * pgsz - 1;
+
+	return 0;
+}
+
+/*
+ * Get the template of an event string, parse the string if it is new
+ * Return value:
+ *      the template, NULL if failed
+ */
+static event_template_t *get_template(char *evns)
+{
+	event_template_t *t;
+	int i;
+
+	for(t = templates; t; t = t->next)
+		if(!strcmp(t->evns, evns))
+			return t;
+
+	t = calloc(1, sizeof(event_template_t));
+	if(t == NULL)
+		return NULL;
+	if(perf_setup_list_events(evns, &t->fds, &t->num_fds) || 
+	   !t->num_fds){
+		free(t);
+		return NULL;
+	}
+	t->evns = strdup(evns);
+	if(t->evns == NULL){
+		perf_free_fds(t->fds, t->num_fds);
+		free(t);
+		return NULL;
+	}
+	/* copies start unopened */
+	for(i = 0; i < t->num_fds; i++)
+		t->fds[i].fd = -1;
+
+	t->next = templates;
+	templates = t;
+
+	return t;
+}
+
+int pfm_prepare_events(char *evns)
+{
+	if(get_template(evns) == NULL)
+		return -1;
+
+	return 0;
+}
+
+int pfm_event_names(char *evns, const char **names, int max)
+{
+	event_template_t *t;
+	int i;
+
+	t = get_template(evns);
+	if(t == NULL)
+		return -1;
+
+	for(i = 0; i < t->num_fds && i < max; i++)
+		names[i] = t->fds[i].name;
+
+	return t->num_fds;
+}
+
+int pfm_plan_events(char *evns, int cpu, int *max_size)
+{
+	event_template_t *t;
+
+	t = get_template(evns);
+	if(t == NULL)
+		return -1;
+
+	/* the groups are planned on the template, before any copy is made */
+	return pfm_mux_plan(t->fds, t->num_fds, cpu == -1 ? 0 : -1, cpu, 
+			    max_size);
+}
+
+int pfm_event_attrs(char *evns, struct perf_event_attr *attrs, 
+		    const char **names, int max)
+{
+	event_template_t *t;
+	int i;
+
+	t = get_template(evns);
+	if(t == NULL)
+		return -1;
+
+	for(i = 0; i < t->num_fds && i < max; i++){
+		attrs[i] = t->fds[i].hw;
+		names[i] = t->fds[i].name;
+	}
+
+	return i;
+}
+
+/*
+ * Get the event list of a new context, a copy of the parsed event string
+ * Parameters:
+ *	evns	--> list of events, comma separated list in a string
+ * Output parameters:
+ *	fds	--> the event list, freed with close_fds
+ *	num	--> number of events
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+static int setup_events(char *evns, perf_event_desc_t **fds, int *num)
+{
+	event_template_t *t;
+	perf_event_desc_t *copy;
+
+	t = get_template(evns);
+	if(t == NULL)
+		return -1;
+
+	copy = malloc(sizeof(perf_event_desc_t) * t->num_fds);
+	if(copy == NULL)
+		return -1;
+	memcpy(copy, t->fds, sizeof(perf_event_desc_t) * t->num_fds);
+
+	*fds = copy;
+	*num = t->num_fds;
+
+	return 0;
+}
+
+/*
+ * Get the totals of a process, create them if the process is new
+ * Parameters:
+ * 	tgid	--> process id
+ *	num	--> number of events monitored for the process
+ * Return value:
+ *      the totals, NULL if out of memory
+ */
+static process_pfm_totals_t *get_process_totals(pid_t tgid, int num)
+{
+	process_pfm_totals_t *p;
+
+	/* totals are only freed at cleanup, the index may be replaced */
+	pfm_epoch_enter();
+	p = pfm_ctx_table_lookup(&process_totals, tgid);
+	pfm_epoch_exit();
+	if(p)
+		return p;
+
+	pthread_mutex_lock(&totals_lock);
+	p = pfm_ctx_table_lookup(&process_totals, tgid);
+	if(p)
+		goto out;
+	p = calloc(1, sizeof(process_pfm_totals_t));
+	if(p == NULL)
+		goto out;
+	p->tgid = tgid;
+	p->num_fds = num;
+	p->values = calloc(num, sizeof(uint64_t));
+	if(p->values == NULL || 
+	   pfm_ctx_table_insert(&process_totals, tgid, p) < 0){
+		free(p->values);
+		free(p);
+		p = NULL;
+	}
+
+ out:
+	pthread_mutex_unlock(&totals_lock);
+	return p;
+}
+
+static int compare_ids(const void *a, const void *b)
+{
+	const inherit_id_t *x = a, *y = b;
+
+	return (x->id > y->id) - (x->id < y->id);
+}
+
+/*
+ * Open the inherited counters of a thread, one copy of the event list on 
+ * every cpu, each copy with a ring buffer for the records of exiting 
+ * children
+ * Return value:
+ *      0       --> success
+ *      other   --> failed, opened events are left for free_thread_context
+ */
+static int open_inherited_events(thread_pfm_context_t *ctx, char *evns, 
+				 int flags, pfm_operations_options_t *options)
+{
+	int cpu, i;
+	int group_fd;
+	int mapped = 0;
+	perf_event_desc_t *fds;
+
+	ctx->num_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+	ctx->cpu_fds = calloc(ctx->num_cpus, sizeof(perf_event_desc_t *));
+	ctx->ids = calloc(ctx->num_cpus * ctx->num_fds, sizeof(inherit_id_t));
+	ctx->inherited = calloc(ctx->num_fds, sizeof(uint64_t));
+	if(ctx->cpu_fds == NULL || ctx->ids == NULL || ctx->inherited == NULL)
+		return -1;
+
+	for(cpu = 0; cpu < ctx->num_cpus; cpu++){
+		if(setup_events(evns, &fds, &i))
+			return -1;
+		ctx->cpu_fds[cpu] = fds;
+
+		for(i = 0; i < ctx->num_fds; i++){
+			int is_group_leader;
+
+			if(options->grouped)
+				is_group_leader = perf_is_group_leader(fds, i);
+			else
+				is_group_leader = 1; 
+			if(is_group_leader)
+				group_fd = -1; 
+			else
+				group_fd = fds[fds[i].group_leader].fd;
+
+			fds[i].hw.disabled = !ctx->enabled;
+			fds[i].hw.enable_on_exec = 0;
+			if(flags & PFM_OP_ENABLE_ON_EXEC){
+				fds[i].hw.disabled = is_group_leader;
+				fds[i].hw.enable_on_exec = is_group_leader;
+			}
+			/* records carry the id, telling their event */
+			fds[i].hw.read_format = PERF_FORMAT_SCALE | 
+				PERF_FORMAT_ID;
+			/* 
+			 * count the new threads too, and have the kernel 
+			 * report the counts of each thread when it exits
+			 */
+			fds[i].hw.inherit = 1;
+			fds[i].hw.inherit_stat = 1;
+			if (options->pinned && is_group_leader)
+				fds[i].hw.pinned = 1;
+
+			fds[i].fd = perf_event_open(&fds[i].hw, ctx->tid, cpu,
+						    group_fd, 0);
+			if(fds[i].fd == -1)
+				break;
+			if(get_event_id(&fds[i]))
+				return -1;
+			ctx->ids[ctx->num_ids].id = fds[i].id;
+			ctx->ids[ctx->num_ids].evt = i;
+			ctx->num_ids++;
+
+			if(i == 0)
+				mapped = !map_inherit_ring(&fds[0]);
+			else if(mapped && ioctl(fds[i].fd, 
+						PERF_EVENT_IOC_SET_OUTPUT, 
+						fds[0].fd))
+				mapped = 0;
+		}
+
+		if(i < ctx->num_fds){
+			/* offline cpus cannot be counted on */
+			if(i == 0 && errno == ENODEV){
+				close_fds(fds, ctx->num_fds);
+				ctx->cpu_fds[cpu] = NULL;
+				continue;
+			}
+			warn("cannot attach event%d %s to thread [%d] on "
+			     "CPU <%d>", i, fds[i].name, ctx->tid, cpu);
+			return -1;
+		}
+		if(mapped){
+			ctx->num_rings++;
+			continue;
+		}
+		warnx("cannot collect the threads exiting on CPU <%d>, they "
+		      "are only in the readings of thread [%d]", cpu, 
+		      ctx->tid);
+		if(fds[0].buf){
+			/* some events of the cpu write elsewhere */
+			munmap(fds[0].buf, fds[0].pgmsk + 1 + 
+			       sysconf(_SC_PAGESIZE));
+			fds[0].buf = NULL;
+			fds[0].pgmsk = 0;
+		}
+	}
+	qsort(ctx->ids, ctx->num_ids, sizeof(inherit_id_t), compare_ids);
+	DPRINTF("PMU context opened for thread [%d] and its children\n", 
+		ctx->tid);
+
+	return 0;
+}
+
 /*
  * Attach to a thread for PMU readings
  * Parameters:
  * 	tid	--> thread id to attach
+ * 	tgid	--> process id of the thread, used for per-process totals
  *	evns 	--> list of evns to monitor, comma seperated list in a string
  *	flags	--> Interval flags used by pfm_operations, not confused kernel perf flags
  *                  See the header file for available flags
@@ -78,30 +653,79 @@ int pfm_operations_init()
  *      0       --> success
  *      other   --> failed
  */
-int pfm_attach_thread(pid_t tid, char * evns, int flags, 
+int pfm_attach_thread(pid_t tid, pid_t tgid, char * evns, int flags, 
 		      pfm_operations_options_t * options)
 {
 	int ret;
 	int i;
 	int group_fd;
 	perf_event_desc_t * fds;
+	thread_pfm_context_t * ctx;
+	process_pfm_totals_t * totals;
+	uint64_t start = pfm_sched_now();
+	/* a trigger may change it meanwhile, checked again once published */
+	int enable_new = __atomic_load_n(&options->enable_new, 
+					 __ATOMIC_SEQ_CST);
 	
-	thread_ctxs[thr_ctx_idx].tid = tid;
-	thread_ctxs[thr_ctx_idx].fds = NULL;
-	thread_ctxs[thr_ctx_idx].num_fds = 0;
-	if(options->enable_new)
-		thread_ctxs[thr_ctx_idx].enabled = 1;
+	/* 
+	 * a context left by an exited thread whose tid has been reused, 
+	 * this happens if we missed the exit
+	 */
+	if(pfm_ctx_table_lookup(&thread_ctxs, tid))
+		pfm_detach_thread(tid);
+
+	ctx = calloc(1, sizeof(thread_pfm_context_t));
+	if(ctx == NULL)
+		return -1;
+	ctx->tid = tid;
+	ctx->tgid = tgid;
+	ctx->fds = NULL;
+	ctx->num_fds = 0;
+	/* 
+	 * inherited counters cannot be read as a group on many kernels, 
+	 * their groups are still scheduled together
+	 */
+	ctx->grouped = options->grouped && !options->inherit;
+	ctx->inherit = options->inherit;
+	if(enable_new)
+		ctx->enabled = 1;
 	else 
-		thread_ctxs[thr_ctx_idx].enabled = 0;
+		ctx->enabled = 0;
 
-	ret = perf_setup_list_events(evns, &(thread_ctxs[thr_ctx_idx].fds), 
-				     &(thread_ctxs[thr_ctx_idx].num_fds));
-	if(ret || !(thread_ctxs[thr_ctx_idx].num_fds))
+	ret = setup_events(evns, &(ctx->fds), &(ctx->num_fds));
+	if(ret){
+		free(ctx);
 		return -1;
+	}
+	if(pfm_counts_alloc(&thread_counts, ctx->num_fds, &ctx->counts)){
+		warnx("cannot allocate the counts of thread [%d]", tid);
+		close_fds(ctx->fds, ctx->num_fds);
+		free(ctx);
+		return -1;
+	}
 	
-	fds = thread_ctxs[thr_ctx_idx].fds;
-	
-	for(i = 0; i < thread_ctxs[thr_ctx_idx].num_fds; i++){
+	fds = ctx->fds;
+	if(options->mux && !ctx->inherit){
+		ctx->mux = pfm_mux_new(fds, ctx->num_fds);
+		if(ctx->mux == NULL){
+			close_fds(fds, ctx->num_fds);
+			pfm_counts_free(&thread_counts, &ctx->counts);
+			free(ctx);
+			return -1;
+		}
+	}
+	if(ctx->inherit){
+		if(pfm_ctx_table_init(&ctx->exiting)){
+			close_fds(fds, ctx->num_fds);
+			pfm_counts_free(&thread_counts, &ctx->counts);
+			free(ctx);
+			return -1;
+		}
+		if(open_inherited_events(ctx, evns, flags, options))
+			goto error;
+		goto opened;
+	}
+	for(i = 0; i < ctx->num_fds; i++){
 		int is_group_leader;
 		
 		if(options->grouped)
@@ -116,7 +740,7 @@ int pfm_attach_thread(pid_t tid, char * evns, int flags,
 		else
 			group_fd = fds[fds[i].group_leader].fd;
 
-		if (options->enable_new){
+		if (enable_new){
 			fds[i].hw.disabled = 0;
 			fds[i].hw.enable_on_exec = 0;
 		}
@@ -134,12 +758,28 @@ int pfm_attach_thread(pid_t tid, char * evns, int flags,
 			fds[i].hw.enable_on_exec = is_group_leader;
 		}
 
+		/* of the planned groups, only the active one counts */
+		if(ctx->mux && is_group_leader && 
+		   i != ctx->mux->leaders[ctx->mux->active]){
+			fds[i].hw.disabled = 1;
+			fds[i].hw.enable_on_exec = 0;
+		}
+
 		fds[i].hw.read_format = PERF_FORMAT_SCALE;
+		/* 
+		 * grouped events are read with one read() on the leader, 
+		 * which returns the values of all members tagged by ids
+		 */
+		if(ctx->grouped)
+			fds[i].hw.read_format |= PERF_FORMAT_GROUP | 
+				PERF_FORMAT_ID;
 		
 		fds[i].hw.inherit = 0; /* only monitor the current thread */
       
 		if (options->pinned && is_group_leader)
 			fds[i].hw.pinned = 1;
+		if(options->sample)
+			pfm_sample_setup(&fds[i]);
      
 		fds[i].fd = perf_event_open(&fds[i].hw, tid, -1, group_fd, 0);
 		if (fds[i].fd == -1) {
@@ -148,298 +788,1661 @@ int pfm_attach_thread(pid_t tid, char * evns, int flags,
 			     fds[i].name, tid);
 			goto error;
 		}
+		if(ctx->grouped && get_event_id(&fds[i]))
+			goto error;
+		/* without a ring, the event still counts */
+		if(options->sample)
+			pfm_sample_map(&fds[i], i);
 		DPRINTF("PMU context opened for thread [%d]\n", tid);
 	}
+	/* a thread whose loads cannot be sampled is still counted */
+	if(options->mem &&
+	   pfm_sample_mem_open(&ctx->mem_fds, &ctx->num_mem_fds, tid, -1, 
+			       (flags & PFM_OP_ENABLE_ON_EXEC) || 
+			       !enable_new, 
+			       (flags & PFM_OP_ENABLE_ON_EXEC) != 0))
+		warn("cannot sample the loads of thread [%d]", tid);
 	
-	thr_ctx_idx++;
+ opened:
+	if(pfm_ctx_table_insert(&thread_ctxs, tid, ctx) < 0){
+		warnx("cannot add the PMU context of thread [%d]", tid);
+		goto error;
+	}
+	/* 
+	 * a trigger enabling or disabling all threads meanwhile did not see
+	 * the context yet; the flag is read with a read-modify-write, as the
+	 * trigger exchanges it, so either the trigger sees the context or the
+	 * context sees the new flag
+	 */
+	if(!(flags & PFM_OP_ENABLE_ON_EXEC) && 
+	   __atomic_fetch_or(&options->enable_new, 0, __ATOMIC_SEQ_CST) != 
+	   enable_new){
+		__atomic_store_n(&ctx->enabled, !enable_new, __ATOMIC_RELEASE);
+		toggle_thread_events(ctx, enable_new ? PERF_EVENT_IOC_DISABLE :
+				     PERF_EVENT_IOC_ENABLE);
+	}
+
+	pfm_output_set_events(fds, ctx->num_fds);
+	pfm_output_context(PFM_OUTPUT_THREAD, tid, tgid);
+	totals = get_process_totals(tgid, ctx->num_fds);
+	if(totals)
+		__atomic_add_fetch(&totals->num_threads, 1, __ATOMIC_RELAXED);
+	else
+		warnx("cannot allocate the totals of process [%d]", tgid);
+
+	attach_threads++;
+	attach_ns += pfm_sched_now() - start;
 	
 	return 0;
 	
  error:
-	free(fds);
+	free_thread_context(ctx);
 	
 	return -1;
 }
 
-/*
- * Cleanup
- */
-int pfm_operations_cleanup()
+static void retire_thread_context(void *ctx)
 {
-	int i;
-	
-	for(i = 0; i < thr_ctx_idx; i++){
-		if(thread_ctxs[i].fds)
-			free(thread_ctxs[i].fds);
-	}
-	
-
-	/* free libpfm resources cleanly */
-	pfm_terminate();
-	
-	return 0;
+	free_thread_context((thread_pfm_context_t*)ctx);
 }
 
-void read_counts(perf_event_desc_t *fds, int num)
+/*
+ * Take the final reading of a detached thread and fold it into the totals
+ * of its process; then free the context, once no reader can see it. Only
+ * for the thread owning the counts.
+ */
+static void finish_thread_context(thread_pfm_context_t *ctx)
 {
-  uint64_t values[3];
-  int evt, ret;
-
-  for (evt = 0; evt < num; evt++) {
-	  ret = read(fds[evt].fd, values, sizeof(values));
-	  if (ret != sizeof(values)) {
-		  /* unsigned */
-		  if (ret == -1)
-			  warnx("cannot read values event %s", fds[evt].name);
-	  
-		  /* likely pinned and could not be loaded */
-		  warnx("could not read event %d, tried to read %zu bytes, but "
-			"got %d", evt, sizeof(values), ret);
-	  }
+	process_pfm_totals_t * totals;
+	int i;
 
+	if(ctx->inherit)
+		collect_inherited(ctx);
 
-	  /*
-	   * scaling because we may be sharing the PMU and
-	   * thus may be multiplexed
-	   */
-	  fds[evt].prev_values[0] = fds[evt].values[0];
-	  fds[evt].prev_values[1] = fds[evt].values[1];
-	  fds[evt].prev_values[2] = fds[evt].values[2];
-	  fds[evt].values[0] = perf_scale(values);
-	  fds[evt].values[1] = values[1];
-	  fds[evt].values[2] = values[2];
-  }
+	/* the final reading before the counters are gone */
+	if(__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE) || 
+	   __atomic_load_n(&ctx->flush, __ATOMIC_ACQUIRE)){
+		print_thread_counts(ctx);
+		pfm_output_commit();
+	}
+	else{
+		read_thread_counts(ctx);
+		update_thread_counts(ctx);
+	}
 
-  return;
-}
+	/* 
+	 * fold the final counts into the process totals; the tracer may add
+	 * totals meanwhile, and the children of inherited counters are folded
+	 * into the same totals by the thread collecting them
+	 */
+	pfm_epoch_enter();
+	totals = pfm_ctx_table_lookup(&process_totals, ctx->tgid);
+	pfm_epoch_exit();
+	if(totals){
+		for(i = 0; i < ctx->num_fds && i < totals->num_fds; i++){
+			uint64_t val = ctx->counts.val[i];
 
-void print_thread_counts(pid_t tid, perf_event_desc_t *fds, int num)
-{
-	int i;
-	
-	read_counts(fds, num);
-	
-	for(i=0; i < num; i++) {
-		double ratio;
-		uint64_t val;
-		
-		val = fds[i].values[0] - fds[i].prev_values[0];
-		
-		ratio = perf_scale_ratio(fds[i].values);
-		
-		/* separate groups */
-		if (perf_is_group_leader(fds, i))
-			putchar('\n');
-      
-		if (fds[i].values[0] < fds[i].prev_values[0]) {
-			reading_output("inconsistent scaling %s (cur=%'"PRIu64" : "
-				       "prev=%'"PRIu64")\n", fds[i].name, fds[i].values[0], 
-				       fds[i].prev_values[0]);
-			continue;
+			/* already added to the totals of their processes */
+			if(ctx->inherit)
+				val -= ctx->inherited[i];
+			__atomic_add_fetch(&totals->values[i], val, 
+					   __ATOMIC_RELAXED);
 		}
-		reading_output("thread [%d]:%'20"PRIu64" %s (%.2f%% scaling, "
-			       "ena=%'"PRIu64", run=%'"PRIu64")\n",
-			       tid,
-			       val,
-			       fds[i].name,
-			       (1.0-ratio)*100.0,
-			       fds[i].values[1],
-			       fds[i].values[2]);
+		__atomic_add_fetch(&totals->num_exited, 1, __ATOMIC_RELAXED);
 	}
 
-	return;
+	/* the entries are zeroed, which only the owner may do */
+	pfm_counts_free(&thread_counts, &ctx->counts);
+	DPRINTF("PMU context closed for thread [%d]\n", ctx->tid);
+	pfm_epoch_retire(ctx, retire_thread_context);
 }
 
-void print_core_counts(int cpu, perf_event_desc_t *fds, int num)
+/*
+ * Finish the threads detached since the last pass, in the order they were
+ * detached
+ */
+static void finish_detached()
 {
-	int i;
+	thread_pfm_context_t *ctx, *next, *list = NULL;
 
-	read_counts(fds, num);
+	ctx = __atomic_exchange_n(&detached, NULL, __ATOMIC_ACQUIRE);
+	for(; ctx; ctx = next){
+		next = ctx->next_detached;
+		ctx->next_detached = list;
+		list = ctx;
+	}
+	for(ctx = list; ctx; ctx = next){
+		next = ctx->next_detached;
+		finish_thread_context(ctx);
+	}
+}
 
-	for(i=0; i < num; i++){
-		double ratio;
-		uint64_t val;
-		
-		val = fds[i].values[0] - fds[i].prev_values[0];
-		
-		ratio = perf_scale_ratio(fds[i].values);
+/*
+ * Detach from a thread, e.g., when it exits
+ * Parameters:
+ * 	tid	--> thread id to detach
+ * Return value:
+ *      0       --> success
+ *      1       --> no thread with matching tid found
+ */
+int pfm_detach_thread(pid_t tid)
+{
+	thread_pfm_context_t * ctx;
+
+	ctx = pfm_ctx_table_remove(&thread_ctxs, tid);
+	if(ctx == NULL)
+		return 1;
+
+	/* the logging thread owns the counts, its next pass finishes it */
+	if(__atomic_load_n(&logging, __ATOMIC_ACQUIRE)){
+		ctx->next_detached = __atomic_load_n(&detached, 
+						     __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&detached, 
+						   &ctx->next_detached, ctx,
+						   1, __ATOMIC_RELEASE, 
+						   __ATOMIC_RELAXED))
+			;
+		return 0;
+	}
+
+	/* a trigger may still be printing its reading */
+	pfm_epoch_synchronize();
+	finish_thread_context(ctx);
+
+	return 0;
+}
+
+void pfm_operations_logging(int enabled)
+{
+	__atomic_store_n(&logging, enabled, __ATOMIC_SEQ_CST);
+	if(enabled)
+		return;
+	/* 
+	 * the threads detached after the last pass; a trigger that found one
+	 * before it was detached may now print its reading
+	 */
+	pfm_epoch_synchronize();
+	finish_detached();
+}
+
+int pfm_thread_attached(pid_t tid)
+{
+	return pfm_ctx_table_lookup(&thread_ctxs, tid) != NULL;
+}
+
+pid_t pfm_thread_tgid(pid_t tid)
+{
+	thread_pfm_context_t * ctx;
+
+	ctx = pfm_ctx_table_lookup(&thread_ctxs, tid);
+	if(ctx == NULL)
+		return tid;
+
+	return ctx->tgid;
+}
+
+/*
+ * Cleanup
+ */
+int pfm_operations_cleanup()
+{
+	int i;
+	thread_pfm_context_t * thr_ctx;
+	core_pfm_context_t * core_ctx;
+	
+	for(i = 0; i < pfm_ctx_table_slots(&thread_ctxs); i++){
+		thr_ctx = pfm_ctx_table_get(&thread_ctxs, i);
+		if(thr_ctx == NULL)
+			continue;
+		free_thread_context(thr_ctx);
+	}
+	pfm_ctx_table_destroy(&thread_ctxs);
+
+	for(i = 0; i < pfm_ctx_table_slots(&core_ctxs); i++){
+		core_ctx = pfm_ctx_table_get(&core_ctxs, i);
+		if(core_ctx == NULL)
+			continue;
+		free_core_context(core_ctx);
+	}
+	pfm_ctx_table_destroy(&core_ctxs);
+
+	for(i = 0; i < pfm_ctx_table_slots(&process_totals); i++){
+		process_pfm_totals_t * totals;
+
+		totals = pfm_ctx_table_get(&process_totals, i);
+		if(totals == NULL)
+			continue;
+		free(totals->values);
+		free(totals);
+	}
+	pfm_ctx_table_destroy(&process_totals);
+	/* the contexts and tables retired by the last readers */
+	pfm_epoch_synchronize();
+	pfm_counts_destroy(&thread_counts);
+	pfm_counts_destroy(&core_counts);
+
+	while(templates){
+		event_template_t *t = templates;
+
+		templates = t->next;
+		perf_free_fds(t->fds, t->num_fds);
+		free(t->evns);
+		free(t);
+	}
+	
+	if(read_passes)
+		DPRINTF("%"PRIu64" read() calls for %"PRIu64" counters in "
+			"%"PRIu64" passes, %.1f syscalls saved per pass\n",
+			read_calls, read_evts + rdpmc_evts, read_passes,
+			(double)(read_evts + rdpmc_evts - read_calls) / 
+			read_passes);
+	if(rdpmc_evts)
+		DPRINTF("%"PRIu64" counters read with rdpmc\n", rdpmc_evts);
+	if(inherit_lost)
+		warnx("%"PRIu64" exited threads lost, their counts are only in"
+		      " the totals of the first thread", inherit_lost);
+	if(attach_threads)
+		DPRINTF("%"PRIu64" threads attached, %.1f us per thread\n", 
+			attach_threads, attach_ns / 1000.0 / attach_threads);
+	if(toggle_calls)
+		DPRINTF("%"PRIu64" ioctl() calls to enable/disable %"PRIu64
+			" counters\n", toggle_calls, toggle_evts);
+
+	if(toggle_pool){
+		pfm_workpool_close(toggle_pool);
+		toggle_pool = NULL;
+	}
+
+	for(i = 0; i < num_shards; i++){
+		sampler_shard_t *sh = &shards[i];
+
+		if(sh->passes == 0)
+			continue;
+		fprintf((FILE*)err_out, "pfm_multi: sampler shard %d: %.1f "
+			"contexts and %.1f us per pass, %.1f us at most\n", i, 
+			(double)sh->ctxs / sh->passes, 
+			sh->ns / 1000.0 / sh->passes, sh->max_ns / 1000.0);
+	}
+	if(sampler_pool){
+		pfm_workpool_close(sampler_pool);
+		sampler_pool = NULL;
+	}
+	free(shards);
+	shards = NULL;
+	num_shards = 0;
+	free(pass_ctxs);
+	pass_ctxs = NULL;
+	pass_size = 0;
+	if(reader_pool){
+		pfm_workpool_close(reader_pool);
+		reader_pool = NULL;
+	}
+	free(reader_ctxs);
+	reader_ctxs = NULL;
+	num_readers = 0;
+	readers_tried = 0;
+
+	/* free libpfm resources cleanly */
+	pfm_terminate();
+	
+	return 0;
+}
+
+/*
+ * Read a whole event group with one read() on its leader. With 
+ * PERF_FORMAT_GROUP|PERF_FORMAT_ID, the kernel returns
+ *   { nr, time_enabled, time_running, { value, id } * nr }
+ * Parameters:
+ *	fds	--> the event list
+ *	row	--> the counts of the event list
+ *	leader	--> index of the group leader
+ *	nevt	--> number of events in this group
+ */
+static void read_group_counts(perf_event_desc_t *fds, pfm_counts_row_t *row,
+			      int leader, int nevt)
+{
+	uint64_t values[3 + 2 * nevt];
+	int i, evt, ret;
+
+	ret = read(fds[leader].fd, values, sizeof(values));
+	__atomic_add_fetch(&read_calls, 1, __ATOMIC_RELAXED);
+	if (ret != sizeof(values)) {
+		if (ret == -1)
+			warn("cannot read values of group %s", 
+			     fds[leader].name);
+		else
+			/* likely pinned and could not be loaded */
+			warnx("could not read group %s, tried to read %zu "
+			      "bytes, but got %d", fds[leader].name, 
+			      sizeof(values), ret);
+		return;
+	}
+	__atomic_add_fetch(&read_evts, values[0], __ATOMIC_RELAXED);
+
+	for (i = 0; i < values[0]; i++) {
+		evt = perf_id2event(fds + leader, nevt, values[4 + 2 * i]);
+		if (evt == -1) {
+			warnx("unknown event id %"PRIu64" in group %s", 
+			      values[4 + 2 * i], fds[leader].name);
+			continue;
+		}
+		pfm_counts_set(row, leader + evt, values[3 + 2 * i], 
+			       values[1], values[2]);
+	}
+
+	return;
+}
+
+/*
+ * Read one event with rdpmc if it is mapped. For per-cpu events, rdpmc only 
+ * returns the right counter on that cpu, so it is only used by a reader 
+ * pinned to the cpu, which cannot migrate in the middle of the read.
+ * Output parameters:
+ *	values	--> raw count, time enabled and time running
+ * Return value:
+ *      0       --> success
+ *      other   --> rdpmc not possible, read() should be used
+ */
+static inline int rdpmc_counts(perf_event_desc_t *fd, int cpu, 
+			       uint64_t *values)
+{
+	if(!fd->buf || cpu == -1 || cpu != reader_cpu)
+		return 1;
+
+	return pfm_rdpmc_read(fd->buf, values);
+}
+
+/*
+ * Read the events of one thread/core context; the counts are scaled by the
+ * next update
+ * Parameters:
+ *	fds	--> the event list
+ *	row	--> the counts of the event list
+ *	num	--> number of events in the list
+ *	grouped	--> whether the events are read as groups
+ *	cpu	--> the cpu of a per-core context, -1 for thread contexts; 
+ *                  used to decide whether rdpmc can be used
+ */
+void read_counts(perf_event_desc_t *fds, pfm_counts_row_t *row, int num, 
+		 int grouped, int cpu)
+{
+  uint64_t values[3];
+  int evt, ret;
+
+  for (evt = 0; evt < num; evt++) {
+	  if (grouped) {
+		  int nevt, i;
+
+		  /* members are read together with their leader */
+		  if (!perf_is_group_leader(fds, evt))
+			  continue;
+		  nevt = perf_get_group_nevents(fds, num, evt);
+
+		  /* 
+		   * use rdpmc only if the whole group can be read with it;
+		   * otherwise, the members would have different timing 
+		   */
+		  if (fds[evt].buf) {
+			  uint64_t gvalues[nevt][3];
+
+			  for (i = 0; i < nevt; i++)
+				  if (rdpmc_counts(&fds[evt + i], cpu, 
+						   gvalues[i]))
+					  break;
+			  if (i == nevt) {
+				  for (i = 0; i < nevt; i++)
+					  pfm_counts_set(row, evt + i, 
+							 gvalues[i][0], 
+							 gvalues[i][1], 
+							 gvalues[i][2]);
+				  __atomic_add_fetch(&rdpmc_evts, nevt, 
+						     __ATOMIC_RELAXED);
+				  continue;
+			  }
+		  }
+
+		  read_group_counts(fds, row, evt, nevt);
+		  continue;
+	  }
+
+	  if (!rdpmc_counts(&fds[evt], cpu, values)) {
+		  pfm_counts_set(row, evt, values[0], values[1], values[2]);
+		  __atomic_add_fetch(&rdpmc_evts, 1, __ATOMIC_RELAXED);
+		  continue;
+	  }
+
+	  ret = read(fds[evt].fd, values, sizeof(values));
+	  __atomic_add_fetch(&read_calls, 1, __ATOMIC_RELAXED);
+	  __atomic_add_fetch(&read_evts, 1, __ATOMIC_RELAXED);
+	  if (ret != sizeof(values)) {
+		  /* unsigned */
+		  if (ret == -1)
+			  warn("cannot read values event %s", fds[evt].name);
+		  else
+			  /* likely pinned and could not be loaded */
+			  warnx("could not read event %s, tried to read %zu "
+				"bytes, but got %d", fds[evt].name, 
+				sizeof(values), ret);
+	  }
+
+	  pfm_counts_set(row, evt, values[0], values[1], values[2]);
+  }
+
+  return;
+}
+
+/*
+ * Read inherited counters, summing their counts on all cpus
+ */
+static void read_inherited_counts(thread_pfm_context_t *ctx)
+{
+	uint64_t values[4]; /* value, time enabled, time running, id */
+	uint64_t sums[3];
+	ssize_t ret;
+	int evt, cpu;
+
+	for(evt = 0; evt < ctx->num_fds; evt++){
+		sums[0] = sums[1] = sums[2] = 0;
+		for(cpu = 0; cpu < ctx->num_cpus; cpu++){
+			if(ctx->cpu_fds[cpu] == NULL)
+				continue;
+			ret = read(ctx->cpu_fds[cpu][evt].fd, values, 
+				   sizeof(values));
+			__atomic_add_fetch(&read_calls, 1, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&read_evts, 1, __ATOMIC_RELAXED);
+			if(ret != sizeof(values)){
+				warnx("could not read event %s on CPU <%d>", 
+				      ctx->fds[evt].name, cpu);
+				continue;
+			}
+			sums[0] += values[0];
+			sums[1] += values[1];
+			sums[2] += values[2];
+		}
+		pfm_counts_set(&ctx->counts, evt, sums[0], sums[1], sums[2]);
+	}
+}
+
+static void read_thread_counts(thread_pfm_context_t *ctx)
+{
+	if(ctx->inherit)
+		read_inherited_counts(ctx);
+	else
+		read_counts(ctx->fds, &ctx->counts, ctx->num_fds, ctx->grouped,
+			    -1);
+}
+
+/*
+ * Scale the counts of a thread read outside a sampling pass
+ */
+static void update_thread_counts(thread_pfm_context_t *ctx)
+{
+	pfm_counts_update_row(&ctx->counts);
+	if(ctx->mux)
+		pfm_mux_extrapolate(ctx->mux, &ctx->counts);
+}
+
+/*
+ * Queue the updated counts of a thread/core for printing
+ */
+static void output_thread_counts(thread_pfm_context_t *ctx)
+{
+	if(ctx->mux)
+		pfm_output_bounded_counts(PFM_OUTPUT_THREAD, ctx->tid, 
+					  &ctx->counts, ctx->mux->bounds);
+	else
+		pfm_output_counts(PFM_OUTPUT_THREAD, ctx->tid, &ctx->counts);
+}
+
+static void output_core_counts(core_pfm_context_t *ctx)
+{
+	if(ctx->mux)
+		pfm_output_bounded_counts(PFM_OUTPUT_CORE, ctx->cpu, 
+					  &ctx->counts, ctx->mux->bounds);
+	else
+		pfm_output_counts(PFM_OUTPUT_CORE, ctx->cpu, &ctx->counts);
+}
+
+/*
+ * Read the counters of a thread/core and queue the readings for printing,
+ * outside a sampling pass
+ */
+void print_thread_counts(thread_pfm_context_t *ctx)
+{
+	read_thread_counts(ctx);
+	update_thread_counts(ctx);
+	output_thread_counts(ctx);
+
+	return;
+}
+
+static void read_core_counts(core_pfm_context_t *ctx)
+{
+	read_counts(ctx->fds, &ctx->counts, ctx->num_fds, ctx->grouped, 
+		    ctx->cpu);
+}
+
+void print_core_counts(core_pfm_context_t *ctx)
+{
+	read_core_counts(ctx);
+	pfm_counts_update_row(&ctx->counts);
+	if(ctx->mux)
+		pfm_mux_extrapolate(ctx->mux, &ctx->counts);
+	output_core_counts(ctx);
+	
+	return;
+}
+
+/*
+ * Report an exited child of inherited counters: print its final counts and
+ * add them to the totals of its process
+ */
+static void report_inherited(thread_pfm_context_t *ctx, inherited_thread_t *t)
+{
+	uint64_t buf[PFM_COUNTS_ARRAYS * ctx->num_fds];
+	pfm_counts_row_t row;
+	process_pfm_totals_t * totals;
+	int i;
+
+	/* the child is reported once, its deltas are its whole counts */
+	memset(buf, 0, sizeof(buf));
+	pfm_counts_local(&row, buf, ctx->num_fds);
+	for(i = 0; i < ctx->num_fds; i++)
+		pfm_counts_set(&row, i, t->values[i * 3], t->values[i * 3 + 1],
+			       t->values[i * 3 + 2]);
+	pfm_counts_update_row(&row);
+	for(i = 0; i < ctx->num_fds; i++)
+		ctx->inherited[i] += row.val[i];
+
+	if(__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE)){
+		pfm_output_context(PFM_OUTPUT_THREAD, t->tid, t->pid);
+		/* the parent's counts already include the child's */
+		pfm_output_counts(PFM_OUTPUT_THREAD | PFM_OUTPUT_IN_PARENT,
+				  t->tid, &row);
+	}
+
+	totals = get_process_totals(t->pid, ctx->num_fds);
+	if(totals == NULL){
+		warnx("cannot allocate the totals of process [%d]", t->pid);
+		return;
+	}
+	/* a thread finishing a context of the process may fold meanwhile */
+	for(i = 0; i < ctx->num_fds && i < totals->num_fds; i++)
+		__atomic_add_fetch(&totals->values[i], row.val[i], 
+				   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&totals->num_threads, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&totals->num_exited, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Save the record of one event of an exited child, report the child when 
+ * the records of all events have been read
+ */
+static void add_inherited(thread_pfm_context_t *ctx, int evt, pid_t pid, 
+			  pid_t tid, uint64_t *values)
+{
+	inherited_thread_t *t;
+
+	t = pfm_ctx_table_lookup(&ctx->exiting, tid);
+	if(t == NULL){
+		t = calloc(1, sizeof(inherited_thread_t) + 
+			   sizeof(uint64_t) * 3 * ctx->num_fds);
+		if(t == NULL)
+			return;
+		t->pid = pid;
+		t->tid = tid;
+		if(pfm_ctx_table_insert(&ctx->exiting, tid, t) < 0){
+			free(t);
+			return;
+		}
+	}
+	/* the counts of a child on every cpu */
+	t->values[evt * 3] += values[0];
+	t->values[evt * 3 + 1] += values[1];
+	t->values[evt * 3 + 2] += values[2];
+
+	if(++t->num_read < ctx->num_fds * ctx->num_rings)
+		return;
+	pfm_ctx_table_remove(&ctx->exiting, tid);
+	report_inherited(ctx, t);
+	free(t);
+}
+
+/*
+ * Read the PERF_RECORD_READ records that the kernel wrote for the exited 
+ * children of a thread with inherited counters. With PERF_FORMAT_ID, a 
+ * record is 
+ *   { header, pid, tid, value, time_enabled, time_running, id }
+ */
+static void collect_inherited(thread_pfm_context_t *ctx)
+{
+	struct perf_event_header ehdr;
+	struct perf_event_mmap_page *hdr;
+	struct {
+		uint32_t pid;
+		uint32_t tid;
+		uint64_t values[3];
+		uint64_t id;
+	} rd;
+	uint64_t lost[2]; /* id, number of lost records */
+	inherit_id_t key, *evt;
+	perf_event_desc_t *fd;
+	uint64_t head;
+	size_t size;
+	int cpu;
+
+	for(cpu = 0; cpu < ctx->num_cpus; cpu++){
+		if(ctx->cpu_fds[cpu] == NULL || ctx->cpu_fds[cpu][0].buf == NULL)
+			continue;
+		fd = &ctx->cpu_fds[cpu][0];
+		hdr = fd->buf;
+
+		head = __atomic_load_n(&hdr->data_head, __ATOMIC_ACQUIRE);
+		while(head - hdr->data_tail >= sizeof(ehdr)){
+			if(perf_read_buffer(fd, &ehdr, sizeof(ehdr)))
+				break;
+			size = ehdr.size - sizeof(ehdr);
+
+			if(ehdr.type == PERF_RECORD_READ && 
+			   size >= sizeof(rd)){
+				perf_read_buffer(fd, &rd, sizeof(rd));
+				size -= sizeof(rd);
+				key.id = rd.id;
+				evt = bsearch(&key, ctx->ids, ctx->num_ids, 
+					      sizeof(inherit_id_t), 
+					      compare_ids);
+				if(evt)
+					add_inherited(ctx, evt->evt, rd.pid,
+						      rd.tid, rd.values);
+			}
+			else if(ehdr.type == PERF_RECORD_LOST && 
+				size >= sizeof(lost)){
+				perf_read_buffer(fd, lost, sizeof(lost));
+				size -= sizeof(lost);
+				inherit_lost += lost[1];
+			}
+			perf_skip_buffer(fd, size);
+		}
+	}
+}
+
+int pfm_collect_inherited(pfm_operations_options_t * options)
+{
+	int i;
+	thread_pfm_context_t * ctx;
+
+	pfm_epoch_enter();
+	for(i = 0; i < pfm_ctx_table_slots(&thread_ctxs); i++){
+		ctx = pfm_ctx_table_get(&thread_ctxs, i);
+		if(ctx && ctx->inherit)
+			collect_inherited(ctx);
+	}
+	pfm_epoch_exit();
+	pfm_output_commit();
+
+	return 0;
+}
+
+
+/*
+ * Read PMU counters for one thread
+ * Parameters:
+ * 	tid	--> thread id to read
+ *	options	--> options for PMU monitoring
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+int pfm_read_one_thread(pid_t tid, pfm_operations_options_t * options)
+{
+  return 0;
+}
+
+/*
+ * Get the pool of sampler threads, create it on first use, from the thread
+ * running the passes, which is pinned along with the pool
+ * Return value:
+ *      the pool, NULL if the passes are read by the calling thread alone
+ */
+static void *get_sampler_pool(pfm_operations_options_t *options)
+{
+	int samplers = options->samplers;
+
+	if(sampler_pool || sampler_failed)
+		return sampler_pool;
+	if(samplers > PFM_MAX_SAMPLERS)
+		samplers = PFM_MAX_SAMPLERS;
+	/* a single sampler is only pooled to be pinned */
+	if(samplers < 2 && options->sampler_cpus == NULL)
+		return NULL;
+	if(samplers < 1)
+		samplers = 1;
+
+	shards = calloc(samplers, sizeof(sampler_shard_t));
+	if(shards == NULL || pfm_workpool_init(&sampler_pool, samplers)){
+		warnx("cannot create %d sampler threads, reading serially", 
+		      samplers);
+		free(shards);
+		shards = NULL;
+		sampler_pool = NULL;
+		sampler_failed = 1;
+		return NULL;
+	}
+	num_shards = samplers;
+	if(options->sampler_cpus && 
+	   pfm_workpool_pin(sampler_pool, options->sampler_cpus, 
+			    options->num_sampler_cpus))
+		warnx("cannot pin the sampler threads");
+
+	return sampler_pool;
+}
+
+/*
+ * Get room for the contexts of a pass
+ * Return value:
+ *      the array, NULL if out of memory
+ */
+static void **get_pass_ctxs(int num)
+{
+	void **ctxs;
+
+	if(num <= pass_size)
+		return pass_ctxs;
+	ctxs = realloc(pass_ctxs, sizeof(void *) * num);
+	if(ctxs == NULL)
+		return NULL;
+	pass_ctxs = ctxs;
+	pass_size = num;
+
+	return pass_ctxs;
+}
+
+/* the reads of a pass */
+typedef struct __read_job{
+	void **ctxs;
+	int num;
+	void (*read)(void *ctx);
+}read_job_t;
+
+/* 
+ * read a shard, the consecutive contexts of one slice of the pass, on the
+ * sampler thread of the shard
+ */
+static void read_shard_work(int shard, void *arg)
+{
+	read_job_t *job = arg;
+	sampler_shard_t *sh = &shards[shard];
+	int first = (int)((int64_t)job->num * shard / num_shards);
+	int last = (int)((int64_t)job->num * (shard + 1) / num_shards);
+	uint64_t start = pfm_sched_now();
+	uint64_t ns;
+	int i;
+
+	for(i = first; i < last; i++)
+		job->read(job->ctxs[i]);
+
+	/* a shard is only read by its own thread */
+	ns = pfm_sched_now() - start;
+	sh->passes++;
+	sh->ctxs += last - first;
+	sh->ns += ns;
+	if(ns > sh->max_ns)
+		sh->max_ns = ns;
+}
+
+/*
+ * Read the contexts of a pass, split into shards read in parallel by the
+ * sampler threads if there are any, one shard each; returns when all are
+ * read
+ */
+static void read_pass(void **ctxs, int num, void (*read)(void *ctx),
+		      pfm_operations_options_t *options)
+{
+	read_job_t job;
+	int i;
+
+	if(get_sampler_pool(options) == NULL){
+		for(i = 0; i < num; i++)
+			read(ctxs[i]);
+		return;
+	}
+
+	job.ctxs = ctxs;
+	job.num = num;
+	job.read = read;
+	pfm_workpool_run_each(sampler_pool, read_shard_work, &job);
+}
+
+static void read_pass_thread(void *ctx)
+{
+	read_thread_counts((thread_pfm_context_t*)ctx);
+}
+
+static void read_pass_core(void *ctx)
+{
+	read_core_counts((core_pfm_context_t*)ctx);
+}
+
+/*
+ * Read PMU counters for all managed threads
+ * Parameters:
+ *	options	--> options for PMU monitoring
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+int pfm_read_all_threads(pfm_operations_options_t * options)
+{
+
+  int i, slots, num = 0;
+  void **ctxs;
+  thread_pfm_context_t * ctx;
+
+  /* the final readings of the threads detached since the last pass */
+  finish_detached();
+
+  pfm_epoch_enter();
+  slots = pfm_ctx_table_slots(&thread_ctxs);
+  ctxs = get_pass_ctxs(slots);
+  if(ctxs == NULL){
+	  pfm_epoch_exit();
+	  warnx("cannot allocate a reading pass");
+	  return 1;
+  }
+  read_passes++;
+  for(i = 0; i < slots; i++){
+	  ctx = pfm_ctx_table_get(&thread_ctxs, i);
+	  /* children that exited are printed before their parent */
+	  if(ctx && ctx->inherit)
+		  collect_inherited(ctx);
+	  /* a context just disabled by a trigger gets its last reading */
+	  if(ctx && ctx->fds && 
+	     (__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE) ||
+	      (__atomic_load_n(&ctx->flush, __ATOMIC_RELAXED) && 
+	       __atomic_exchange_n(&ctx->flush, 0, __ATOMIC_ACQ_REL))))
+		  ctxs[num++] = ctx;
+  }
+
+  /* every shard reads at the same tick */
+  read_pass(ctxs, num, read_pass_thread, options);
+
+  /* scale the counts of all threads at once */
+  pfm_counts_update(&thread_counts);
+
+  /* queued in table order, whichever shard read them */
+  for(i = 0; i < num; i++){
+	  ctx = ctxs[i];
+	  if(ctx->mux)
+		  pfm_mux_extrapolate(ctx->mux, &ctx->counts);
+	  output_thread_counts(ctx);
+  }
+  pfm_output_end_pass();
+  pfm_epoch_exit();
+
+  return 0;
+}
+
+/*
+ * Print the PMU totals of each process
+ * Parameters:
+ *	options	--> options for PMU monitoring
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+
+int pfm_read_all_processes(pfm_operations_options_t * options)
+{
+	int i, j, evt, num_live;
+	process_pfm_totals_t * totals;
+	thread_pfm_context_t * ctx;
+
+	/* the totals are printed directly, after the queued readings */
+	pfm_output_flush();
+
+	for(i = 0; i < pfm_ctx_table_slots(&process_totals); i++){
+		totals = pfm_ctx_table_get(&process_totals, i);
+		if(totals == NULL)
+			continue;
+
+		uint64_t values[totals->num_fds];
+
+		for(evt = 0; evt < totals->num_fds; evt++)
+			values[evt] = totals->values[evt];
+
+		/* add the last readings of the live threads */
+		num_live = 0;
+		for(j = 0; j < pfm_ctx_table_slots(&thread_ctxs); j++){
+			ctx = pfm_ctx_table_get(&thread_ctxs, j);
+			if(ctx == NULL || ctx->tgid != totals->tgid)
+				continue;
+			for(evt = 0; evt < totals->num_fds && 
+				    evt < ctx->num_fds; evt++){
+				values[evt] += ctx->counts.val[evt];
+				/* already added to the totals of their processes */
+				if(ctx->inherit)
+					values[evt] -= ctx->inherited[evt];
+			}
+			num_live++;
+		}
+
+		pfm_output_totals(totals->tgid, totals->num_threads, 
+				  totals->num_exited, num_live, values, 
+				  totals->num_fds);
+	}
+	pfm_output_commit();
+
+	return 0;
+}
+
+/*
+ * Create the context of a core, with its event list not opened yet
+ * Return value:
+ *      the context, NULL if failed
+ */
+static core_pfm_context_t *new_core_context(int cpu, char *evns, 
+					    pfm_operations_options_t *options)
+{
+	core_pfm_context_t * ctx;
+
+	if(pfm_ctx_table_lookup(&core_ctxs, cpu)){
+		warnx("CPU <%d> is already monitored", cpu);
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof(core_pfm_context_t));
+	if(ctx == NULL)
+		return NULL;
+	ctx->cpu = cpu;
+	ctx->fds = NULL;
+	ctx->num_fds = 0;
+	ctx->grouped = options->grouped;
+	/* a trigger may change it meanwhile, see add_core_context */
+	if(__atomic_load_n(&options->enable_new, __ATOMIC_SEQ_CST))
+		ctx->enabled = 1;
+	else
+		ctx->enabled = 0;
+
+	if(setup_events(evns, &(ctx->fds), &(ctx->num_fds))){
+		free(ctx);
+		return NULL;
+	}
+	if(pfm_counts_alloc(&core_counts, ctx->num_fds, &ctx->counts)){
+		warnx("cannot allocate the counts of CPU <%d>", cpu);
+		free_core_context(ctx);
+		return NULL;
+	}
+	if(options->mux){
+		ctx->mux = pfm_mux_new(ctx->fds, ctx->num_fds);
+		if(ctx->mux == NULL){
+			free_core_context(ctx);
+			return NULL;
+		}
+	}
+
+	return ctx;
+}
+
+/*
+ * Open the events of a core context; only touches the context, so the 
+ * contexts of different cores can be opened in parallel
+ * Return value:
+ *      0       --> success
+ *      other   --> failed, opened events are left for close_fds
+ */
+static int open_core_events(core_pfm_context_t *ctx, 
+			    pfm_operations_options_t *options)
+{
+	int i;
+	int group_fd;
+	int cpu = ctx->cpu;
+	perf_event_desc_t * fds = ctx->fds;
+
+	for(i = 0; i < ctx->num_fds; i++){
+		int is_group_leader;
+      
+		if(options->grouped)
+			is_group_leader = perf_is_group_leader(fds, i);
+		else
+			// if not grouped then every body is its own leader
+			is_group_leader = 1; 
+      
+		if(is_group_leader)
+			group_fd = -1; 
+		else
+			group_fd = fds[fds[i].group_leader].fd;
+      
+		/*
+		 * create PMU context disabled?
+		 */
+		if(ctx->enabled)
+			fds[i].hw.disabled = 0;
+		else
+			fds[i].hw.disabled = 1;
+		/* of the planned groups, only the active one counts */
+		if(ctx->mux && is_group_leader && 
+		   i != ctx->mux->leaders[ctx->mux->active])
+			fds[i].hw.disabled = 1;
+		DPRINTF("CPU <%d> pfm created disabled %d\n", cpu, 
+			fds[i].hw.disabled);
+	  
+		fds[i].hw.read_format = PERF_FORMAT_SCALE;
+		if(options->grouped)
+			fds[i].hw.read_format |= PERF_FORMAT_GROUP | 
+				PERF_FORMAT_ID;
 		
-		/* separate groups */
-		if (perf_is_group_leader(fds, i))
-			putchar('\n');
+		if (options->pinned && is_group_leader)
+			fds[i].hw.pinned = 1;
+		if(options->sample)
+			pfm_sample_setup(&fds[i]);
 		
-		if (fds[i].values[0] < fds[i].prev_values[0]) {
-			reading_output("inconsistent scaling %s (cur=%'"PRIu64" : "
-				       "prev=%'"PRIu64")\n", fds[i].name, fds[i].values[0], 
-				       fds[i].prev_values[0]);
+		fds[i].fd = perf_event_open(&fds[i].hw, -1, cpu, group_fd, 0);
+		if (fds[i].fd == -1) {
+			warn("cannot attach event%d %s to CPU <%d>", i, 
+			     fds[i].name, cpu);
+			return -1;
+		}
+		if(options->grouped && get_event_id(&fds[i]))
+			return -1;
+		if(options->sample)
+			pfm_sample_map(&fds[i], i);
+		/* map the user page for reading the counter with rdpmc */
+		if(options->rdpmc){
+			fds[i].buf = pfm_rdpmc_map(fds[i].fd);
+			if(fds[i].buf == NULL)
+				warn("cannot map event%d %s of CPU <%d>, "
+				     "using read()", i, fds[i].name, cpu);
+		}
+		DPRINTF("PMU context opened for CPU <%d>\n", cpu);
+	}
+	if(options->mem &&
+	   pfm_sample_mem_open(&ctx->mem_fds, &ctx->num_mem_fds, -1, cpu, 
+			       !ctx->enabled, 0))
+		warn("cannot sample the loads of CPU <%d>", cpu);
+
+	return 0;
+}
+
+/*
+ * Add an opened core context to the managed contexts
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+static int add_core_context(core_pfm_context_t *ctx, 
+			    pfm_operations_options_t *options)
+{
+	int enable_new = ctx->enabled;
+
+	if(pfm_ctx_table_insert(&core_ctxs, ctx->cpu, ctx) < 0){
+		warnx("cannot add the PMU context of CPU <%d>", ctx->cpu);
+		return -1;
+	}
+	/* 
+	 * a trigger enabling or disabling all cores meanwhile did not see 
+	 * the context yet; read as for threads
+	 */
+	if(__atomic_fetch_or(&options->enable_new, 0, __ATOMIC_SEQ_CST) != 
+	   enable_new){
+		__atomic_store_n(&ctx->enabled, !enable_new, __ATOMIC_RELEASE);
+		toggle_core_events(ctx, enable_new ? PERF_EVENT_IOC_DISABLE :
+				   PERF_EVENT_IOC_ENABLE);
+	}
+	pfm_output_set_events(ctx->fds, ctx->num_fds);
+	pfm_output_context(PFM_OUTPUT_CORE, ctx->cpu, -1);
+	
+	return 0;
+}
+
+/*
+ * Attach to a core for PMU readings
+ * Parameters:
+ * 	cpu	--> cpu to attach
+ *	evns 	--> list of evns to monitor, comma separated list in a string
+ *	flags	--> Interval flags used by pfm_operations, not confused kernel perf flags
+ *                  See header file for available flags
+ *	options	--> options for PMU monitoring
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+int pfm_attach_core(int cpu, char * evns, int flags, 
+		    pfm_operations_options_t * options)
+{
+	core_pfm_context_t * ctx;
+	
+	ctx = new_core_context(cpu, evns, options);
+	if(ctx == NULL)
+		return -1;
+
+	if(open_core_events(ctx, options) || add_core_context(ctx, options)){
+		free_core_context(ctx);
+		return -1;
+	}
+	
+	return 0;
+}
+
+/* a parallel core attach */
+typedef struct __core_attach_job{
+	core_pfm_context_t **ctxs;
+	int *failed;
+	pfm_operations_options_t *options;
+}core_attach_job_t;
+
+static void core_attach_work(int idx, void *arg)
+{
+	core_attach_job_t *job = arg;
+
+	if(job->ctxs[idx])
+		job->failed[idx] = open_core_events(job->ctxs[idx], 
+						    job->options);
+}
+
+/*
+ * Attach to a list of cores. The event list is parsed once, then the events
+ * of the cores are opened in parallel by a pool of threads. 
+ */
+int pfm_attach_cores(int *cpus, int num, char * evns, int flags, 
+		     pfm_operations_options_t * options, int *num_workers)
+{
+	core_attach_job_t job;
+	void *pool = NULL;
+	int workers;
+	int attached = 0;
+	int i;
+
+	job.ctxs = calloc(num, sizeof(core_pfm_context_t *));
+	job.failed = calloc(num, sizeof(int));
+	job.options = options;
+	if(job.ctxs == NULL || job.failed == NULL){
+		free(job.ctxs);
+		free(job.failed);
+		return 0;
+	}
+
+	/* parsing and copying the event list is done serially */
+	for(i = 0; i < num; i++)
+		job.ctxs[i] = new_core_context(cpus[i], evns, options);
+
+	workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers > num)
+		workers = num;
+	if(workers > MAX_ATTACH_WORKERS)
+		workers = MAX_ATTACH_WORKERS;
+	if(workers < 1)
+		workers = 1;
+	if(pfm_workpool_init(&pool, workers)){
+		warnx("cannot create attaching threads, attaching serially");
+		workers = 1;
+		for(i = 0; i < num; i++)
+			core_attach_work(i, &job);
+	}
+	else{
+		pfm_workpool_run(pool, num, core_attach_work, &job);
+		pfm_workpool_close(pool);
+	}
+	if(num_workers)
+		*num_workers = workers;
+
+	/* one writer of the context table, and the output is not thread-safe */
+	for(i = 0; i < num; i++){
+		core_pfm_context_t *ctx = job.ctxs[i];
+
+		if(ctx == NULL)
+			continue;
+		if(job.failed[i] || add_core_context(ctx, options)){
+			free_core_context(ctx);
 			continue;
 		}
-		reading_output("CPU <%d>:%'20"PRIu64" %s (%.2f%% scaling, "
-			       "ena=%'"PRIu64", run=%'"PRIu64")\n",
-			       cpu,
-			       val,
-			       fds[i].name,
-			       (1.0-ratio)*100.0,
-			       fds[i].values[1],
-			       fds[i].values[2]);
+		attached++;
+	}
+
+	free(job.ctxs);
+	free(job.failed);
+
+	return attached;
+}
+
+/*
+ * Get the pool of rdpmc readers, create it on first use with a reader for 
+ * every core context whose counters are mapped; inside an epoch section
+ * Return value:
+ *      the pool, NULL if the cores are read with read()
+ */
+static void *get_reader_pool(pfm_operations_options_t *options)
+{
+	core_pfm_context_t *ctx;
+	int i, slots, num = 1;
+
+	if(readers_tried || !options->rdpmc)
+		return reader_pool;
+	readers_tried = 1;
+
+	slots = pfm_ctx_table_slots(&core_ctxs);
+	for(i = 0; i < slots; i++){
+		ctx = pfm_ctx_table_get(&core_ctxs, i);
+		if(ctx && ctx->num_fds && ctx->fds[0].buf)
+			num++;
+	}
+	if(num == 1)
+		return NULL;
+
+	reader_ctxs = calloc(num, sizeof(core_pfm_context_t *));
+	if(reader_ctxs == NULL || pfm_workpool_init(&reader_pool, num)){
+		warnx("cannot create %d rdpmc readers, using read()", num - 1);
+		free(reader_ctxs);
+		reader_ctxs = NULL;
+		reader_pool = NULL;
+		return NULL;
+	}
+	num_readers = num;
+
+	num = 1;
+	for(i = 0; i < slots; i++){
+		ctx = pfm_ctx_table_get(&core_ctxs, i);
+		if(ctx && ctx->num_fds && ctx->fds[0].buf)
+			ctx->reader = num++;
+	}
+
+	return reader_pool;
+}
+
+/*
+ * Read the cores of a pass: a reader pins itself to its core on its first 
+ * pass, and reads it with rdpmc from then on; if it cannot be pinned, it 
+ * reads with read(). The thread running the pass reads the other cores.
+ */
+static void read_core_work(int idx, void *arg)
+{
+	read_job_t *job = arg;
+	core_pfm_context_t *ctx;
+	cpu_set_t set;
+	int i;
+
+	if(idx == 0){
+		for(i = 0; i < job->num; i++){
+			ctx = job->ctxs[i];
+			if(ctx->reader == 0)
+				read_core_counts(ctx);
+		}
+		return;
 	}
-	
-	return;
+
+	ctx = reader_ctxs[idx];
+	if(ctx == NULL)
+		return;
+	if(reader_cpu != ctx->cpu){
+		CPU_ZERO(&set);
+		CPU_SET(ctx->cpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			warnx("cannot pin the rdpmc reader of CPU <%d>, "
+			      "using read()", ctx->cpu);
+		else
+			reader_cpu = ctx->cpu;
+	}
+	read_core_counts(ctx);
+}
+
+int pfm_read_all_cores(pfm_operations_options_t * options)
+{
+
+  int i, slots, num = 0;
+  void **ctxs;
+  core_pfm_context_t * ctx;
+
+  pfm_epoch_enter();
+  slots = pfm_ctx_table_slots(&core_ctxs);
+  ctxs = get_pass_ctxs(slots);
+  if(ctxs == NULL)
+    {
+      pfm_epoch_exit();
+      warnx("cannot allocate a reading pass");
+      return 1;
+    }
+  read_passes++;
+  for(i = 0; i < slots; i++)
+    {
+      ctx = pfm_ctx_table_get(&core_ctxs, i);
+      /* as pfm_read_all_threads */
+      if(ctx && ctx->fds && 
+	 (__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE) ||
+	  (__atomic_load_n(&ctx->flush, __ATOMIC_RELAXED) && 
+	   __atomic_exchange_n(&ctx->flush, 0, __ATOMIC_ACQ_REL))))
+	{
+	  ctxs[num++] = ctx;
+	}
+    }
+
+  /* every shard reads at the same tick */
+  if(get_reader_pool(options))
+    {
+      read_job_t job;
+
+      for(i = 1; i < num_readers; i++)
+	reader_ctxs[i] = NULL;
+      for(i = 0; i < num; i++)
+	{
+	  ctx = ctxs[i];
+	  if(ctx->reader)
+	    reader_ctxs[ctx->reader] = ctx;
+	}
+      job.ctxs = ctxs;
+      job.num = num;
+      job.read = read_pass_core;
+      pfm_workpool_run_each(reader_pool, read_core_work, &job);
+    }
+  else
+    read_pass(ctxs, num, read_pass_core, options);
+
+  /* scale the counts of all cores at once */
+  pfm_counts_update(&core_counts);
+
+  for(i = 0; i < num; i++)
+    {
+      ctx = ctxs[i];
+      if(ctx->mux)
+	pfm_mux_extrapolate(ctx->mux, &ctx->counts);
+      output_core_counts(ctx);
+    }
+  pfm_output_end_pass();
+  pfm_epoch_exit();
+
+  return 0;
 }
 
 
 /*
- * Read PMU counters for one thread
+ * Apply an enable/disable ioctl to the events of a context; with grouped 
+ * events, one ioctl on each group leader toggles the whole group at once
  * Parameters:
- * 	tid	--> thread id to read
- *	options	--> options for PMU monitoring
+ *	kind	--> "thread" or "cpu", for the error messages
+ *	id	--> tid or cpu id, for the error messages
  * Return value:
  *      0       --> success
- *      other   --> failed
+ *      1       --> some ioctl failed
  */
-int pfm_read_one_thread(pid_t tid, pfm_operations_options_t * options)
+static int ioctl_events(perf_event_desc_t *fds, int num, int grouped, 
+			long request, const char *kind, int id)
 {
-  return 0;
+	int evt;
+	int ret_val;
+	int error = 0;
+	int calls = 0;
+
+	for (evt = 0; evt < num; evt++){
+		if(grouped && !perf_is_group_leader(fds, evt))
+			continue;
+		ret_val = ioctl(fds[evt].fd, request, 
+				grouped ? PERF_IOC_FLAG_GROUP : 0);
+		calls++;
+		if(ret_val == -1){
+			DPRINTF("Error when enable/disable event %s for "
+				"%s %d: %s\n", 
+				fds[evt].name, kind, id, 
+				strerror(errno));
+			error = 1;
+		}
+	}
+	__atomic_add_fetch(&toggle_calls, calls, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&toggle_evts, num, __ATOMIC_RELAXED);
+
+	return error;
 }
 
 /*
- * Read PMU counters for all managed threads
- * Parameters:
- *	options	--> options for PMU monitoring
+ * Apply an enable/disable ioctl to the active group of planned groups; the
+ * other groups wait for their turn
  * Return value:
  *      0       --> success
- *      other   --> failed
+ *      1       --> the ioctl failed
  */
-int pfm_read_all_threads(pfm_operations_options_t * options)
+static int ioctl_group(perf_event_desc_t *fds, pfm_mux_t *mux, long request,
+		       const char *kind, int id)
 {
+	/* the logging thread may be rotating it */
+	int active = __atomic_load_n(&mux->active, __ATOMIC_ACQUIRE);
+	int leader = mux->leaders[active];
 
-  int i;
-  
-  for(i = 0; i < thr_ctx_idx; i++)
-	  if(thread_ctxs[i].fds && thread_ctxs[i].enabled)
-		  print_thread_counts(thread_ctxs[i].tid, thread_ctxs[i].fds, 
-				      thread_ctxs[i].num_fds);
-	
+	__atomic_add_fetch(&toggle_calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&toggle_evts, mux->sizes[active], 
+			   __ATOMIC_RELAXED);
+	if(ioctl(fds[leader].fd, request, PERF_IOC_FLAG_GROUP) == -1){
+		DPRINTF("Error when enable/disable group %s for %s %d: %s\n",
+			fds[leader].name, kind, id, strerror(errno));
+		return 1;
+	}
 
-  return 0;
+	return 0;
 }
 
 /*
- * Attach to a core for PMU readings
- * Parameters:
- * 	cpu	--> cpu to attach
- *	evns 	--> list of evns to monitor, comma separated list in a string
- *	flags	--> Interval flags used by pfm_operations, not confused kernel perf flags
- *                  See header file for available flags
- *	options	--> options for PMU monitoring
+ * Move planned groups to their next slice: stop the active group, take the
+ * counts of its slice, and start the next group
  * Return value:
  *      0       --> success
- *      other   --> failed
+ *      1       --> failed, the active group is left running
  */
-int pfm_attach_core(int cpu, char * evns, int flags, 
-		    pfm_operations_options_t * options)
+static int rotate_events(perf_event_desc_t *fds, pfm_mux_t *mux, 
+			 const char *kind, int id)
+{
+	int leader = mux->leaders[mux->active];
+	int nevt = mux->sizes[mux->active];
+	uint64_t values[3 + 2 * nevt];
+	uint64_t counts[nevt];
+	int i, evt;
+
+	if(ioctl_group(fds, mux, PERF_EVENT_IOC_DISABLE, kind, id))
+		return 1;
+
+	/* the group is stopped, so the slice ends with these counts */
+	__atomic_add_fetch(&read_calls, 1, __ATOMIC_RELAXED);
+	if(read(fds[leader].fd, values, sizeof(values)) != sizeof(values)){
+		warnx("could not read group %s of %s %d", fds[leader].name, 
+		      kind, id);
+		ioctl_group(fds, mux, PERF_EVENT_IOC_ENABLE, kind, id);
+		return 1;
+	}
+	__atomic_add_fetch(&read_evts, values[0], __ATOMIC_RELAXED);
+	memcpy(counts, mux->slice_counts + leader, sizeof(counts));
+	for(i = 0; i < values[0]; i++){
+		evt = perf_id2event(fds + leader, nevt, values[4 + 2 * i]);
+		if(evt != -1)
+			counts[evt] = values[3 + 2 * i];
+	}
+	pfm_mux_end_slice(mux, counts, values[1]);
+
+	return ioctl_group(fds, mux, PERF_EVENT_IOC_ENABLE, kind, id);
+}
+
+int pfm_rotate_all_threads(pfm_operations_options_t * options)
 {
-	int ret;
 	int i;
-	int group_fd;
-	perf_event_desc_t * fds;
-	
-	core_ctxs[core_ctx_idx].cpu = cpu;
-	core_ctxs[core_ctx_idx].fds = NULL;
-	core_ctxs[core_ctx_idx].num_fds = 0;
-	if(options->enable_new)
-		core_ctxs[core_ctx_idx].enabled = 1;
-	else
-		core_ctxs[core_ctx_idx].enabled = 0;
+	int error = 0;
+	thread_pfm_context_t * ctx;
 
-	ret = perf_setup_list_events(evns, &(core_ctxs[core_ctx_idx].fds), 
-				     &(core_ctxs[core_ctx_idx].num_fds));
-	if(ret || !(core_ctxs[core_ctx_idx].num_fds))
-		return -1;
+	pfm_epoch_enter();
+	for(i = 0; i < pfm_ctx_table_slots(&thread_ctxs); i++){
+		ctx = pfm_ctx_table_get(&thread_ctxs, i);
+		if(ctx == NULL || ctx->mux == NULL || 
+		   !__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE))
+			continue;
+		if(rotate_events(ctx->fds, ctx->mux, "thread", ctx->tid))
+			error = 1;
+		/* a trigger may have stopped the group before the switch */
+		if(!__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE))
+			ioctl_group(ctx->fds, ctx->mux, PERF_EVENT_IOC_DISABLE,
+				    "thread", ctx->tid);
+	}
+	pfm_epoch_exit();
 
-	fds = core_ctxs[core_ctx_idx].fds;
+	return error;
+}
 
-	for(i = 0; i < core_ctxs[core_ctx_idx].num_fds; i++){
-		int is_group_leader;
-      
-		if(options->grouped)
-			is_group_leader = perf_is_group_leader(fds, i);
-		else
-			// if not grouped then every body is its own leader
-			is_group_leader = 1; 
-      
-		if(is_group_leader)
-			group_fd = -1; 
-		else
-			group_fd = fds[fds[i].group_leader].fd;
-      
-		/*
-		 * create PMU context disabled?
-		 */
-		if(options->enable_new)
-			fds[i].hw.disabled = 0;
-		else
-			fds[i].hw.disabled = 1;
-		DPRINTF("CPU <%d> pfm created disabled %d\n", cpu, 
-			fds[i].hw.disabled);
-	  
-		fds[i].hw.read_format = PERF_FORMAT_SCALE;
-		
-		if (options->pinned && is_group_leader)
-			fds[i].hw.pinned = 1;
-		
-		fds[i].fd = perf_event_open(&fds[i].hw, -1, cpu, group_fd, 0);
-		if (fds[i].fd == -1) {
-			warn("cannot attach event%d %s to CPU <%d>", i, 
-			     fds[i].name, cpu);
-			goto error;
-		}
-		DPRINTF("PMU context opened for CPU <%d>\n", cpu);
+int pfm_rotate_all_cores(pfm_operations_options_t * options)
+{
+	int i;
+	int error = 0;
+	core_pfm_context_t * ctx;
+
+	pfm_epoch_enter();
+	for(i = 0; i < pfm_ctx_table_slots(&core_ctxs); i++){
+		ctx = pfm_ctx_table_get(&core_ctxs, i);
+		if(ctx == NULL || ctx->mux == NULL || 
+		   !__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE))
+			continue;
+		if(rotate_events(ctx->fds, ctx->mux, "cpu", ctx->cpu))
+			error = 1;
+		/* a trigger may have stopped the group before the switch */
+		if(!__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE))
+			ioctl_group(ctx->fds, ctx->mux, PERF_EVENT_IOC_DISABLE,
+				    "cpu", ctx->cpu);
 	}
-	
-	core_ctx_idx++;
-	
-	return 0;
-	
- error:
-	free(fds);
-	
-	return -1;
+	pfm_epoch_exit();
+
+	return error;
 }
 
-int pfm_read_all_cores(pfm_operations_options_t * options)
+/*
+ * Toggle the events of a thread
+ * Return value:
+ *      0       --> success
+ *      1       --> some ioctl failed
+ */
+static int toggle_thread_events(thread_pfm_context_t *ctx, long request)
 {
+	int cpu;
+	int error = 0;
 
-  int i;
-  
-  for(i = 0; i < core_ctx_idx; i++)
-    {
-      if(core_ctxs[i].fds && core_ctxs[i].enabled)
-	{
-	  print_core_counts(core_ctxs[i].cpu, core_ctxs[i].fds, 
-			    core_ctxs[i].num_fds);
+	/* 
+	 * inherited counters may be grouped when opened, but toggle them one
+	 * by one as they are read one by one
+	 */
+	if(ctx->inherit){
+		for(cpu = 0; cpu < ctx->num_cpus; cpu++)
+			if(ctx->cpu_fds[cpu] && 
+			   ioctl_events(ctx->cpu_fds[cpu], ctx->num_fds, 0,
+					request, "thread", ctx->tid))
+				error = 1;
 	}
-    }
+	else if(ctx->mux)
+		error = ioctl_group(ctx->fds, ctx->mux, request, "thread", 
+				    ctx->tid);
+	else
+		error = ioctl_events(ctx->fds, ctx->num_fds, ctx->grouped, 
+				     request, "thread", ctx->tid);
+	if(ctx->mem_fds && 
+	   ioctl_events(ctx->mem_fds, ctx->num_mem_fds, 1, request, "thread",
+			ctx->tid))
+		error = 1;
 
-  return 0;
+	return error;
+}
+
+/*
+ * Get the pool toggling many contexts in parallel, create it on first use;
+ * the pool is kept for the next toggles
+ * Return value:
+ *      the pool, NULL if it cannot be created
+ */
+static void *get_toggle_pool()
+{
+	int workers;
+
+	if(toggle_pool)
+		return toggle_pool;
+
+	workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(workers > MAX_TOGGLE_WORKERS)
+		workers = MAX_TOGGLE_WORKERS;
+	if(workers < 2)
+		return NULL;
+	if(pfm_workpool_init(&toggle_pool, workers)){
+		toggle_pool = NULL;
+		return NULL;
+	}
+
+	return toggle_pool;
 }
 
+/* a parallel enable/disable of many contexts */
+typedef struct __toggle_job{
+	void **ctxs;
+	long request;
+	int error;
+}toggle_job_t;
 
-static int _pfm_enable_mon_one_thread(int tidx, int enabled)
+static void thread_toggle_work(int idx, void *arg)
+{
+	toggle_job_t *job = arg;
+
+	if(toggle_thread_events(job->ctxs[idx], job->request))
+		__atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+}
+
+static int toggle_core_events(core_pfm_context_t *ctx, long request)
+{
+	int error;
+
+	if(ctx->mux)
+		error = ioctl_group(ctx->fds, ctx->mux, request, "cpu", 
+				    ctx->cpu);
+	else
+		error = ioctl_events(ctx->fds, ctx->num_fds, ctx->grouped, 
+				     request, "cpu", ctx->cpu);
+	if(ctx->mem_fds && 
+	   ioctl_events(ctx->mem_fds, ctx->num_mem_fds, 1, request, "cpu",
+			ctx->cpu))
+		error = 1;
+
+	return error;
+}
+
+static void core_toggle_work(int idx, void *arg)
+{
+	toggle_job_t *job = arg;
+
+	if(toggle_core_events(job->ctxs[idx], job->request))
+		__atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Run a toggle job over its contexts, in parallel if there are many
+ * Return value:
+ *      0       --> success
+ *      1       --> some ioctl failed
+ */
+static int run_toggle_job(toggle_job_t *job, int num, pfm_workpool_fn fn)
+{
+	void *pool = NULL;
+	int i;
+
+	if(num >= MIN_PARALLEL_TOGGLES)
+		pool = get_toggle_pool();
+
+	if(pool)
+		pfm_workpool_run(pool, num, fn, job);
+	else
+		for(i = 0; i < num; i++)
+			fn(i, job);
+
+	return job->error;
+}
+
+static int _pfm_enable_mon_one_thread(thread_pfm_context_t *ctx, int enabled)
 {
-	int evt;
 	long request;
-	int tid = thread_ctxs[tidx].tid;
+	int tid = ctx->tid;
 	int ret_val;
-	int error = 0;
+	int deferred = __atomic_load_n(&logging, __ATOMIC_ACQUIRE);
 
 	if(enabled)
 		request = PERF_EVENT_IOC_ENABLE;
 	else
 		request = PERF_EVENT_IOC_DISABLE;
 
-	thread_ctxs[tidx].enabled = enabled;
-	if(!thread_ctxs[tidx].fds){
+	__atomic_store_n(&ctx->enabled, enabled, __ATOMIC_RELEASE);
+	if(!ctx->fds){
 		// strange no event assoicated with this thread
 		DPRINTF("No events for thread %d when trying to enable its "
 			"events\n", tid);
@@ -447,115 +2450,178 @@ static int _pfm_enable_mon_one_thread(int tidx, int enabled)
 	}
 	
 	// print out current reading if monitoring is to be disabled
-	if(!enabled)
-		print_thread_counts(tid, thread_ctxs[tidx].fds, 
-				    thread_ctxs[tidx].num_fds);
+	if(!enabled && !deferred){
+		print_thread_counts(ctx);
+		pfm_output_commit();
+	}
 	// disable the counters
 	DPRINTF("Enabling thread %d to %d\n", tid, enabled);
-	for (evt = 0; evt < thread_ctxs[tidx].num_fds; evt++){
-		ret_val = ioctl(thread_ctxs[tidx].fds[evt].fd, request);
-		if(ret_val == -1){
-			DPRINTF("Error when enable/disable event %s for "
-				"thread %d: %s\n", 
-				thread_ctxs[tidx].fds[evt].name, tid, 
-				strerror(errno));
-			error = 1;
-		}
-	}
 
-	return error;
+	ret_val = toggle_thread_events(ctx, request);
+	/* stopped, so the next pass reads the counts of now */
+	if(!enabled && deferred)
+		__atomic_store_n(&ctx->flush, 1, __ATOMIC_RELEASE);
+
+	return ret_val;
 }
 
 // options is pfm_operations_options_t type, kept for future extension
 int pfm_enable_mon_thread(void *pfm_op_options, pid_t tid, int enabled)
 {
-	int i, ret_val;
-	
-	for(i = 0; i < thr_ctx_idx; i++)
-		if(thread_ctxs[i].tid == tid){
-			ret_val = _pfm_enable_mon_one_thread(i, enabled);
-			if(ret_val)
-				return 2;
-			else 
-				return 0;
-		}
-	       
+	int ret_val;
+	thread_pfm_context_t * ctx;
 	
-	return 1;
+	pfm_epoch_enter();
+	ctx = pfm_ctx_table_lookup(&thread_ctxs, tid);
+	if(ctx == NULL){
+		pfm_epoch_exit();
+		return 1;
+	}
+
+	ret_val = _pfm_enable_mon_one_thread(ctx, enabled);
+	pfm_epoch_exit();
+	if(ret_val)
+		return 2;
+	else 
+		return 0;
 }
 
 int pfm_enable_mon_all_threads(void *pfm_op_options, int enabled)
 {
-	int i, ret_val;
+	int i, slots, num = 0;
 	int error = 0;
+	thread_pfm_context_t * ctx;
+	toggle_job_t job;
+	int deferred = __atomic_load_n(&logging, __ATOMIC_ACQUIRE);
 	
-	for(i = 0; i < thr_ctx_idx; i++){
-		ret_val = _pfm_enable_mon_one_thread(i, enabled);
-		if(ret_val)
+	pfm_epoch_enter();
+	slots = pfm_ctx_table_slots(&thread_ctxs);
+	job.ctxs = malloc(sizeof(void *) * slots);
+	if(job.ctxs == NULL){
+		pfm_epoch_exit();
+		return 1;
+	}
+	job.request = enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE;
+	job.error = 0;
+
+	/* 
+	 * the readings are printed serially, as the output of a thread is 
+	 * not shared; only the ioctls are done in parallel
+	 */
+	for(i = 0; i < slots; i++){
+		ctx = pfm_ctx_table_get(&thread_ctxs, i);
+		if(ctx == NULL)
+			continue;
+		__atomic_store_n(&ctx->enabled, enabled, __ATOMIC_RELEASE);
+		if(!ctx->fds){
 			error = 1;
+			continue;
+		}
+		if(!enabled && !deferred)
+			print_thread_counts(ctx);
+		job.ctxs[num++] = ctx;
 	}
+	if(!enabled && !deferred)
+		pfm_output_commit();
+	DPRINTF("Enabling %d threads to %d\n", num, enabled);
+
+	if(run_toggle_job(&job, num, thread_toggle_work))
+		error = 1;
+	/* stopped, so the next pass reads the counts of now */
+	for(i = 0; !enabled && deferred && i < num; i++)
+		__atomic_store_n(&((thread_pfm_context_t*)job.ctxs[i])->flush,
+				 1, __ATOMIC_RELEASE);
+	pfm_epoch_exit();
+	free(job.ctxs);
 	
 	return error;
 }
 
-static int _pfm_enable_mon_one_core(int cidx, int enabled)
+static int _pfm_enable_mon_one_core(core_pfm_context_t *ctx, int enabled)
 {
-	int evt;
 	long request;
 	int ret_val;
-	int error = 0;
+	int deferred = __atomic_load_n(&logging, __ATOMIC_ACQUIRE);
 
 	if(enabled)
 		request = PERF_EVENT_IOC_ENABLE;
 	else
 		request = PERF_EVENT_IOC_DISABLE;
 
-	core_ctxs[cidx].enabled = enabled;
+	__atomic_store_n(&ctx->enabled, enabled, __ATOMIC_RELEASE);
 	// print out current reading if monitoring is to be disabled
-	if(!enabled)
-		print_core_counts(core_ctxs[cidx].cpu, core_ctxs[cidx].fds, 
-				  core_ctxs[cidx].num_fds);
-	for (evt = 0; evt < core_ctxs[cidx].num_fds; evt++){
-		ret_val = ioctl(core_ctxs[cidx].fds[evt].fd, request);
-		if(ret_val == -1){
-			DPRINTF("Error when enable/disable event %s for cpu "
-				"%d: %s", core_ctxs[cidx].fds[evt].name,
-				core_ctxs[cidx].cpu, strerror(errno));
-			error = 1;
-		}
+	if(!enabled && !deferred){
+		print_core_counts(ctx);
+		pfm_output_commit();
 	}
 
-	return error;
+	ret_val = toggle_core_events(ctx, request);
+	/* stopped, so the next pass reads the counts of now */
+	if(!enabled && deferred)
+		__atomic_store_n(&ctx->flush, 1, __ATOMIC_RELEASE);
+
+	return ret_val;
 }
 
 // options is pfm_operations_options_t type, kept for future extension
 int pfm_enable_mon_core(void *pfm_op_options, int cpu, int enabled)
 {
-	int i, ret_val;
-	
-	for(i = 0; i < core_ctx_idx; i++)
-		if(core_ctxs[i].cpu == cpu){
-			ret_val = _pfm_enable_mon_one_core(i, enabled);
-			if(ret_val)
-				return 2;
-			else 
-				return 0;
-		}
-	
+	int ret_val;
+	core_pfm_context_t * ctx;
 	
-	return 1;
+	pfm_epoch_enter();
+	ctx = pfm_ctx_table_lookup(&core_ctxs, cpu);
+	if(ctx == NULL){
+		pfm_epoch_exit();
+		return 1;
+	}
+
+	ret_val = _pfm_enable_mon_one_core(ctx, enabled);
+	pfm_epoch_exit();
+	if(ret_val)
+		return 2;
+	else 
+		return 0;
 }
 
 int pfm_enable_mon_all_cores(void *pfm_op_options, int enabled)
 {
-	int i, ret_val;
+	int i, slots, num = 0;
 	int error = 0;
+	core_pfm_context_t * ctx;
+	toggle_job_t job;
+	int deferred = __atomic_load_n(&logging, __ATOMIC_ACQUIRE);
 	
-	for(i = 0; i < core_ctx_idx; i++){
-		ret_val = _pfm_enable_mon_one_core(i, enabled);
-		if(ret_val)
-			error = 1;
+	pfm_epoch_enter();
+	slots = pfm_ctx_table_slots(&core_ctxs);
+	job.ctxs = malloc(sizeof(void *) * slots);
+	if(job.ctxs == NULL){
+		pfm_epoch_exit();
+		return 1;
 	}
+	job.request = enabled ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE;
+	job.error = 0;
+
+	for(i = 0; i < slots; i++){
+		ctx = pfm_ctx_table_get(&core_ctxs, i);
+		if(ctx == NULL)
+			continue;
+		__atomic_store_n(&ctx->enabled, enabled, __ATOMIC_RELEASE);
+		if(!enabled && !deferred)
+			print_core_counts(ctx);
+		job.ctxs[num++] = ctx;
+	}
+	if(!enabled && !deferred)
+		pfm_output_commit();
+
+	if(run_toggle_job(&job, num, core_toggle_work))
+		error = 1;
+	/* stopped, so the next pass reads the counts of now */
+	for(i = 0; !enabled && deferred && i < num; i++)
+		__atomic_store_n(&((core_pfm_context_t*)job.ctxs[i])->flush,
+				 1, __ATOMIC_RELEASE);
+	pfm_epoch_exit();
+	free(job.ctxs);
 	
 	return error;
 }
@@ -4,6 +4,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#define PFM_MAX_SAMPLERS 64 /* the most sampler threads of a reading pass */
+
 /*
  * Options for PMU reading
  */
@@ -12,6 +14,21 @@ typedef struct __pfm_operations_options{
 	int pinned; /* whether the events should be pinned to the CPU */
 	int enable_new; /* whether enable monitoring on newly-created 
 			   threads/cpus */
+	int rdpmc; /* whether per-core counters are read in userspace with 
+		      rdpmc when possible */
+	int inherit; /* whether new threads are counted by the counters they 
+			inherit, instead of being attached one by one */
+	int mux; /* whether the groups planned by pfm_plan_events are counted 
+		    one at a time and rotated by pfm_rotate_all_* */
+	int sample; /* whether the events also sample into rings drained by 
+		       pfm_sample, see pfm_sample_init */
+	int mem; /* whether the load latency event samples every thread or 
+		    cpu too, see pfm_sample_mem_init */
+	int samplers; /* number of threads sharing the reads of a reading 
+			 pass, 1 or less for the calling thread alone */
+	int *sampler_cpus; /* cpus the samplers are pinned to, NULL if not 
+			      pinned */
+	int num_sampler_cpus;
 }pfm_operations_options_t;
 
 /*
@@ -25,12 +42,69 @@ typedef struct __pfm_operations_options{
  */
 int pfm_operations_init();
 
+/*
+ * Parse an event list ahead of time; contexts attached later with the same
+ * list only copy the parsed events, which keeps new threads stopped for a 
+ * shorter time
+ * Parameters:
+ *	evns 	--> list of evns to monitor, comma separated list in a string
+ * Return value:
+ *      0       --> success
+ *      other   --> failed, e.g., unknown events
+ */
+int pfm_prepare_events(char *evns);
+
+/*
+ * Get the names of the events in an event list
+ * Parameters:
+ *	evns 	--> list of evns, comma separated list in a string
+ *	max	--> size of names, can be 0 to only count the events
+ * Output parameters:
+ *	names	--> the name of each event, valid until pfm_operations_cleanup
+ * Return value:
+ *      number of events in the list, -1 if the list cannot be parsed
+ */
+int pfm_event_names(char *evns, const char **names, int max);
+
+struct perf_event_attr;
+
+/*
+ * Get the encoded events of an event list, e.g., for monitored threads to 
+ * open the same events on themselves
+ * Parameters:
+ *	evns 	--> list of evns, comma separated list in a string
+ *	max	--> size of attrs and names
+ * Output parameters:
+ *	attrs	--> the perf_event_attr of each event
+ *	names	--> the name of each event, valid until pfm_operations_cleanup
+ * Return value:
+ *      number of events returned, -1 if the list cannot be parsed
+ */
+int pfm_event_attrs(char *evns, struct perf_event_attr *attrs, 
+		    const char **names, int max);
+
+/*
+ * Split an event list into groups that fit the PMU together, by probing the
+ * PMU with the events; contexts attached later with the same list open the
+ * events in these groups
+ * Parameters:
+ *	evns 	--> list of evns, comma separated list in a string
+ *	cpu	--> the cpu to probe for per-core monitoring, -1 to probe the
+ *                  calling thread for per-thread monitoring
+ * Output parameters:
+ *	max_size	--> the most events counted at once
+ * Return value:
+ *      number of groups, -1 if the list cannot be parsed or opened
+ */
+int pfm_plan_events(char *evns, int cpu, int *max_size);
+
 #define PFM_OP_ENABLE_ON_EXEC		(1U << 0)
 
 /*
  * Attach to a thread for PMU readings
  * Parameters:
  * 	tid	--> thread id to attach
+ * 	tgid	--> process id of the thread, used for per-process totals
  *	evns 	--> list of evns to monitor, comma separated list in a string
  *	flags	--> Interval flags used by pfm_operations, not confused kernel perf flags
  *                  See following macros for available flags
@@ -39,7 +113,65 @@ int pfm_operations_init();
  *      0       --> success
  *      other   --> failed
  */
-int pfm_attach_thread(pid_t tid, char * evns, int flags, pfm_operations_options_t * options); 
+int pfm_attach_thread(pid_t tid, pid_t tgid, char * evns, int flags, 
+		      pfm_operations_options_t * options); 
+
+/*
+ * Detach from a thread, e.g., when it exits. Its counters are read one last 
+ * time, the final reading is printed if its monitoring is enabled, and the 
+ * counts are added to the totals of its process. Then its counters are 
+ * closed and its context is freed, once no other thread reads it. While 
+ * logging, the reading is taken by the next pass of the logging thread.
+ * Parameters:
+ * 	tid	--> thread id to detach
+ * Return value:
+ *      0       --> success
+ *      1       --> no thread with matching tid found
+ */
+int pfm_detach_thread(pid_t tid);
+
+/*
+ * Tell whether a logging thread runs the reading passes, concurrently with
+ * the attach/detach of threads and the triggers; while it does, the final 
+ * readings of detached threads and the readings of contexts disabled by a
+ * trigger are taken by its next pass, as it owns the counts. Turn it on 
+ * before the logging thread starts, and off once it is joined, which takes
+ * the readings left.
+ * Parameters:
+ *	enabled	--> whether the logging thread runs
+ */
+void pfm_operations_logging(int enabled);
+
+/*
+ * Tell whether a thread is monitored; only for the tracer, which attaches
+ * the threads
+ * Parameters:
+ * 	tid	--> thread id
+ * Return value:
+ *      1       --> the thread is attached
+ *      0       --> it is not
+ */
+int pfm_thread_attached(pid_t tid);
+
+/*
+ * Get the process id of a monitored thread
+ * Parameters:
+ * 	tid	--> thread id
+ * Return value:
+ *      the process id, or tid if the thread is not monitored
+ */
+pid_t pfm_thread_tgid(pid_t tid);
+
+/*
+ * Print the PMU totals of each process, i.e., the counts of its exited 
+ * threads plus the last readings of its live threads
+ * Parameters:
+ *	options	--> options for PMU monitoring
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+int pfm_read_all_processes(pfm_operations_options_t * options);
 
 /*
  * Read PMU counters for one thread
@@ -54,7 +186,12 @@ int pfm_attach_thread(pid_t tid, char * evns, int flags, pfm_operations_options_
 int pfm_read_one_thread(pid_t tid, pfm_operations_options_t * options); 
 
 /*
- * Read PMU counters for all managed threads
+ * Read PMU counters for all managed threads. With options->samplers, the
+ * enabled threads are split into that many shards of consecutive threads, 
+ * read in parallel by a pool of sampler threads created by the first pass,
+ * each shard always by the same thread; the readings are then queued by
+ * the calling thread in the same order as a serial pass, once every shard
+ * is read.
  * Parameters:
  *	options	--> options for PMU monitoring
  * Return value:
@@ -63,6 +200,30 @@ int pfm_read_one_thread(pid_t tid, pfm_operations_options_t * options);
  */
 int pfm_read_all_threads(pfm_operations_options_t * options); 
 
+/*
+ * End the counting slice of the active group of every managed thread, and 
+ * start the next group; only for options->mux
+ * Parameters:
+ *	options	--> options for PMU monitoring
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+int pfm_rotate_all_threads(pfm_operations_options_t * options);
+
+/*
+ * Collect the final counts of the threads that exited under inherited 
+ * counters, and queue them for printing; pfm_read_all_threads also does 
+ * this, call it in between to keep the kernel's record buffers from filling
+ * up
+ * Parameters:
+ *	options	--> options for PMU monitoring
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+int pfm_collect_inherited(pfm_operations_options_t * options);
+
 
 /*
  * Attach to a core for PMU readings
@@ -78,9 +239,26 @@ int pfm_read_all_threads(pfm_operations_options_t * options);
  */
 int pfm_attach_core(int cpu, char * evns, int flags, pfm_operations_options_t * options); 
 
+/*
+ * Attach to a list of cores for PMU readings; the event list is parsed once
+ * and the events of the cores are opened in parallel
+ * Parameters:
+ * 	cpus	--> cpus to attach
+ *	num	--> number of cpus
+ *	evns 	--> list of evns to monitor, comma separated list in a string
+ *	flags	--> Interval flags used by pfm_operations, see pfm_attach_core
+ *	options	--> options for PMU monitoring
+ * Output parameter:
+ *	num_workers	--> number of threads used to attach, can be NULL
+ * Return value:
+ *      number of cores attached
+ */
+int pfm_attach_cores(int *cpus, int num, char * evns, int flags, 
+		     pfm_operations_options_t * options, int *num_workers);
+
 
 /*
- * Read PMU counters for all managed cores
+ * Read PMU counters for all managed cores, sharded as pfm_read_all_threads
  * Parameters:
  *	options	--> options for PMU monitoring
  * Return value:
@@ -89,6 +267,16 @@ int pfm_attach_core(int cpu, char * evns, int flags, pfm_operations_options_t *
  */
 int pfm_read_all_cores(pfm_operations_options_t * options); 
 
+/*
+ * Rotate the planned groups of all managed cores, see pfm_rotate_all_threads
+ * Parameters:
+ *	options	--> options for PMU monitoring
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+int pfm_rotate_all_cores(pfm_operations_options_t * options); 
+
 
 /*
  * Cleanup
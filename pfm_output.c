@@ -0,0 +1,1093 @@
+/*
+ * Output path of pfm_multi: per-producer lock-free rings and a writer thread.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <math.h>
+
+#include "pfm_common.h"
+#include "pfm_output.h"
+#include "pfm_metrics.h"
+#include "pfm_ctx_table.h"
+#include "pfm_topo.h"
+
+#define RING_WORDS (1UL << 18) /* size of each ring, in 64-bit words */
+
+/* record types */
+#define REC_PAD 0 /* skip to the beginning of the ring */
+#define REC_TICK 1
+#define REC_COUNTS 2
+#define REC_CONTEXT 3
+#define REC_TOTALS 4
+#define REC_PASS 5 /* end of a sampling pass */
+#define REC_BANDWIDTH 6
+#define REC_MEMORY 7
+
+/* 
+ * Every record starts with a header word: size in words (low 32 bits), 
+ * record type (bits 32-39) and an argument (bits 40-63). The tick record is 
+ * followed by seq, intended, actual and missed (relative to start); the counts
+ * record has the kind as argument and is followed by the id, the time 
+ * enabled since the last reading, and the arrays of the scaled values, the
+ * deltas, the times enabled and the times running of the events, then the 
+ * bound of each event if the kind has COUNTS_BOUNDED; the context record has the kind as argument
+ * and is followed by the id and tgid; the totals record is followed by tgid, 
+ * the numbers of threads, exited threads and live threads, and the values;
+ * the pass record has nothing else; the bandwidth record is followed by the
+ * socket, the bytes read and written and the time counted; the memory record
+ * has the number of NUMA nodes as argument and is followed by the tid, the 
+ * pid and a pfm_mem_stats_t.
+ */
+#define REC_HDR(type, arg, size) \
+	(((uint64_t)(arg) << 40) | ((uint64_t)(type) << 32) | (size))
+#define REC_SIZE(hdr) ((hdr) & 0xffffffffUL)
+#define REC_TYPE(hdr) (((hdr) >> 32) & 0xff)
+#define REC_ARG(hdr) ((hdr) >> 40)
+#define EVT_WORDS 4 /* val, delta, ena and run */
+/* the arrays of a counts record of num events */
+#define COUNTS_VAL(rec, num) ((rec) + 3)
+#define COUNTS_DELTA(rec, num) ((rec) + 3 + (num))
+#define COUNTS_ENA(rec, num) ((rec) + 3 + 2 * (num))
+#define COUNTS_RUN(rec, num) ((rec) + 3 + 3 * (num))
+#define COUNTS_BOUND(rec, num) ((rec) + 3 + 4 * (num))
+/* 
+ * or'd into the kind of a counts record whose values are followed by the 
+ * bound of each event
+ */
+#define COUNTS_BOUNDED 0x100
+
+/* 
+ * A single-producer single-consumer ring. head is only written by the 
+ * producer, tail only by the writer; both only increase.
+ */
+typedef struct _pfm_output_ring{
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t overflows __attribute__((aligned(64)));
+	uint64_t *buf;
+	struct _pfm_output_ring *next;
+}output_ring;
+
+static output_ring *rings; /* all rings, new rings are added at the head */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread output_ring *my_ring; /* the ring of the calling thread */
+
+/* writer thread */
+static pthread_t writer;
+static int writer_running;
+static int writer_stopping;
+static sem_t writer_wakeup;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drain_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t drain_gen; /* number of completed drain passes */
+
+/* the event list, used for formatting */
+static int num_evts;
+static char **evt_names;
+static int *evt_leaders;
+
+/* derived metrics of each reading, and whether to print only them */
+static void *metrics;
+static int metrics_only;
+static double *metric_deltas; /* scaled delta of each event */
+
+/* 
+ * Rollups: the readings of a sampling pass are summed per process, socket, 
+ * NUMA node and overall by the writer, and printed at the end of the pass
+ */
+typedef struct _rollup{
+	int id; /* tgid, socket or node */
+	int members; /* readings summed in this pass */
+	int kind; /* kind of the readings */
+	uint64_t ns; /* the longest time enabled of the readings */
+	uint64_t *deltas; /* summed delta of each event */
+	double *scaled; /* summed scaled delta of each event, for metrics */
+}rollup_t;
+
+#define ROLLUP_LEVELS 4 /* process, socket, node and all */
+static const char *rollup_labels[ROLLUP_LEVELS] = {"process [%d]:", 
+						   "socket <%d>:", 
+						   "node <%d>:", "all:"};
+static int rollup_levels = PFM_ROLLUP_SELF;
+static pfm_ctx_table_t rollups[ROLLUP_LEVELS]; /* rollup_t by id */
+static pfm_ctx_table_t rollup_tgids; /* tgid of each thread, by tid */
+static pfm_topo_t topo; /* for the socket and node of each cpu */
+
+/* 
+ * binary output state; contexts seen before the header is written go into 
+ * the context table of the header
+ */
+static int out_format;
+static int bin_header_written;
+static pfm_bin_context_t *bin_contexts;
+static int bin_num_contexts;
+static int bin_max_contexts;
+
+/*
+ * Get the ring of the calling thread, create it on first use
+ */
+static output_ring *get_ring()
+{
+	output_ring *r;
+
+	if(my_ring)
+		return my_ring;
+
+	r = (output_ring*)calloc(1, sizeof(output_ring));
+	if(r == NULL)
+		return NULL;
+	r->buf = (uint64_t*)malloc(sizeof(uint64_t) * RING_WORDS);
+	if(r->buf == NULL){
+		free(r);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&rings_lock);
+	r->next = rings;
+	__atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rings_lock);
+
+	my_ring = r;
+
+	return r;
+}
+
+/*
+ * Reserve size words in the ring of the calling thread
+ * Return value:
+ *      the space to write the record, NULL if the ring is full
+ */
+static uint64_t *ring_reserve(output_ring *r, uint64_t size)
+{
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	uint64_t pos = r->head % RING_WORDS;
+	uint64_t pad = 0;
+
+	/* records never wrap, skip the end of the ring if too short */
+	if(pos + size > RING_WORDS)
+		pad = RING_WORDS - pos;
+
+	if(r->head + pad + size - tail > RING_WORDS){
+		__atomic_add_fetch(&r->overflows, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	if(pad){
+		r->buf[pos] = REC_HDR(REC_PAD, 0, pad);
+		__atomic_store_n(&r->head, r->head + pad, __ATOMIC_RELEASE);
+		pos = 0;
+	}
+
+	return r->buf + pos;
+}
+
+/*
+ * Publish a reserved record to the writer
+ */
+static inline void ring_publish(output_ring *r, uint64_t size)
+{
+	__atomic_store_n(&r->head, r->head + size, __ATOMIC_RELEASE);
+}
+
+void pfm_output_tick(pfm_sched_tick_t *tick, uint64_t start)
+{
+	output_ring *r = get_ring();
+	uint64_t *rec;
+
+	if(r == NULL || (rec = ring_reserve(r, 5)) == NULL)
+		return;
+
+	rec[0] = REC_HDR(REC_TICK, 0, 5);
+	rec[1] = tick->seq;
+	rec[2] = tick->intended - start;
+	rec[3] = tick->actual - start;
+	rec[4] = tick->missed;
+	ring_publish(r, 5);
+}
+
+/*
+ * Copy the arrays of a row into a counts record
+ */
+static void copy_counts(uint64_t *rec, int id, pfm_counts_row_t *row)
+{
+	int num = row->num;
+
+	rec[1] = (uint64_t)(int64_t)id;
+	rec[2] = num ? row->elapsed[0] : 0;
+	memcpy(COUNTS_VAL(rec, num), row->val, sizeof(uint64_t) * num);
+	memcpy(COUNTS_DELTA(rec, num), row->delta, sizeof(uint64_t) * num);
+	memcpy(COUNTS_ENA(rec, num), row->ena, sizeof(uint64_t) * num);
+	memcpy(COUNTS_RUN(rec, num), row->run, sizeof(uint64_t) * num);
+}
+
+void pfm_output_counts(int kind, int id, pfm_counts_row_t *row)
+{
+	output_ring *r = get_ring();
+	uint64_t size = 3 + EVT_WORDS * row->num;
+	uint64_t *rec;
+
+	if(r == NULL || (rec = ring_reserve(r, size)) == NULL)
+		return;
+
+	rec[0] = REC_HDR(REC_COUNTS, kind, size);
+	copy_counts(rec, id, row);
+	ring_publish(r, size);
+}
+
+void pfm_output_bounded_counts(int kind, int id, pfm_counts_row_t *row, 
+			       uint64_t *bounds)
+{
+	output_ring *r = get_ring();
+	uint64_t size = 3 + (EVT_WORDS + 1) * row->num;
+	uint64_t *rec;
+
+	if(r == NULL || (rec = ring_reserve(r, size)) == NULL)
+		return;
+
+	rec[0] = REC_HDR(REC_COUNTS, kind | COUNTS_BOUNDED, size);
+	copy_counts(rec, id, row);
+	memcpy(COUNTS_BOUND(rec, row->num), bounds, 
+	       sizeof(uint64_t) * row->num);
+	ring_publish(r, size);
+}
+
+void pfm_output_context(int kind, int id, int tgid)
+{
+	output_ring *r = get_ring();
+	uint64_t *rec;
+
+	if(r == NULL || (rec = ring_reserve(r, 3)) == NULL)
+		return;
+
+	rec[0] = REC_HDR(REC_CONTEXT, kind, 3);
+	rec[1] = (uint64_t)(int64_t)id;
+	rec[2] = (uint64_t)(int64_t)tgid;
+	ring_publish(r, 3);
+}
+
+void pfm_output_totals(int tgid, int num_threads, int num_exited, int num_live,
+		       uint64_t *values, int num)
+{
+	output_ring *r = get_ring();
+	uint64_t size = 5 + num;
+	uint64_t *rec;
+
+	if(r == NULL || (rec = ring_reserve(r, size)) == NULL)
+		return;
+
+	rec[0] = REC_HDR(REC_TOTALS, 0, size);
+	rec[1] = (uint64_t)(int64_t)tgid;
+	rec[2] = num_threads;
+	rec[3] = num_exited;
+	rec[4] = num_live;
+	memcpy(rec + 5, values, sizeof(uint64_t) * num);
+	ring_publish(r, size);
+}
+
+void pfm_output_bandwidth(int socket, uint64_t read, uint64_t written, 
+			  uint64_t ns)
+{
+	output_ring *r = get_ring();
+	uint64_t *rec;
+
+	if(r == NULL || (rec = ring_reserve(r, 5)) == NULL)
+		return;
+
+	rec[0] = REC_HDR(REC_BANDWIDTH, 0, 5);
+	rec[1] = (uint64_t)(int64_t)socket;
+	rec[2] = read;
+	rec[3] = written;
+	rec[4] = ns;
+	ring_publish(r, 5);
+}
+
+void pfm_output_memory(pid_t tid, pid_t pid, pfm_mem_stats_t *stats,
+		       int num_nodes)
+{
+	output_ring *r = get_ring();
+	uint64_t words = sizeof(pfm_mem_stats_t) / sizeof(uint64_t) + 
+		num_nodes + 1;
+	uint64_t *rec;
+
+	if(r == NULL || (rec = ring_reserve(r, 3 + words)) == NULL)
+		return;
+
+	rec[0] = REC_HDR(REC_MEMORY, num_nodes, 3 + words);
+	rec[1] = (uint64_t)(int64_t)tid;
+	rec[2] = (uint64_t)(int64_t)pid;
+	memcpy(rec + 3, stats, sizeof(uint64_t) * words);
+	ring_publish(r, 3 + words);
+}
+
+void pfm_output_end_pass()
+{
+	output_ring *r;
+	uint64_t *rec;
+
+	/* only the rollups need to know where a pass ends */
+	if(rollup_levels & ~PFM_ROLLUP_SELF){
+		r = get_ring();
+		if(r && (rec = ring_reserve(r, 1)) != NULL){
+			rec[0] = REC_HDR(REC_PASS, 0, 1);
+			ring_publish(r, 1);
+		}
+	}
+
+	pfm_output_commit();
+}
+
+void pfm_output_commit()
+{
+	if(writer_running)
+		sem_post(&writer_wakeup);
+}
+
+/*
+ * Evaluate the derived metrics over metric_deltas and finish the line
+ */
+static void print_metrics(uint64_t ns)
+{
+	int i;
+
+	for(i = 0; i < pfm_metrics_num(metrics); i++)
+		reading_output(" %s=%.4f", pfm_metrics_name(metrics, i),
+			       pfm_metrics_eval(metrics, i, metric_deltas, 
+						ns));
+	reading_output("\n");
+}
+
+/*
+ * Evaluate the derived metrics of a reading and print them on one line
+ */
+static void format_metrics(int kind, int id, uint64_t *rec, int num)
+{
+	uint64_t *val = COUNTS_VAL(rec, num), *delta = COUNTS_DELTA(rec, num);
+	uint64_t *ena = COUNTS_ENA(rec, num), *run = COUNTS_RUN(rec, num);
+	int i;
+
+	for(i = 0; i < num_evts; i++){
+		/* a delta above the value is a negative one */
+		if(i >= num || delta[i] > val[i]){
+			metric_deltas[i] = NAN;
+			continue;
+		}
+		metric_deltas[i] = delta[i];
+		// scale as the counts themselves are scaled
+		if(run[i] && run[i] < ena[i])
+			metric_deltas[i] = metric_deltas[i] * ena[i] / run[i];
+	}
+
+	if(kind == PFM_OUTPUT_THREAD){
+		reading_output("thread [%d]:", id);
+	}
+	else{
+		reading_output("CPU <%d>:", id);
+	}
+	print_metrics(rec[2]);
+}
+
+/*
+ * Get the rollup of a level for an id, create it if it is new
+ * Return value:
+ *      the rollup, NULL if out of memory
+ */
+static rollup_t *get_rollup(int level, int id)
+{
+	rollup_t *r;
+
+	r = pfm_ctx_table_lookup(&rollups[level], id);
+	if(r)
+		return r;
+
+	r = (rollup_t*)calloc(1, sizeof(rollup_t));
+	if(r == NULL)
+		return NULL;
+	r->id = id;
+	r->deltas = (uint64_t*)calloc(num_evts, sizeof(uint64_t));
+	r->scaled = (double*)calloc(num_evts, sizeof(double));
+	if(r->deltas == NULL || r->scaled == NULL || 
+	   pfm_ctx_table_insert(&rollups[level], id, r) < 0){
+		free(r->deltas);
+		free(r->scaled);
+		free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+/*
+ * Add a reading to the rollups of its process, socket, node and to the 
+ * overall rollup
+ */
+static void rollup_counts(int kind, int id, uint64_t *rec, int num)
+{
+	uint64_t *val = COUNTS_VAL(rec, num), *delta = COUNTS_DELTA(rec, num);
+	uint64_t *ena = COUNTS_ENA(rec, num), *run = COUNTS_RUN(rec, num);
+	int ids[ROLLUP_LEVELS] = {-1, -1, -1, 0};
+	int *tgid;
+	rollup_t *r;
+	int level, i;
+
+	if(kind == PFM_OUTPUT_THREAD){
+		tgid = pfm_ctx_table_lookup(&rollup_tgids, id);
+		ids[0] = tgid ? *tgid : id;
+	}
+	else if(id >= 0 && id < topo.num_cpus){
+		ids[1] = topo.socket[id];
+		ids[2] = topo.node[id];
+	}
+
+	for(level = 0; level < ROLLUP_LEVELS; level++){
+		if(!(rollup_levels & (PFM_ROLLUP_PROCESS << level)) || 
+		   ids[level] < 0)
+			continue;
+		r = get_rollup(level, ids[level]);
+		if(r == NULL)
+			continue;
+		r->members++;
+		r->kind = kind;
+		for(i = 0; i < num && i < num_evts; i++){
+			if(delta[i] > val[i])
+				continue;
+			r->deltas[i] += delta[i];
+			r->scaled[i] += run[i] && run[i] < ena[i] ? 
+				(double)delta[i] * ena[i] / run[i] : delta[i];
+		}
+		if(rec[2] > r->ns)
+			r->ns = rec[2];
+	}
+}
+
+/*
+ * Print the rollups of a pass and clear them for the next pass
+ */
+static void format_rollups()
+{
+	rollup_t *r;
+	int level, slot, i;
+	const char *members;
+
+	for(level = 0; level < ROLLUP_LEVELS; level++){
+		for(slot = 0; slot < pfm_ctx_table_slots(&rollups[level]); 
+		    slot++){
+			r = pfm_ctx_table_get(&rollups[level], slot);
+			if(r == NULL || r->members == 0)
+				continue;
+			members = r->kind == PFM_OUTPUT_THREAD ? "threads" : 
+				"cpus";
+
+			reading_output("\n");
+			for(i = 0; !metrics_only && i < num_evts; i++){
+				reading_output(rollup_labels[level], r->id);
+				reading_output("%'20"PRIu64" %s (%d %s)\n",
+					       r->deltas[i], evt_names[i],
+					       r->members, members);
+			}
+			if(metrics){
+				reading_output(rollup_labels[level], r->id);
+				memcpy(metric_deltas, r->scaled, 
+				       sizeof(double) * num_evts);
+				print_metrics(r->ns);
+			}
+
+			r->members = 0;
+			r->ns = 0;
+			memset(r->deltas, 0, sizeof(uint64_t) * num_evts);
+			memset(r->scaled, 0, sizeof(double) * num_evts);
+		}
+	}
+}
+
+/*
+ * Remember the process of a thread for its rollup
+ */
+static void rollup_context(int kind, int id, int tgid)
+{
+	int *t;
+
+	if(kind != PFM_OUTPUT_THREAD || 
+	   !(rollup_levels & PFM_ROLLUP_PROCESS))
+		return;
+
+	/* a tid may be reused by a thread of another process */
+	t = pfm_ctx_table_lookup(&rollup_tgids, id);
+	if(t == NULL){
+		t = (int*)malloc(sizeof(int));
+		if(t == NULL || pfm_ctx_table_insert(&rollup_tgids, id, t) < 0){
+			free(t);
+			return;
+		}
+	}
+	*t = tgid;
+}
+
+/*
+ * Format the readings of a thread or core, the same way as they used to be 
+ * printed by print_thread_counts/print_core_counts
+ */
+static void format_counts(int kind, int id, uint64_t *rec, int num,
+			  uint64_t *bounds)
+{
+	uint64_t *val = COUNTS_VAL(rec, num), *delta = COUNTS_DELTA(rec, num);
+	uint64_t *ena = COUNTS_ENA(rec, num), *run = COUNTS_RUN(rec, num);
+	int i;
+
+	if(rollup_levels & ~PFM_ROLLUP_SELF && !(kind & PFM_OUTPUT_IN_PARENT))
+		rollup_counts(kind, id, rec, num);
+	kind &= ~PFM_OUTPUT_IN_PARENT;
+	if(!(rollup_levels & PFM_ROLLUP_SELF))
+		return;
+
+	for(i = 0; !metrics_only && i < num && i < num_evts; i++){
+		uint64_t values[3] = {val[i], ena[i], run[i]};
+		double ratio;
+
+		ratio = perf_scale_ratio(values);
+
+		/* separate groups */
+		if (evt_leaders[i])
+			reading_output("\n");
+
+		if (delta[i] > val[i]) {
+			reading_output("inconsistent scaling %s (cur=%'"PRIu64
+				       " : prev=%'"PRIu64")\n", evt_names[i], 
+				       val[i], val[i] - delta[i]);
+			continue;
+		}
+		if(kind == PFM_OUTPUT_THREAD){
+			reading_output("thread [%d]:", id);
+		}
+		else{
+			reading_output("CPU <%d>:", id);
+		}
+		reading_output("%'20"PRIu64" %s (%.2f%% scaling, "
+			       "ena=%'"PRIu64", run=%'"PRIu64,
+			       delta[i],
+			       evt_names[i],
+			       (1.0-ratio)*100.0,
+			       ena[i],
+			       run[i]);
+		/* extrapolated by the multiplexing planner */
+		if(bounds == NULL){
+			reading_output(")\n");
+		}
+		else if(bounds[i] == UINT64_MAX){
+			reading_output(", +/- unknown)\n");
+		}
+		else{
+			reading_output(", +/-%'"PRIu64" at 95%%)\n", 
+				       bounds[i]);
+		}
+	}
+
+	if(metrics)
+		format_metrics(kind, id, rec, num);
+}
+
+/*
+ * Format the totals of a process
+ */
+static void format_totals(uint64_t *rec, int num)
+{
+	int evt;
+
+	reading_output("\n");
+	for(evt = 0; evt < num && evt < num_evts; evt++)
+		reading_output("process [%d]:%'20"PRIu64" %s (%d threads,"
+			       " %d exited, %d live)\n",
+			       (int)(int64_t)rec[0], rec[4 + evt], 
+			       evt_names[evt], (int)rec[1], (int)rec[2], 
+			       (int)rec[3]);
+}
+
+/*
+ * Format the memory traffic of a socket
+ */
+static void format_bandwidth(uint64_t *rec)
+{
+	int socket = (int)(int64_t)rec[0];
+	double sec = rec[3] / 1000000000.0;
+
+	reading_output("socket <%d>:%'20"PRIu64" bytes read (%.3f GB/s)\n",
+		       socket, rec[1], sec > 0 ? rec[1] / sec / 1e9 : 0.0);
+	reading_output("socket <%d>:%'20"PRIu64" bytes written (%.3f GB/s)\n",
+		       socket, rec[2], sec > 0 ? rec[2] / sec / 1e9 : 0.0);
+}
+
+static const char *mem_sources[PFM_MEM_SOURCES] = {"L1", "LFB", "L2", "L3",
+						   "DRAM", "remote DRAM",
+						   "remote cache", "other"};
+
+/*
+ * Format the sampled loads of a thread, as shares of the samples
+ */
+static void format_memory(int tid, pfm_mem_stats_t *m, int num_nodes)
+{
+	double n = m->samples ? (double)m->samples : 1.0;
+	int i;
+
+	reading_output("thread [%d]:%'20"PRIu64" loads sampled (%.1f cycles "
+		       "on average)\n", tid, m->samples, m->latency / n);
+	reading_output("thread [%d]: latency", tid);
+	for(i = 0; i < PFM_MEM_LAT_BUCKETS - 1; i++){
+		reading_output(" <%d: %.1f%%,", 32 << i, m->lat[i] * 100.0 / n);
+	}
+	reading_output(" >=%d: %.1f%%\n", 32 << (PFM_MEM_LAT_BUCKETS - 2),
+		       m->lat[i] * 100.0 / n);
+	reading_output("thread [%d]: source", tid);
+	for(i = 0; i < PFM_MEM_SOURCES; i++){
+		reading_output(" %s: %.1f%%%s", mem_sources[i], 
+			       m->src[i] * 100.0 / n, 
+			       i < PFM_MEM_SOURCES - 1 ? "," : "\n");
+	}
+	reading_output("thread [%d]: node", tid);
+	for(i = 0; i < num_nodes; i++){
+		reading_output(" <%d>: %.1f%%,", i, m->nodes[i] * 100.0 / n);
+	}
+	reading_output(" unknown: %.1f%%\n", m->nodes[num_nodes] * 100.0 / n);
+}
+
+static void format_record(uint64_t *rec)
+{
+	switch(REC_TYPE(rec[0])){
+	case REC_TICK:
+		reading_output("\ntick %"PRIu64": intended %'"PRIu64" ns, "
+			       "actual %'"PRIu64" ns (late %'"PRIu64" ns, "
+			       "missed %"PRIu64")\n", rec[1], rec[2], rec[3],
+			       rec[3] - rec[2], rec[4]);
+		break;
+	case REC_COUNTS:
+		if(REC_ARG(rec[0]) & COUNTS_BOUNDED){
+			int num = (REC_SIZE(rec[0]) - 3) / (EVT_WORDS + 1);
+
+			format_counts(REC_ARG(rec[0]) & ~COUNTS_BOUNDED, 
+				      (int)(int64_t)rec[1], rec, num, 
+				      COUNTS_BOUND(rec, num));
+		}
+		else
+			format_counts(REC_ARG(rec[0]), (int)(int64_t)rec[1], 
+				      rec, (REC_SIZE(rec[0]) - 3) / EVT_WORDS,
+				      NULL);
+		break;
+	case REC_CONTEXT:
+		/* contexts are only described in binary output */
+		rollup_context(REC_ARG(rec[0]), (int)(int64_t)rec[1], 
+			       (int)(int64_t)rec[2]);
+		break;
+	case REC_PASS:
+		format_rollups();
+		break;
+	case REC_TOTALS:
+		format_totals(rec + 1, REC_SIZE(rec[0]) - 5);
+		break;
+	case REC_BANDWIDTH:
+		format_bandwidth(rec + 1);
+		break;
+	case REC_MEMORY:
+		format_memory((int)(int64_t)rec[1], (pfm_mem_stats_t*)(rec + 3),
+			      REC_ARG(rec[0]));
+		break;
+	default:
+		fprintf((FILE*)err_out, "Unknown output record type %d\n",
+			(int)REC_TYPE(rec[0]));
+	}
+}
+
+static inline void bin_write(void *data, size_t size)
+{
+	if(fwrite(data, size, 1, (FILE*)reading_out) != 1)
+		DPRINTF("Failed to write binary output\n");
+}
+
+/*
+ * Write the stream header, with the event table and the contexts seen so far
+ */
+static void bin_write_header()
+{
+	pfm_bin_header_t hdr;
+	pfm_bin_event_t evt;
+	int i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PFM_BIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = PFM_BIN_VERSION;
+	hdr.num_events = num_evts;
+	hdr.num_contexts = bin_num_contexts;
+	hdr.header_size = sizeof(hdr) + sizeof(pfm_bin_event_t) * num_evts + 
+		sizeof(pfm_bin_context_t) * bin_num_contexts;
+	bin_write(&hdr, sizeof(hdr));
+
+	for(i = 0; i < num_evts; i++){
+		memset(&evt, 0, sizeof(evt));
+		evt.flags = evt_leaders[i] ? PFM_BIN_EVT_LEADER : 0;
+		strncpy(evt.name, evt_names[i], PFM_BIN_NAME_LEN - 1);
+		bin_write(&evt, sizeof(evt));
+	}
+	if(bin_num_contexts)
+		bin_write(bin_contexts, 
+			  sizeof(pfm_bin_context_t) * bin_num_contexts);
+
+	free(bin_contexts);
+	bin_contexts = NULL;
+	bin_header_written = 1;
+}
+
+/*
+ * Keep a context for the header; returns 0 if the context has been kept
+ */
+static int bin_keep_context(pfm_bin_context_t *ctx)
+{
+	if(bin_num_contexts == bin_max_contexts){
+		pfm_bin_context_t *contexts;
+		int max = bin_max_contexts ? bin_max_contexts * 2 : 64;
+
+		contexts = realloc(bin_contexts, 
+				   sizeof(pfm_bin_context_t) * max);
+		if(contexts == NULL)
+			return -1;
+		bin_contexts = contexts;
+		bin_max_contexts = max;
+	}
+	bin_contexts[bin_num_contexts++] = *ctx;
+
+	return 0;
+}
+
+static void bin_record(uint64_t *rec)
+{
+	int i, num;
+
+	if(REC_TYPE(rec[0]) == REC_CONTEXT){
+		pfm_bin_context_rec_t c;
+
+		memset(&c, 0, sizeof(c));
+		c.rec.type = PFM_BIN_REC_CONTEXT;
+		c.rec.size = sizeof(c);
+		c.ctx.kind = REC_ARG(rec[0]);
+		c.ctx.id = (int32_t)(int64_t)rec[1];
+		c.ctx.tgid = (int32_t)(int64_t)rec[2];
+		if(!bin_header_written && !bin_keep_context(&c.ctx))
+			return;
+		if(!bin_header_written)
+			bin_write_header();
+		bin_write(&c, sizeof(c));
+		return;
+	}
+
+	/* the event list is known once there are readings */
+	if(!bin_header_written)
+		bin_write_header();
+
+	switch(REC_TYPE(rec[0])){
+	case REC_TICK:{
+		pfm_bin_tick_t t;
+
+		t.rec.type = PFM_BIN_REC_TICK;
+		t.rec.size = sizeof(t);
+		t.seq = rec[1];
+		t.intended = rec[2];
+		t.actual = rec[3];
+		t.missed = rec[4];
+		bin_write(&t, sizeof(t));
+		break;
+	}
+	case REC_COUNTS:{
+		/* the bounds are left out */
+		if(REC_ARG(rec[0]) & COUNTS_BOUNDED)
+			num = (REC_SIZE(rec[0]) - 3) / (EVT_WORDS + 1);
+		else
+			num = (REC_SIZE(rec[0]) - 3) / EVT_WORDS;
+		pfm_bin_value_t vals[num_evts];
+		pfm_bin_counts_t c;
+
+		memset(vals, 0, sizeof(vals));
+		for(i = 0; i < num && i < num_evts; i++){
+			vals[i].delta = (int64_t)COUNTS_DELTA(rec, num)[i];
+			vals[i].ena = COUNTS_ENA(rec, num)[i];
+			vals[i].run = COUNTS_RUN(rec, num)[i];
+		}
+		c.rec.type = PFM_BIN_REC_COUNTS;
+		c.rec.size = sizeof(c) + sizeof(vals);
+		c.kind = REC_ARG(rec[0]) & ~(PFM_OUTPUT_IN_PARENT | 
+					     COUNTS_BOUNDED);
+		c.id = (int32_t)(int64_t)rec[1];
+		bin_write(&c, sizeof(c));
+		bin_write(vals, sizeof(vals));
+		break;
+	}
+	case REC_TOTALS:{
+		num = REC_SIZE(rec[0]) - 5;
+		if(num > num_evts)
+			num = num_evts;
+		uint64_t vals[num_evts];
+		pfm_bin_totals_t t;
+
+		memset(vals, 0, sizeof(vals));
+		memcpy(vals, rec + 5, sizeof(uint64_t) * num);
+		t.rec.type = PFM_BIN_REC_TOTALS;
+		t.rec.size = sizeof(t) + sizeof(vals);
+		t.tgid = (int32_t)(int64_t)rec[1];
+		t.num_threads = rec[2];
+		t.num_exited = rec[3];
+		t.num_live = rec[4];
+		bin_write(&t, sizeof(t));
+		bin_write(vals, sizeof(vals));
+		break;
+	}
+	case REC_BANDWIDTH:{
+		pfm_bin_bandwidth_t b;
+
+		memset(&b, 0, sizeof(b));
+		b.rec.type = PFM_BIN_REC_BANDWIDTH;
+		b.rec.size = sizeof(b);
+		b.socket = (int32_t)(int64_t)rec[1];
+		b.read = rec[2];
+		b.written = rec[3];
+		b.ns = rec[4];
+		bin_write(&b, sizeof(b));
+		break;
+	}
+	case REC_MEMORY:{
+		pfm_bin_memory_t m;
+
+		memset(&m, 0, sizeof(m));
+		m.rec.type = PFM_BIN_REC_MEMORY;
+		m.rec.size = sizeof(m) + sizeof(uint64_t) * 
+			(REC_ARG(rec[0]) + 1);
+		m.tid = (int32_t)(int64_t)rec[1];
+		m.pid = (int32_t)(int64_t)rec[2];
+		m.num_nodes = REC_ARG(rec[0]);
+		/* the stats are laid out as the body of the binary record */
+		bin_write(&m, offsetof(pfm_bin_memory_t, samples));
+		bin_write(rec + 3, m.rec.size - 
+			  offsetof(pfm_bin_memory_t, samples));
+		break;
+	}
+	case REC_PASS:
+		/* rollups are only printed in text output */
+		break;
+	default:
+		fprintf((FILE*)err_out, "Unknown output record type %d\n",
+			(int)REC_TYPE(rec[0]));
+	}
+}
+
+/*
+ * Format everything queued in all rings
+ */
+static void drain_rings()
+{
+	output_ring *r;
+	uint64_t head, tail, hdr;
+
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next){
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		tail = r->tail;
+		while(tail < head){
+			hdr = r->buf[tail % RING_WORDS];
+			if(REC_TYPE(hdr) == REC_PAD)
+				;
+			else if(out_format == PFM_OUTPUT_BIN)
+				bin_record(r->buf + tail % RING_WORDS);
+			else
+				format_record(r->buf + tail % RING_WORDS);
+			tail += REC_SIZE(hdr);
+			__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		}
+	}
+	fflush((FILE*)reading_out);
+}
+
+static void * writer_thread(void * param)
+{
+	int stopping;
+
+	do{
+		sem_wait(&writer_wakeup);
+		stopping = __atomic_load_n(&writer_stopping, __ATOMIC_ACQUIRE);
+		drain_rings();
+
+		pthread_mutex_lock(&drain_lock);
+		drain_gen++;
+		pthread_cond_broadcast(&drain_cond);
+		pthread_mutex_unlock(&drain_lock);
+	}while(!stopping);
+
+	return NULL;
+}
+
+int pfm_output_init(int format)
+{
+	out_format = format;
+	bin_header_written = 0;
+
+	if(sem_init(&writer_wakeup, 0, 0))
+		return -1;
+
+	writer_stopping = 0;
+	if(pthread_create(&writer, NULL, writer_thread, NULL))
+		return -1;
+	writer_running = 1;
+
+	return 0;
+}
+
+void pfm_output_set_events(perf_event_desc_t *fds, int num)
+{
+	int i;
+
+	if(evt_names)
+		return;
+
+	evt_leaders = (int*)calloc(num, sizeof(int));
+	evt_names = (char**)calloc(num, sizeof(char*));
+	if(evt_names == NULL || evt_leaders == NULL){
+		free(evt_leaders);
+		free(evt_names);
+		evt_names = NULL;
+		return;
+	}
+	if(metrics){
+		metric_deltas = (double*)calloc(num, sizeof(double));
+		if(metric_deltas == NULL)
+			metrics = NULL;
+	}
+	for(i = 0; i < num; i++){
+		evt_names[i] = strdup(fds[i].name);
+		evt_leaders[i] = perf_is_group_leader(fds, i);
+	}
+	num_evts = num;
+}
+
+int pfm_output_set_rollups(int levels)
+{
+	int level;
+
+	rollup_levels = levels;
+	if(!(levels & ~PFM_ROLLUP_SELF))
+		return 0;
+
+	for(level = 0; level < ROLLUP_LEVELS; level++)
+		if(pfm_ctx_table_init(&rollups[level]))
+			return -1;
+	if(pfm_ctx_table_init(&rollup_tgids))
+		return -1;
+	if(levels & (PFM_ROLLUP_SOCKET | PFM_ROLLUP_NODE))
+		return pfm_topo_read(&topo);
+
+	return 0;
+}
+
+void pfm_output_set_metrics(void *m, int only)
+{
+	metrics = m;
+	metrics_only = only;
+}
+
+void pfm_output_flush()
+{
+	uint64_t gen;
+
+	if(!writer_running)
+		return;
+
+	/* 
+	 * a drain pass may be in progress and miss our records, so wait for 
+	 * the pass after it; posting twice makes sure that pass happens
+	 */
+	pthread_mutex_lock(&drain_lock);
+	gen = drain_gen;
+	sem_post(&writer_wakeup);
+	sem_post(&writer_wakeup);
+	while(drain_gen < gen + 2)
+		pthread_cond_wait(&drain_cond, &drain_lock);
+	pthread_mutex_unlock(&drain_lock);
+}
+
+uint64_t pfm_output_overflows()
+{
+	output_ring *r;
+	uint64_t overflows = 0;
+
+	for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+		overflows += __atomic_load_n(&r->overflows, __ATOMIC_RELAXED);
+
+	return overflows;
+}
+
+int pfm_output_close()
+{
+	output_ring *r;
+	uint64_t overflows;
+	int i;
+
+	if(writer_running){
+		__atomic_store_n(&writer_stopping, 1, __ATOMIC_RELEASE);
+		sem_post(&writer_wakeup);
+		pthread_join(writer, NULL);
+		writer_running = 0;
+		sem_destroy(&writer_wakeup);
+	}
+
+	/* a binary stream always has a header, even without readings */
+	if(out_format == PFM_OUTPUT_BIN && !bin_header_written)
+		bin_write_header();
+
+	overflows = pfm_output_overflows();
+	if(overflows)
+		fprintf((FILE*)err_out, "pfm_multi: output ring overflowed, "
+			"%"PRIu64" readings dropped\n", overflows);
+
+	while(rings){
+		r = rings;
+		rings = r->next;
+		free(r->buf);
+		free(r);
+	}
+	my_ring = NULL;
+
+	if(rollup_levels & ~PFM_ROLLUP_SELF){
+		int level, slot;
+
+		/* readings after the last pass, e.g., of threads that exited */
+		format_rollups();
+		for(level = 0; level < ROLLUP_LEVELS; level++){
+			for(slot = 0; slot < pfm_ctx_table_slots(&rollups[level]);
+			    slot++){
+				rollup_t *ru = pfm_ctx_table_get(&rollups[level],
+								 slot);
+
+				if(ru == NULL)
+					continue;
+				free(ru->deltas);
+				free(ru->scaled);
+				free(ru);
+			}
+			pfm_ctx_table_destroy(&rollups[level]);
+		}
+		for(slot = 0; slot < pfm_ctx_table_slots(&rollup_tgids); slot++)
+			free(pfm_ctx_table_get(&rollup_tgids, slot));
+		pfm_ctx_table_destroy(&rollup_tgids);
+		pfm_topo_free(&topo);
+		rollup_levels = PFM_ROLLUP_SELF;
+	}
+
+	for(i = 0; i < num_evts; i++)
+		free(evt_names[i]);
+	free(evt_names);
+	free(evt_leaders);
+	evt_names = NULL;
+	evt_leaders = NULL;
+	num_evts = 0;
+
+	return 0;
+}
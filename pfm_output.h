@@ -0,0 +1,191 @@
+/*
+ * Output path of pfm_multi. Samplers only copy the raw counter values into a 
+ * preallocated lock-free ring buffer; a writer thread drains the rings and 
+ * formats the readings. Every producing thread gets its own single-producer 
+ * single-consumer ring, so producers never wait for each other or for the 
+ * writer. When a ring is full, the record is dropped and counted.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_OUTPUT_H__
+#define __PFM_OUTPUT_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "perf_util.h"
+#include "pfm_sched.h"
+#include "pfm_counts.h"
+#include "pfm_output_bin.h"
+
+/* 
+ * or'd into the kind of a reading already counted in another reading, e.g.,
+ * an exited child with -I, whose counts are in the first thread's; rollups 
+ * skip such readings
+ */
+#define PFM_OUTPUT_IN_PARENT 0x80
+
+/* rollup levels of the readings of each sampling pass */
+#define PFM_ROLLUP_SELF (1 << 0) /* each thread or core, not summed */
+#define PFM_ROLLUP_PROCESS (1 << 1) /* threads summed per process */
+#define PFM_ROLLUP_SOCKET (1 << 2) /* cores summed per socket */
+#define PFM_ROLLUP_NODE (1 << 3) /* cores summed per NUMA node */
+#define PFM_ROLLUP_ALL (1 << 4) /* everything summed */
+
+/* output formats */
+#define PFM_OUTPUT_TEXT 0 /* human-readable lines */
+#define PFM_OUTPUT_BIN 1 /* binary stream, see pfm_output_bin.h */
+
+/*
+ * Start the writer thread
+ * Parameters:
+ *	format	--> PFM_OUTPUT_TEXT or PFM_OUTPUT_BIN
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+int pfm_output_init(int format);
+
+/*
+ * Set the event list used to format the readings; all contexts monitor the 
+ * same list, so only the first call takes effect
+ * Parameters:
+ *	fds	--> the event list
+ *	num	--> number of events in the list
+ */
+void pfm_output_set_events(perf_event_desc_t *fds, int num);
+
+/*
+ * Set the derived metrics printed after each reading in text output; call 
+ * before the first reading
+ * Parameters:
+ *	metrics	--> compiled metrics, see pfm_metrics.h
+ *	only	--> print only the metrics of a reading, not its events
+ */
+void pfm_output_set_metrics(void *metrics, int only);
+
+/*
+ * Set the rollup levels printed for each sampling pass in text output; call
+ * before the first reading. Without a call, only PFM_ROLLUP_SELF is printed.
+ * Parameters:
+ *	levels	--> PFM_ROLLUP_* or'd together
+ * Return value:
+ *      0       --> success
+ *      other   --> failed to allocate memory
+ */
+int pfm_output_set_rollups(int levels);
+
+/*
+ * Queue the start of a sampling tick
+ * Parameters:
+ *	tick	--> the tick information from the scheduler
+ *	start	--> the time of tick 0, to print relative times
+ */
+void pfm_output_tick(pfm_sched_tick_t *tick, uint64_t start);
+
+/*
+ * Queue the readings of a thread or core. The scaled values, their deltas,
+ * the times enabled and running of each event are copied as arrays.
+ * Parameters:
+ *	kind	--> PFM_OUTPUT_THREAD or PFM_OUTPUT_CORE, with 
+ *                  PFM_OUTPUT_IN_PARENT
+ *	id	--> tid or cpu id
+ *	row	--> the counts of the event list, updated
+ */
+void pfm_output_counts(int kind, int id, pfm_counts_row_t *row);
+
+/*
+ * Queue the readings of a thread or core whose counts are extrapolated by
+ * the multiplexing planner, along with the 95% confidence bound of the delta
+ * of each event (UINT64_MAX if unknown); the bounds are only printed in text
+ * output
+ * Parameters:
+ *	bounds	--> the bound of each event
+ */
+void pfm_output_bounded_counts(int kind, int id, pfm_counts_row_t *row, 
+			       uint64_t *bounds);
+
+/*
+ * Queue the memory traffic of a socket since its last reading, from the
+ * uncore memory controllers
+ * Parameters:
+ *	socket	--> the socket
+ *	read	--> bytes read from memory
+ *	written	--> bytes written to memory
+ *	ns	--> the time counted, to print the bandwidth
+ */
+void pfm_output_bandwidth(int socket, uint64_t read, uint64_t written, 
+			  uint64_t ns);
+
+/* sampled loads of a thread, laid out as in pfm_bin_memory_t */
+typedef struct __pfm_mem_stats{
+	uint64_t samples;
+	uint64_t latency;
+	uint64_t lat[PFM_MEM_LAT_BUCKETS];
+	uint64_t src[PFM_MEM_SOURCES];
+	uint64_t nodes[]; /* num_nodes + 1 */
+}pfm_mem_stats_t;
+
+/*
+ * Queue the loads of a thread sampled since its last reading, see 
+ * pfm_sample_mem_flush
+ * Parameters:
+ *	tid		--> the thread
+ *	pid		--> its process
+ *	stats		--> the sampled loads
+ *	num_nodes	--> number of NUMA nodes
+ */
+void pfm_output_memory(pid_t tid, pid_t pid, pfm_mem_stats_t *stats,
+		       int num_nodes);
+
+/*
+ * Queue the description of a new thread or core
+ * Parameters:
+ *	kind	--> PFM_OUTPUT_THREAD or PFM_OUTPUT_CORE
+ *	id	--> tid or cpu id
+ *	tgid	--> process id of a thread, -1 for a core
+ */
+void pfm_output_context(int kind, int id, int tgid);
+
+/*
+ * Queue the totals of a process
+ * Parameters:
+ *	tgid		--> process id
+ *	num_threads	--> number of threads ever monitored in the process
+ *	num_exited	--> number of exited threads
+ *	num_live	--> number of live threads
+ *	values		--> the total count of each event
+ *	num		--> number of events
+ */
+void pfm_output_totals(int tgid, int num_threads, int num_exited, int num_live,
+		       uint64_t *values, int num);
+
+/*
+ * Wake up the writer for the records queued by this thread; a sampler calls 
+ * this once per pass
+ */
+void pfm_output_commit();
+
+/*
+ * Mark the end of a sampling pass over all threads or cores, where the 
+ * rollups of the pass are printed, and wake up the writer
+ */
+void pfm_output_end_pass();
+
+/*
+ * Wait until the writer has formatted everything queued so far
+ */
+void pfm_output_flush();
+
+/*
+ * Number of records dropped because a ring was full
+ */
+uint64_t pfm_output_overflows();
+
+/*
+ * Drain the rings and stop the writer thread
+ */
+int pfm_output_close();
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * The binary output format of pfm_multi (-o bin), shared by the writer in 
+ * pfm_output.c and by pfm_decode. All fields are in host byte order.
+ *
+ * A stream starts with a header, followed by the event table and a context 
+ * table (the cpus, or the threads known when the header is written). Then 
+ * come records; each record starts with its type and its size, so readers can
+ * skip record types they do not know. Counts records have a fixed size for a 
+ * given stream: one delta value per event.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_OUTPUT_BIN_H__
+#define __PFM_OUTPUT_BIN_H__
+
+#include <stdint.h>
+
+#define PFM_BIN_MAGIC "PFMMULTI"
+#define PFM_BIN_VERSION 1
+#define PFM_BIN_NAME_LEN 256 /* event names are NUL-padded to this length */
+
+/* kinds of counter readings */
+#define PFM_OUTPUT_THREAD 1
+#define PFM_OUTPUT_CORE 2
+
+/* stream header */
+typedef struct __pfm_bin_header{
+	char magic[8]; /* PFM_BIN_MAGIC, not NUL-terminated */
+	uint32_t version;
+	uint32_t header_size; /* bytes, including the event/context tables */
+	uint32_t num_events;
+	uint32_t num_contexts;
+}pfm_bin_header_t;
+
+/* one entry of the event table */
+#define PFM_BIN_EVT_LEADER 0x1 /* the event leads a group */
+typedef struct __pfm_bin_event{
+	uint32_t flags;
+	uint32_t reserved;
+	char name[PFM_BIN_NAME_LEN];
+}pfm_bin_event_t;
+
+/* one entry of the context table, also used as a record body */
+typedef struct __pfm_bin_context{
+	uint32_t kind; /* PFM_OUTPUT_THREAD or PFM_OUTPUT_CORE */
+	int32_t id; /* tid or cpu id */
+	int32_t tgid; /* process of a thread, -1 for cores */
+	uint32_t reserved;
+}pfm_bin_context_t;
+
+/* record types */
+#define PFM_BIN_REC_TICK 1
+#define PFM_BIN_REC_CONTEXT 2
+#define PFM_BIN_REC_COUNTS 3
+#define PFM_BIN_REC_TOTALS 4
+#define PFM_BIN_REC_BANDWIDTH 5
+#define PFM_BIN_REC_MEMORY 6
+
+typedef struct __pfm_bin_rec{
+	uint32_t type;
+	uint32_t size; /* bytes, including this header */
+}pfm_bin_rec_t;
+
+/* start of a sampling tick; times in ns relative to the start of logging */
+typedef struct __pfm_bin_tick{
+	pfm_bin_rec_t rec;
+	uint64_t seq;
+	uint64_t intended;
+	uint64_t actual;
+	uint64_t missed;
+}pfm_bin_tick_t;
+
+/* a new context, for threads created after the header */
+typedef struct __pfm_bin_context_rec{
+	pfm_bin_rec_t rec;
+	pfm_bin_context_t ctx;
+}pfm_bin_context_rec_t;
+
+/* 
+ * the readings of one context since its last reading; delta is the 
+ * difference of the scaled counts (negative if the scaling is inconsistent),
+ * ena and run are the total time enabled and running
+ */
+typedef struct __pfm_bin_value{
+	int64_t delta;
+	uint64_t ena;
+	uint64_t run;
+}pfm_bin_value_t;
+
+typedef struct __pfm_bin_counts{
+	pfm_bin_rec_t rec;
+	uint32_t kind;
+	int32_t id;
+	pfm_bin_value_t values[]; /* num_events values */
+}pfm_bin_counts_t;
+
+/* the totals of a process at the end of a run */
+typedef struct __pfm_bin_totals{
+	pfm_bin_rec_t rec;
+	int32_t tgid;
+	uint32_t num_threads;
+	uint32_t num_exited;
+	uint32_t num_live;
+	uint64_t values[]; /* num_events values */
+}pfm_bin_totals_t;
+
+/* 
+ * the memory traffic of a socket since its last reading, from the uncore 
+ * memory controllers (-B)
+ */
+typedef struct __pfm_bin_bandwidth{
+	pfm_bin_rec_t rec;
+	int32_t socket;
+	uint32_t reserved;
+	uint64_t read; /* bytes */
+	uint64_t written; /* bytes */
+	uint64_t ns; /* time counted */
+}pfm_bin_bandwidth_t;
+
+/* 
+ * the loads of a thread sampled by the load latency event since its last
+ * reading (-W): latency bucket i counts the loads under 32 << i cycles, the
+ * last bucket the slower ones; sources are where the loads were served
+ */
+#define PFM_MEM_LAT_BUCKETS 8
+#define PFM_MEM_SRC_L1 0
+#define PFM_MEM_SRC_LFB 1 /* line fill buffer, a miss already in flight */
+#define PFM_MEM_SRC_L2 2
+#define PFM_MEM_SRC_L3 3
+#define PFM_MEM_SRC_DRAM 4 /* local memory */
+#define PFM_MEM_SRC_REMOTE_DRAM 5
+#define PFM_MEM_SRC_REMOTE_CACHE 6
+#define PFM_MEM_SRC_OTHER 7 /* I/O, uncached or unknown */
+#define PFM_MEM_SOURCES 8
+
+typedef struct __pfm_bin_memory{
+	pfm_bin_rec_t rec;
+	int32_t tid;
+	int32_t pid;
+	uint32_t num_nodes;
+	uint32_t reserved;
+	uint64_t samples;
+	uint64_t latency; /* summed cycles */
+	uint64_t lat[PFM_MEM_LAT_BUCKETS];
+	uint64_t src[PFM_MEM_SOURCES];
+	/* 
+	 * loads by the NUMA node of their page, num_nodes + 1 counts, the 
+	 * last for pages whose node is unknown
+	 */
+	uint64_t nodes[];
+}pfm_bin_memory_t;
+
+#endif
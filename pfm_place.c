@@ -0,0 +1,405 @@
+/*
+ * Placement of the monitored threads on cores.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#define _GNU_SOURCE             // for cpu affinity
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fnmatch.h>
+
+#include "pfm_common.h"
+#include "pfm_place.h"
+#include "pfm_topo.h"
+
+static const char *policy_names[] = {"none", "rr", "compact", "scatter",
+				     "core"};
+
+/* a rule pinning threads by creation order or by name */
+typedef struct _place_rule{
+	int order; /* creation order, -1 for a name rule */
+	char *pattern; /* shell pattern of the comm of a name rule */
+	cpu_set_t set;
+}place_rule;
+
+typedef struct _place_info{
+	int policy;
+	int *order; /* the candidate cpus in the order of the policy */
+	int num;
+	place_rule *rules;
+	int num_rules;
+	int has_name_rules;
+	int next; /* creation order of the next thread */
+}place_info;
+
+/* a candidate cpu and its place in the topology */
+typedef struct _place_cpu{
+	int cpu;
+	int socket;
+	int core;
+	int sibling; /* SMT siblings of the core that come before it */
+	int rank; /* cpus of the socket that come before it, cores first */
+}place_cpu;
+
+static int compare_compact(const void *a, const void *b)
+{
+	const place_cpu *x = a, *y = b;
+
+	if(x->socket != y->socket)
+		return x->socket - y->socket;
+	if(x->core != y->core)
+		return x->core - y->core;
+	return x->sibling - y->sibling;
+}
+
+static int compare_scatter(const void *a, const void *b)
+{
+	const place_cpu *x = a, *y = b;
+
+	if(x->rank != y->rank)
+		return x->rank - y->rank;
+	return x->socket - y->socket;
+}
+
+static int compare_core(const void *a, const void *b)
+{
+	const place_cpu *x = a, *y = b;
+
+	if(x->sibling != y->sibling)
+		return x->sibling - y->sibling;
+	return compare_compact(a, b);
+}
+
+/*
+ * Order the candidate cpus for a policy
+ * Return value:
+ *      0       --> success
+ *      other   --> failed to read the topology
+ */
+static int order_cpus(place_info *p)
+{
+	pfm_topo_t topo;
+	place_cpu *c;
+	int i, j;
+
+	if(p->policy == PFM_PLACE_RR)
+		return 0;
+	if(pfm_topo_read(&topo))
+		return -1;
+	c = calloc(p->num, sizeof(place_cpu));
+	if(c == NULL){
+		pfm_topo_free(&topo);
+		return -1;
+	}
+
+	for(i = 0; i < p->num; i++){
+		c[i].cpu = p->order[i];
+		c[i].socket = -1;
+		/* without topology, every cpu is a core of its own */
+		c[i].core = c[i].cpu;
+		if(c[i].cpu < topo.num_cpus && topo.core[c[i].cpu] != -1){
+			c[i].socket = topo.socket[c[i].cpu];
+			c[i].core = topo.core[c[i].cpu];
+		}
+	}
+	for(i = 0; i < p->num; i++)
+		for(j = 0; j < p->num; j++){
+			if(c[j].socket != c[i].socket || j == i)
+				continue;
+			if(c[j].core == c[i].core && c[j].cpu < c[i].cpu)
+				c[i].sibling++;
+		}
+	/* within a socket, the first sibling of every core comes first */
+	for(i = 0; i < p->num; i++)
+		for(j = 0; j < p->num; j++){
+			if(c[j].socket != c[i].socket || j == i)
+				continue;
+			if(c[j].sibling < c[i].sibling ||
+			   (c[j].sibling == c[i].sibling &&
+			    (c[j].core < c[i].core ||
+			     (c[j].core == c[i].core && c[j].cpu < c[i].cpu))))
+				c[i].rank++;
+		}
+
+	switch(p->policy){
+	case PFM_PLACE_COMPACT:
+		qsort(c, p->num, sizeof(place_cpu), compare_compact);
+		break;
+	case PFM_PLACE_SCATTER:
+		qsort(c, p->num, sizeof(place_cpu), compare_scatter);
+		break;
+	case PFM_PLACE_CORE:
+		qsort(c, p->num, sizeof(place_cpu), compare_core);
+		break;
+	}
+	for(i = 0; i < p->num; i++)
+		p->order[i] = c[i].cpu;
+
+	free(c);
+	pfm_topo_free(&topo);
+
+	return 0;
+}
+
+int pfm_place_policy(const char *name)
+{
+	int i;
+
+	for(i = PFM_PLACE_RR;
+	    i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+		if(!strcmp(name, policy_names[i]))
+			return i;
+
+	return -1;
+}
+
+int pfm_place_init(void **handle, int policy, int *cpus, int num)
+{
+	place_info *p;
+	pfm_topo_t topo;
+	int i;
+
+	if(handle == NULL || policy < PFM_PLACE_NONE ||
+	   policy > PFM_PLACE_CORE)
+		return 1;
+	*handle = NULL;
+
+	p = calloc(1, sizeof(place_info));
+	if(p == NULL)
+		return 2;
+	p->policy = policy;
+
+	if(policy != PFM_PLACE_NONE && cpus == NULL){
+		/* all online cpus */
+		if(pfm_topo_read(&topo)){
+			free(p);
+			return 2;
+		}
+		p->order = malloc(sizeof(int) * topo.num_cpus);
+		for(i = 0; p->order && i < topo.num_cpus; i++)
+			if(topo.online[i])
+				p->order[p->num++] = i;
+		pfm_topo_free(&topo);
+	}
+	else if(policy != PFM_PLACE_NONE){
+		p->order = malloc(sizeof(int) * num);
+		if(p->order)
+			memcpy(p->order, cpus, sizeof(int) * num);
+		p->num = num;
+	}
+	if((policy != PFM_PLACE_NONE && p->order == NULL) || order_cpus(p)){
+		pfm_place_close(p);
+		return 2;
+	}
+
+	*handle = p;
+
+	return 0;
+}
+
+/*
+ * Parse a list of cpus and ranges, e.g. "0,4-7"
+ * Return value:
+ *      0       --> success
+ *      1       --> syntax error
+ */
+static int parse_cpus(const char *list, cpu_set_t *set)
+{
+	const char *s = list;
+	char *end;
+	long first, last;
+
+	CPU_ZERO(set);
+	while(*s){
+		first = strtol(s, &end, 10);
+		if(end == s || first < 0)
+			return 1;
+		last = first;
+		s = end;
+		if(*s == '-'){
+			last = strtol(s + 1, &end, 10);
+			if(end == s + 1 || last < first)
+				return 1;
+			s = end;
+		}
+		if(last >= CPU_SETSIZE)
+			return 1;
+		for(; first <= last; first++)
+			CPU_SET(first, set);
+		if(*s == ',')
+			s++;
+		else if(*s)
+			return 1;
+	}
+
+	return CPU_COUNT(set) == 0;
+}
+
+int pfm_place_add_rule(void *handle, const char *rule)
+{
+	place_info *p = (place_info*)handle;
+	place_rule *rules, *r;
+	const char *eq, *c;
+
+	eq = strchr(rule, '=');
+	if(p == NULL || eq == NULL || eq == rule)
+		return 1;
+
+	rules = realloc(p->rules, sizeof(place_rule) * (p->num_rules + 1));
+	if(rules == NULL)
+		return 2;
+	p->rules = rules;
+	r = &rules[p->num_rules];
+
+	if(parse_cpus(eq + 1, &r->set))
+		return 1;
+
+	/* a key of digits is a creation order, anything else a name */
+	for(c = rule; c < eq && isdigit((unsigned char)*c); c++)
+		;
+	if(c == eq){
+		r->order = atoi(rule);
+		r->pattern = NULL;
+	}
+	else{
+		r->order = -1;
+		r->pattern = strndup(rule, eq - rule);
+		if(r->pattern == NULL)
+			return 2;
+		p->has_name_rules = 1;
+	}
+	p->num_rules++;
+
+	return 0;
+}
+
+/*
+ * Get the name of a thread
+ * Return value:
+ *      0       --> success
+ *      other   --> the thread is gone
+ */
+static int read_comm(pid_t tid, char *comm, size_t size)
+{
+	char path[64];
+	FILE *f;
+	char *nl;
+
+	snprintf(path, sizeof(path), "/proc/%d/comm", tid);
+	f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	if(fgets(comm, size, f) == NULL){
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	nl = strchr(comm, '\n');
+	if(nl)
+		*nl = '\0';
+
+	return 0;
+}
+
+/*
+ * Find the first rule matching a thread
+ * Parameters:
+ *	order	--> creation order of the thread, -1 to match names only
+ * Return value:
+ *      the rule, NULL if none matches
+ */
+static place_rule *match_rule(place_info *p, pid_t tid, int order)
+{
+	char comm[64];
+	int has_comm = 0;
+	int i;
+
+	if(p->has_name_rules)
+		has_comm = !read_comm(tid, comm, sizeof(comm));
+
+	for(i = 0; i < p->num_rules; i++){
+		place_rule *r = &p->rules[i];
+
+		if(r->pattern == NULL){
+			if(r->order == order)
+				return r;
+		}
+		else if(has_comm && !fnmatch(r->pattern, comm, 0))
+			return r;
+	}
+
+	return NULL;
+}
+
+int pfm_place_new_thread(void *handle, pid_t tid, cpu_set_t *set)
+{
+	place_info *p = (place_info*)handle;
+	place_rule *r;
+	int order;
+
+	if(p == NULL)
+		return 1;
+	order = p->next++;
+
+	r = match_rule(p, tid, order);
+	if(r){
+		*set = r->set;
+		return 0;
+	}
+	if(p->num == 0)
+		return 1;
+
+	CPU_ZERO(set);
+	CPU_SET(p->order[order % p->num], set);
+
+	return 0;
+}
+
+int pfm_place_exec(void *handle, pid_t tid, cpu_set_t *set)
+{
+	place_info *p = (place_info*)handle;
+	place_rule *r;
+
+	if(p == NULL || !p->has_name_rules)
+		return 1;
+
+	r = match_rule(p, tid, -1);
+	if(r == NULL)
+		return 1;
+	*set = r->set;
+
+	return 0;
+}
+
+void pfm_place_print(void *handle)
+{
+	place_info *p = (place_info*)handle;
+	int i;
+
+	if(p == NULL || p->num == 0)
+		return;
+
+	fprintf((FILE*)err_out, "pfm_multi: %s placement on cpus",
+		policy_names[p->policy]);
+	for(i = 0; i < p->num; i++)
+		fprintf((FILE*)err_out, "%s%d", i ? "," : " ", p->order[i]);
+	fprintf((FILE*)err_out, "\n");
+}
+
+void pfm_place_close(void *handle)
+{
+	place_info *p = (place_info*)handle;
+	int i;
+
+	if(p == NULL)
+		return;
+
+	for(i = 0; i < p->num_rules; i++)
+		free(p->rules[i].pattern);
+	free(p->rules);
+	free(p->order);
+	free(p);
+}
@@ -0,0 +1,95 @@
+/*
+ * Placement of the monitored threads on cores (-P, -L and -r). A policy
+ * orders the candidate cpus by the topology, and the n-th thread created is
+ * pinned to the n-th cpu of that order, wrapping around. Rules pin threads
+ * by their creation order or by their name (comm) instead, and take
+ * precedence over the policy.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_PLACE_H__
+#define __PFM_PLACE_H__
+
+#include <sched.h> /* cpu_set_t, needs _GNU_SOURCE */
+#include <sys/types.h>
+
+/* placement policies */
+#define PFM_PLACE_NONE 0 /* only rules pin threads */
+#define PFM_PLACE_RR 1 /* the cpus in the order given to -P */
+#define PFM_PLACE_COMPACT 2 /* fill the SMT siblings, then the cores of a
+			       socket, then the next socket */
+#define PFM_PLACE_SCATTER 3 /* one socket after another */
+#define PFM_PLACE_CORE 4 /* one thread per physical core, then the other
+			    siblings */
+
+/*
+ * Get the policy of a name: rr, compact, scatter or core
+ * Return value:
+ *      the policy, -1 if the name is unknown
+ */
+int pfm_place_policy(const char *name);
+
+/*
+ * Create a placement
+ * Parameters:
+ *	policy	--> the policy
+ *	cpus	--> the candidate cpus, NULL for all online cpus
+ *	num	--> number of candidate cpus
+ * Output parameter:
+ *	handle	--> the handle of the placement
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid parameter
+ *      2       --> failed to allocate memory or to read the topology
+ */
+int pfm_place_init(void **handle, int policy, int *cpus, int num);
+
+/*
+ * Add a rule: "order=cpus" pins the order-th thread created (0 is the first
+ * thread) and "name=cpus" pins the threads whose comm matches the shell
+ * pattern name; cpus is a list of cpus and ranges, e.g. "0,4-7". Rules are
+ * matched in the order they are added.
+ * Parameters:
+ *	handle	--> the handle of the placement
+ *	rule	--> the rule
+ * Return value:
+ *      0       --> success
+ *      1       --> syntax error
+ *      2       --> failed to allocate memory
+ */
+int pfm_place_add_rule(void *handle, const char *rule);
+
+/*
+ * Place a new thread; threads must be placed in the order they are created
+ * Parameters:
+ *	handle	--> the handle of the placement
+ *	tid	--> the new thread
+ * Output parameter:
+ *	set	--> the cpus to pin the thread to
+ * Return value:
+ *      0       --> set is valid
+ *      1       --> the thread is not pinned
+ */
+int pfm_place_new_thread(void *handle, pid_t tid, cpu_set_t *set);
+
+/*
+ * Place a thread again after an exec changed its name; only name rules
+ * apply
+ * Return value:
+ *      0       --> set is valid
+ *      1       --> the thread keeps its cpus
+ */
+int pfm_place_exec(void *handle, pid_t tid, cpu_set_t *set);
+
+/*
+ * Print the order of the cpus used by the policy to err_out
+ */
+void pfm_place_print(void *handle);
+
+/*
+ * Free a placement
+ */
+void pfm_place_close(void *handle);
+
+#endif
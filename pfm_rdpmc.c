@@ -0,0 +1,120 @@
+/*
+ * Userspace counter reading through the perf_event_mmap_page of an event.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+
+#include "pfm_rdpmc.h"
+
+#define barrier() __asm__ volatile("" ::: "memory")
+
+void *pfm_rdpmc_map(int fd)
+{
+	void *page;
+
+	page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+	if(page == MAP_FAILED)
+		return NULL;
+
+	return page;
+}
+
+void pfm_rdpmc_unmap(void *page)
+{
+	if(page)
+		munmap(page, sysconf(_SC_PAGESIZE));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static inline uint64_t rdpmc(unsigned int counter)
+{
+	uint32_t low, high;
+
+	__asm__ volatile("rdpmc" : "=a" (low), "=d" (high) : "c" (counter));
+
+	return low | ((uint64_t)high) << 32;
+}
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t low, high;
+
+	__asm__ volatile("rdtsc" : "=a" (low), "=d" (high));
+
+	return low | ((uint64_t)high) << 32;
+}
+
+int pfm_rdpmc_read(void *page, uint64_t *values)
+{
+	struct perf_event_mmap_page *pc = (struct perf_event_mmap_page *)page;
+	uint32_t seq, idx, time_mult, time_shift;
+	uint64_t count, enabled, running, cyc, time_offset;
+	uint64_t quot, rem, delta;
+	int64_t pmc;
+
+	/* 
+	 * the kernel updates the page under pc->lock; retry until we get a 
+	 * consistent snapshot (see the comments in linux/perf_event.h)
+	 */
+	do {
+		seq = pc->lock;
+		barrier();
+
+		if(!pc->cap_user_rdpmc || !pc->cap_user_time)
+			return 1;
+
+		/* 
+		 * index is 0 if the event is not on the PMU now (disabled or 
+		 * multiplexed out); its times are only known by the kernel 
+		 */
+		idx = pc->index;
+		if(!idx)
+			return 1;
+
+		enabled = pc->time_enabled;
+		running = pc->time_running;
+		count = pc->offset;
+		cyc = rdtsc();
+		time_offset = pc->time_offset;
+		time_mult = pc->time_mult;
+		time_shift = pc->time_shift;
+
+		/* sign extend the counter to 64 bits */
+		pmc = rdpmc(idx - 1);
+		pmc <<= 64 - pc->pmc_width;
+		pmc >>= 64 - pc->pmc_width;
+		count += pmc;
+
+		barrier();
+	} while(pc->lock != seq);
+
+	/* the times in the page are as of the last schedule in */
+	quot = cyc >> time_shift;
+	rem = cyc & (((uint64_t)1 << time_shift) - 1);
+	delta = time_offset + quot * time_mult + 
+		((rem * time_mult) >> time_shift);
+	enabled += delta;
+	running += delta;
+
+	values[0] = count;
+	values[1] = enabled;
+	values[2] = running;
+
+	return 0;
+}
+
+#else
+
+int pfm_rdpmc_read(void *page, uint64_t *values)
+{
+	/* no rdpmc on this architecture */
+	return 1;
+}
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Userspace counter reading through the perf_event_mmap_page of an event.
+ * The counters are read with rdpmc under the seqlock of the mmap'd page, 
+ * without entering the kernel. This is used by pfm_multi for per-core 
+ * contexts, and by the pfm_trigger lib for self-monitoring.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_RDPMC_H__
+#define __PFM_RDPMC_H__
+
+#include <stdint.h>
+
+/*
+ * Map the perf_event_mmap_page of an opened event
+ * Parameters:
+ *	fd	--> the perf event fd
+ * Return value:
+ *      the mapped page, NULL if the page can not be mapped
+ */
+void *pfm_rdpmc_map(int fd);
+
+/*
+ * Unmap a page mapped with pfm_rdpmc_map
+ * Parameters:
+ *	page	--> the mapped page, NULL is ignored
+ */
+void pfm_rdpmc_unmap(void *page);
+
+/*
+ * Read an event in userspace with the seqlock + rdpmc protocol. The event
+ * must be scheduled on the cpu running the caller, i.e. it monitors the 
+ * calling thread, or it is a per-cpu event and the caller runs on that cpu.
+ * Parameters:
+ *	page	--> the mapped page of the event
+ * Output parameters:
+ *	values	--> raw count, time enabled and time running, i.e., the same
+ *                  layout as a read() with PERF_FORMAT_SCALE
+ * Return value:
+ *      0       --> success
+ *      1       --> rdpmc or user time is not available (cap_user_rdpmc or 
+ *                  cap_user_time is off, or not on x86); use read() instead
+ */
+int pfm_rdpmc_read(void *page, uint64_t *values);
+
+#endif
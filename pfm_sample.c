@@ -0,0 +1,1187 @@
+/*
+ * Sampling mode: ring buffers of sampling events, drained in place, and the
+ * instruction pointer histograms of each thread; the load latency event of
+ * the memory sampling mode shares the rings and the drain thread.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+#include <errno.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "pfm_common.h"
+#include "pfm_sample.h"
+#include "pfm_ctx_table.h"
+#include "pfm_output.h"
+#include "pfm_sysfs.h"
+
+#define SAMPLE_RING_PAGES 8 /* data pages of each ring, a power of 2 */
+#define SAMPLE_DRAIN_US 10000 /* us between two passes of the drain thread */
+#define KERNEL_IP 0x8000000000000000ULL /* kernel addresses start here */
+#define MEM_LOADS "mem-loads" /* the load latency event in sysfs */
+/* the leader the load latency event needs on some processors */
+#define MEM_LOADS_AUX "mem-loads-aux"
+#define MEM_SAMPLE_TYPE (PERF_SAMPLE_IP | PERF_SAMPLE_TID | \
+			 PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR | \
+			 PERF_SAMPLE_WEIGHT | PERF_SAMPLE_DATA_SRC)
+
+/* the function symbols of an ELF file */
+typedef struct _elf_sym{
+	uint64_t addr;
+	uint64_t size;
+	const char *name;
+}elf_sym;
+
+typedef struct _elf_load{
+	uint64_t offset;
+	uint64_t vaddr;
+	uint64_t size;
+}elf_load;
+
+/* an interned path and, once loaded, the symbols of its ELF file */
+typedef struct _path_info{
+	char *path;
+	int loaded;
+	elf_sym *syms; /* sorted by address */
+	int num_syms;
+	char *strtab; /* names of syms */
+	elf_load *loads;
+	int num_loads;
+	struct _path_info *next;
+}path_info;
+
+/* the ring of one sampling event */
+typedef struct _sample_ring{
+	void *buf; /* the mapped header page and data pages */
+	uint64_t mask; /* size of the data pages - 1 */
+	int evt;
+}sample_ring;
+
+/* an instruction pointer and where it is, seen the first time it is hit */
+typedef struct _ip_slot{
+	uint64_t ip; /* 0 for a free slot */
+	uint64_t count;
+	path_info *file; /* the mapped file, NULL if unknown */
+	uint64_t offset; /* offset of ip in the file */
+}ip_slot;
+
+/* the samples of one thread and event, an open-addressing hash of ips */
+typedef struct _ip_hist{
+	ip_slot *slots;
+	int num_slots; /* a power of 2 */
+	int used;
+	uint64_t samples;
+}ip_hist;
+
+/* a data page hit by sampled loads */
+typedef struct _page_slot{
+	uint64_t page; /* 0 for a free slot */
+	uint64_t count;
+	uint64_t latency; /* summed cycles */
+	int node; /* NUMA node when first hit, num_nodes if unknown */
+}page_slot;
+
+/* the pages of one thread, an open-addressing hash as ip_hist */
+typedef struct _page_hist{
+	page_slot *slots;
+	int num_slots; /* a power of 2 */
+	int used;
+	uint64_t samples;
+}page_hist;
+
+typedef struct _thread_hist{
+	pid_t tid;
+	pid_t pid;
+	ip_hist *hists; /* one per event */
+	pfm_mem_stats_t *mem; /* loads since the last flush, NULL if none */
+	page_hist pages;
+}thread_hist;
+
+/* a line of /proc/pid/maps */
+typedef struct _map_entry{
+	uint64_t start;
+	uint64_t end;
+	uint64_t offset;
+	path_info *file; /* NULL for anonymous memory */
+}map_entry;
+
+typedef struct _proc_maps{
+	map_entry *entries; /* sorted by address, as in the file */
+	int num;
+	uint64_t pass; /* drain pass of the last reading */
+}proc_maps;
+
+/* sampling settings */
+static uint64_t sample_period;
+static int sample_top;
+static char **evt_names;
+static int num_evts;
+static size_t page_size;
+
+/* the drain thread, and the lock it holds for a pass */
+static pthread_t drainer;
+static int drainer_running;
+static int drainer_stopping;
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t drain_pass;
+
+static pfm_ctx_table_t rings; /* sample_ring, by fd */
+static pfm_ctx_table_t threads; /* thread_hist, by tid */
+static pfm_ctx_table_t maps; /* proc_maps, by pid */
+static path_info *paths;
+static uint64_t lost_samples;
+static int map_failures;
+
+/* 
+ * the load latency event, and its auxiliary leader if any, as probed by 
+ * pfm_sample_mem_init; the event samples last
+ */
+static struct perf_event_attr mem_attrs[2];
+static int num_mem_attrs;
+static const char *mem_pmu;
+static int num_nodes;
+
+/*
+ * Intern a path; the paths live until the report
+ */
+static path_info *intern_path(const char *path)
+{
+	path_info *p;
+
+	for(p = paths; p; p = p->next)
+		if(!strcmp(p->path, path))
+			return p;
+
+	p = calloc(1, sizeof(path_info));
+	if(p == NULL)
+		return NULL;
+	p->path = strdup(path);
+	if(p->path == NULL){
+		free(p);
+		return NULL;
+	}
+	p->next = paths;
+	paths = p;
+
+	return p;
+}
+
+static void free_maps(proc_maps *m)
+{
+	free(m->entries);
+	free(m);
+}
+
+/*
+ * Read the file mappings of a process
+ * Return value:
+ *      the mappings, NULL if the process is gone
+ */
+static proc_maps *read_maps(pid_t pid)
+{
+	char line[4096], path[4096];
+	proc_maps *m;
+	map_entry *e;
+	FILE *f;
+	int max = 0;
+
+	snprintf(line, sizeof(line), "/proc/%d/maps", pid);
+	f = fopen(line, "r");
+	if(f == NULL)
+		return NULL;
+	m = calloc(1, sizeof(proc_maps));
+	if(m == NULL){
+		fclose(f);
+		return NULL;
+	}
+
+	while(fgets(line, sizeof(line), f)){
+		uint64_t start, end, offset;
+		char perms[8];
+		path_info *p = NULL;
+
+		path[0] = '\0';
+		if(sscanf(line, "%"SCNx64"-%"SCNx64" %7s %"SCNx64" %*s %*s "
+			  "%4095[^\n]", &start, &end, perms, &offset,
+			  path) < 4)
+			continue;
+		/* only code is sampled */
+		if(perms[2] != 'x')
+			continue;
+		if(path[0])
+			p = intern_path(path);
+
+		if(m->num == max){
+			max = max ? max * 2 : 64;
+			e = realloc(m->entries, sizeof(map_entry) * max);
+			if(e == NULL)
+				break;
+			m->entries = e;
+		}
+		e = &m->entries[m->num++];
+		e->start = start;
+		e->end = end;
+		e->offset = offset;
+		e->file = p;
+	}
+	fclose(f);
+
+	return m;
+}
+
+static map_entry *find_map(proc_maps *m, uint64_t ip)
+{
+	int lo = 0, hi = m->num - 1, mid;
+
+	while(lo <= hi){
+		mid = (lo + hi) / 2;
+		if(ip < m->entries[mid].start)
+			hi = mid - 1;
+		else if(ip >= m->entries[mid].end)
+			lo = mid + 1;
+		else
+			return &m->entries[mid];
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the mapping of an ip in a process; the mappings are read again once
+ * per drain pass if the ip is not mapped, e.g., after a dlopen
+ */
+static map_entry *locate_ip(pid_t pid, uint64_t ip)
+{
+	proc_maps *m = pfm_ctx_table_lookup(&maps, pid);
+	map_entry *e = NULL;
+
+	if(m)
+		e = find_map(m, ip);
+	if(e || (m && m->pass == drain_pass))
+		return e;
+
+	if(m)
+		free_maps(pfm_ctx_table_remove(&maps, pid));
+	m = read_maps(pid);
+	if(m == NULL)
+		return NULL;
+	m->pass = drain_pass;
+	if(pfm_ctx_table_insert(&maps, pid, m) < 0){
+		free_maps(m);
+		return NULL;
+	}
+
+	return find_map(m, ip);
+}
+
+static thread_hist *get_thread(pid_t pid, pid_t tid)
+{
+	thread_hist *t = pfm_ctx_table_lookup(&threads, tid);
+
+	if(t)
+		return t;
+	t = calloc(1, sizeof(thread_hist));
+	if(t == NULL)
+		return NULL;
+	t->hists = calloc(num_evts, sizeof(ip_hist));
+	if((num_evts && t->hists == NULL) || 
+	   pfm_ctx_table_insert(&threads, tid, t) < 0){
+		free(t->hists);
+		free(t);
+		return NULL;
+	}
+	t->tid = tid;
+	t->pid = pid;
+
+	return t;
+}
+
+static ip_slot *find_slot(ip_slot *slots, int num, uint64_t ip)
+{
+	uint64_t i = (ip * 0x9e3779b97f4a7c15ULL) >> 32;
+
+	for(i &= num - 1; slots[i].ip && slots[i].ip != ip; 
+	    i = (i + 1) & (num - 1))
+		;
+
+	return &slots[i];
+}
+
+/*
+ * Double the slots of a histogram
+ * Return value:
+ *      0       --> success
+ *      other   --> out of memory
+ */
+static int grow_hist(ip_hist *h)
+{
+	int num = h->num_slots ? h->num_slots * 2 : 256;
+	ip_slot *slots;
+	int i;
+
+	slots = calloc(num, sizeof(ip_slot));
+	if(slots == NULL)
+		return -1;
+	for(i = 0; i < h->num_slots; i++)
+		if(h->slots[i].ip)
+			*find_slot(slots, num, h->slots[i].ip) = 
+				h->slots[i];
+	free(h->slots);
+	h->slots = slots;
+	h->num_slots = num;
+
+	return 0;
+}
+
+static void add_sample(int evt, uint64_t ip, pid_t pid, pid_t tid)
+{
+	thread_hist *t = get_thread(pid, tid);
+	ip_hist *h;
+	ip_slot *s;
+	map_entry *e;
+
+	if(t == NULL || ip == 0)
+		return;
+	h = &t->hists[evt];
+	h->samples++;
+	if(h->used * 2 >= h->num_slots && grow_hist(h))
+		return;
+
+	s = find_slot(h->slots, h->num_slots, ip);
+	if(s->ip == 0){
+		/* where the ip is mapped now, the mappings may change later */
+		s->ip = ip;
+		h->used++;
+		if(ip < KERNEL_IP && (e = locate_ip(pid, ip)) != NULL){
+			s->file = e->file;
+			s->offset = ip - e->start + e->offset;
+		}
+	}
+	s->count++;
+}
+
+static page_slot *find_page(page_slot *slots, int num, uint64_t page)
+{
+	uint64_t i = (page * 0x9e3779b97f4a7c15ULL) >> 32;
+
+	for(i &= num - 1; slots[i].page && slots[i].page != page; 
+	    i = (i + 1) & (num - 1))
+		;
+
+	return &slots[i];
+}
+
+/*
+ * Double the slots of a page histogram
+ * Return value:
+ *      0       --> success
+ *      other   --> out of memory
+ */
+static int grow_pages(page_hist *h)
+{
+	int num = h->num_slots ? h->num_slots * 2 : 256;
+	page_slot *slots;
+	int i;
+
+	slots = calloc(num, sizeof(page_slot));
+	if(slots == NULL)
+		return -1;
+	for(i = 0; i < h->num_slots; i++)
+		if(h->slots[i].page)
+			*find_page(slots, num, h->slots[i].page) = 
+				h->slots[i];
+	free(h->slots);
+	h->slots = slots;
+	h->num_slots = num;
+
+	return 0;
+}
+
+/*
+ * Get the NUMA node of a page of a process, with move_pages(2) moving 
+ * nothing
+ * Return value:
+ *      the node, num_nodes if the page is not present or not accessible
+ */
+static int page_node(pid_t pid, uint64_t page)
+{
+	void *addr = (void*)(uintptr_t)page;
+	int status = -1;
+
+	if(syscall(SYS_move_pages, pid, 1UL, &addr, NULL, &status, 0) ||
+	   status < 0 || status >= num_nodes)
+		return num_nodes;
+
+	return status;
+}
+
+/*
+ * Where a load was served, from the PERF_SAMPLE_DATA_SRC of its sample
+ */
+static int mem_source(uint64_t data_src)
+{
+	uint64_t lvl = (data_src >> PERF_MEM_LVL_SHIFT) & 0x3fff;
+#ifdef PERF_MEM_LVLNUM_SHIFT
+	uint64_t num = (data_src >> PERF_MEM_LVLNUM_SHIFT) & 0xf;
+	int remote = (data_src >> PERF_MEM_REMOTE_SHIFT) & 1;
+#endif
+
+	if(lvl & PERF_MEM_LVL_HIT){
+		if(lvl & PERF_MEM_LVL_L1)
+			return PFM_MEM_SRC_L1;
+		if(lvl & PERF_MEM_LVL_LFB)
+			return PFM_MEM_SRC_LFB;
+		if(lvl & PERF_MEM_LVL_L2)
+			return PFM_MEM_SRC_L2;
+		if(lvl & PERF_MEM_LVL_L3)
+			return PFM_MEM_SRC_L3;
+		if(lvl & PERF_MEM_LVL_LOC_RAM)
+			return PFM_MEM_SRC_DRAM;
+		if(lvl & (PERF_MEM_LVL_REM_RAM1 | PERF_MEM_LVL_REM_RAM2))
+			return PFM_MEM_SRC_REMOTE_DRAM;
+		if(lvl & (PERF_MEM_LVL_REM_CCE1 | PERF_MEM_LVL_REM_CCE2))
+			return PFM_MEM_SRC_REMOTE_CACHE;
+	}
+#ifdef PERF_MEM_LVLNUM_SHIFT
+	/* newer kernels may only fill the level number */
+	switch(num){
+	case PERF_MEM_LVLNUM_L1:
+		return PFM_MEM_SRC_L1;
+	case PERF_MEM_LVLNUM_LFB:
+		return PFM_MEM_SRC_LFB;
+	case PERF_MEM_LVLNUM_L2:
+		return PFM_MEM_SRC_L2;
+	case PERF_MEM_LVLNUM_L3:
+		return remote ? PFM_MEM_SRC_REMOTE_CACHE : PFM_MEM_SRC_L3;
+	case PERF_MEM_LVLNUM_ANY_CACHE:
+		return remote ? PFM_MEM_SRC_REMOTE_CACHE : PFM_MEM_SRC_OTHER;
+	case PERF_MEM_LVLNUM_RAM:
+		return remote ? PFM_MEM_SRC_REMOTE_DRAM : PFM_MEM_SRC_DRAM;
+	}
+#endif
+
+	return PFM_MEM_SRC_OTHER;
+}
+
+static void add_mem_sample(pid_t pid, pid_t tid, uint64_t addr, 
+			   uint64_t latency, uint64_t data_src)
+{
+	thread_hist *t = get_thread(pid, tid);
+	page_hist *h;
+	page_slot *p;
+	int bucket;
+
+	if(t == NULL)
+		return;
+	if(t->mem == NULL){
+		t->mem = calloc(1, sizeof(pfm_mem_stats_t) + 
+				sizeof(uint64_t) * (num_nodes + 1));
+		if(t->mem == NULL)
+			return;
+	}
+
+	for(bucket = 0; bucket < PFM_MEM_LAT_BUCKETS - 1 && 
+		    latency >= (32ULL << bucket); bucket++)
+		;
+	t->mem->samples++;
+	t->mem->latency += latency;
+	t->mem->lat[bucket]++;
+	t->mem->src[mem_source(data_src)]++;
+
+	/* some loads have no address, e.g., when the PMU cannot tell */
+	if(addr == 0){
+		t->mem->nodes[num_nodes]++;
+		return;
+	}
+	h = &t->pages;
+	h->samples++;
+	if(h->used * 2 >= h->num_slots && grow_pages(h)){
+		t->mem->nodes[num_nodes]++;
+		return;
+	}
+	p = find_page(h->slots, h->num_slots, addr & ~(page_size - 1));
+	if(p->page == 0){
+		/* the node where the page is now, it may migrate later */
+		p->page = addr & ~(page_size - 1);
+		p->node = page_node(pid, p->page);
+		h->used++;
+	}
+	p->count++;
+	p->latency += latency;
+	t->mem->nodes[p->node]++;
+}
+
+/*
+ * Parse the records of a ring in place; a record that wraps around the end
+ * of the ring is the only one copied
+ */
+static void drain_ring(sample_ring *r)
+{
+	struct perf_event_mmap_page *hdr = r->buf;
+	char *data = (char*)r->buf + page_size;
+	uint64_t head = __atomic_load_n(&hdr->data_head, __ATOMIC_ACQUIRE);
+	uint64_t tail = hdr->data_tail;
+	uint64_t copy[8];
+	struct perf_event_header *eh;
+	uint64_t *body, off;
+
+	while(tail < head){
+		/* headers are 8-byte aligned, so they never wrap */
+		eh = (struct perf_event_header*)(data + (tail & r->mask));
+		if(eh->size < sizeof(*eh))
+			break;
+		off = tail & r->mask;
+		body = (uint64_t*)(eh + 1);
+		if(off + eh->size > r->mask + 1 && eh->size <= sizeof(copy)){
+			size_t first = r->mask + 1 - off;
+
+			memcpy(copy, eh, first);
+			memcpy((char*)copy + first, data, eh->size - first);
+			body = (uint64_t*)((struct perf_event_header*)copy + 1);
+		}
+
+		if(eh->type == PERF_RECORD_SAMPLE && r->evt == PFM_SAMPLE_MEM &&
+		   eh->size >= sizeof(*eh) + 6 * sizeof(uint64_t))
+			/* then the address, the latency and the source */
+			add_mem_sample((pid_t)(uint32_t)body[1],
+				       (pid_t)(body[1] >> 32), body[3], body[4],
+				       body[5]);
+		else if(eh->type == PERF_RECORD_SAMPLE && 
+			r->evt != PFM_SAMPLE_MEM &&
+			eh->size >= sizeof(*eh) + 3 * sizeof(uint64_t))
+			/* ip, then pid and tid, then time */
+			add_sample(r->evt, body[0], (pid_t)(uint32_t)body[1],
+				   (pid_t)(body[1] >> 32));
+		else if(eh->type == PERF_RECORD_LOST)
+			lost_samples += body[1];
+		tail += eh->size;
+	}
+
+	__atomic_store_n(&hdr->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void drain_all()
+{
+	int i;
+
+	drain_pass++;
+	for(i = 0; i < pfm_ctx_table_slots(&rings); i++){
+		sample_ring *r = pfm_ctx_table_get(&rings, i);
+
+		if(r)
+			drain_ring(r);
+	}
+}
+
+static void * drain_thread(void * param)
+{
+	while(!__atomic_load_n(&drainer_stopping, __ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&sample_lock);
+		drain_all();
+		pthread_mutex_unlock(&sample_lock);
+		usleep(SAMPLE_DRAIN_US);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start the drain thread, for the first of the sampling modes
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+static int start_drainer(int top)
+{
+	sample_top = top;
+	if(drainer_running)
+		return 0;
+	page_size = sysconf(_SC_PAGESIZE);
+
+	if(pfm_ctx_table_init(&rings) || pfm_ctx_table_init(&threads) ||
+	   pfm_ctx_table_init(&maps))
+		return -1;
+
+	drainer_stopping = 0;
+	if(pthread_create(&drainer, NULL, drain_thread, NULL))
+		return -1;
+	drainer_running = 1;
+
+	return 0;
+}
+
+int pfm_sample_init(uint64_t period, int top, const char **names, int num)
+{
+	int i;
+
+	sample_period = period;
+	evt_names = calloc(num, sizeof(char*));
+	if(evt_names == NULL)
+		return -1;
+	for(i = 0; i < num; i++)
+		evt_names[i] = strdup(names[i]);
+	num_evts = num;
+
+	return start_drainer(top);
+}
+
+/*
+ * Get the number of NUMA nodes, from the possible nodes
+ */
+static int count_nodes()
+{
+	char buf[256];
+	char *last;
+
+	if(pfm_sysfs_read_line("/sys/devices/system/node/possible", buf, 
+			       sizeof(buf)))
+		return 1;
+	/* e.g. "0-3" or "0" */
+	last = strrchr(buf, '-');
+	if(last == NULL)
+		last = strrchr(buf, ',');
+
+	return (last ? atoi(last + 1) : atoi(buf)) + 1;
+}
+
+/*
+ * Open the load latency events as a group, the sampling event last
+ * Return value:
+ *      0       --> success
+ *      other   --> failed, errno is set and nothing is left open
+ */
+static int open_mem_group(struct perf_event_attr *attrs, int *fds, pid_t pid,
+			  int cpu)
+{
+	int i, saved;
+
+	for(i = 0; i < num_mem_attrs; i++){
+		fds[i] = perf_event_open(&attrs[i], pid, cpu, 
+					 i ? fds[0] : -1, 0);
+		if(fds[i] == -1){
+			saved = errno;
+			while(i--)
+				close(fds[i]);
+			errno = saved;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int pfm_sample_mem_init(uint64_t period, int ldlat, int top)
+{
+	static const char *pmus[] = {"cpu", "cpu_core"};
+	struct perf_event_attr *attr;
+	int fds[2];
+	int i, type, excl, precise;
+
+	memset(mem_attrs, 0, sizeof(mem_attrs));
+	for(i = 0; i < sizeof(pmus) / sizeof(pmus[0]); i++){
+		type = pfm_sysfs_pmu_type(pmus[i]);
+		if(type != -1 && 
+		   !pfm_sysfs_encode_event(pmus[i], MEM_LOADS, &mem_attrs[1]))
+			break;
+	}
+	if(i == sizeof(pmus) / sizeof(pmus[0]))
+		return 1;
+	mem_pmu = pmus[i];
+
+	/* 
+	 * the threshold is a term of the event, e.g. "ldlat=3"; a PMU 
+	 * without it samples all loads
+	 */
+	if(pfm_sysfs_encode_term(mem_pmu, "ldlat", ldlat, &mem_attrs[1]))
+		DPRINTF("No load latency threshold in PMU %s\n", mem_pmu);
+	num_mem_attrs = 1;
+	if(!pfm_sysfs_encode_event(mem_pmu, MEM_LOADS_AUX, &mem_attrs[0]))
+		num_mem_attrs = 2;
+	else
+		mem_attrs[0] = mem_attrs[1];
+	attr = &mem_attrs[num_mem_attrs - 1];
+	for(i = 0; i < num_mem_attrs; i++){
+		mem_attrs[i].type = type;
+		mem_attrs[i].size = sizeof(struct perf_event_attr);
+	}
+	attr->sample_period = period;
+	attr->sample_type = MEM_SAMPLE_TYPE;
+
+	/* 
+	 * the most precise level the PMU takes, counting the kernel if 
+	 * allowed; try it on ourselves
+	 */
+	for(excl = 0; excl < 2; excl++)
+		for(precise = 3; precise > 0; precise--){
+			for(i = 0; i < num_mem_attrs; i++){
+				mem_attrs[i].precise_ip = precise;
+				mem_attrs[i].exclude_kernel = excl;
+				mem_attrs[i].exclude_hv = excl;
+			}
+			if(open_mem_group(mem_attrs, fds, 0, -1))
+				continue;
+			for(i = 0; i < num_mem_attrs; i++)
+				close(fds[i]);
+			goto found;
+		}
+	return 2;
+
+ found:
+	num_nodes = count_nodes();
+	if(start_drainer(top))
+		return 3;
+
+	return 0;
+}
+
+void pfm_sample_mem_print()
+{
+	struct perf_event_attr *attr = &mem_attrs[num_mem_attrs - 1];
+
+	fprintf((FILE*)err_out, "pfm_multi: sampling loads every %'"PRIu64
+		" with %s/%s/%s, precise level %d, %d NUMA nodes\n", 
+		(uint64_t)attr->sample_period, mem_pmu, MEM_LOADS, 
+		num_mem_attrs > 1 ? " led by " MEM_LOADS_AUX : "",
+		attr->precise_ip, num_nodes);
+}
+
+int pfm_sample_mem_open(perf_event_desc_t **fds, int *num, pid_t tid, 
+			int cpu, int disabled, int enable_on_exec)
+{
+	struct perf_event_attr attrs[2];
+	perf_event_desc_t *f;
+	int opened[2];
+	int i;
+
+	*fds = NULL;
+	*num = 0;
+	f = calloc(num_mem_attrs, sizeof(perf_event_desc_t));
+	if(f == NULL)
+		return -1;
+
+	memcpy(attrs, mem_attrs, sizeof(attrs));
+	/* the leader enables and disables the group */
+	attrs[0].disabled = disabled;
+	attrs[0].enable_on_exec = enable_on_exec;
+	if(open_mem_group(attrs, opened, tid, cpu)){
+		free(f);
+		return -1;
+	}
+
+	for(i = 0; i < num_mem_attrs; i++){
+		f[i].hw = attrs[i];
+		f[i].fd = opened[i];
+		f[i].group_leader = 0;
+		f[i].name = i == num_mem_attrs - 1 ? MEM_LOADS : MEM_LOADS_AUX;
+	}
+	*fds = f;
+	*num = num_mem_attrs;
+	/* without a ring, the thread or cpu is simply not sampled */
+	pfm_sample_map(&f[num_mem_attrs - 1], PFM_SAMPLE_MEM);
+
+	return 0;
+}
+
+void pfm_sample_mem_flush()
+{
+	int i;
+
+	if(!drainer_running || !num_mem_attrs)
+		return;
+
+	pthread_mutex_lock(&sample_lock);
+	drain_all();
+	for(i = 0; i < pfm_ctx_table_slots(&threads); i++){
+		thread_hist *t = pfm_ctx_table_get(&threads, i);
+
+		if(t == NULL || t->mem == NULL || t->mem->samples == 0)
+			continue;
+		pfm_output_memory(t->tid, t->pid, t->mem, num_nodes);
+		memset(t->mem, 0, sizeof(pfm_mem_stats_t) + 
+		       sizeof(uint64_t) * (num_nodes + 1));
+	}
+	pthread_mutex_unlock(&sample_lock);
+	pfm_output_commit();
+}
+
+void pfm_sample_setup(perf_event_desc_t *fd)
+{
+	fd->hw.sample_period = sample_period;
+	fd->hw.sample_type = PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+		PERF_SAMPLE_TIME;
+	fd->hw.freq = 0;
+}
+
+int pfm_sample_map(perf_event_desc_t *fd, int evt)
+{
+	sample_ring *r;
+	void *buf;
+
+	r = calloc(1, sizeof(sample_ring));
+	if(r == NULL)
+		return -1;
+	buf = mmap(NULL, (SAMPLE_RING_PAGES + 1) * page_size,
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fd->fd, 0);
+	if(buf == MAP_FAILED){
+		/* say it once, there may be thousands of events */
+		if(map_failures++ == 0)
+			warn("cannot map the sample ring of %s, see "
+			     "/proc/sys/kernel/perf_event_mlock_kb", fd->name);
+		free(r);
+		return -1;
+	}
+	r->buf = buf;
+	r->mask = SAMPLE_RING_PAGES * page_size - 1;
+	r->evt = evt;
+
+	pthread_mutex_lock(&sample_lock);
+	if(pfm_ctx_table_insert(&rings, fd->fd, r) < 0){
+		pthread_mutex_unlock(&sample_lock);
+		munmap(buf, (SAMPLE_RING_PAGES + 1) * page_size);
+		free(r);
+		return -1;
+	}
+	pthread_mutex_unlock(&sample_lock);
+
+	/* close_fds unmaps through pfm_sample_unmap, before pgmsk */
+	fd->buf = buf;
+
+	return 0;
+}
+
+void pfm_sample_unmap(perf_event_desc_t *fd)
+{
+	sample_ring *r;
+
+	if(!drainer_running || fd->fd == -1)
+		return;
+
+	pthread_mutex_lock(&sample_lock);
+	r = pfm_ctx_table_remove(&rings, fd->fd);
+	if(r)
+		drain_ring(r);
+	pthread_mutex_unlock(&sample_lock);
+	if(r == NULL)
+		return;
+
+	munmap(r->buf, (SAMPLE_RING_PAGES + 1) * page_size);
+	free(r);
+	fd->buf = NULL;
+}
+
+void pfm_sample_exec(pid_t pid)
+{
+	proc_maps *m;
+
+	if(!drainer_running)
+		return;
+
+	pthread_mutex_lock(&sample_lock);
+	m = pfm_ctx_table_remove(&maps, pid);
+	pthread_mutex_unlock(&sample_lock);
+	if(m)
+		free_maps(m);
+}
+
+static int compare_syms(const void *a, const void *b)
+{
+	const elf_sym *x = a, *y = b;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/*
+ * Load the function symbols and loadable segments of a 64-bit ELF file;
+ * .symtab is used if the file has one, .dynsym otherwise
+ */
+static void load_elf(path_info *p)
+{
+	Elf64_Ehdr *eh;
+	Elf64_Shdr *sh, *symtab = NULL;
+	Elf64_Phdr *ph;
+	Elf64_Sym *sym;
+	char *image;
+	long size;
+	FILE *f;
+	int i, num;
+
+	p->loaded = 1;
+	f = fopen(p->path, "r");
+	if(f == NULL)
+		return;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	image = size > (long)sizeof(Elf64_Ehdr) ? malloc(size) : NULL;
+	if(image == NULL || fread(image, size, 1, f) != 1){
+		free(image);
+		fclose(f);
+		return;
+	}
+	fclose(f);
+
+	eh = (Elf64_Ehdr*)image;
+	if(memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+	   eh->e_ident[EI_CLASS] != ELFCLASS64 ||
+	   eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf64_Shdr) > size ||
+	   eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf64_Phdr) > size)
+		goto out;
+
+	ph = (Elf64_Phdr*)(image + eh->e_phoff);
+	p->loads = calloc(eh->e_phnum, sizeof(elf_load));
+	for(i = 0; p->loads && i < eh->e_phnum; i++)
+		if(ph[i].p_type == PT_LOAD){
+			p->loads[p->num_loads].offset = ph[i].p_offset;
+			p->loads[p->num_loads].vaddr = ph[i].p_vaddr;
+			p->loads[p->num_loads].size = ph[i].p_filesz;
+			p->num_loads++;
+		}
+
+	sh = (Elf64_Shdr*)(image + eh->e_shoff);
+	for(i = 0; i < eh->e_shnum; i++)
+		if(sh[i].sh_type == SHT_SYMTAB ||
+		   (sh[i].sh_type == SHT_DYNSYM && symtab == NULL))
+			symtab = &sh[i];
+	if(symtab == NULL || symtab->sh_link >= eh->e_shnum ||
+	   symtab->sh_offset + symtab->sh_size > size ||
+	   sh[symtab->sh_link].sh_offset + sh[symtab->sh_link].sh_size > size)
+		goto out;
+
+	/* keep the names, the image is freed */
+	p->strtab = malloc(sh[symtab->sh_link].sh_size);
+	num = symtab->sh_size / sizeof(Elf64_Sym);
+	p->syms = calloc(num, sizeof(elf_sym));
+	if(p->strtab == NULL || p->syms == NULL)
+		goto out;
+	memcpy(p->strtab, image + sh[symtab->sh_link].sh_offset,
+	       sh[symtab->sh_link].sh_size);
+
+	sym = (Elf64_Sym*)(image + symtab->sh_offset);
+	for(i = 0; i < num; i++){
+		if(ELF64_ST_TYPE(sym[i].st_info) != STT_FUNC ||
+		   sym[i].st_shndx == SHN_UNDEF ||
+		   sym[i].st_name >= sh[symtab->sh_link].sh_size)
+			continue;
+		p->syms[p->num_syms].addr = sym[i].st_value;
+		p->syms[p->num_syms].size = sym[i].st_size;
+		p->syms[p->num_syms].name = p->strtab + sym[i].st_name;
+		p->num_syms++;
+	}
+	qsort(p->syms, p->num_syms, sizeof(elf_sym), compare_syms);
+
+ out:
+	free(image);
+}
+
+/*
+ * Print the symbol of an ip, e.g. "main+0x1a (/usr/bin/app)"
+ */
+static void print_symbol(FILE *out, ip_slot *s)
+{
+	path_info *p = s->file;
+	uint64_t vaddr = 0;
+	int i, lo, hi, mid, found = -1;
+
+	if(s->ip >= KERNEL_IP){
+		fprintf(out, "[kernel]\n");
+		return;
+	}
+	if(p == NULL){
+		fprintf(out, "[unknown]\n");
+		return;
+	}
+	if(!p->loaded)
+		load_elf(p);
+
+	/* the file offset as an address of the ELF file */
+	for(i = 0; i < p->num_loads; i++)
+		if(s->offset >= p->loads[i].offset &&
+		   s->offset < p->loads[i].offset + p->loads[i].size){
+			vaddr = s->offset - p->loads[i].offset +
+				p->loads[i].vaddr;
+			break;
+		}
+	if(i < p->num_loads){
+		lo = 0;
+		hi = p->num_syms - 1;
+		while(lo <= hi){
+			mid = (lo + hi) / 2;
+			if(p->syms[mid].addr <= vaddr){
+				found = mid;
+				lo = mid + 1;
+			}
+			else
+				hi = mid - 1;
+		}
+	}
+
+	if(found != -1 && (p->syms[found].size == 0 ||
+			   vaddr < p->syms[found].addr + p->syms[found].size))
+		fprintf(out, "%s+0x%"PRIx64" (%s)\n", p->syms[found].name,
+			vaddr - p->syms[found].addr, p->path);
+	else
+		fprintf(out, "%s+0x%"PRIx64"\n", p->path, s->offset);
+}
+
+static int compare_counts(const void *a, const void *b)
+{
+	const ip_slot *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+static int compare_threads(const void *a, const void *b)
+{
+	const thread_hist *x = *(thread_hist**)a, *y = *(thread_hist**)b;
+
+	return x->tid - y->tid;
+}
+
+/*
+ * Print the top ips of a histogram, its slots are sorted in place
+ */
+static void print_hist(FILE *out, thread_hist *t, int evt)
+{
+	ip_hist *h = &t->hists[evt];
+	int i, num = 0;
+
+	if(h->samples == 0)
+		return;
+
+	for(i = 0; i < h->num_slots; i++)
+		if(h->slots[i].ip)
+			h->slots[num++] = h->slots[i];
+	qsort(h->slots, num, sizeof(ip_slot), compare_counts);
+
+	fprintf(out, "\nthread [%d] (process [%d]): %'"PRIu64" samples of %s"
+		" every %'"PRIu64" events\n", t->tid, t->pid, h->samples,
+		evt_names[evt], sample_period);
+	for(i = 0; i < num && i < sample_top; i++){
+		fprintf(out, "%7.2f%% %'12"PRIu64"  %#18"PRIx64"  ",
+			h->slots[i].count * 100.0 / h->samples,
+			h->slots[i].count, h->slots[i].ip);
+		print_symbol(out, &h->slots[i]);
+	}
+}
+
+static int compare_pages(const void *a, const void *b)
+{
+	const page_slot *x = a, *y = b;
+
+	return (x->count < y->count) - (x->count > y->count);
+}
+
+/*
+ * Print the hottest pages of a thread, its slots are sorted in place
+ */
+static void print_pages(FILE *out, thread_hist *t)
+{
+	page_hist *h = &t->pages;
+	int i, num = 0;
+
+	if(h->samples == 0)
+		return;
+
+	for(i = 0; i < h->num_slots; i++)
+		if(h->slots[i].page)
+			h->slots[num++] = h->slots[i];
+	qsort(h->slots, num, sizeof(page_slot), compare_pages);
+
+	fprintf(out, "\nthread [%d] (process [%d]): %'"PRIu64" sampled loads "
+		"on %d pages\n", t->tid, t->pid, h->samples, num);
+	for(i = 0; i < num && i < sample_top; i++){
+		fprintf(out, "%7.2f%% %'12"PRIu64"  %#18"PRIx64"  %8.1f cycles  ",
+			h->slots[i].count * 100.0 / h->samples,
+			h->slots[i].count, h->slots[i].page, 
+			(double)h->slots[i].latency / h->slots[i].count);
+		if(h->slots[i].node == num_nodes)
+			fprintf(out, "node unknown\n");
+		else
+			fprintf(out, "node <%d>\n", h->slots[i].node);
+	}
+}
+
+void pfm_sample_report(void *out)
+{
+	thread_hist **list;
+	path_info *p;
+	int i, evt, num = 0;
+
+	if(!drainer_running)
+		return;
+
+	__atomic_store_n(&drainer_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(drainer, NULL);
+	drainer_running = 0;
+	/* rings of events that are still open */
+	drain_all();
+
+	list = calloc(pfm_ctx_table_slots(&threads) + 1, sizeof(thread_hist*));
+	for(i = 0; list && i < pfm_ctx_table_slots(&threads); i++)
+		if(pfm_ctx_table_get(&threads, i))
+			list[num++] = pfm_ctx_table_get(&threads, i);
+	if(list)
+		qsort(list, num, sizeof(thread_hist*), compare_threads);
+	for(i = 0; i < num; i++)
+		for(evt = 0; evt < num_evts; evt++)
+			print_hist((FILE*)out, list[i], evt);
+	for(i = 0; i < num; i++)
+		print_pages((FILE*)out, list[i]);
+	fflush((FILE*)out);
+	if(lost_samples)
+		warnx("%"PRIu64" samples lost, the rings were full",
+		      lost_samples);
+	free(list);
+
+	/* free everything */
+	for(i = 0; i < pfm_ctx_table_slots(&threads); i++){
+		thread_hist *t = pfm_ctx_table_get(&threads, i);
+
+		if(t == NULL)
+			continue;
+		for(evt = 0; evt < num_evts; evt++)
+			free(t->hists[evt].slots);
+		free(t->hists);
+		free(t->mem);
+		free(t->pages.slots);
+		free(t);
+	}
+	pfm_ctx_table_destroy(&threads);
+	for(i = 0; i < pfm_ctx_table_slots(&maps); i++)
+		if(pfm_ctx_table_get(&maps, i))
+			free_maps(pfm_ctx_table_get(&maps, i));
+	pfm_ctx_table_destroy(&maps);
+	for(i = 0; i < pfm_ctx_table_slots(&rings); i++){
+		sample_ring *r = pfm_ctx_table_get(&rings, i);
+
+		if(r == NULL)
+			continue;
+		munmap(r->buf, (SAMPLE_RING_PAGES + 1) * page_size);
+		free(r);
+	}
+	pfm_ctx_table_destroy(&rings);
+	while(paths){
+		p = paths;
+		paths = p->next;
+		free(p->path);
+		free(p->syms);
+		free(p->strtab);
+		free(p->loads);
+		free(p);
+	}
+	for(i = 0; i < num_evts; i++)
+		free(evt_names[i]);
+	free(evt_names);
+	evt_names = NULL;
+	num_evts = 0;
+	num_mem_attrs = 0;
+}
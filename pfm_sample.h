@@ -0,0 +1,134 @@
+/*
+ * Sampling modes of pfm_multi (-S and -W). With -S, every event also samples
+ * the instruction
+ * pointer each period events into a ring buffer mapped from its fd; a drain
+ * thread parses the samples in place in the rings and counts them per thread
+ * and event and instruction pointer. At the end, the hottest instruction
+ * pointers of each thread are printed with their symbols, resolved from the
+ * /proc/pid/maps of the process, read while it ran, and the ELF symbol
+ * tables of the mapped files.
+ *
+ * With -W, every thread or cpu also opens the load latency event of the PMU
+ * (PEBS on Intel), which samples the data address, the latency and the data
+ * source of loads. The samples of each thread are bucketed by latency, data
+ * source and NUMA node of the page, and queued with each reading; the 
+ * hottest pages of each thread are printed at the end.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_SAMPLE_H__
+#define __PFM_SAMPLE_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "perf_util.h"
+
+#define PFM_SAMPLE_MEM -1 /* the evt of the ring of the load latency event */
+
+/*
+ * Start the drain thread
+ * Parameters:
+ *	period	--> events between two samples
+ *	top	--> number of instruction pointers printed per thread and
+ *                  event
+ *	names	--> the name of each event of the list
+ *	num	--> number of events in the list
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+int pfm_sample_init(uint64_t period, int top, const char **names, int num);
+
+/*
+ * Find the load latency event of the PMU, check that it can sample the data
+ * address, latency and source of loads, and start the drain thread
+ * Parameters:
+ *	period	--> loads between two samples
+ *	ldlat	--> the least latency of the sampled loads, in cycles
+ *	top	--> number of pages printed per thread
+ * Return value:
+ *      0       --> success
+ *      1       --> the PMU has no load latency event (mem-loads), e.g., it
+ *                  is not an Intel PMU with PEBS
+ *      2       --> the event cannot sample loads, e.g., in a virtual 
+ *                  machine; errno is set
+ *      3       --> failed to start the drain thread
+ */
+int pfm_sample_mem_init(uint64_t period, int ldlat, int top);
+
+/*
+ * Print the load latency event found by pfm_sample_mem_init to err_out
+ */
+void pfm_sample_mem_print();
+
+/*
+ * Open the load latency event for a thread or a cpu and map its ring; on 
+ * some processors, the event needs an auxiliary event as group leader, so
+ * the events are returned as a group whose last event samples
+ * Parameters:
+ *	tid		--> the thread, -1 for a cpu
+ *	cpu		--> the cpu, -1 for a thread
+ *	disabled	--> whether the group is opened disabled
+ *	enable_on_exec	--> whether the group is enabled by the next exec
+ * Output parameters:
+ *	fds		--> the opened events, closed as any event list
+ *	num		--> number of events
+ * Return value:
+ *      0       --> success
+ *      other   --> failed to open the events, errno is set
+ */
+int pfm_sample_mem_open(perf_event_desc_t **fds, int *num, pid_t tid, 
+			int cpu, int disabled, int enable_on_exec);
+
+/*
+ * Queue the loads of each thread sampled since the last flush, see 
+ * pfm_output_memory; called with each reading and at the end
+ */
+void pfm_sample_mem_flush();
+
+/*
+ * Make an event sample, before it is opened
+ * Parameters:
+ *	fd	--> the event
+ */
+void pfm_sample_setup(perf_event_desc_t *fd);
+
+/*
+ * Map the ring buffer of an opened sampling event and hand it to the drain
+ * thread
+ * Parameters:
+ *	fd	--> the event
+ *	evt	--> index of the event in the list
+ * Return value:
+ *      0       --> success
+ *      other   --> failed, e.g., the locked memory limit is reached; the
+ *                  event still counts
+ */
+int pfm_sample_map(perf_event_desc_t *fd, int evt);
+
+/*
+ * Take the samples left in the ring buffer of an event and unmap it, before
+ * the event is closed; does nothing if the event has no sampling ring
+ * Parameters:
+ *	fd	--> the event
+ */
+void pfm_sample_unmap(perf_event_desc_t *fd);
+
+/*
+ * Forget the mappings of a process that has exec'd a new program
+ * Parameters:
+ *	pid	--> the process
+ */
+void pfm_sample_exec(pid_t pid);
+
+/*
+ * Stop the drain thread and print the hottest instruction pointers and data
+ * pages of each thread; call after every sampling event is closed
+ * Parameters:
+ *	out	--> the FILE to print to
+ */
+void pfm_sample_report(void *out);
+
+#endif
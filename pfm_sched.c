@@ -0,0 +1,241 @@
+/*
+ * Periodic sampling scheduler built on an absolute-deadline timerfd and epoll.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "pfm_common.h"
+#include "pfm_sched.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+#define MAX_EPOLL_EVENTS 16
+
+/* an fd monitored by the scheduler */
+typedef struct _pfm_sched_fd{
+	int fd;
+	pfm_sched_fd_fn fn;
+	void *arg;
+	struct _pfm_sched_fd *next;
+}sched_fd;
+
+/* data used by the scheduler */
+typedef struct _pfm_sched_info{
+	int epfd;
+	int timerfd;
+	int stopfd; /* eventfd written by pfm_sched_stop */
+	uint64_t interval;
+	uint64_t start;
+	uint64_t seq; /* number of deadlines passed, including missed ones */
+	uint64_t missed;
+	sched_fd *fds;
+}sched_info;
+
+uint64_t pfm_sched_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static inline void ns_to_timespec(uint64_t ns, struct timespec *ts)
+{
+	ts->tv_sec = ns / NSEC_PER_SEC;
+	ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+static int epoll_add(int epfd, int fd, uint32_t events, void *ptr)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = ptr;
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int pfm_sched_init(void **handle, long interval, uint64_t start)
+{
+	sched_info *s;
+	struct itimerspec its;
+
+	if(handle == NULL || interval <= 0)
+		return 1;
+	*handle = NULL;
+
+	s = (sched_info*)calloc(1, sizeof(sched_info));
+	if(s == NULL)
+		return 2;
+	s->epfd = s->timerfd = s->stopfd = -1;
+	s->interval = interval;
+	s->start = start ? start : pfm_sched_now();
+
+	s->epfd = epoll_create1(EPOLL_CLOEXEC);
+	s->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	s->stopfd = eventfd(0, EFD_CLOEXEC);
+	if(s->epfd == -1 || s->timerfd == -1 || s->stopfd == -1){
+		DPRINTF("Failed to create scheduler fds: %d\n", errno);
+		goto error;
+	}
+
+	/* 
+	 * absolute deadlines: the kernel advances the deadline by interval 
+	 * from the previous deadline, not from the time we read the timer
+	 */
+	ns_to_timespec(s->start + s->interval, &its.it_value);
+	ns_to_timespec(s->interval, &its.it_interval);
+	if(timerfd_settime(s->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1){
+		DPRINTF("Failed to arm scheduler timer: %d\n", errno);
+		goto error;
+	}
+
+	/* NULL marks the timer, the stop eventfd is marked by itself */
+	if(epoll_add(s->epfd, s->timerfd, EPOLLIN, NULL) == -1 ||
+	   epoll_add(s->epfd, s->stopfd, EPOLLIN, &s->stopfd) == -1)
+		goto error;
+
+	*handle = (void*)s;
+
+	return 0;
+
+ error:
+	pfm_sched_close(s);
+	return 2;
+}
+
+int pfm_sched_add_fd(void *handle, int fd, uint32_t events, pfm_sched_fd_fn fn,
+		     void *arg)
+{
+	sched_info *s = (sched_info*)handle;
+	sched_fd *f;
+
+	if(s == NULL || fn == NULL)
+		return 1;
+
+	f = (sched_fd*)calloc(1, sizeof(sched_fd));
+	if(f == NULL)
+		return 2;
+	f->fd = fd;
+	f->fn = fn;
+	f->arg = arg;
+
+	if(epoll_add(s->epfd, fd, events, f) == -1){
+		free(f);
+		return 2;
+	}
+	f->next = s->fds;
+	s->fds = f;
+
+	return 0;
+}
+
+int pfm_sched_run(void *handle, pfm_sched_tick_fn fn, void *arg)
+{
+	sched_info *s = (sched_info*)handle;
+	struct epoll_event evs[MAX_EPOLL_EVENTS];
+	pfm_sched_tick_t tick;
+	uint64_t expirations;
+	int i, n, quit = 0;
+
+	if(s == NULL)
+		return 1;
+
+	while(!quit){
+		n = epoll_wait(s->epfd, evs, MAX_EPOLL_EVENTS, -1);
+		if(n == -1){
+			if(errno == EINTR)
+				continue;
+			DPRINTF("Scheduler epoll error: %d\n", errno);
+			return 2;
+		}
+
+		for(i = 0; i < n && !quit; i++){
+			if(evs[i].data.ptr == &s->stopfd){
+				quit = 1;
+			}
+			else if(evs[i].data.ptr == NULL){
+				/* number of deadlines passed since last read */
+				if(read(s->timerfd, &expirations, 
+					sizeof(expirations)) != 
+				   sizeof(expirations))
+					continue;
+				s->seq += expirations;
+				s->missed += expirations - 1;
+
+				tick.seq = s->seq;
+				tick.intended = s->start + s->seq * s->interval;
+				tick.actual = pfm_sched_now();
+				tick.missed = expirations - 1;
+				if(fn && fn(&tick, arg))
+					quit = 1;
+			}
+			else{
+				sched_fd *f = (sched_fd*)evs[i].data.ptr;
+
+				if(f->fn(f->fd, evs[i].events, f->arg))
+					quit = 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int pfm_sched_stop(void *handle)
+{
+	sched_info *s = (sched_info*)handle;
+	uint64_t one = 1;
+
+	if(s == NULL)
+		return 1;
+
+	if(write(s->stopfd, &one, sizeof(one)) != sizeof(one))
+		return 2;
+
+	return 0;
+}
+
+uint64_t pfm_sched_missed(void *handle)
+{
+	sched_info *s = (sched_info*)handle;
+
+	if(s == NULL)
+		return 0;
+
+	return s->missed;
+}
+
+int pfm_sched_close(void *handle)
+{
+	sched_info *s = (sched_info*)handle;
+	sched_fd *f;
+
+	if(s == NULL)
+		return 1;
+
+	while(s->fds){
+		f = s->fds;
+		s->fds = f->next;
+		free(f);
+	}
+	if(s->epfd != -1)
+		close(s->epfd);
+	if(s->timerfd != -1)
+		close(s->timerfd);
+	if(s->stopfd != -1)
+		close(s->stopfd);
+	free(s);
+
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Periodic sampling scheduler for pfm_multi. Ticks are driven by a timerfd 
+ * armed with absolute deadlines, so the sampling period does not drift with 
+ * the cost of a sampling pass. The timer is multiplexed with other fds (e.g.,
+ * signalfd) in one epoll loop.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_SCHED_H__
+#define __PFM_SCHED_H__
+
+#include <stdint.h>
+
+/* information about one tick, all times are in ns of CLOCK_MONOTONIC */
+typedef struct __pfm_sched_tick{
+	uint64_t seq; /* tick number, starting from 1 */
+	uint64_t intended; /* the deadline of this tick */
+	uint64_t actual; /* the time the tick is handled */
+	uint64_t missed; /* number of deadlines skipped before this tick */
+}pfm_sched_tick_t;
+
+/*
+ * Callback for ticks
+ * Return value:
+ *      0       --> continue
+ *      other   --> stop the scheduler
+ */
+typedef int (*pfm_sched_tick_fn)(pfm_sched_tick_t *tick, void *arg);
+
+/*
+ * Callback for other fds, events are the epoll events of fd
+ * Return value:
+ *      0       --> continue
+ *      other   --> stop the scheduler
+ */
+typedef int (*pfm_sched_fd_fn)(int fd, uint32_t events, void *arg);
+
+/*
+ * Create a scheduler
+ * Parameters:
+ *	interval	--> tick interval in nanoseconds
+ *	start		--> the time of tick 0 (first deadline is start + 
+ *                          interval); 0 means now
+ * Output parameter:
+ *	handle		--> the handle of the scheduler
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid parameter
+ *      2       --> failed to create timerfd/epoll
+ */
+int pfm_sched_init(void **handle, long interval, uint64_t start);
+
+/*
+ * Add an fd to be monitored along with the timer
+ * Parameters:
+ *	handle	--> the handle of the scheduler
+ *	fd	--> the fd
+ *	events	--> epoll events to wait for, e.g., EPOLLIN
+ *	fn	--> the callback
+ *	arg	--> argument passed to the callback
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid handle
+ *      2       --> epoll error
+ */
+int pfm_sched_add_fd(void *handle, int fd, uint32_t events, pfm_sched_fd_fn fn,
+		     void *arg);
+
+/*
+ * Run the scheduler loop until a callback asks to stop, or until 
+ * pfm_sched_stop is called. Blocks the calling thread.
+ * Parameters:
+ *	handle	--> the handle of the scheduler
+ *	fn	--> the tick callback
+ *	arg	--> argument passed to the callback
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid handle
+ *      2       --> timerfd/epoll error
+ */
+int pfm_sched_run(void *handle, pfm_sched_tick_fn fn, void *arg);
+
+/*
+ * Ask a running scheduler to stop; can be called from any thread
+ */
+int pfm_sched_stop(void *handle);
+
+/*
+ * Get the number of missed deadlines so far
+ */
+uint64_t pfm_sched_missed(void *handle);
+
+/*
+ * Destroy the scheduler
+ */
+int pfm_sched_close(void *handle);
+
+/*
+ * Current time in ns of CLOCK_MONOTONIC
+ */
+uint64_t pfm_sched_now(void);
+
+#endif
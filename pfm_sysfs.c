@@ -0,0 +1,139 @@
+/*
+ * PMU events described in sysfs.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "perf_util.h"
+
+#include "pfm_common.h"
+#include "pfm_sysfs.h"
+
+int pfm_sysfs_read_line(const char *path, char *buf, int size)
+{
+	FILE *f;
+	char *nl;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	if(fgets(buf, size, f) == NULL){
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	nl = strchr(buf, '\n');
+	if(nl)
+		*nl = '\0';
+
+	return 0;
+}
+
+int pfm_sysfs_pmu_type(const char *pmu)
+{
+	char path[512], buf[64];
+
+	snprintf(path, sizeof(path), PFM_SYSFS_PMU_DIR "/%s/type", pmu);
+	if(pfm_sysfs_read_line(path, buf, sizeof(buf)))
+		return -1;
+
+	return atoi(buf);
+}
+
+/*
+ * Put the bits of value into the config fields of a format, e.g.
+ * "config:0-7" or "config1:0-3,8"
+ * Return value:
+ *      0       --> success
+ *      other   --> unknown format
+ */
+static int deposit_bits(struct perf_event_attr *attr, const char *format,
+			uint64_t value)
+{
+	uint64_t *config;
+	const char *s;
+	char *end;
+	long lo, hi;
+
+	if(!strncmp(format, "config:", 7))
+		config = (uint64_t*)&attr->config;
+	else if(!strncmp(format, "config1:", 8))
+		config = (uint64_t*)&attr->config1;
+	else if(!strncmp(format, "config2:", 8))
+		config = (uint64_t*)&attr->config2;
+	else
+		return -1;
+
+	s = strchr(format, ':') + 1;
+	while(*s){
+		lo = strtol(s, &end, 10);
+		if(end == s || lo < 0 || lo > 63)
+			return -1;
+		hi = lo;
+		if(*end == '-')
+			hi = strtol(end + 1, &end, 10);
+		if(hi < lo || hi > 63)
+			return -1;
+		for(; lo <= hi; lo++, value >>= 1){
+			*config &= ~(1ULL << lo);
+			if(value & 1)
+				*config |= 1ULL << lo;
+		}
+		if(*end == ',')
+			end++;
+		else if(*end)
+			return -1;
+		s = end;
+	}
+
+	return 0;
+}
+
+int pfm_sysfs_encode_term(const char *pmu, const char *term, uint64_t value,
+			  struct perf_event_attr *attr)
+{
+	char path[512], format[128];
+
+	snprintf(path, sizeof(path), PFM_SYSFS_PMU_DIR "/%s/format/%s", pmu,
+		 term);
+	if(pfm_sysfs_read_line(path, format, sizeof(format)) ||
+	   deposit_bits(attr, format, value))
+		return -1;
+
+	return 0;
+}
+
+int pfm_sysfs_encode_event(const char *pmu, const char *event,
+			   struct perf_event_attr *attr)
+{
+	char path[512], terms[256];
+	char *term, *eq, *saveptr;
+	uint64_t value;
+
+	snprintf(path, sizeof(path), PFM_SYSFS_PMU_DIR "/%s/events/%s", pmu,
+		 event);
+	if(pfm_sysfs_read_line(path, terms, sizeof(terms)))
+		return -1;
+
+	for(term = strtok_r(terms, ",", &saveptr); term;
+	    term = strtok_r(NULL, ",", &saveptr)){
+		/* a term without a value is a flag */
+		value = 1;
+		eq = strchr(term, '=');
+		if(eq){
+			*eq = '\0';
+			value = strtoull(eq + 1, NULL, 0);
+		}
+		if(pfm_sysfs_encode_term(pmu, term, value, attr)){
+			DPRINTF("Cannot encode term %s of %s/%s\n", term, pmu,
+				event);
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * PMU events described in sysfs: the PMUs in /sys/bus/event_source/devices
+ * publish their type, their events (events/) and how event terms map to the
+ * config fields (format/), as the perf tool reads them.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_SYSFS_H__
+#define __PFM_SYSFS_H__
+
+#include <stdint.h>
+
+#define PFM_SYSFS_PMU_DIR "/sys/bus/event_source/devices"
+
+struct perf_event_attr;
+
+/*
+ * Read the first line of a sysfs file, without the newline
+ * Return value:
+ *      0       --> success
+ *      other   --> the file cannot be read
+ */
+int pfm_sysfs_read_line(const char *path, char *buf, int size);
+
+/*
+ * Get the perf type of a PMU, e.g. "cpu"
+ * Return value:
+ *      the type, -1 if there is no such PMU
+ */
+int pfm_sysfs_pmu_type(const char *pmu);
+
+/*
+ * Put a value into the config fields of a term of a PMU, e.g. "ldlat";
+ * the fields are cleared first
+ * Return value:
+ *      0       --> success
+ *      other   --> the PMU has no such term
+ */
+int pfm_sysfs_encode_term(const char *pmu, const char *term, uint64_t value,
+			  struct perf_event_attr *attr);
+
+/*
+ * Encode an event of a PMU from its sysfs description, e.g.
+ * "event=0x04,umask=0x03"; the type is not set
+ * Return value:
+ *      0       --> success
+ *      other   --> the PMU has no such event
+ */
+int pfm_sysfs_encode_event(const char *pmu, const char *event,
+			   struct perf_event_attr *attr);
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * CPU topology from sysfs.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "pfm_topo.h"
+
+#define SYSFS_CPU_DIR "/sys/devices/system/cpu"
+
+/*
+ * Read a number from a sysfs file
+ * Return value:
+ *      the number, -1 if the file cannot be read
+ */
+static int read_sysfs_int(const char *path)
+{
+	FILE *f;
+	int val;
+
+	f = fopen(path, "r");
+	if(f == NULL)
+		return -1;
+	if(fscanf(f, "%d", &val) != 1)
+		val = -1;
+	fclose(f);
+
+	return val;
+}
+
+/*
+ * Get the NUMA node of a cpu; the cpu directory links to its node as nodeN
+ * Return value:
+ *      the node, 0 if unknown
+ */
+static int read_node(int cpu)
+{
+	char path[128];
+	DIR *dir;
+	struct dirent *ent;
+	int node = 0;
+
+	snprintf(path, sizeof(path), SYSFS_CPU_DIR "/cpu%d", cpu);
+	dir = opendir(path);
+	if(dir == NULL)
+		return 0;
+	while((ent = readdir(dir)) != NULL)
+		if(!strncmp(ent->d_name, "node", 4) &&
+		   isdigit((unsigned char)ent->d_name[4])){
+			node = atoi(ent->d_name + 4);
+			break;
+		}
+	closedir(dir);
+
+	return node;
+}
+
+int pfm_topo_read(pfm_topo_t *topo)
+{
+	char path[128];
+	int cpu;
+
+	memset(topo, 0, sizeof(pfm_topo_t));
+	topo->num_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+	topo->socket = (int*)malloc(sizeof(int) * topo->num_cpus);
+	topo->core = (int*)malloc(sizeof(int) * topo->num_cpus);
+	topo->node = (int*)malloc(sizeof(int) * topo->num_cpus);
+	topo->online = (int*)malloc(sizeof(int) * topo->num_cpus);
+	if(!topo->socket || !topo->core || !topo->node || !topo->online){
+		pfm_topo_free(topo);
+		return -1;
+	}
+
+	for(cpu = 0; cpu < topo->num_cpus; cpu++){
+		snprintf(path, sizeof(path), SYSFS_CPU_DIR "/cpu%d/topology/"
+			 "physical_package_id", cpu);
+		topo->socket[cpu] = read_sysfs_int(path);
+		snprintf(path, sizeof(path), SYSFS_CPU_DIR "/cpu%d/topology/"
+			 "core_id", cpu);
+		topo->core[cpu] = read_sysfs_int(path);
+		topo->node[cpu] = read_node(cpu);
+		/* cpus that cannot go offline, e.g. cpu0, have no such file */
+		snprintf(path, sizeof(path), SYSFS_CPU_DIR "/cpu%d/online",
+			 cpu);
+		topo->online[cpu] = read_sysfs_int(path) != 0;
+	}
+
+	return 0;
+}
+
+void pfm_topo_free(pfm_topo_t *topo)
+{
+	free(topo->socket);
+	free(topo->core);
+	free(topo->node);
+	free(topo->online);
+	memset(topo, 0, sizeof(pfm_topo_t));
+}
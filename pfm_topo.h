@@ -0,0 +1,34 @@
+/*
+ * CPU topology of the machine, read from sysfs: the socket, core and NUMA
+ * node of every cpu.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_TOPO_H__
+#define __PFM_TOPO_H__
+
+typedef struct __pfm_topo{
+	int num_cpus; /* cpus 0 to num_cpus - 1, online or not */
+	int *socket; /* physical package of each cpu, -1 if unknown */
+	int *core; /* core id in the package, -1 if unknown */
+	int *node; /* NUMA node of each cpu, 0 if unknown as without NUMA */
+	int *online; /* whether each cpu is online */
+}pfm_topo_t;
+
+/*
+ * Read the topology
+ * Output parameter:
+ *	topo	--> the topology, freed with pfm_topo_free
+ * Return value:
+ *      0       --> success
+ *      other   --> failed to allocate memory
+ */
+int pfm_topo_read(pfm_topo_t *topo);
+
+/*
+ * Free a topology
+ */
+void pfm_topo_free(pfm_topo_t *topo);
+
+#endif
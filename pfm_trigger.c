@@ -10,29 +10,129 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-
-// for message queue
-#include <messageQx.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "pfm_common.h"
 #include "pfm_trigger.h"
 #include "pfm_trigger_common.h"
 #include "pfm_operations.h"
 
+// rounds of polling an empty ring before sleeping on the futex
+#define TRIGGER_SPINS 256
+
 // data used by pfm_trigger
 typedef struct _pfm_trigger_info{
-	void *msgq;
+	trigger_ring *ring;
+	size_t ring_size; // bytes mapped
+	// never read back from the ring, which any process may write
+	uint32_t size; // number of slots
+	uint64_t tail; // next position to consume
 	int is_sys_wide;
 	int *enable_new;
 	// options is pfm_operations_options_t type, kept for future extension
 	void *pfm_op_options;
+	uint64_t num_msgs; // messages received
+	uint64_t num_sleeps; // times slept on an empty ring
 }trigger_info;
 
+/*
+ * Create the ring in shared memory
+ * Return values:
+ *    the ring, NULL if failed
+ */
+static trigger_ring *create_ring(size_t *bytes)
+{
+	trigger_ring *r;
+	size_t size;
+	int fd;
+	uint32_t i;
+
+	size = sizeof(trigger_ring) + 
+		sizeof(trigger_slot) * MAX_NUM_TRIGGER_MSGS;
+
+	// monitored programs may run as other users
+	fd = shm_open(PFM_TRIGGER_SHM_NAME, O_CREAT | O_RDWR | O_TRUNC, 0666);
+	if(fd == -1)
+		return NULL;
+	fchmod(fd, 0666);
+	if(ftruncate(fd, size)){
+		close(fd);
+		shm_unlink(PFM_TRIGGER_SHM_NAME);
+		return NULL;
+	}
+	r = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(r == MAP_FAILED){
+		shm_unlink(PFM_TRIGGER_SHM_NAME);
+		return NULL;
+	}
+
+	r->size = MAX_NUM_TRIGGER_MSGS;
+	r->msg_size = sizeof(trigger_msg);
+	r->attr_size = sizeof(struct perf_event_attr);
+	r->num_events = 0;
+	r->head = 0;
+	r->waiting = 0;
+	for(i = 0; i < MAX_NUM_TRIGGER_MSGS; i++)
+		r->slots[i].seq = i;
+	// senders check the magic before using the ring
+	__atomic_store_n(&r->magic, PFM_TRIGGER_MAGIC, __ATOMIC_RELEASE);
+
+	*bytes = size;
+
+	return r;
+}
+
+/*
+ * Take the next message from the ring, sleep if the ring stays empty
+ */
+static void receive_msg(trigger_info *t, trigger_msg *msg)
+{
+	trigger_ring *r = t->ring;
+	trigger_slot *slot;
+	int spins = 0;
+
+	while(1){
+		slot = &r->slots[t->tail & (t->size - 1)];
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == t->tail+1){
+			*msg = slot->msg;
+			// free the slot for the message one lap later
+			__atomic_store_n(&slot->seq, t->tail + t->size, 
+					 __ATOMIC_RELEASE);
+			t->tail++;
+			t->num_msgs++;
+			return;
+		}
+
+		if(++spins < TRIGGER_SPINS){
+			sched_yield();
+			continue;
+		}
+
+		/* 
+		 * tell the senders we are going to sleep, then look again, 
+		 * so a message sent in between is not missed
+		 */
+		__atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != t->tail+1){
+			t->num_sleeps++;
+			// returns at once if a sender has cleared waiting
+			trigger_futex(&r->waiting, FUTEX_WAIT, 1);
+		}
+		__atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+		spins = 0;
+	}
+}
+
 int pfm_trigger_init(void **handle, int is_sys_wide, int *enable_new, 
 		     void *pfm_op_options)
 {
-	void * msgq;
-	int ret_val;
 	trigger_info *t;
 
 	if(handle == NULL || enable_new == NULL || pfm_op_options == NULL)
@@ -40,18 +140,21 @@ int pfm_trigger_init(void **handle, int is_sys_wide, int *enable_new,
 
 	*handle = NULL;
 
-	// create the message queue for communication
-	ret_val = msgqx_create(PFM_TRIGGER_MSG_NAME, sizeof(trigger_msg), 
-			       MAX_NUM_THREADS, &(msgq));
-	if(ret_val){
-		DPRINTF("Failed to create message queue for pfm trigger %d\n",
-			ret_val);
+	// create the pfm_trigger handle and initialize it
+	t = (trigger_info*)calloc(1, sizeof(trigger_info));
+	if(t == NULL)
+		return 1;
+
+	// create the ring for communication
+	t->ring = create_ring(&t->ring_size);
+	if(t->ring == NULL){
+		DPRINTF("Failed to create the ring for pfm trigger\n");
+		free(t);
 		return 1;
 	}
+	t->size = MAX_NUM_TRIGGER_MSGS;
+	t->tail = 0;
 	
-	// create the pfm_trigger handle and initialize it
-	t = (trigger_info*)calloc(1, sizeof(trigger_info));
-	t->msgq = msgq;
 	t->is_sys_wide = is_sys_wide;
 	t->enable_new = enable_new;
 	*enable_new = 0;
@@ -62,16 +165,69 @@ int pfm_trigger_init(void **handle, int is_sys_wide, int *enable_new,
 }
 
 
+int pfm_trigger_set_events(void *handle, char *evns)
+{
+	trigger_info *t = (trigger_info*)handle;
+	trigger_ring *r;
+	struct perf_event_attr attrs[PFM_TRIGGER_MAX_EVENTS];
+	const char *names[PFM_TRIGGER_MAX_EVENTS];
+	int num, i;
+
+	if(t == NULL || t->ring == NULL)
+		return 1;
+	r = t->ring;
+
+	num = pfm_event_attrs(evns, attrs, names, PFM_TRIGGER_MAX_EVENTS);
+	if(num < 0)
+		return 2;
+	if(num == PFM_TRIGGER_MAX_EVENTS)
+		DPRINTF("Region markers only count the first %d events\n", 
+			num);
+
+	for(i = 0; i < num; i++){
+		snprintf(r->events[i].name, PFM_TRIGGER_EVENT_NAME_LEN, "%s", 
+			 names[i]);
+		r->events[i].attr = attrs[i];
+	}
+	// the lib reads the events after it sees the number
+	__atomic_store_n(&r->num_events, num, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+int pfm_trigger_stop(void *handle)
+{
+	trigger_info *t = (trigger_info*)handle;
+	trigger_msg msg;
+
+	if(t == NULL || t->ring == NULL)
+		return 1;
+
+	msg.id = 0;
+	msg.msg = quit_trigger;
+	trigger_ring_send(t->ring, t->size, &msg);
+
+	return 0;
+}
+
+
 int pfm_trigger_close(void *handle)
 {
 	trigger_info *t = (trigger_info*)handle;
 	int ret_val = 0;
 
-	if(t == NULL || t->msgq == NULL)
+	if(t == NULL || t->ring == NULL)
 		return 1;
 	
-	ret_val = msgqx_close(t->msgq);
-	ret_val = msgqx_destroy(PFM_TRIGGER_MSG_NAME);
+	DPRINTF("pfm_trigger received %"PRIu64" messages, slept %"PRIu64
+		" times\n", t->num_msgs, t->num_sleeps);
+
+	if(munmap(t->ring, t->ring_size))
+		ret_val = 2;
+	if(shm_unlink(PFM_TRIGGER_SHM_NAME))
+		ret_val = 2;
+	free(t);
 	
 	return ret_val;
 }
@@ -80,21 +236,14 @@ int pfm_trigger_close(void *handle)
 int pfm_trigger_begin_process(void *handle)
 {
 	trigger_info *t = (trigger_info*)handle;
-	int ret_val = 0;
 	trigger_msg msg;
 	int quit = 0;
 
-	if(t == NULL || t->msgq == NULL)
+	if(t == NULL || t->ring == NULL)
 		return 1;
 
 	while(1){
-		ret_val = msgqx_receive(t->msgq, &msg);
-
-		if(ret_val){
-			fprintf(stderr, "pfm_trigger message wait error: %d",
-				ret_val);
-			continue;
-		}
+		receive_msg(t, &msg);
 		
 		switch(msg.msg){
 		case thr_enable:
@@ -115,7 +264,8 @@ int pfm_trigger_begin_process(void *handle)
 			break;
 		case all_enable:
 			DPRINTF("pfm_trigger enabling all\n");
-			*t->enable_new = 1;
+			/* new contexts check it again once published */
+			__atomic_exchange_n(t->enable_new, 1, __ATOMIC_SEQ_CST);
 			if(t->is_sys_wide)
 				pfm_enable_mon_all_cores(t->pfm_op_options, 1);
 			else
@@ -124,7 +274,7 @@ int pfm_trigger_begin_process(void *handle)
 			break;
 		case all_disable:
 			DPRINTF("pfm_trigger disabling all\n");
-			*t->enable_new = 0;
+			__atomic_exchange_n(t->enable_new, 0, __ATOMIC_SEQ_CST);
 			if(t->is_sys_wide)
 				pfm_enable_mon_all_cores(t->pfm_op_options, 0);
 			else
@@ -22,7 +22,7 @@
  *
  * Return values:
  *    0: success
- *    1: failed to open message queue
+ *    1: failed to create the shared memory ring
  *    2: invalid parameter, handle and/or enable_new are NULL
  *
  */
@@ -30,14 +30,39 @@ int pfm_trigger_init(void **handle, int is_sys_wide, int *enable_new,
 		     void *pfm_op_options);
 
 /*
- * Close the pfm_trigger
+ * Publish the events monitored by pfm_multi to the pfm_trigger lib, whose 
+ * region markers open the same events on the calling thread
  * Input parameters:
  *    handle: the handle to the pfm_trigger
+ *    evns: list of events, comma separated list in a string
  *
  * return values:
  *    0: success
  *    1: invalid handle
- *    2: failed to close and/or destroy message queue
+ *    2: the events cannot be parsed
+ */
+int pfm_trigger_set_events(void *handle, char *evns);
+
+/*
+ * Ask the message processing of pfm_trigger to quit
+ * Input parameters:
+ *    handle: the handle to the pfm_trigger
+ *
+ * return values:
+ *    0: success
+ *    1: invalid handle
+ */
+int pfm_trigger_stop(void *handle);
+
+/*
+ * Close the pfm_trigger, after its message processing has quit
+ * Input parameters:
+ *    handle: the handle to the pfm_trigger
+ *
+ * return values:
+ *    0: success
+ *    1: invalid handle
+ *    2: failed to unmap and/or remove the shared memory ring
  */
 int pfm_trigger_close(void *handle);
 
@@ -52,7 +77,6 @@ int pfm_trigger_close(void *handle);
  * return values:
  *    0: success
  *    1: invalid handle
- *    2: message queue operation error 
  */
 int pfm_trigger_begin_process(void *handle);
 
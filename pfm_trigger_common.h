@@ -2,13 +2,37 @@
  * Common declaration shared by the pfm_trigger module in pfm_multi and in the 
  * pfm_trigger lib used by monitored programs.
  *
+ * Monitored threads send their messages through a ring in shared memory: a
+ * bounded multi-producer single-consumer queue, where each slot carries a 
+ * sequence number telling whether it is free or filled. Senders only enter 
+ * the kernel to wake pfm_trigger up when it sleeps on an empty ring.
+ *
+ * Any process may write the ring, so nothing pfm_multi indexes with is read
+ * back from it: the number of slots and the position of pfm_trigger are
+ * kept in private memory.
+ *
+ * The shared memory also carries the encoded events monitored by pfm_multi,
+ * so that region markers in the pfm_trigger lib can open the same events on
+ * the calling thread.
+ *
  * Author: Wei Wang <wwang@virginia.edu>
  */
 
 #ifndef __PFM_TRIGGER_COMMON_H__
 #define __PFM_TRIGGER_COMMON_H__
 
-#define PFM_TRIGGER_MSG_NAME "PFMTRIGGERMSGQ"
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+
+#define PFM_TRIGGER_SHM_NAME "/PFMTRIGGERRING"
+#define PFM_TRIGGER_MAGIC 0x50464d5452494733ULL /* "PFMTRIG3" */
+#define PFM_TRIGGER_CACHELINE 64
+#define PFM_TRIGGER_MAX_EVENTS 16 /* events published for region markers */
+#define PFM_TRIGGER_EVENT_NAME_LEN 64
 
 // message types
 typedef enum _pfm_trigger_msg_type{
@@ -28,6 +52,84 @@ typedef struct _pfm_trigger_msg{
 	trigger_msg_ty msg;
 }trigger_msg;
 
+// a slot of the ring
+typedef struct _pfm_trigger_slot{
+	/* 
+	 * pos + 1 when the message for position pos is filled, 
+	 * pos + size when the slot is free for position pos + size
+	 */
+	uint64_t seq;
+	trigger_msg msg;
+}trigger_slot;
+
+// an event published for region markers
+typedef struct _pfm_trigger_event{
+	char name[PFM_TRIGGER_EVENT_NAME_LEN];
+	struct perf_event_attr attr;
+}trigger_event;
+
+// the ring in shared memory
+typedef struct _pfm_trigger_ring{
+	uint64_t magic;
+	uint32_t size; // number of slots, a power of 2, for the lib to check
+	uint32_t msg_size;
+	uint32_t attr_size; // sizeof(struct perf_event_attr) of pfm_multi
+	// number of events, stored after the events are filled
+	uint32_t num_events;
+	trigger_event events[PFM_TRIGGER_MAX_EVENTS];
+	// next position to fill, claimed by senders with CAS
+	uint64_t head __attribute__((aligned(PFM_TRIGGER_CACHELINE)));
+	// futex word, 1 when pfm_trigger sleeps or is about to
+	uint32_t waiting __attribute__((aligned(PFM_TRIGGER_CACHELINE)));
+	trigger_slot slots[] __attribute__((aligned(PFM_TRIGGER_CACHELINE)));
+}trigger_ring;
+
+static inline long trigger_futex(uint32_t *uaddr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+/*
+ * Put a message in the ring, wake pfm_trigger up if it sleeps.
+ * Like mq_send on a full queue, blocks until pfm_trigger frees a slot.
+ * size is the number of slots, as checked when the ring was mapped.
+ */
+static inline void trigger_ring_send(trigger_ring *r, uint32_t size, 
+				     trigger_msg *msg)
+{
+	uint64_t pos, seq;
+	trigger_slot *slot;
+	int64_t diff;
+
+	pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	while(1){
+		slot = &r->slots[pos & (size - 1)];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		diff = (int64_t)(seq - pos);
+		if(diff == 0){
+			if(__atomic_compare_exchange_n(&r->head, &pos, pos + 1,
+						       1, __ATOMIC_RELAXED,
+						       __ATOMIC_RELAXED))
+				break;
+			/* pos is reloaded by the failed CAS */
+		}
+		else if(diff < 0){
+			/* full, give pfm_trigger some time to drain */
+			sched_yield();
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+		else
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	}
+
+	slot->msg = *msg;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
 
+	/* the store above must be visible before waiting is checked */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&r->waiting, __ATOMIC_RELAXED) &&
+	   __atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST))
+		trigger_futex(&r->waiting, FUTEX_WAKE, 1);
+}
 
 #endif
@@ -7,50 +7,125 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
-#include <messageQx.h>
 #include <common_toolx.h>
 
 #include "pfm_trigger.h"
 #include "pfm_common.h"
 #include "pfm_trigger_lib.h"
 #include "pfm_trigger_common.h"
+#include "pfm_rdpmc.h"
 
-void * msgq = NULL;
+#define MAX_REGION_DEPTH 16
+#define REGION_NAME_LEN 64 // for names passed from Fortran
+
+trigger_ring * ring = NULL;
+size_t ring_size = 0;
+static uint32_t ring_slots; // number of slots, as checked when mapped
+
+/*
+ * Region markers read counters opened by each thread on itself, so a 
+ * region starts and ends exactly at the marker calls. The counters are read
+ * with rdpmc when the kernel allows it, and with read() otherwise.
+ */
+
+// a region of a thread, summed over its calls
+typedef struct _region_stats{
+	char *name;
+	uint64_t calls;
+	uint64_t counts[PFM_TRIGGER_MAX_EVENTS]; // scaled
+}region_stats;
+
+// a begun region, with the counters read when it began
+typedef struct _region_frame{
+	int region; // index in the regions of the thread
+	uint64_t values[PFM_TRIGGER_MAX_EVENTS * 3];
+}region_frame;
+
+// the counters and regions of a thread
+typedef struct _region_thread{
+	pid_t tid;
+	int num_fds;
+	int fds[PFM_TRIGGER_MAX_EVENTS];
+	void *pages[PFM_TRIGGER_MAX_EVENTS]; // NULL if not mapped
+	int depth;
+	region_frame stack[MAX_REGION_DEPTH];
+	region_stats *regions;
+	int num_regions;
+	int max_regions;
+	struct _region_thread *next;
+}region_thread;
+
+static __thread region_thread *self_regions;
+static __thread int self_regions_failed; // do not retry on every region
+// every thread that used regions, kept after exit for the report
+static region_thread *all_regions;
+static pthread_mutex_t regions_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t regions_key;
+static pthread_once_t regions_once = PTHREAD_ONCE_INIT;
+// event names, copied since the ring may be unmapped before the report
+static char region_evt_names[PFM_TRIGGER_MAX_EVENTS][PFM_TRIGGER_EVENT_NAME_LEN];
+static int region_num_evts;
 
 void * err_out;
 void * reading_out;
 
 int pfm_trigger_user_init()
 {
-	int ret_val = 0;
-	int size;
+	int fd;
+	struct stat st;
+	trigger_ring *r;
+	uint32_t slots;
 
 	err_out = stderr;
 	reading_out = stdout;
 
-	msgq = NULL;
-	ret_val = msgqx_open(PFM_TRIGGER_MSG_NAME, &msgq, &size);
-
-	if(ret_val){
-		msgq = NULL;
+	ring = NULL;
+	fd = shm_open(PFM_TRIGGER_SHM_NAME, O_RDWR, 0);
+	if(fd == -1)
+		return 1;
+	if(fstat(fd, &st) || st.st_size < (off_t)sizeof(trigger_ring)){
+		close(fd);
 		return 1;
 	}
-	if(size != sizeof(trigger_msg)){
-		msgqx_close(msgq);
-		msgq = NULL;
+	r = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(r == MAP_FAILED)
+		return 1;
+
+	// a ring of another version of pfm_multi
+	slots = r->size;
+	if(__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != PFM_TRIGGER_MAGIC ||
+	   r->msg_size != sizeof(trigger_msg) || 
+	   r->attr_size != sizeof(struct perf_event_attr) || 
+	   slots == 0 || (slots & (slots - 1)) ||
+	   st.st_size < (off_t)(sizeof(trigger_ring) + 
+				sizeof(trigger_slot) * slots)){
+		munmap(r, st.st_size);
 		return 2;
 	}
+
+	ring = r;
+	ring_size = st.st_size;
+	ring_slots = slots;
 	
 	return 0;
 }
 
 int pfm_trigger_user_enable_thread(int enable)
 {
-	int ret_val;
 	trigger_msg msg;
 
-	if(msgq == NULL)
+	if(ring == NULL)
 		return 1;
 
 	msg.id = gettid();
@@ -60,26 +135,19 @@ int pfm_trigger_user_enable_thread(int enable)
 		msg.msg = thr_disable;
 
 	
-	ret_val = msgqx_send(msgq, &msg);
+	trigger_ring_send(ring, ring_slots, &msg);
 	DPRINTF("Message sent for thread %d changing monitoring state to %d\n",
 		msg.id, enable);
 
-	if(ret_val){
-		fprintf(stderr, "Failed to send message %d from thread %d with "
-			"return value %d\n", msg.msg, msg.id, ret_val);
-		ret_val = 2;
-	}
-	
-	return ret_val;
+	return 0;
 }
 
 
 int pfm_trigger_user_enable_core(int cpu, int enable)
 {
-	int ret_val;
 	trigger_msg msg;
 
-	if(msgq == NULL)
+	if(ring == NULL)
 		return 1;
 
 	msg.id = cpu;
@@ -88,25 +156,18 @@ int pfm_trigger_user_enable_core(int cpu, int enable)
 	else
 		msg.msg = cpu_disable;
 
-	ret_val = msgqx_send(msgq, &msg);
+	trigger_ring_send(ring, ring_slots, &msg);
 	DPRINTF("Message sent for cpu %d changing monitoring state to %d\n",
 		msg.id, enable);
 
-	if(ret_val){
-		fprintf(stderr, "Failed to send message %d for cpu %d with "
-			"return value %d\n", msg.msg, msg.id, ret_val);
-		ret_val = 2;
-	}
-	
-	return ret_val;
+	return 0;
 }
 
 int pfm_trigger_user_enable_all(int enable)
 {
-	int ret_val;
 	trigger_msg msg;
 
-	if(msgq == NULL)
+	if(ring == NULL)
 		return 1;
 
 	msg.id = 0;
@@ -115,42 +176,29 @@ int pfm_trigger_user_enable_all(int enable)
 	else
 		msg.msg = all_disable;
 
-	ret_val = msgqx_send(msgq, &msg);
+	trigger_ring_send(ring, ring_slots, &msg);
 	DPRINTF("Message sent for changing all monitoring states to %d\n",
 		enable);
 
-	if(ret_val){
-		fprintf(stderr, "Failed to send all-state-changing message %d "
-			"with return value %d\n", msg.msg, ret_val);
-		ret_val = 2;
-	}
-	
-	return ret_val;
+	return 0;
 }
 
 
 int pfm_trigger_user_stop()
 {
-	int ret_val;
 	trigger_msg msg;
 
-	if(msgq == NULL)
+	if(ring == NULL)
 		return 1;
 
 	msg.id = 0;
 
 	msg.msg = quit_trigger;
 
-	ret_val = msgqx_send(msgq, &msg);
+	trigger_ring_send(ring, ring_slots, &msg);
 	DPRINTF("Message sent for quit trigger\n");
 
-	if(ret_val){
-		fprintf(stderr, "Failed to send quit-trigger message "
-			"with return value %d\n", ret_val);
-		ret_val = 2;
-	}
-	
-	return ret_val;
+	return 0;
 }
 
 
@@ -158,18 +206,236 @@ int pfm_trigger_user_cleanup()
 {
 	int ret_val = 0;
 
-	if(msgq == NULL)
+	if(ring == NULL)
 		return 1;
 
-	ret_val = msgqx_close(msgq);
+	ret_val = munmap(ring, ring_size);
+	ring = NULL;
 
 	if(ret_val)
-		DPRINTF("Failed to close message queue for user: %d\n", 
+		DPRINTF("Failed to unmap the trigger ring for user: %d\n", 
 			ret_val);
 
 	return ret_val;
 }
 
+/*
+ * Close the counters of an exiting thread; its regions are kept for the 
+ * report
+ */
+static void close_regions(void *param)
+{
+	region_thread *th = (region_thread*)param;
+	int i;
+
+	for(i = 0; i < th->num_fds; i++){
+		pfm_rdpmc_unmap(th->pages[i]);
+		close(th->fds[i]);
+	}
+	th->num_fds = 0;
+}
+
+/*
+ * Print the regions of every thread
+ */
+static void report_regions(void)
+{
+	region_thread *th;
+	region_stats *r;
+	int i, evt;
+
+	pthread_mutex_lock(&regions_lock);
+	for(th = all_regions; th; th = th->next){
+		for(i = 0; i < th->num_regions; i++){
+			r = &th->regions[i];
+			reading_output("\n");
+			for(evt = 0; evt < region_num_evts; evt++)
+				reading_output("region %s thread [%d]:%'20"
+					       PRIu64" %s (%"PRIu64" calls)\n",
+					       r->name, th->tid, r->counts[evt],
+					       region_evt_names[evt], r->calls);
+		}
+	}
+	pthread_mutex_unlock(&regions_lock);
+}
+
+static void init_regions(void)
+{
+	pthread_key_create(&regions_key, close_regions);
+	atexit(report_regions);
+}
+
+/*
+ * Open the events published by pfm_multi on the calling thread
+ * Return values:
+ *    the counters of the thread, NULL if failed
+ */
+static region_thread *open_regions(void)
+{
+	region_thread *th;
+	struct perf_event_attr attr;
+	int num, i;
+
+	num = __atomic_load_n(&ring->num_events, __ATOMIC_ACQUIRE);
+	if(num == 0 || num > PFM_TRIGGER_MAX_EVENTS)
+		return NULL;
+
+	pthread_once(&regions_once, init_regions);
+
+	th = (region_thread*)calloc(1, sizeof(region_thread));
+	if(th == NULL)
+		return NULL;
+	th->tid = gettid();
+
+	for(i = 0; i < num; i++){
+		attr = ring->events[i].attr;
+		attr.disabled = 0;
+		attr.enable_on_exec = 0;
+		attr.inherit = 0;
+		attr.pinned = 0;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | 
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+		th->fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if(th->fds[i] == -1){
+			fprintf(stderr, "Failed to open event %s for regions "
+				"of thread %d\n", ring->events[i].name, th->tid);
+			close_regions(th);
+			free(th);
+			return NULL;
+		}
+		th->pages[i] = pfm_rdpmc_map(th->fds[i]);
+		th->num_fds++;
+	}
+
+	pthread_mutex_lock(&regions_lock);
+	if(region_num_evts == 0){
+		for(i = 0; i < num; i++)
+			memcpy(region_evt_names[i], ring->events[i].name, 
+			       PFM_TRIGGER_EVENT_NAME_LEN);
+		region_num_evts = num;
+	}
+	th->next = all_regions;
+	all_regions = th;
+	pthread_mutex_unlock(&regions_lock);
+
+	pthread_setspecific(regions_key, th);
+
+	return th;
+}
+
+/*
+ * Find the region of a thread by name, add it if it is new
+ * Return values:
+ *    index of the region, -1 if out of memory
+ */
+static int find_region(region_thread *th, const char *name)
+{
+	region_stats *regions;
+	int i;
+
+	for(i = 0; i < th->num_regions; i++)
+		if(!strcmp(th->regions[i].name, name))
+			return i;
+
+	if(th->num_regions == th->max_regions){
+		regions = realloc(th->regions, sizeof(region_stats) * 
+				  (th->max_regions * 2 + 4));
+		if(regions == NULL)
+			return -1;
+		th->regions = regions;
+		th->max_regions = th->max_regions * 2 + 4;
+	}
+
+	memset(&th->regions[i], 0, sizeof(region_stats));
+	th->regions[i].name = strdup(name);
+	if(th->regions[i].name == NULL)
+		return -1;
+	th->num_regions++;
+
+	return i;
+}
+
+/*
+ * Read the counters of the calling thread, in the layout of a read() with
+ * PERF_FORMAT_SCALE
+ */
+static inline void read_regions(region_thread *th, uint64_t *values)
+{
+	int i;
+
+	for(i = 0; i < th->num_fds; i++){
+		if(th->pages[i] && !pfm_rdpmc_read(th->pages[i], values + 3*i))
+			continue;
+		if(read(th->fds[i], values + 3*i, sizeof(uint64_t) * 3) != 
+		   sizeof(uint64_t) * 3)
+			memset(values + 3*i, 0, sizeof(uint64_t) * 3);
+	}
+}
+
+int pfm_trigger_region_begin(const char *name)
+{
+	region_thread *th = self_regions;
+	region_frame *f;
+	int region;
+
+	if(th == NULL){
+		if(ring == NULL)
+			return 1;
+		if(self_regions_failed)
+			return 2;
+		th = self_regions = open_regions();
+		if(th == NULL){
+			self_regions_failed = 1;
+			return 2;
+		}
+	}
+
+	if(th->depth == MAX_REGION_DEPTH)
+		return 3;
+
+	region = find_region(th, name);
+	if(region == -1)
+		return 2;
+
+	f = &th->stack[th->depth++];
+	f->region = region;
+	// the last thing done, so the region starts here
+	read_regions(th, f->values);
+
+	return 0;
+}
+
+int pfm_trigger_region_end()
+{
+	region_thread *th = self_regions;
+	uint64_t values[PFM_TRIGGER_MAX_EVENTS * 3];
+	region_frame *f;
+	region_stats *r;
+	uint64_t count, ena, run;
+	int i;
+
+	if(th == NULL || th->depth == 0)
+		return 1;
+
+	// the first thing done, so the region ends here
+	read_regions(th, values);
+
+	f = &th->stack[--th->depth];
+	r = &th->regions[f->region];
+	r->calls++;
+	for(i = 0; i < th->num_fds; i++){
+		count = values[3*i] - f->values[3*i];
+		ena = values[3*i+1] - f->values[3*i+1];
+		run = values[3*i+2] - f->values[3*i+2];
+		// scale if the counter was multiplexed in the region
+		if(run && run < ena)
+			count = (uint64_t)((double)count * ena / run);
+		r->counts[i] += count;
+	}
+
+	return 0;
+}
+
 /*
  * Fortran interfaces
  */
@@ -209,6 +475,30 @@ void pfm_trigger_stop_()
 	return;
 }
 
+void pfm_trigger_region_begin_(const char *name, size_t name_len)
+{
+	char buf[REGION_NAME_LEN];
+
+	// Fortran strings are blank padded, not null terminated
+	while(name_len > 0 && name[name_len-1] == ' ')
+		name_len--;
+	if(name_len >= REGION_NAME_LEN)
+		name_len = REGION_NAME_LEN - 1;
+	memcpy(buf, name, name_len);
+	buf[name_len] = '\0';
+
+	pfm_trigger_region_begin(buf);
+
+	return;
+}
+
+void pfm_trigger_region_end_()
+{
+	pfm_trigger_region_end();
+
+	return;
+}
+
 void pfm_trigger_cleanup_()
 {
 	pfm_trigger_user_cleanup();
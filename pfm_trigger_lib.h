@@ -7,17 +7,20 @@
 
 #ifndef __PFM_TRIGGER_USER_LIB_H__
 #define __PFM_TRIGGER_USER_LIB_H__
+
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /*
- * initialized the semaphore and the shared memory
+ * map the message ring shared with pfm_multi
  * 
  * Return values:
  *       0: success
- *       1: failed to open message queue
- *       2: open shared memory failed
+ *       1: failed to open the shared memory ring
+ *       2: the ring was created by an incompatible pfm_multi
  */
 int pfm_trigger_user_init();
 // Fortran interface
@@ -30,8 +33,7 @@ void pfm_trigger_init_();
  *
  * Return values:
  *      0:  success
- *      1:  no message queue; pfm_trigger not initialized
- *      2:  failed to send message
+ *      1:  no message ring; pfm_trigger not initialized
  */
 int pfm_trigger_user_enable_thread(int enable);
 // Fortran interface
@@ -45,8 +47,7 @@ void pfm_trigger_enable_thread_(int *enable);
  *
  * Return values:
  *      0:  success
- *      1:  no message queue; pfm_trigger not initialized
- *      2:  failed to send message
+ *      1:  no message ring; pfm_trigger not initialized
  */
 int pfm_trigger_user_enable_core(int cpu, int enable);
 // Fortran interface
@@ -59,8 +60,7 @@ void pfm_trigger_enable_core_(int *cpu, int *enable);
  *
  * Return values:
  *      0:  success
- *      1:  no message queue; pfm_trigger not initialized
- *      2:  failed to send message
+ *      1:  no message ring; pfm_trigger not initialized
  */
 int pfm_trigger_user_enable_all(int enable);
 // Fortran interface
@@ -72,8 +72,7 @@ void pfm_trigger_enable_all_(int *enable);
  *
  * Return values:
  *      0:  success
- *      1:  no message queue; pfm_trigger not initialized
- *      2:  failed to send message
+ *      1:  no message ring; pfm_trigger not initialized
  */
 int pfm_trigger_user_stop();
 // Fortran interface
@@ -81,7 +80,40 @@ void pfm_trigger_stop_();
 
 
 /*
- * cleanup the semaphore and the shared memory
+ * begin a region of the calling thread; the counters are read right here, 
+ * on the calling thread itself, so the region starts at this call and not 
+ * when pfm_multi processes a message. The first call of a thread opens the
+ * events monitored by pfm_multi (at most 16) on the thread. Regions can 
+ * nest, up to 16 levels.
+ * Counts are summed per region name and per thread, and printed when the 
+ * program exits.
+ * Parameters:
+ *      name: name of the region; regions with the same name are summed
+ *
+ * Return values:
+ *      0:  success
+ *      1:  no message ring; pfm_trigger not initialized
+ *      2:  pfm_multi published no events, or they cannot be opened
+ *      3:  regions nested too deep
+ */
+int pfm_trigger_region_begin(const char *name);
+// Fortran interface
+void pfm_trigger_region_begin_(const char *name, size_t name_len);
+
+/*
+ * end the innermost region of the calling thread, reading the counters 
+ * right here
+ *
+ * Return values:
+ *      0:  success
+ *      1:  no region begun by this thread
+ */
+int pfm_trigger_region_end();
+// Fortran interface
+void pfm_trigger_region_end_();
+
+/*
+ * unmap the message ring
  * Parameters:
  *       
  * Return values:
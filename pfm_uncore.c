@@ -0,0 +1,331 @@
+/*
+ * Memory bandwidth of each socket from the uncore memory controller PMUs.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include "perf_util.h"
+
+#include "pfm_common.h"
+#include "pfm_uncore.h"
+#include "pfm_output.h"
+#include "pfm_topo.h"
+#include "pfm_sysfs.h"
+
+#define IMC_PREFIX "uncore_imc" /* memory controller boxes */
+#define CAS_BYTES 64.0 /* a CAS moves a cache line */
+
+/*
+ * The events counting reads and writes, by kernel version and processor;
+ * the first pair some box has is used for all boxes, as boxes of different
+ * kinds may count the same traffic
+ */
+static const char *bw_events[][2] = {{"cas_count_read", "cas_count_write"},
+				     {"data_read", "data_write"},
+				     {"data_reads", "data_writes"}};
+
+/* one box counted on one socket, reads lead the group */
+typedef struct _uncore_box{
+	int fd;
+	int write_fd;
+	int cpu; /* the designated cpu */
+	int socket;
+	double scale[2]; /* bytes per count of reads and writes */
+	uint64_t prev[2]; /* counts at the last reading */
+	uint64_t prev_ena;
+}uncore_box;
+
+typedef struct _uncore_info{
+	uncore_box *boxes;
+	int num;
+	int pair; /* index in bw_events */
+	int num_sockets;
+	uint64_t *bytes; /* read and written bytes of each socket */
+	uint64_t *ns; /* time counted of each socket */
+	int *has_boxes; /* whether a socket has boxes */
+}uncore_info;
+
+/*
+ * Get the bytes per count of an event, from its scale and unit
+ */
+static double event_scale(const char *pmu, const char *event)
+{
+	char path[512], buf[64];
+	double scale;
+
+	snprintf(path, sizeof(path), PFM_SYSFS_PMU_DIR "/%s/events/%s.scale",
+		 pmu, event);
+	if(pfm_sysfs_read_line(path, buf, sizeof(buf)))
+		return CAS_BYTES;
+	scale = strtod(buf, NULL);
+
+	snprintf(path, sizeof(path), PFM_SYSFS_PMU_DIR "/%s/events/%s.unit",
+		 pmu, event);
+	if(!pfm_sysfs_read_line(path, buf, sizeof(buf))){
+		if(!strcmp(buf, "MiB"))
+			scale *= 1024.0 * 1024.0;
+		else if(!strcmp(buf, "KiB"))
+			scale *= 1024.0;
+	}
+
+	return scale;
+}
+
+/*
+ * Add a box to the list
+ * Return value:
+ *      0       --> success
+ *      other   --> failed to allocate memory
+ */
+static int add_box(uncore_info *u, uncore_box *box)
+{
+	uncore_box *boxes;
+
+	boxes = realloc(u->boxes, sizeof(uncore_box) * (u->num + 1));
+	if(boxes == NULL)
+		return -1;
+	u->boxes = boxes;
+	u->boxes[u->num++] = *box;
+
+	return 0;
+}
+
+/*
+ * Add the boxes of a PMU with the events of a pair, one on each cpu of its
+ * cpumask
+ * Return value:
+ *      0       --> success, or the PMU does not have the events
+ *      other   --> failed to allocate memory
+ */
+static int add_pmu(uncore_info *u, const char *pmu, int pair,
+		   struct perf_event_attr *read_attr,
+		   struct perf_event_attr *write_attr)
+{
+	char path[512], buf[256];
+	uncore_box box;
+	const char *s;
+	char *end;
+	long first, last;
+	int type;
+
+	memset(read_attr, 0, sizeof(struct perf_event_attr));
+	memset(write_attr, 0, sizeof(struct perf_event_attr));
+	if(pfm_sysfs_encode_event(pmu, bw_events[pair][0], read_attr) ||
+	   pfm_sysfs_encode_event(pmu, bw_events[pair][1], write_attr))
+		return 0;
+
+	type = pfm_sysfs_pmu_type(pmu);
+	if(type == -1)
+		return 0;
+	snprintf(path, sizeof(path), PFM_SYSFS_PMU_DIR "/%s/cpumask", pmu);
+	if(pfm_sysfs_read_line(path, buf, sizeof(buf)))
+		return 0;
+
+	memset(&box, 0, sizeof(box));
+	box.fd = box.write_fd = -1;
+	box.scale[0] = event_scale(pmu, bw_events[pair][0]);
+	box.scale[1] = event_scale(pmu, bw_events[pair][1]);
+	read_attr->type = write_attr->type = type;
+
+	/* the cpumask has one cpu per socket, e.g. "0,24" */
+	s = buf;
+	while(*s){
+		first = strtol(s, &end, 10);
+		if(end == s)
+			break;
+		last = first;
+		if(*end == '-')
+			last = strtol(end + 1, &end, 10);
+		for(; first <= last; first++){
+			box.cpu = first;
+			if(add_box(u, &box))
+				return -1;
+		}
+		if(*end != ',')
+			break;
+		s = end + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Open the group of a box on its designated cpu
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+static int open_box(uncore_box *box, struct perf_event_attr *read_attr,
+		    struct perf_event_attr *write_attr)
+{
+	read_attr->size = write_attr->size = sizeof(struct perf_event_attr);
+	read_attr->read_format = write_attr->read_format =
+		PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED;
+
+	box->fd = perf_event_open(read_attr, -1, box->cpu, -1, 0);
+	if(box->fd == -1)
+		return -1;
+	box->write_fd = perf_event_open(write_attr, -1, box->cpu, box->fd, 0);
+	if(box->write_fd == -1)
+		return -1;
+
+	return 0;
+}
+
+int pfm_uncore_open(void **handle)
+{
+	uncore_info *u;
+	struct perf_event_attr read_attr, write_attr;
+	pfm_topo_t topo;
+	DIR *dir;
+	struct dirent *ent;
+	int pair, i, ret = 0;
+
+	*handle = NULL;
+	u = calloc(1, sizeof(uncore_info));
+	if(u == NULL)
+		return 3;
+
+	dir = opendir(PFM_SYSFS_PMU_DIR);
+	if(dir == NULL){
+		free(u);
+		return 1;
+	}
+	for(pair = 0; pair < sizeof(bw_events) / sizeof(bw_events[0]) &&
+		    u->num == 0 && ret == 0; pair++){
+		rewinddir(dir);
+		while((ent = readdir(dir)) != NULL && ret == 0){
+			int first = u->num;
+
+			if(strncmp(ent->d_name, IMC_PREFIX, strlen(IMC_PREFIX)))
+				continue;
+			if(add_pmu(u, ent->d_name, pair, &read_attr,
+				   &write_attr)){
+				ret = 3;
+				break;
+			}
+			for(i = first; i < u->num; i++)
+				if(open_box(&u->boxes[i], &read_attr,
+					    &write_attr)){
+					DPRINTF("Cannot open %s on cpu %d\n",
+						ent->d_name, u->boxes[i].cpu);
+					ret = 2;
+					break;
+				}
+		}
+		u->pair = pair;
+	}
+	closedir(dir);
+	if(ret == 0 && u->num == 0)
+		ret = 1;
+	if(ret == 0 && pfm_topo_read(&topo))
+		ret = 3;
+	if(ret){
+		pfm_uncore_close(u);
+		return ret;
+	}
+
+	/* cpus without topology count as socket 0 */
+	for(i = 0; i < u->num; i++){
+		if(u->boxes[i].cpu < topo.num_cpus &&
+		   topo.socket[u->boxes[i].cpu] >= 0)
+			u->boxes[i].socket = topo.socket[u->boxes[i].cpu];
+		if(u->boxes[i].socket >= u->num_sockets)
+			u->num_sockets = u->boxes[i].socket + 1;
+	}
+	pfm_topo_free(&topo);
+
+	u->bytes = calloc(u->num_sockets * 2, sizeof(uint64_t));
+	u->ns = calloc(u->num_sockets, sizeof(uint64_t));
+	u->has_boxes = calloc(u->num_sockets, sizeof(int));
+	if(!u->bytes || !u->ns || !u->has_boxes){
+		pfm_uncore_close(u);
+		return 3;
+	}
+	for(i = 0; i < u->num; i++)
+		u->has_boxes[u->boxes[i].socket] = 1;
+
+	*handle = u;
+
+	return 0;
+}
+
+void pfm_uncore_read(void *handle)
+{
+	uncore_info *u = (uncore_info*)handle;
+	uint64_t values[4]; /* nr, time enabled, reads, writes */
+	uncore_box *box;
+	uint64_t ns;
+	int i, s;
+
+	if(u == NULL)
+		return;
+
+	memset(u->bytes, 0, sizeof(uint64_t) * u->num_sockets * 2);
+	memset(u->ns, 0, sizeof(uint64_t) * u->num_sockets);
+
+	/* one read per box, however many cores the socket has */
+	for(i = 0; i < u->num; i++){
+		box = &u->boxes[i];
+		if(read(box->fd, values, sizeof(values)) != sizeof(values)){
+			DPRINTF("Cannot read uncore box on cpu %d\n", box->cpu);
+			continue;
+		}
+		s = box->socket;
+		u->bytes[s * 2] += (uint64_t)((values[2] - box->prev[0]) *
+					      box->scale[0]);
+		u->bytes[s * 2 + 1] += (uint64_t)((values[3] - box->prev[1]) *
+						  box->scale[1]);
+		ns = values[1] - box->prev_ena;
+		if(ns > u->ns[s])
+			u->ns[s] = ns;
+		box->prev[0] = values[2];
+		box->prev[1] = values[3];
+		box->prev_ena = values[1];
+	}
+
+	for(s = 0; s < u->num_sockets; s++)
+		if(u->has_boxes[s])
+			pfm_output_bandwidth(s, u->bytes[s * 2],
+					     u->bytes[s * 2 + 1], u->ns[s]);
+	pfm_output_commit();
+}
+
+void pfm_uncore_print(void *handle)
+{
+	uncore_info *u = (uncore_info*)handle;
+
+	if(u == NULL)
+		return;
+
+	fprintf((FILE*)err_out, "pfm_multi: memory bandwidth of %d sockets "
+		"from %d uncore boxes (%s, %s)\n", u->num_sockets, u->num,
+		bw_events[u->pair][0], bw_events[u->pair][1]);
+}
+
+void pfm_uncore_close(void *handle)
+{
+	uncore_info *u = (uncore_info*)handle;
+	int i;
+
+	if(u == NULL)
+		return;
+
+	for(i = 0; i < u->num; i++){
+		if(u->boxes[i].write_fd != -1)
+			close(u->boxes[i].write_fd);
+		if(u->boxes[i].fd != -1)
+			close(u->boxes[i].fd);
+	}
+	free(u->boxes);
+	free(u->bytes);
+	free(u->ns);
+	free(u->has_boxes);
+	free(u);
+}
@@ -0,0 +1,46 @@
+/*
+ * Memory bandwidth of each socket from the uncore memory controller PMUs
+ * (-B). The uncore PMUs are found in /sys/bus/event_source/devices; each
+ * memory controller box is counted once per socket, on the cpu its cpumask
+ * designates, so a reading costs one read() per box and socket whatever the
+ * number of cores.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_UNCORE_H__
+#define __PFM_UNCORE_H__
+
+/*
+ * Find the memory controller PMUs and start counting the bytes read from and
+ * written to memory
+ * Output parameter:
+ *	handle	--> the handle of the uncore counters
+ * Return value:
+ *      0       --> success
+ *      1       --> no memory controller PMU with bandwidth events
+ *      2       --> failed to open the counters, e.g., perf_event_paranoid
+ *                  forbids system-wide counting
+ *      3       --> failed to allocate memory
+ */
+int pfm_uncore_open(void **handle);
+
+/*
+ * Read the counters and queue the bytes read and written by each socket
+ * since the last reading, see pfm_output_bandwidth
+ * Parameters:
+ *	handle	--> the handle of the uncore counters
+ */
+void pfm_uncore_read(void *handle);
+
+/*
+ * Print the memory controller boxes counted to err_out
+ */
+void pfm_uncore_print(void *handle);
+
+/*
+ * Stop counting and free the counters
+ */
+void pfm_uncore_close(void *handle);
+
+#endif
@@ -0,0 +1,245 @@
+/*
+ * A pool of worker threads running parallel loops.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#define _GNU_SOURCE             // for pthread_setaffinity_np
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "pfm_common.h"
+#include "pfm_workpool.h"
+
+struct _pfm_workpool_info;
+
+/* a worker thread and its index, 1 to num_workers; the caller is 0 */
+typedef struct _pfm_worker{
+	struct _pfm_workpool_info *pool;
+	int idx;
+}pfm_worker;
+
+/* data used by the pool */
+typedef struct _pfm_workpool_info{
+	pthread_t *workers;
+	pfm_worker *args;
+	int num_workers; /* number of created threads */
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond; /* a new loop or stop */
+	pthread_cond_t done_cond; /* all workers left the loop */
+	uint64_t gen; /* generation of the current loop */
+	int stop;
+	int busy; /* workers still in the current loop */
+	/* the current loop */
+	pfm_workpool_fn fn;
+	void *arg;
+	int num_items;
+	int next_item; /* next item to hand out, updated atomically */
+	int each; /* one item per thread, the item of its index */
+}workpool_info;
+
+/* hand out items of the current loop until there is none left */
+static void run_items(workpool_info *pool)
+{
+	int idx;
+
+	while((idx = __atomic_fetch_add(&pool->next_item, 1, 
+					__ATOMIC_RELAXED)) < pool->num_items)
+		pool->fn(idx, pool->arg);
+}
+
+static void *worker(void *arg)
+{
+	pfm_worker *self = arg;
+	workpool_info *pool = self->pool;
+	uint64_t gen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while(1){
+		while(!pool->stop && pool->gen == gen)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if(pool->stop)
+			break;
+		gen = pool->gen;
+		pthread_mutex_unlock(&pool->lock);
+
+		if(pool->each)
+			pool->fn(self->idx, pool->arg);
+		else
+			run_items(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		if(--pool->busy == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int pfm_workpool_init(void **handle, int num_workers)
+{
+	workpool_info *pool;
+	int i;
+
+	if(handle == NULL || num_workers < 1)
+		return 1;
+
+	pool = calloc(1, sizeof(workpool_info));
+	if(pool == NULL)
+		return 2;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	/* the caller of pfm_workpool_run is one of the workers */
+	pool->workers = calloc(num_workers, sizeof(pthread_t));
+	pool->args = calloc(num_workers, sizeof(pfm_worker));
+	if(pool->workers == NULL || pool->args == NULL){
+		pfm_workpool_close(pool);
+		return 2;
+	}
+	for(i = 0; i < num_workers - 1; i++){
+		pool->args[i].pool = pool;
+		pool->args[i].idx = i + 1;
+		if(pthread_create(&pool->workers[i], NULL, worker, 
+				  &pool->args[i])){
+			pfm_workpool_close(pool);
+			return 2;
+		}
+		pool->num_workers++;
+	}
+
+	*handle = pool;
+
+	return 0;
+}
+
+/*
+ * Start a loop on the workers, run the part of the caller, and wait for the
+ * workers to leave the loop
+ */
+static void run_loop(workpool_info *pool, int num_items, pfm_workpool_fn fn,
+		     void *arg, int each)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->num_items = num_items;
+	pool->next_item = 0;
+	pool->each = each;
+	pool->busy = pool->num_workers;
+	pool->gen++;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	if(each)
+		fn(0, arg);
+	else
+		run_items(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	while(pool->busy)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+int pfm_workpool_run(void *handle, int num_items, pfm_workpool_fn fn, 
+		     void *arg)
+{
+	workpool_info *pool = handle;
+
+	if(pool == NULL)
+		return 1;
+	if(num_items <= 0)
+		return 0;
+
+	run_loop(pool, num_items, fn, arg, 0);
+
+	return 0;
+}
+
+int pfm_workpool_run_each(void *handle, pfm_workpool_fn fn, void *arg)
+{
+	workpool_info *pool = handle;
+
+	if(pool == NULL)
+		return 1;
+
+	run_loop(pool, pool->num_workers + 1, fn, arg, 1);
+
+	return 0;
+}
+
+/*
+ * Pin a thread to one cpu
+ * Return value:
+ *      0       --> success
+ *      other   --> failed
+ */
+static int pin_thread(pthread_t thr, int cpu)
+{
+	cpu_set_t set;
+
+	if(cpu < 0 || cpu >= CPU_SETSIZE)
+		return 1;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return pthread_setaffinity_np(thr, sizeof(set), &set);
+}
+
+int pfm_workpool_pin(void *handle, int *cpus, int num)
+{
+	workpool_info *pool = handle;
+	int i, ret = 0;
+
+	if(pool == NULL || cpus == NULL || num < 1)
+		return 1;
+
+	if(pin_thread(pthread_self(), cpus[0]))
+		ret = 2;
+	for(i = 0; i < pool->num_workers; i++)
+		if(pin_thread(pool->workers[i], cpus[(i + 1) % num]))
+			ret = 2;
+
+	return ret;
+}
+
+int pfm_workpool_size(void *handle)
+{
+	workpool_info *pool = handle;
+
+	if(pool == NULL)
+		return 0;
+
+	return pool->num_workers + 1;
+}
+
+int pfm_workpool_close(void *handle)
+{
+	workpool_info *pool = handle;
+	int i;
+
+	if(pool == NULL)
+		return 1;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for(i = 0; i < pool->num_workers; i++)
+		pthread_join(pool->workers[i], NULL);
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	free(pool->workers);
+	free(pool->args);
+	free(pool);
+
+	return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * A small pool of worker threads that run a parallel loop, used to fan 
+ * slow per-context setup (e.g., perf_event_open for every cpu) out across
+ * cores. The thread calling pfm_workpool_run also works on the loop.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#ifndef __PFM_WORKPOOL_H__
+#define __PFM_WORKPOOL_H__
+
+/*
+ * Work function, called once for every item of a loop
+ * Parameters:
+ *	idx	--> index of the item, 0 to num_items - 1
+ *	arg	--> argument given to pfm_workpool_run
+ */
+typedef void (*pfm_workpool_fn)(int idx, void *arg);
+
+/*
+ * Create a pool
+ * Parameters:
+ *	num_workers	--> number of threads working on a loop, including 
+ *                          the caller of pfm_workpool_run; 1 means the 
+ *                          caller runs loops alone
+ * Output parameter:
+ *	handle		--> the handle of the pool
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid parameter
+ *      2       --> failed to allocate memory or to create threads
+ */
+int pfm_workpool_init(void **handle, int num_workers);
+
+/*
+ * Run fn for every item in [0, num_items), returns when all items are done;
+ * items are handed out one at a time, so slow items do not hold back the 
+ * others. Only one loop may run at a time.
+ * Parameters:
+ *	handle		--> the handle of the pool
+ *	num_items	--> number of items
+ *	fn		--> the work function
+ *	arg		--> argument passed to fn
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid handle
+ */
+int pfm_workpool_run(void *handle, int num_items, pfm_workpool_fn fn, 
+		     void *arg);
+
+/*
+ * Run fn once on every thread of the pool, returns when all are done: idx 0
+ * on the calling thread and idx i on worker i, the thread that 
+ * pfm_workpool_pin pins to cpus[i % num]. Unlike pfm_workpool_run, the work
+ * of a thread is fixed, e.g., a thread keeps reading the same counters.
+ * Parameters:
+ *	handle	--> the handle of the pool
+ *	fn	--> the work function
+ *	arg	--> argument passed to fn
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid handle
+ */
+int pfm_workpool_run_each(void *handle, pfm_workpool_fn fn, void *arg);
+
+/*
+ * Pin the threads of a pool to a list of cpus: the calling thread, which is
+ * to run the loops, to the first cpu and the workers to the next ones, 
+ * wrapping around the list
+ * Parameters:
+ *	handle	--> the handle of the pool
+ *	cpus	--> the cpus
+ *	num	--> number of cpus
+ * Return value:
+ *      0       --> success
+ *      1       --> invalid parameter
+ *      2       --> some thread cannot be pinned, e.g., an offline cpu
+ */
+int pfm_workpool_pin(void *handle, int *cpus, int num);
+
+/*
+ * Get the number of threads working on a loop
+ */
+int pfm_workpool_size(void *handle);
+
+/*
+ * Stop the workers and destroy the pool
+ */
+int pfm_workpool_close(void *handle);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * Check the vector update of the counter store against its scalar form:
+ * every reading is stored both in a row of a store, updated by the passes
+ * of pfm_counts_update, and in a local row, updated by
+ * pfm_counts_update_row, and the two must give the same scaled counts,
+ * deltas and elapsed times. The readings are multiplexed, not multiplexed,
+ * never running, or missing for a tick, and the rows span several blocks
+ * with various numbers of events.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <err.h>
+
+#include "pfm_counts.h"
+
+#define NUM_ROWS 600
+#define MAX_EVENTS 13
+#define NUM_TICKS 200
+
+typedef struct __test_row{
+	pfm_counts_row_t row; /* in the store */
+	pfm_counts_row_t local; /* the same readings, updated alone */
+	uint64_t buf[PFM_COUNTS_ARRAYS * MAX_EVENTS];
+}test_row_t;
+
+static pfm_counts_t store;
+static test_row_t rows[NUM_ROWS];
+static int failed;
+
+static uint64_t random_u64(uint64_t max)
+{
+	return (((uint64_t)rand() << 31) ^ rand()) % max;
+}
+
+/*
+ * Give an event a new reading for the tick, or none
+ */
+static void read_event(test_row_t *t, int evt)
+{
+	uint64_t raw = t->local.raw[evt], ena = t->local.ena[evt];
+	uint64_t run = t->local.run[evt];
+	uint64_t step = random_u64(1000000) + 1;
+
+	switch(rand() % 5){
+	case 0:
+		/* not read this tick */
+		return;
+	case 1:
+		/* not multiplexed */
+		ena = run = ena + step;
+		break;
+	case 2:
+		/* never ran so far */
+		if(run == 0){
+			ena += step;
+			break;
+		}
+		/* fall through */
+	default:
+		/* multiplexed, ran some of the time */
+		ena += step;
+		run += random_u64(step);
+		break;
+	}
+	raw += random_u64(1ULL << 32);
+
+	pfm_counts_set(&t->row, evt, raw, ena, run);
+	pfm_counts_set(&t->local, evt, raw, ena, run);
+}
+
+static void check_row(test_row_t *t, int idx, int tick)
+{
+	int i;
+
+	for(i = 0; i < t->row.num; i++){
+		if(t->row.val[i] == t->local.val[i] &&
+		   t->row.delta[i] == t->local.delta[i] &&
+		   t->row.elapsed[i] == t->local.elapsed[i])
+			continue;
+		warnx("tick %d row %d event %d: raw %"PRIu64" ena %"PRIu64
+		      " run %"PRIu64", vector %"PRIu64"/%"PRIu64"/%"PRIu64
+		      ", scalar %"PRIu64"/%"PRIu64"/%"PRIu64, tick, idx, i,
+		      t->local.raw[i], t->local.ena[i], t->local.run[i],
+		      t->row.val[i], t->row.delta[i], t->row.elapsed[i],
+		      t->local.val[i], t->local.delta[i], t->local.elapsed[i]);
+		failed = 1;
+	}
+}
+
+int main()
+{
+	int i, j, tick, num = 0;
+
+	pfm_counts_init(&store);
+	srand(1);
+
+	for(i = 0; i < NUM_ROWS; i++){
+		int n = rand() % MAX_EVENTS + 1;
+
+		if(pfm_counts_alloc(&store, n, &rows[i].row))
+			errx(1, "cannot allocate a row");
+		pfm_counts_local(&rows[i].local, rows[i].buf, n);
+		num += n;
+	}
+
+	for(tick = 0; tick < NUM_TICKS; tick++){
+		for(i = 0; i < NUM_ROWS; i++)
+			for(j = 0; j < rows[i].row.num; j++)
+				read_event(&rows[i], j);
+		pfm_counts_update(&store);
+		for(i = 0; i < NUM_ROWS; i++){
+			pfm_counts_update_row(&rows[i].local);
+			check_row(&rows[i], i, tick);
+		}
+	}
+
+	for(i = 0; i < NUM_ROWS; i++)
+		pfm_counts_free(&store, &rows[i].row);
+	pfm_counts_destroy(&store);
+
+	printf("%d rows, %d events, %d ticks\n", NUM_ROWS, num, NUM_TICKS);
+	if(failed)
+		errx(1, "the vector and scalar updates disagree");
+	printf("the vector and scalar updates agree\n");
+
+	return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * Stress the context table with 10k short-lived threads, as a JVM or an
+ * OpenMP workload creates them: every thread is added by its tid when it
+ * starts and removed when it exits, up to MAX_LIVE at a time. Checks that
+ * every lookup finds the context of its tid, that removed tids are gone,
+ * and that the slots of exited threads are reused, so the table does not
+ * grow with the number of threads ever seen.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <err.h>
+#include <sys/syscall.h>
+
+#include "pfm_ctx_table.h"
+#include "pfm_epoch.h"
+
+#define NUM_THREADS 10000
+#define MAX_LIVE 256
+
+typedef struct __test_thread{
+	pthread_t thr;
+	pid_t tid; /* set by the thread */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int started;
+	int stop;
+}test_thread_t;
+
+static pfm_ctx_table_t table;
+static int failed;
+
+static void *thread_fn(void *arg)
+{
+	test_thread_t *t = arg;
+
+	pthread_mutex_lock(&t->lock);
+	t->tid = syscall(SYS_gettid);
+	t->started = 1;
+	pthread_cond_signal(&t->cond);
+	/* stay alive until removed, so that its tid is not reused */
+	while(!t->stop)
+		pthread_cond_wait(&t->cond, &t->lock);
+	pthread_mutex_unlock(&t->lock);
+
+	return NULL;
+}
+
+static test_thread_t *start_thread()
+{
+	test_thread_t *t = calloc(1, sizeof(test_thread_t));
+
+	if(t == NULL)
+		err(1, "out of memory");
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	if(pthread_create(&t->thr, NULL, thread_fn, t))
+		errx(1, "cannot create a thread");
+
+	pthread_mutex_lock(&t->lock);
+	while(!t->started)
+		pthread_cond_wait(&t->cond, &t->lock);
+	pthread_mutex_unlock(&t->lock);
+
+	if(pfm_ctx_table_insert(&table, t->tid, t) < 0){
+		warnx("cannot add thread %d", t->tid);
+		failed = 1;
+	}
+
+	return t;
+}
+
+static void stop_thread(test_thread_t *t)
+{
+	if(pfm_ctx_table_remove(&table, t->tid) != t){
+		warnx("thread %d removed, but not found", t->tid);
+		failed = 1;
+	}
+	if(pfm_ctx_table_lookup(&table, t->tid)){
+		warnx("thread %d found after its removal", t->tid);
+		failed = 1;
+	}
+
+	pthread_mutex_lock(&t->lock);
+	t->stop = 1;
+	pthread_cond_signal(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(t->thr, NULL);
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->cond);
+	free(t);
+}
+
+/*
+ * Look up every live thread, and walk the slots
+ */
+static void check_live(test_thread_t **live, int num_live)
+{
+	int i, num = 0;
+
+	for(i = 0; i < num_live; i++){
+		if(pfm_ctx_table_lookup(&table, live[i]->tid) == live[i])
+			continue;
+		warnx("thread %d not found", live[i]->tid);
+		failed = 1;
+	}
+
+	for(i = 0; i < pfm_ctx_table_slots(&table); i++)
+		if(pfm_ctx_table_get(&table, i))
+			num++;
+	if(num != num_live || table.count != num_live){
+		warnx("%d contexts in the slots, %d in the table, %d live",
+		      num, table.count, num_live);
+		failed = 1;
+	}
+}
+
+int main()
+{
+	test_thread_t *live[MAX_LIVE];
+	int num_live = 0, max_live = 0, started = 0;
+	int i, target;
+
+	if(pfm_ctx_table_init(&table))
+		errx(1, "cannot create the table");
+	srand(1);
+
+	while(started < NUM_THREADS || num_live){
+		/* start a burst of threads, then let some random ones exit */
+		target = rand() % MAX_LIVE + 1;
+		while(started < NUM_THREADS && num_live < target){
+			live[num_live++] = start_thread();
+			started++;
+		}
+		if(num_live > max_live)
+			max_live = num_live;
+		check_live(live, num_live);
+		for(i = rand() % (num_live + 1); i > 0; i--){
+			int victim = rand() % num_live;
+
+			stop_thread(live[victim]);
+			live[victim] = live[--num_live];
+		}
+		if(started == NUM_THREADS)
+			while(num_live)
+				stop_thread(live[--num_live]);
+	}
+	check_live(live, 0);
+
+	printf("%d threads, at most %d live, %d slots used\n", NUM_THREADS,
+	       max_live, pfm_ctx_table_slots(&table));
+	/* the slots of removed threads are reused after an epoch or two */
+	if(pfm_ctx_table_slots(&table) > 2 * max_live){
+		warnx("the slots of exited threads are not reused");
+		failed = 1;
+	}
+	pfm_ctx_table_destroy(&table);
+	/* the arrays replaced by the growth */
+	pfm_epoch_synchronize();
+
+	if(failed)
+		errx(1, "the context table is broken");
+	printf("the context table is consistent\n");
+
+	return 0;
+}
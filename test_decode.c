@@ -0,0 +1,241 @@
+/*
+ * Round trip of the binary output: the same readings are written by the
+ * output path of pfm_multi once as text (-o text) and once as a binary
+ * stream (-o bin), the stream is decoded by pfm_decode, and its text must
+ * be the text of pfm_multi, line for line. The readings cover ticks,
+ * threads and cores, multiplexed and non-multiplexed counts, derived
+ * metrics, process totals, memory bandwidth and sampled loads. The CSV of
+ * pfm_decode is checked for the scaling of a multiplexed count.
+ *
+ * The stream carries neither the scaled values nor the bounds of -m, so
+ * inconsistent and extrapolated readings are left out.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <locale.h>
+#include <err.h>
+
+#include "pfm_common.h"
+#include "pfm_output.h"
+#include "pfm_metrics.h"
+#include "pfm_counts.h"
+
+#define NUM_EVENTS 3
+#define TEXT_FILE "test_decode.txt"
+#define BIN_FILE "test_decode.bin"
+#define DECODED_FILE "test_decode.out"
+#define CSV_FILE "test_decode.csv"
+#define METRICS "ipc=instructions/cycles,mips=instructions*1000/ns"
+
+void *reading_out;
+void *err_out;
+
+static char *evt_names[NUM_EVENTS] = {"cycles", "instructions",
+				      "cache-misses"};
+
+/*
+ * Queue a reading of a context: raw counts grow by step each tick, and the
+ * events run for run_pct percents of the time enabled
+ */
+static void put_counts(int kind, int id, pfm_counts_row_t *row, int tick,
+		       uint64_t step, int run_pct)
+{
+	uint64_t ena = 2000000ULL * tick;
+	int i;
+
+	for(i = 0; i < NUM_EVENTS; i++)
+		pfm_counts_set(row, i, step * tick * (i + 1), ena,
+			       ena * run_pct / 100);
+	pfm_counts_update_row(row);
+	pfm_output_counts(kind, id, row);
+}
+
+/*
+ * Write the readings with the output path of pfm_multi
+ */
+static void write_readings(int format, const char *file)
+{
+	uint64_t thr_buf[2][PFM_COUNTS_ARRAYS * NUM_EVENTS];
+	uint64_t core_buf[PFM_COUNTS_ARRAYS * NUM_EVENTS];
+	pfm_counts_row_t threads[2], core;
+	perf_event_desc_t fds[NUM_EVENTS];
+	uint64_t totals[NUM_EVENTS] = {123456789, 987654321, 4242};
+	/* the stats of one NUMA node and the unknown one */
+	uint64_t mem_buf[sizeof(pfm_mem_stats_t) / sizeof(uint64_t) + 2];
+	pfm_mem_stats_t *mem = (pfm_mem_stats_t *)mem_buf;
+	pfm_sched_tick_t tick;
+	char errbuf[256];
+	void *metrics;
+	int i, t;
+
+	reading_out = fopen(file, "w");
+	if(reading_out == NULL)
+		err(1, "cannot create %s", file);
+
+	memset(fds, 0, sizeof(fds));
+	for(i = 0; i < NUM_EVENTS; i++){
+		fds[i].name = evt_names[i];
+		/* cycles and instructions in a group */
+		fds[i].group_leader = i < 2 ? 0 : i;
+	}
+	if(pfm_metrics_compile(&metrics, METRICS, (const char **)evt_names,
+			       NUM_EVENTS, errbuf, sizeof(errbuf)))
+		errx(1, "cannot compile the metrics: %s", errbuf);
+	if(pfm_output_init(format))
+		errx(1, "cannot start the output writer");
+	pfm_output_set_metrics(metrics, 0);
+	pfm_output_set_events(fds, NUM_EVENTS);
+
+	memset(thr_buf, 0, sizeof(thr_buf));
+	memset(core_buf, 0, sizeof(core_buf));
+	pfm_counts_local(&threads[0], thr_buf[0], NUM_EVENTS);
+	pfm_counts_local(&threads[1], thr_buf[1], NUM_EVENTS);
+	pfm_counts_local(&core, core_buf, NUM_EVENTS);
+	pfm_output_context(PFM_OUTPUT_THREAD, 1001, 1000);
+	pfm_output_context(PFM_OUTPUT_THREAD, 1002, 1000);
+
+	for(t = 1; t <= 3; t++){
+		tick.seq = t;
+		tick.intended = 1000000000ULL * t;
+		tick.actual = tick.intended + 1234 * t;
+		tick.missed = t == 3;
+		pfm_output_tick(&tick, 0);
+		/* not multiplexed, half of the time, a quarter */
+		put_counts(PFM_OUTPUT_THREAD, 1001, &threads[0], t,
+			   1000003, 100);
+		put_counts(PFM_OUTPUT_THREAD, 1002, &threads[1], t, 777,
+			   50);
+		put_counts(PFM_OUTPUT_CORE, 0, &core, t, 31337, 25);
+		pfm_output_bandwidth(0, 1000000ULL * t, 500000ULL * t,
+				     1000000000ULL);
+
+		memset(mem_buf, 0, sizeof(mem_buf));
+		mem->samples = 100 * t;
+		mem->latency = 4000 * t;
+		mem->lat[0] = 60 * t;
+		mem->lat[PFM_MEM_LAT_BUCKETS - 1] = 40 * t;
+		mem->src[PFM_MEM_SRC_L1] = 70 * t;
+		mem->src[PFM_MEM_SRC_DRAM] = 30 * t;
+		mem->nodes[0] = 90 * t;
+		mem->nodes[1] = 10 * t;
+		pfm_output_memory(1001, 1000, mem, 1);
+		pfm_output_end_pass();
+	}
+	pfm_output_totals(1000, 2, 1, 1, totals, NUM_EVENTS);
+
+	pfm_output_close();
+	pfm_metrics_free(metrics);
+	fclose(reading_out);
+}
+
+/*
+ * Compare two files line by line
+ * Return value:
+ *      0       --> same
+ *      1       --> different
+ */
+static int compare(const char *expected, const char *got)
+{
+	FILE *e = fopen(expected, "r"), *g = fopen(got, "r");
+	char eline[1024], gline[1024];
+	int line = 0, ret = 0;
+
+	if(e == NULL || g == NULL)
+		err(1, "cannot open %s or %s", expected, got);
+	while(1){
+		char *el = fgets(eline, sizeof(eline), e);
+		char *gl = fgets(gline, sizeof(gline), g);
+
+		line++;
+		if(el == NULL && gl == NULL)
+			break;
+		if(el && gl && !strcmp(el, gl))
+			continue;
+		warnx("line %d: pfm_multi prints \"%s\", pfm_decode "
+		      "\"%s\"", line, el ? strtok(el, "\n") : "(end)",
+		      gl ? strtok(gl, "\n") : "(end)");
+		ret = 1;
+		break;
+	}
+	fclose(e);
+	fclose(g);
+
+	return ret;
+}
+
+/*
+ * Check the scaling column of the CSV rows of a context
+ */
+static int check_csv(const char *file, const char *ctx, const char *evt,
+		     const char *scaling)
+{
+	FILE *f = fopen(file, "r");
+	char line[1024], *field, *save;
+	int i, found = 0, ret = 0;
+
+	if(f == NULL)
+		err(1, "cannot open %s", file);
+	while(fgets(line, sizeof(line), f)){
+		char *fields[11];
+
+		field = strtok_r(line, ",\n", &save);
+		for(i = 0; i < 11 && field; i++){
+			fields[i] = field;
+			field = strtok_r(NULL, ",\n", &save);
+		}
+		if(i < 11 || strcmp(fields[3], "thread") ||
+		   strcmp(fields[4], ctx) || strcmp(fields[6], evt))
+			continue;
+		found++;
+		if(strcmp(fields[10], scaling)){
+			warnx("CSV scaling of thread %s is %s, not %s",
+			      ctx, fields[10], scaling);
+			ret = 1;
+		}
+	}
+	fclose(f);
+	if(!found){
+		warnx("no CSV row of thread %s", ctx);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+int main()
+{
+	int failed = 0;
+
+	setlocale(LC_ALL, "");
+	err_out = stderr;
+
+	write_readings(PFM_OUTPUT_TEXT, TEXT_FILE);
+	write_readings(PFM_OUTPUT_BIN, BIN_FILE);
+
+	if(system("./pfm_decode -M " METRICS " " BIN_FILE " > "
+		  DECODED_FILE))
+		errx(1, "pfm_decode failed");
+	if(system("./pfm_decode -c " BIN_FILE " > " CSV_FILE))
+		errx(1, "pfm_decode -c failed");
+
+	failed |= compare(TEXT_FILE, DECODED_FILE);
+	/* running half of the time is 50% scaling */
+	failed |= check_csv(CSV_FILE, "1002", "cycles", "0.5000");
+	failed |= check_csv(CSV_FILE, "1001", "cycles", "0.0000");
+
+	if(failed)
+		errx(1, "pfm_decode does not reproduce the text output");
+	unlink(TEXT_FILE);
+	unlink(BIN_FILE);
+	unlink(DECODED_FILE);
+	unlink(CSV_FILE);
+	printf("pfm_decode reproduces the text output\n");
+
+	return 0;
+}
@@ -0,0 +1,460 @@
+/*
+ * Stress the lock-free sharing of contexts between the threads of
+ * pfm_multi, following the paths of pfm_operations step by step:
+ *  - the tracer attaches contexts as pfm_attach_thread does: a row of the
+ *    counter store, the totals of the process looked up or created under
+ *    the lock, the context published in the table, then enable_new checked
+ *    again; it detaches them as pfm_detach_thread does: while logging they
+ *    are pushed on a list for the logger, once logging is stopped they are
+ *    finished in place after a grace period;
+ *  - the logger runs reading passes inside epoch sections: it walks the
+ *    slots, stores a reading for every enabled or flushed context, updates
+ *    the store, then finishes the detached contexts in the order they were
+ *    detached: the last reading, folded into the totals of the process,
+ *    the row freed and the context retired;
+ *  - the trigger flips contexts looked up by key, and now and then enables
+ *    or disables all of them and new ones through enable_new; while not
+ *    logging, a disabled context has its reading taken at once, as
+ *    print_thread_counts does.
+ * Halfway, logging is stopped as stop_logging stops it. Freed contexts are
+ * poisoned, so a context used after it is freed fails the checks. In the
+ * end, every detached context must be freed, the totals must hold the last
+ * readings of their threads, and the contexts still attached must all be
+ * in the state of the last all_enable or all_disable. Built with
+ * "make tsan", the test also runs under ThreadSanitizer, which must report
+ * no race; the code of pfm_operations itself needs libpfm and is not
+ * linked, its paths are copied here.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <err.h>
+
+#include "pfm_ctx_table.h"
+#include "pfm_epoch.h"
+#include "pfm_counts.h"
+
+#define NUM_KEYS 4096
+#define THREADS_PER_PROCESS 8
+#define NUM_PROCESSES (NUM_KEYS / THREADS_PER_PROCESS)
+#define NUM_EVENTS 6
+#define NUM_ITERS 200000
+#define CTX_MAGIC 0x5a5a5a5a5a5a5a5aULL
+
+typedef struct __test_ctx{
+	uint64_t magic; /* CTX_MAGIC until freed */
+	int key;
+	int tgid;
+	int enabled; /* flipped by the trigger */
+	int flush; /* set by the trigger, a last reading is due */
+	pfm_counts_row_t counts; /* owned by the logger, if logging */
+	struct __test_ctx *next; /* on the detached list */
+}test_ctx_t;
+
+typedef struct __test_totals{
+	int tgid;
+	int num_threads; /* added atomically */
+	int num_exited; /* likewise */
+	uint64_t values[NUM_EVENTS]; /* likewise */
+}test_totals_t;
+
+static pfm_ctx_table_t table;
+static pfm_ctx_table_t totals_table;
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static pfm_counts_t store;
+/* contexts detached by the tracer, finished by the logger */
+static test_ctx_t *detached;
+static int logging;
+static int enable_new;
+static int stop_logger, stop_trigger, trigger_done;
+/* the state of the last all_enable or all_disable */
+static int last_all;
+/* written by one thread at a time, read when the others are joined */
+static uint64_t finished, reads, flips, prints;
+static uint64_t freed;
+
+static void check_ctx(test_ctx_t *ctx, int key)
+{
+	if(ctx->magic != CTX_MAGIC)
+		errx(1, "a freed context is still seen");
+	if(key != -1 && ctx->key != key)
+		errx(1, "key %d finds the context of key %d", key, ctx->key);
+}
+
+static void free_ctx(void *ptr)
+{
+	test_ctx_t *ctx = ptr;
+
+	memset(ctx, 0xab, sizeof(test_ctx_t));
+	free(ctx);
+	__atomic_add_fetch(&freed, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * The raw count of an event at the last reading of a context
+ */
+static uint64_t final_count(int key, int evt)
+{
+	return (uint64_t)(key + 1) * 1000 + evt;
+}
+
+/*
+ * A reading of a context, not multiplexed, scaled alone
+ */
+static void read_ctx(test_ctx_t *ctx, uint64_t val)
+{
+	int i;
+
+	for(i = 0; i < NUM_EVENTS; i++)
+		pfm_counts_set(&ctx->counts, i, val + i, val, val);
+	pfm_counts_update_row(&ctx->counts);
+}
+
+/*
+ * As get_process_totals: looked up lock-free, created under the lock
+ */
+static test_totals_t *get_totals(int tgid)
+{
+	test_totals_t *p;
+
+	pfm_epoch_enter();
+	p = pfm_ctx_table_lookup(&totals_table, tgid);
+	pfm_epoch_exit();
+	if(p)
+		return p;
+
+	pthread_mutex_lock(&totals_lock);
+	p = pfm_ctx_table_lookup(&totals_table, tgid);
+	if(p)
+		goto out;
+	p = calloc(1, sizeof(test_totals_t));
+	if(p == NULL)
+		err(1, "out of memory");
+	p->tgid = tgid;
+	if(pfm_ctx_table_insert(&totals_table, tgid, p) < 0)
+		errx(1, "cannot add the totals of %d", tgid);
+
+ out:
+	pthread_mutex_unlock(&totals_lock);
+	return p;
+}
+
+/*
+ * As finish_thread_context: the last reading, folded into the totals, then
+ * the context given back
+ */
+static void finish_ctx(test_ctx_t *ctx)
+{
+	test_totals_t *totals;
+	int i;
+
+	check_ctx(ctx, -1);
+	for(i = 0; i < NUM_EVENTS; i++)
+		pfm_counts_set(&ctx->counts, i, final_count(ctx->key, i),
+			       ~0ULL >> 1, ~0ULL >> 1);
+	pfm_counts_update_row(&ctx->counts);
+
+	pfm_epoch_enter();
+	totals = pfm_ctx_table_lookup(&totals_table, ctx->tgid);
+	pfm_epoch_exit();
+	if(totals == NULL)
+		errx(1, "no totals for process %d", ctx->tgid);
+	for(i = 0; i < NUM_EVENTS; i++)
+		__atomic_add_fetch(&totals->values[i], ctx->counts.val[i],
+				   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&totals->num_exited, 1, __ATOMIC_RELAXED);
+
+	pfm_counts_free(&store, &ctx->counts);
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELAXED);
+	/* a trigger may still have found it */
+	pfm_epoch_retire(ctx, free_ctx);
+}
+
+/*
+ * As finish_detached: in the order the contexts were detached
+ */
+static void finish_detached()
+{
+	test_ctx_t *ctx, *next, *list = NULL;
+
+	ctx = __atomic_exchange_n(&detached, NULL, __ATOMIC_ACQUIRE);
+	for(; ctx; ctx = next){
+		next = ctx->next;
+		ctx->next = list;
+		list = ctx;
+	}
+	for(ctx = list; ctx; ctx = next){
+		next = ctx->next;
+		finish_ctx(ctx);
+	}
+}
+
+static void *logging_thread(void *arg)
+{
+	uint64_t val = 1;
+	test_ctx_t *ctx;
+	int i, j, num;
+
+	while(!__atomic_load_n(&stop_logger, __ATOMIC_ACQUIRE)){
+		pfm_epoch_enter();
+		num = pfm_ctx_table_slots(&table);
+		for(i = 0; i < num; i++){
+			ctx = pfm_ctx_table_get(&table, i);
+			if(ctx == NULL)
+				continue;
+			check_ctx(ctx, -1);
+			if(!__atomic_load_n(&ctx->enabled, __ATOMIC_ACQUIRE) &&
+			   !__atomic_exchange_n(&ctx->flush, 0,
+						__ATOMIC_ACQ_REL))
+				continue;
+			/* multiplexed, so that the pass scales */
+			for(j = 0; j < NUM_EVENTS; j++)
+				pfm_counts_set(&ctx->counts, j, val, val,
+					       val / 2 + 1);
+			reads++;
+		}
+		pfm_counts_update(&store);
+		pfm_epoch_exit();
+		val += 3;
+		/* the contexts detached during the pass */
+		finish_detached();
+	}
+
+	return NULL;
+}
+
+/*
+ * As _pfm_enable_mon_one_thread: a disabled context is read at once when
+ * not logging, or at the next pass
+ */
+static void toggle_ctx(test_ctx_t *ctx, int enabled)
+{
+	int deferred = __atomic_load_n(&logging, __ATOMIC_ACQUIRE);
+
+	if(!enabled && !deferred){
+		read_ctx(ctx, 1);
+		prints++;
+	}
+	__atomic_store_n(&ctx->enabled, enabled, __ATOMIC_RELEASE);
+	if(!enabled && deferred)
+		__atomic_store_n(&ctx->flush, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * As the all_enable and all_disable messages of pfm_trigger
+ */
+static void toggle_all(int enabled)
+{
+	test_ctx_t *ctx;
+	int i, num;
+
+	/* new contexts check it again once published */
+	__atomic_exchange_n(&enable_new, enabled, __ATOMIC_SEQ_CST);
+	pfm_epoch_enter();
+	num = pfm_ctx_table_slots(&table);
+	for(i = 0; i < num; i++){
+		ctx = pfm_ctx_table_get(&table, i);
+		if(ctx == NULL)
+			continue;
+		check_ctx(ctx, -1);
+		toggle_ctx(ctx, enabled);
+	}
+	pfm_epoch_exit();
+}
+
+static void *trigger_thread(void *arg)
+{
+	unsigned int seed = 12345;
+	test_ctx_t *ctx;
+	int key;
+
+	while(!__atomic_load_n(&stop_trigger, __ATOMIC_ACQUIRE)){
+		pfm_epoch_enter();
+		key = rand_r(&seed) % NUM_KEYS;
+		ctx = pfm_ctx_table_lookup(&table, key);
+		if(ctx){
+			check_ctx(ctx, key);
+			toggle_ctx(ctx, !__atomic_load_n(&ctx->enabled,
+							 __ATOMIC_RELAXED));
+			flips++;
+		}
+		pfm_epoch_exit();
+		/* now and then, an all_enable or all_disable message */
+		if(rand_r(&seed) % 1024 == 0)
+			toggle_all(rand_r(&seed) & 1);
+		/* waiting for the next message */
+		sched_yield();
+	}
+	/* the last one, while the tracer still attaches */
+	last_all = rand_r(&seed) & 1;
+	toggle_all(last_all);
+	__atomic_store_n(&trigger_done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/*
+ * As pfm_attach_thread
+ */
+static void attach_ctx(int key)
+{
+	test_ctx_t *ctx = calloc(1, sizeof(test_ctx_t));
+	test_totals_t *totals;
+	int enabled;
+
+	if(ctx == NULL)
+		err(1, "out of memory");
+	ctx->magic = CTX_MAGIC;
+	ctx->key = key;
+	ctx->tgid = key / THREADS_PER_PROCESS;
+	enabled = __atomic_load_n(&enable_new, __ATOMIC_ACQUIRE);
+	ctx->enabled = enabled;
+	if(pfm_counts_alloc(&store, NUM_EVENTS, &ctx->counts))
+		errx(1, "cannot allocate the counts of key %d", key);
+	/* published filled */
+	if(pfm_ctx_table_insert(&table, key, ctx) < 0)
+		errx(1, "cannot add key %d", key);
+	/* a trigger enabling or disabling all meanwhile did not see it */
+	if(__atomic_fetch_or(&enable_new, 0, __ATOMIC_SEQ_CST) != enabled)
+		__atomic_store_n(&ctx->enabled, !enabled, __ATOMIC_RELEASE);
+
+	totals = get_totals(ctx->tgid);
+	__atomic_add_fetch(&totals->num_threads, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * As pfm_detach_thread
+ */
+static void detach_ctx(test_ctx_t *ctx)
+{
+	/* the logging thread owns the counts, its next pass finishes it */
+	if(__atomic_load_n(&logging, __ATOMIC_ACQUIRE)){
+		ctx->next = __atomic_load_n(&detached, __ATOMIC_RELAXED);
+		while(!__atomic_compare_exchange_n(&detached, &ctx->next, ctx,
+						   1, __ATOMIC_RELEASE,
+						   __ATOMIC_RELAXED))
+			;
+		return;
+	}
+
+	/* a trigger may still be reading it */
+	pfm_epoch_synchronize();
+	finish_ctx(ctx);
+}
+
+int main(int argc, char **argv)
+{
+	static uint64_t expected[NUM_PROCESSES][NUM_EVENTS];
+	static int attaches[NUM_PROCESSES], exits[NUM_PROCESSES];
+	pthread_t logger, trigger;
+	unsigned int seed = 7;
+	uint64_t detaches = 0;
+	test_totals_t *totals;
+	test_ctx_t *ctx;
+	long i, iters = NUM_ITERS;
+	int key, e, live = 0, failed = 0;
+
+	if(argc > 1)
+		iters = atol(argv[1]);
+	if(pfm_ctx_table_init(&table) || pfm_ctx_table_init(&totals_table))
+		errx(1, "cannot create the tables");
+	pfm_counts_init(&store);
+	enable_new = 1;
+	__atomic_store_n(&logging, 1, __ATOMIC_SEQ_CST);
+	if(pthread_create(&logger, NULL, logging_thread, NULL) ||
+	   pthread_create(&trigger, NULL, trigger_thread, NULL))
+		errx(1, "cannot create the threads");
+
+	/*
+	 * the tracer: a key is attached if absent, detached if present, until
+	 * the last all_enable or all_disable is done
+	 */
+	for(i = 0; i < iters ||
+		    !__atomic_load_n(&trigger_done, __ATOMIC_ACQUIRE); i++){
+		/* as stop_logging */
+		if(i == iters / 2){
+			__atomic_store_n(&stop_logger, 1, __ATOMIC_RELEASE);
+			pthread_join(logger, NULL);
+			__atomic_store_n(&logging, 0, __ATOMIC_SEQ_CST);
+			pfm_epoch_synchronize();
+			finish_detached();
+		}
+		if(i == iters)
+			__atomic_store_n(&stop_trigger, 1, __ATOMIC_RELEASE);
+
+		key = rand_r(&seed) % NUM_KEYS;
+		ctx = pfm_ctx_table_remove(&table, key);
+		if(ctx){
+			for(e = 0; e < NUM_EVENTS; e++)
+				expected[ctx->tgid][e] += final_count(key, e);
+			exits[ctx->tgid]++;
+			detach_ctx(ctx);
+			detaches++;
+			live--;
+			continue;
+		}
+		attach_ctx(key);
+		attaches[key / THREADS_PER_PROCESS]++;
+		live++;
+	}
+	pthread_join(trigger, NULL);
+	pfm_epoch_synchronize();
+
+	printf("%ld attaches and detaches, %d live, %d slots, %"PRIu64
+	       " reads, %"PRIu64" flips, %"PRIu64" prints\n", i, live,
+	       pfm_ctx_table_slots(&table), reads, flips, prints);
+	printf("%"PRIu64" detached, %"PRIu64" finished, %"PRIu64" freed\n",
+	       detaches, finished, freed);
+	if(finished != detaches || freed != detaches)
+		errx(1, "the detached contexts are not all freed");
+
+	/* the contexts still attached */
+	for(i = 0; i < pfm_ctx_table_slots(&table); i++){
+		ctx = pfm_ctx_table_get(&table, i);
+		if(ctx == NULL)
+			continue;
+		if(ctx->enabled != last_all){
+			warnx("key %d is %s, all were %s", ctx->key,
+			      ctx->enabled ? "enabled" : "disabled",
+			      last_all ? "enabled" : "disabled");
+			failed = 1;
+		}
+		pfm_counts_free(&store, &ctx->counts);
+		free(ctx);
+	}
+
+	for(i = 0; i < NUM_PROCESSES; i++){
+		totals = pfm_ctx_table_lookup(&totals_table, i);
+		if(totals == NULL){
+			if(attaches[i])
+				errx(1, "no totals for process %ld", i);
+			continue;
+		}
+		if(totals->num_threads != attaches[i] ||
+		   totals->num_exited != exits[i] ||
+		   memcmp(totals->values, expected[i], sizeof(expected[i]))){
+			warnx("process %ld: %d threads, %d exited, the tracer "
+			      "saw %d and %d", i, totals->num_threads,
+			      totals->num_exited, attaches[i], exits[i]);
+			failed = 1;
+		}
+		free(totals);
+	}
+	if(failed)
+		errx(1, "the totals or the states of the contexts are wrong");
+
+	pfm_ctx_table_destroy(&table);
+	pfm_ctx_table_destroy(&totals_table);
+	pfm_counts_destroy(&store);
+	pfm_epoch_synchronize();
+	printf("the contexts are shared safely\n");
+
+	return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * Check the compiler of derived metrics: expressions are compiled against a
+ * few events and evaluated on known deltas, for the precedence and
+ * associativity of the operators, unary minus, event names in braces, the
+ * time enabled "ns" and the division by zero, which gives NaN. Bad
+ * expressions must fail with their error message: unknown events,
+ * unbalanced parentheses and braces, and expressions too deep for the
+ * evaluation stack or nested too deep for the parser.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <err.h>
+
+#include "pfm_metrics.h"
+
+#define NUM_EVENTS 3
+#define NS 1000000.0
+#define DEEP 1000000 /* far beyond the stack of a recursive parser */
+
+static const char * const names[NUM_EVENTS] = {"cycles", "instructions",
+					       "INST_RETIRED:ANY_P:u=1"};
+static const double deltas[NUM_EVENTS] = {2000, 1000, 500};
+
+static const struct{
+	const char *list;
+	double value; /* NaN for a division by zero */
+}good[] = {
+	{"x=1+2*3", 7},
+	{"x=(1+2)*3", 9},
+	{"x=10-4-3", 3},
+	{"x=16/4/2", 2},
+	{"x=2*3+4*5", 26},
+	{"x= 1.5 * ( cycles - instructions ) ", 1500},
+	{"x=instructions/cycles", 0.5},
+	{"x=-cycles+instructions", -1000},
+	{"x=--3", 3},
+	{"x=2*-3", -6},
+	{"x=-(cycles-instructions)*2", -2000},
+	{"x={INST_RETIRED:ANY_P:u=1}*2", 1000},
+	{"x={cycles}/{instructions}", 2},
+	{"x=instructions*1000/ns", 1},
+	{"x=cycles/0", NAN},
+	{"x=cycles/(instructions*2-cycles)", NAN},
+};
+
+static const struct{
+	const char *list;
+	const char *msg;
+}bad[] = {
+	{"x=foo*2", "unknown event at \"foo*2\" in metric x"},
+	{"x=cycles+{foo}", "unknown event at \"foo}\" in metric x"},
+	{"x=(cycles+1", "missing ) at \"\" in metric x"},
+	{"x=((cycles)", "missing ) at \"\" in metric x"},
+	{"x=cycles+1)", "unexpected text at \")\" in metric x"},
+	{"x={cycles", "missing } at \"cycles\" in metric x"},
+	{"x=cycles*", "expected a number, an event or ( at \"\" in metric x"},
+	{"x", "metric \"x\" is not name=expr"},
+	{"ipc=instructions/cycles,y=bar", "unknown event at \"bar\" in "
+	 "metric y"},
+};
+
+/*
+ * Compile and evaluate one metric
+ */
+static int check_good(const char *list, double expected)
+{
+	char errbuf[256];
+	void *metrics;
+	double value;
+	int ret = 0;
+
+	if(pfm_metrics_compile(&metrics, list, names, NUM_EVENTS, errbuf,
+			       sizeof(errbuf))){
+		warnx("\"%s\" does not compile: %s", list, errbuf);
+		return 1;
+	}
+	value = pfm_metrics_eval(metrics, 0, deltas, NS);
+	if(isnan(expected) ? !isnan(value) : value != expected){
+		warnx("\"%s\" is %g, not %g", list, value, expected);
+		ret = 1;
+	}
+	pfm_metrics_free(metrics);
+
+	return ret;
+}
+
+/*
+ * A metric that must fail with a message; only the start of the message
+ * is compared if whole is 0
+ */
+static int check_bad(const char *list, const char *msg, int whole)
+{
+	char errbuf[256];
+	void *metrics;
+	int ret;
+
+	ret = pfm_metrics_compile(&metrics, list, names, NUM_EVENTS, errbuf,
+				  sizeof(errbuf));
+	if(ret == 0)
+		pfm_metrics_free(metrics);
+	if(ret != 1 || (whole ? strcmp(errbuf, msg) :
+			strncmp(errbuf, msg, strlen(msg)))){
+		warnx("\"%.40s\" returns %d: %s, expected \"%s\"", list,
+		      ret, ret ? errbuf : "compiled", msg);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * A metric of n repetitions of start, then middle, then n of end
+ */
+static char *nested(const char *start, const char *middle, const char *end,
+		    int n)
+{
+	size_t ls = strlen(start), le = strlen(end);
+	char *s, *p;
+	int i;
+
+	s = malloc(2 + (ls + le) * n + strlen(middle) + 1);
+	if(s == NULL)
+		err(1, "out of memory");
+	strcpy(s, "x=");
+	p = s + 2;
+	for(i = 0; i < n; i++, p += ls)
+		memcpy(p, start, ls);
+	strcpy(p, middle);
+	p += strlen(middle);
+	for(i = 0; i < n; i++, p += le)
+		memcpy(p, end, le);
+	*p = '\0';
+
+	return s;
+}
+
+/*
+ * Nesting: the parser takes what fits in the evaluation stack and
+ * refuses the rest before it recurses too deep
+ */
+static int check_nesting()
+{
+	char *s;
+	int failed = 0;
+
+	/* parentheses alone do not grow the evaluation stack */
+	s = nested("(", "cycles", ")", 60);
+	failed |= check_good(s, 2000);
+	free(s);
+	s = nested("-", "cycles", "", 60);
+	failed |= check_good(s, 2000);
+	free(s);
+
+	/* each level pushes a 1 */
+	s = nested("1+(", "1", ")", 31);
+	failed |= check_good(s, 32);
+	free(s);
+	s = nested("1+(", "1", ")", 40);
+	failed |= check_bad(s, "expression too deep", 0);
+	free(s);
+
+	s = nested("(", "cycles", ")", DEEP);
+	failed |= check_bad(s, "expression nested too deep", 0);
+	free(s);
+	s = nested("-", "cycles", "", DEEP);
+	failed |= check_bad(s, "expression nested too deep", 0);
+	free(s);
+
+	return failed;
+}
+
+/*
+ * A list of metrics: names, order and values
+ */
+static int check_list()
+{
+	const char *list = "ipc=instructions/cycles,"
+		"mips=instructions*1000/ns,neg=-{INST_RETIRED:ANY_P:u=1}";
+	static const char * const mnames[] = {"ipc", "mips", "neg"};
+	static const double values[] = {0.5, 1, -500};
+	char errbuf[256];
+	void *metrics;
+	int i, failed = 0;
+
+	if(pfm_metrics_compile(&metrics, list, names, NUM_EVENTS, errbuf,
+			       sizeof(errbuf))){
+		warnx("\"%s\" does not compile: %s", list, errbuf);
+		return 1;
+	}
+	if(pfm_metrics_num(metrics) != 3){
+		warnx("%d metrics in \"%s\"", pfm_metrics_num(metrics), list);
+		failed = 1;
+	}
+	for(i = 0; i < 3 && !failed; i++)
+		if(strcmp(pfm_metrics_name(metrics, i), mnames[i]) ||
+		   pfm_metrics_eval(metrics, i, deltas, NS) != values[i]){
+			warnx("metric %d is %s = %g, not %s = %g", i,
+			      pfm_metrics_name(metrics, i),
+			      pfm_metrics_eval(metrics, i, deltas, NS),
+			      mnames[i], values[i]);
+			failed = 1;
+		}
+	pfm_metrics_free(metrics);
+
+	return failed;
+}
+
+int main()
+{
+	int i, failed = 0;
+
+	for(i = 0; i < sizeof(good) / sizeof(good[0]); i++)
+		failed |= check_good(good[i].list, good[i].value);
+	for(i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+		failed |= check_bad(bad[i].list, bad[i].msg, 1);
+	failed |= check_nesting();
+	failed |= check_list();
+
+	if(failed)
+		errx(1, "metrics are compiled or evaluated wrong");
+	printf("metrics compile, evaluate and fail as expected\n");
+
+	return 0;
+}
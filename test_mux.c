@@ -0,0 +1,222 @@
+/*
+ * Check the extrapolation of multiplexed groups: the slices of a rotation
+ * are fed to pfm_mux_end_slice with known counts, the groups are read as
+ * pfm_multi reads them, and pfm_mux_extrapolate must give back the counts
+ * of the whole monitored time. With steady rates, the extrapolated counts
+ * and deltas are exact, also when a reading ends in the middle of a
+ * rotation; this relies on the delta of the update being taken from the
+ * extrapolated count of the last reading, which pfm_mux_extrapolate
+ * recovers from the row. With rates that vary from slice to slice, the
+ * 95% bound of each delta must cover the true delta about 95% of the time.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <math.h>
+#include <err.h>
+
+#include "pfm_mux.h"
+#include "pfm_counts.h"
+
+#define NUM_EVENTS 5
+#define NUM_GROUPS 3
+#define SLICE_NS 1000000
+#define NUM_READINGS 2000
+#define RATE_SD 0.2 /* of the mean rate, from slice to slice */
+
+/* for the debugging messages of the planner */
+void *err_out;
+
+/* three groups: two of two events and one of one */
+static const int leaders[NUM_EVENTS] = {0, 0, 2, 2, 4};
+static const int groups[NUM_EVENTS] = {0, 0, 1, 1, 2};
+/* mean rates, in counts/ns */
+static const double rates[NUM_EVENTS] = {3, 1, 7, 2, 5};
+
+typedef struct __mux_sim{
+	pfm_mux_t *mux;
+	pfm_counts_row_t row;
+	uint64_t buf[PFM_COUNTS_ARRAYS * NUM_EVENTS];
+	uint64_t raw[NUM_EVENTS]; /* counted while the group is active */
+	uint64_t ena[NUM_GROUPS]; /* time enabled of each group */
+	uint64_t truth[NUM_EVENTS]; /* counted all the time */
+	uint64_t last_truth[NUM_EVENTS]; /* at the last reading */
+}mux_sim_t;
+
+static void sim_init(mux_sim_t *s)
+{
+	perf_event_desc_t fds[NUM_EVENTS];
+	int i;
+
+	memset(s, 0, sizeof(mux_sim_t));
+	memset(fds, 0, sizeof(fds));
+	for(i = 0; i < NUM_EVENTS; i++)
+		fds[i].group_leader = leaders[i];
+	s->mux = pfm_mux_new(fds, NUM_EVENTS);
+	if(s->mux == NULL)
+		errx(1, "cannot create the rotation state");
+	if(s->mux->num_groups != NUM_GROUPS)
+		errx(1, "%d groups planned, not %d", s->mux->num_groups,
+		     NUM_GROUPS);
+	pfm_counts_local(&s->row, s->buf, NUM_EVENTS);
+}
+
+/*
+ * The count of an event in a slice, its rate drawn around the mean
+ */
+static uint64_t slice_count(double rate, double sd)
+{
+	double u1 = 1.0 - drand48(), u2 = drand48();
+	double r;
+
+	/* Box-Muller */
+	r = rate * (1.0 + sd * sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2));
+
+	return r > 0 ? (uint64_t)(r * SLICE_NS + 0.5) : 0;
+}
+
+/*
+ * One slice of the active group: every event happens, the events of the
+ * group are counted, and the group rotates, as rotate_events does
+ */
+static void run_slice(mux_sim_t *s, double sd)
+{
+	int g = s->mux->active;
+	uint64_t c;
+	int i;
+
+	for(i = 0; i < NUM_EVENTS; i++){
+		c = slice_count(rates[i], sd);
+		s->truth[i] += c;
+		if(groups[i] == g)
+			s->raw[i] += c;
+	}
+	s->ena[g] += SLICE_NS;
+	pfm_mux_end_slice(s->mux, s->raw + s->mux->leaders[g], s->ena[g]);
+}
+
+/*
+ * Read all groups, the stopped ones with the time of their last slice, and
+ * update and extrapolate the row, as a reading of pfm_multi
+ */
+static void read_sim(mux_sim_t *s)
+{
+	int i;
+
+	for(i = 0; i < NUM_EVENTS; i++)
+		pfm_counts_set(&s->row, i, s->raw[i], s->ena[groups[i]],
+			       s->ena[groups[i]]);
+	pfm_counts_update_row(&s->row);
+	pfm_mux_extrapolate(s->mux, &s->row);
+}
+
+static uint64_t diff(uint64_t a, uint64_t b)
+{
+	return a > b ? a - b : b - a;
+}
+
+/*
+ * Steady rates, readings after 1 to 7 slices: the counts and deltas are
+ * exact, up to the rounding of the scaling
+ */
+static int check_steady()
+{
+	mux_sim_t s;
+	uint64_t total, truth_delta;
+	int i, r, n, failed = 0;
+
+	sim_init(&s);
+	/* every group counts before the first reading */
+	for(n = 0; n < NUM_GROUPS; n++)
+		run_slice(&s, 0);
+
+	for(r = 0; r < NUM_READINGS && !failed; r++){
+		if(r)
+			for(n = r % 7 + 1; n > 0; n--)
+				run_slice(&s, 0);
+		read_sim(&s);
+		total = s.ena[0] + s.ena[1] + s.ena[2];
+		for(i = 0; i < NUM_EVENTS; i++){
+			truth_delta = s.truth[i] - s.last_truth[i];
+			if(diff(s.row.val[i], s.truth[i]) > 1 ||
+			   diff(s.row.delta[i], truth_delta) > 2 ||
+			   s.row.ena[i] != total ||
+			   s.row.run[i] != s.ena[groups[i]]){
+				warnx("reading %d, event %d: count %"PRIu64
+				      " delta %"PRIu64", expected %"PRIu64
+				      " and %"PRIu64, r, i, s.row.val[i],
+				      s.row.delta[i], s.truth[i],
+				      truth_delta);
+				failed = 1;
+			}
+			s.last_truth[i] = s.truth[i];
+		}
+	}
+	pfm_mux_free(s.mux);
+
+	return failed;
+}
+
+/*
+ * Varying rates, readings after two rotations: the 95% bound covers about
+ * 95% of the deltas, neither much less nor all of them
+ */
+static int check_bounds()
+{
+	mux_sim_t s;
+	uint64_t truth_delta;
+	int i, r, n, bounded = 0, covered = 0;
+	double coverage;
+
+	sim_init(&s);
+	for(r = 0; r < NUM_READINGS; r++){
+		for(n = 0; n < 2 * NUM_GROUPS; n++)
+			run_slice(&s, RATE_SD);
+		read_sim(&s);
+		for(i = 0; i < NUM_EVENTS; i++){
+			truth_delta = s.truth[i] - s.last_truth[i];
+			s.last_truth[i] = s.truth[i];
+			if(s.mux->bounds[i] == PFM_MUX_NO_BOUND)
+				continue;
+			bounded++;
+			if(diff(s.row.delta[i], truth_delta) <=
+			   s.mux->bounds[i])
+				covered++;
+		}
+	}
+	pfm_mux_free(s.mux);
+
+	coverage = bounded ? 100.0 * covered / bounded : 0;
+	printf("the 95%% bound covers %.1f%% of %d deltas\n", coverage,
+	       bounded);
+	if(bounded != NUM_READINGS * NUM_EVENTS || coverage < 92.0 ||
+	   coverage > 98.0){
+		warnx("%d of %d deltas bounded, %.1f%% covered", bounded,
+		      NUM_READINGS * NUM_EVENTS, coverage);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main()
+{
+	int failed = 0;
+
+	err_out = stderr;
+	srand48(1);
+
+	failed |= check_steady();
+	failed |= check_bounds();
+
+	if(failed)
+		errx(1, "the extrapolation of multiplexed groups is wrong");
+	printf("multiplexed groups are extrapolated to the monitored time\n");
+
+	return 0;
+}
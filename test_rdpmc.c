@@ -0,0 +1,167 @@
+/*
+ * Check the rdpmc reads of pfm_rdpmc against read() of the same events: a
+ * count read with rdpmc must lie between the counts read() returns right
+ * before and right after it, and so must the times, give or take the
+ * rounding of the clocks. Software events are always checked; the kernel 
+ * gives them no rdpmc index, so they must fall back to read(). Hardware 
+ * events are checked when the PMU has them. The per-cpu events are read from a thread pinned to their cpu, as pfm_multi
+ * reads them with -R.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <err.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "pfm_rdpmc.h"
+
+#define NUM_READS 10000
+/* 
+ * the times of rdpmc are computed from the TSC, those of read() from the 
+ * kernel clock; both count ns, but may round differently
+ */
+#define TIME_SLACK_NS 1000
+
+static int failed;
+
+static int open_event(uint32_t type, uint64_t config, pid_t pid, int cpu)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return syscall(__NR_perf_event_open, &attr, pid, cpu, -1, 0);
+}
+
+static void read_event(int fd, uint64_t *values)
+{
+	if(read(fd, values, sizeof(uint64_t) * 3) != sizeof(uint64_t) * 3)
+		err(1, "cannot read an event");
+}
+
+/*
+ * Read an event NUM_READS times with rdpmc, each between two read()
+ * Return value:
+ *      number of reads done with rdpmc
+ */
+static int check_event(const char *name, int fd)
+{
+	struct perf_event_mmap_page *pc;
+	uint64_t before[3], values[3], after[3];
+	volatile uint64_t spin;
+	int i, j, num_rdpmc = 0;
+
+	pc = pfm_rdpmc_map(fd);
+	if(pc == NULL)
+		err(1, "cannot map %s", name);
+
+	for(i = 0; i < NUM_READS; i++){
+		for(spin = 0, j = 0; j < 100; j++)
+			spin += j;
+		read_event(fd, before);
+		if(pfm_rdpmc_read(pc, values)){
+			/* only when the kernel does not allow it */
+			if(pc->cap_user_rdpmc && pc->cap_user_time && pc->index){
+				warnx("%s: rdpmc refused while allowed", name);
+				failed = 1;
+			}
+			continue;
+		}
+		read_event(fd, after);
+		num_rdpmc++;
+		for(j = 0; j < 3; j++){
+			uint64_t slack = j ? TIME_SLACK_NS : 0;
+
+			if(values[j] + slack >= before[j] && 
+			   values[j] <= after[j] + slack)
+				continue;
+			warnx("%s: rdpmc value %d is %"PRIu64", read() gives "
+			      "%"PRIu64" before and %"PRIu64" after", name, j,
+			      values[j], before[j], after[j]);
+			failed = 1;
+		}
+	}
+
+	printf("%s: %d of %d reads with rdpmc, the others with read()\n",
+	       name, num_rdpmc, NUM_READS);
+	pfm_rdpmc_unmap(pc);
+
+	return num_rdpmc;
+}
+
+/*
+ * Check the events of the calling thread and of the cpu it is pinned to
+ */
+static void check_events(const char *kind, uint32_t type, uint64_t config,
+			 int sw)
+{
+	char name[64];
+	cpu_set_t set;
+	int fd, cpu;
+
+	snprintf(name, sizeof(name), "%s of the thread", kind);
+	fd = open_event(type, config, 0, -1);
+	if(fd == -1){
+		if(sw)
+			err(1, "cannot open %s", name);
+		printf("%s: not supported, skipped\n", name);
+		return;
+	}
+	if(check_event(name, fd) && sw){
+		warnx("%s: read with rdpmc, but it has no counter", name);
+		failed = 1;
+	}
+	close(fd);
+
+	/* the per-cpu events need privileges */
+	cpu = sched_getcpu();
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(sched_setaffinity(0, sizeof(set), &set))
+		err(1, "cannot pin to CPU %d", cpu);
+	snprintf(name, sizeof(name), "%s of CPU %d", kind, cpu);
+	fd = open_event(type, config, -1, cpu);
+	if(fd == -1){
+		printf("%s: cannot be opened, skipped\n", name);
+		return;
+	}
+	if(check_event(name, fd) && sw){
+		warnx("%s: read with rdpmc, but it has no counter", name);
+		failed = 1;
+	}
+	close(fd);
+}
+
+int main()
+{
+	check_events("task-clock", PERF_TYPE_SOFTWARE,
+		     PERF_COUNT_SW_TASK_CLOCK, 1);
+	check_events("cpu-clock", PERF_TYPE_SOFTWARE,
+		     PERF_COUNT_SW_CPU_CLOCK, 1);
+	check_events("instructions", PERF_TYPE_HARDWARE,
+		     PERF_COUNT_HW_INSTRUCTIONS, 0);
+	check_events("cycles", PERF_TYPE_HARDWARE,
+		     PERF_COUNT_HW_CPU_CYCLES, 0);
+
+	if(failed)
+		errx(1, "rdpmc and read() disagree");
+	printf("rdpmc and read() agree\n");
+
+	return 0;
+}
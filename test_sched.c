@@ -0,0 +1,224 @@
+/*
+ * Check the scheduler of the logging thread and of the wait for a -T
+ * process: the ticks keep to the absolute deadlines and count the ones
+ * missed by a slow tick, an fd added with pfm_sched_add_fd gets its
+ * callback and stops the loop, a signal blocked before the signalfd is
+ * created still reaches the loop, as SIGINT does for -T, and
+ * pfm_sched_stop ends the loop from another thread.
+ *
+ * Author: Wei Wang <wwang@virginia.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <err.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+#include "pfm_sched.h"
+
+#define INTERVAL 2000000 /* ns */
+#define NUM_TICKS 20
+#define SLOW_TICK 5
+#define SLOW_INTERVALS 3
+
+/* for the debugging messages of the scheduler */
+void *err_out;
+
+typedef struct __tick_state{
+	uint64_t start;
+	uint64_t last_seq;
+	uint64_t missed;
+	int ticks;
+	int failed;
+}tick_state_t;
+
+typedef struct __fd_state{
+	int fd;
+	int calls;
+	uint64_t value; /* eventfd counter, or signal number */
+}fd_state_t;
+
+static void sleep_ns(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000ULL;
+	ts.tv_nsec = ns % 1000000000ULL;
+	while(nanosleep(&ts, &ts))
+		;
+}
+
+static int count_tick(pfm_sched_tick_t *tick, void *arg)
+{
+	tick_state_t *t = arg;
+
+	if(tick->intended != t->start + tick->seq * INTERVAL ||
+	   tick->actual < tick->intended ||
+	   tick->seq != t->last_seq + tick->missed + 1){
+		warnx("tick %"PRIu64": intended %"PRIu64", actual %"PRIu64
+		      ", %"PRIu64" missed after tick %"PRIu64, tick->seq,
+		      tick->intended - t->start, tick->actual - t->start,
+		      tick->missed, t->last_seq);
+		t->failed = 1;
+	}
+	t->last_seq = tick->seq;
+	t->missed += tick->missed;
+	/* a pass longer than the interval */
+	if(++t->ticks == SLOW_TICK)
+		sleep_ns(INTERVAL * SLOW_INTERVALS);
+
+	return t->ticks == NUM_TICKS;
+}
+
+static int check_ticks()
+{
+	tick_state_t t = {0};
+	void *sched;
+
+	t.start = pfm_sched_now();
+	if(pfm_sched_init(&sched, INTERVAL, t.start))
+		errx(1, "cannot create the scheduler");
+	pfm_sched_run(sched, count_tick, &t);
+	if(t.missed < SLOW_INTERVALS - 1 ||
+	   t.missed != pfm_sched_missed(sched)){
+		warnx("%"PRIu64" ticks missed, the scheduler counts %"PRIu64,
+		      t.missed, pfm_sched_missed(sched));
+		t.failed = 1;
+	}
+	pfm_sched_close(sched);
+	printf("%d ticks, %"PRIu64" missed after a slow one\n", t.ticks,
+	       t.missed);
+
+	return t.failed;
+}
+
+static int read_eventfd(int fd, uint32_t events, void *arg)
+{
+	fd_state_t *f = arg;
+
+	if(fd != f->fd || !(events & EPOLLIN) ||
+	   read(fd, &f->value, sizeof(f->value)) != sizeof(f->value))
+		return 0;
+	f->calls++;
+
+	return 1;
+}
+
+static int read_signalfd(int fd, uint32_t events, void *arg)
+{
+	fd_state_t *f = arg;
+	struct signalfd_siginfo si;
+
+	if(fd != f->fd || read(fd, &si, sizeof(si)) != sizeof(si))
+		return 0;
+	f->value = si.ssi_signo;
+	f->calls++;
+
+	return 1;
+}
+
+static void *write_later(void *arg)
+{
+	fd_state_t *f = arg;
+	uint64_t one = 42;
+
+	sleep_ns(INTERVAL * 5);
+	if(write(f->fd, &one, sizeof(one)) != sizeof(one))
+		err(1, "cannot write the eventfd");
+
+	return NULL;
+}
+
+static void *stop_later(void *arg)
+{
+	sleep_ns(INTERVAL * 5);
+	pfm_sched_stop(arg);
+
+	return NULL;
+}
+
+/*
+ * Run a scheduler with a tick far away, until fn of an fd or
+ * pfm_sched_stop called by a thread running thr ends it
+ */
+static void run_until(int fd, pfm_sched_fd_fn fn, fd_state_t *f,
+		      void *(*thr)(void *))
+{
+	pthread_t t;
+	void *sched;
+
+	if(pfm_sched_init(&sched, 1000000000L, 0))
+		errx(1, "cannot create the scheduler");
+	if(fd != -1 && pfm_sched_add_fd(sched, fd, EPOLLIN, fn, f))
+		errx(1, "cannot add fd %d", fd);
+	if(thr && pthread_create(&t, NULL, thr, thr == stop_later ?
+				 sched : (void *)f))
+		errx(1, "cannot create a thread");
+	if(pfm_sched_run(sched, NULL, NULL))
+		errx(1, "the scheduler failed");
+	if(thr)
+		pthread_join(t, NULL);
+	pfm_sched_close(sched);
+}
+
+int main()
+{
+	fd_state_t f = {0};
+	sigset_t set;
+	uint64_t start;
+	int failed = 0;
+
+	err_out = stderr;
+	failed |= check_ticks();
+
+	/* an eventfd written by another thread */
+	f.fd = eventfd(0, EFD_CLOEXEC);
+	if(f.fd == -1)
+		err(1, "cannot create the eventfd");
+	run_until(f.fd, read_eventfd, &f, write_later);
+	close(f.fd);
+	if(f.calls != 1 || f.value != 42){
+		warnx("the eventfd callback ran %d times, read %"PRIu64,
+		      f.calls, f.value);
+		failed = 1;
+	}
+
+	/* a signal pending before the signalfd is created, as for -T */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	raise(SIGUSR1);
+	f.fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(f.fd == -1)
+		err(1, "cannot create the signalfd");
+	f.calls = 0;
+	run_until(f.fd, read_signalfd, &f, NULL);
+	close(f.fd);
+	if(f.calls != 1 || f.value != SIGUSR1){
+		warnx("the signalfd callback ran %d times, read signal %"
+		      PRIu64, f.calls, f.value);
+		failed = 1;
+	}
+
+	/* stopped from another thread long before the first tick */
+	start = pfm_sched_now();
+	run_until(-1, NULL, NULL, stop_later);
+	if(pfm_sched_now() - start >= 1000000000ULL){
+		warnx("pfm_sched_stop did not end the loop");
+		failed = 1;
+	}
+
+	if(failed)
+		errx(1, "the scheduler misses ticks, fds or stops");
+	printf("the scheduler keeps its deadlines, fds and stops\n");
+
+	return 0;
+}